@@ -1,7 +1,9 @@
+import numpy
+
 from pygpu.gpuarray import GpuArrayException
 from pygpu.gpuarray cimport (gpucontext, GA_NO_ERROR, get_typecode,
                              typecode_to_dtype, GpuContext, GpuArray,
-                             get_exc, gpuarray_get_elsize)
+                             get_exc, gpuarray_get_elsize, _GpuArray)
 from pygpu.gpuarray cimport (GA_BUFFER, GA_SIZE, GA_SSIZE, GA_ULONG, GA_LONG,
                              GA_UINT, GA_INT, GA_USHORT, GA_SHORT,
                              GA_UBYTE, GA_BYTE, GA_DOUBLE, GA_FLOAT)
@@ -41,6 +43,28 @@ cdef extern from "gpuarray/elemwise.h":
     cdef int GE_BROADCAST
     cdef int GE_NOCOLLAPSE
 
+cdef extern from "gpuarray/fusion.h":
+    ctypedef struct _GpuFusion "GpuFusion":
+        pass
+
+    cdef enum:
+        GPUFUSION_MAXARGS
+
+    _GpuFusion *GpuFusion_new(gpucontext *ctx, int flags)
+    void GpuFusion_free(_GpuFusion *f)
+    void GpuFusion_reset(_GpuFusion *f)
+    int GpuFusion_array(_GpuFusion *f, _GpuArray *a, int *node)
+    int GpuFusion_scalar(_GpuFusion *f, int typecode, const void *val,
+                         int *node)
+    int GpuFusion_unary(_GpuFusion *f, const char *op, int a, int *node)
+    int GpuFusion_binary(_GpuFusion *f, const char *op, int a, int b,
+                         int *node)
+    int GpuFusion_call(_GpuFusion *f, const char *fn, int typecode,
+                       unsigned int n, const int *args, int *node)
+    int GpuFusion_cast(_GpuFusion *f, int typecode, int a, int *node)
+    int GpuFusion_typecode(_GpuFusion *f, int node)
+    int GpuFusion_eval(_GpuFusion *f, int node, _GpuArray *out, int flags)
+
 
 cdef class arg:
     cdef gpuelemwise_arg a
@@ -193,3 +217,110 @@ cdef class GpuElemwise:
         err = GpuElemwise_call(self.ge, self.callbuf, GE_BROADCAST if kwargs.get('broadcast', True) else 0)
         if err != GA_NO_ERROR:
             raise get_exc(err)("Could not call GpuElemwise")
+
+
+cdef class GpuFusion:
+    """
+    GpuFusion(ctx)
+
+    Records a graph of elementwise operations and evaluates it in a
+    single kernel.  Nodes are referred to by the integers returned by
+    the methods.  The kernels are kept across :meth:`reset`.
+    """
+    cdef _GpuFusion *f
+    cdef list keep
+
+    def __cinit__(self, GpuContext ctx):
+        self.f = GpuFusion_new(ctx.ctx, 0)
+        if self.f is NULL:
+            raise MemoryError
+        self.keep = []
+
+    def __dealloc__(self):
+        if self.f is not NULL:
+            GpuFusion_free(self.f)
+            self.f = NULL
+
+    def reset(self):
+        GpuFusion_reset(self.f)
+        self.keep = []
+
+    def array(self, GpuArray a):
+        cdef int node
+        cdef int err
+        err = GpuFusion_array(self.f, &a.ga, &node)
+        if err != GA_NO_ERROR:
+            raise get_exc(err)("Could not add array to GpuFusion")
+        # The C object only has a pointer to it
+        self.keep.append(a)
+        return node
+
+    def scalar(self, o, dtype):
+        cdef bytes val
+        cdef int node
+        cdef int err
+        val = numpy.asarray(o, dtype=dtype).tobytes()
+        err = GpuFusion_scalar(self.f, get_typecode(dtype), <char *>val,
+                               &node)
+        if err != GA_NO_ERROR:
+            raise get_exc(err)("Could not add scalar to GpuFusion")
+        return node
+
+    def unary(self, op, int a):
+        cdef bytes bop = to_bytes(op)
+        cdef int node
+        cdef int err
+        err = GpuFusion_unary(self.f, bop, a, &node)
+        if err != GA_NO_ERROR:
+            raise get_exc(err)("Could not add operation %s to GpuFusion" %
+                               (op,))
+        return node
+
+    def binary(self, op, int a, int b):
+        cdef bytes bop = to_bytes(op)
+        cdef int node
+        cdef int err
+        err = GpuFusion_binary(self.f, bop, a, b, &node)
+        if err != GA_NO_ERROR:
+            raise get_exc(err)("Could not add operation %s to GpuFusion" %
+                               (op,))
+        return node
+
+    def call(self, fn, args, dtype=None):
+        cdef int _args[GPUFUSION_MAXARGS]
+        cdef bytes bfn = to_bytes(fn)
+        cdef unsigned int i
+        cdef int node
+        cdef int err
+        if len(args) > GPUFUSION_MAXARGS:
+            raise ValueError("too many arguments for %s" % (fn,))
+        for i in range(len(args)):
+            _args[i] = args[i]
+        err = GpuFusion_call(self.f, bfn,
+                             -1 if dtype is None else get_typecode(dtype),
+                             len(args), _args, &node)
+        if err != GA_NO_ERROR:
+            raise get_exc(err)("Could not add call to %s to GpuFusion" %
+                               (fn,))
+        return node
+
+    def cast(self, int a, dtype):
+        cdef int node
+        cdef int err
+        err = GpuFusion_cast(self.f, get_typecode(dtype), a, &node)
+        if err != GA_NO_ERROR:
+            raise get_exc(err)("Could not add cast to GpuFusion")
+        return node
+
+    def dtype(self, int node):
+        cdef int typecode = GpuFusion_typecode(self.f, node)
+        if typecode == -1:
+            raise ValueError("invalid node: %d" % (node,))
+        return typecode_to_dtype(typecode)
+
+    def eval(self, int node, GpuArray out, bint broadcast=True):
+        cdef int err
+        err = GpuFusion_eval(self.f, node, &out.ga,
+                             GE_BROADCAST if broadcast else 0)
+        if err != GA_NO_ERROR:
+            raise get_exc(err)("Could not evaluate GpuFusion")
@@ -1,10 +1,13 @@
+import weakref
+
 import numpy
 
 from .dtypes import dtype_to_ctype, get_common_dtype
 from . import gpuarray
-from ._elemwise import GpuElemwise, arg
+from ._elemwise import GpuElemwise, GpuFusion, arg
 
-__all__ = ['GpuElemwise', 'elemwise1', 'elemwise2', 'ielemwise2', 'compare']
+__all__ = ['GpuElemwise', 'elemwise1', 'elemwise2', 'ielemwise2', 'compare',
+           'Expr', 'lazy', 'lazy_call']
 
 
 def _dtype(o):
@@ -99,3 +102,235 @@ def compare(a, op, b, broadcast=False, convert_f16=True):
     return elemwise2(a, op, b, a, odtype=numpy.dtype('bool'),
                      op_tmpl="res = (a %(op)s b)",
                      broadcast=broadcast, convert_f16=convert_f16)
+
+
+# One GpuFusion per context, reused between evaluations
+_fusions = weakref.WeakKeyDictionary()
+
+
+def _get_fusion(ctx):
+    f = _fusions.get(ctx)
+    if f is None:
+        f = GpuFusion(ctx)
+        _fusions[ctx] = f
+    return f
+
+
+def _as_expr(o):
+    if isinstance(o, Expr):
+        return o
+    if isinstance(o, gpuarray.GpuArray):
+        return Expr('array', (o,))
+    return Expr('scalar', (o,), dtype=_dtype(o))
+
+
+class Expr(object):
+    """
+    Lazy elementwise expression.
+
+    Operations on expressions record a graph instead of computing
+    anything.  :meth:`eval` computes the whole graph in a single
+    kernel, with no intermediate arrays.  Kernels are reused for
+    graphs with the same structure and types.  Start from
+    :func:`lazy`.
+
+    The operations follow C semantics once the operands are promoted
+    to a common type, except for `/` which always produces a floating
+    point result.
+    """
+    def __init__(self, kind, args, op=None, dtype=None):
+        self.kind = kind
+        self.args = args
+        self.op = op
+        self.dtype = dtype
+
+    def _arrays(self, res, seen):
+        if id(self) in seen:
+            return
+        seen.add(id(self))
+        if self.kind == 'array':
+            res.append(self.args[0])
+        elif self.kind != 'scalar':
+            for a in self.args:
+                a._arrays(res, seen)
+
+    def _record(self, f, nodes, nd):
+        n = nodes.get(id(self))
+        if n is not None:
+            return n
+        if self.kind == 'array':
+            a = self.args[0]
+            if a.ndim < nd:
+                a = a.reshape(((1,) * (nd - a.ndim)) + a.shape)
+            n = f.array(a)
+        elif self.kind == 'scalar':
+            n = f.scalar(self.args[0], self.dtype)
+        else:
+            args = [a._record(f, nodes, nd) for a in self.args]
+            if self.kind == 'unary':
+                n = f.unary(self.op, args[0])
+            elif self.kind == 'binary':
+                if self.op == '/':
+                    args = [a if f.dtype(a).kind == 'f'
+                            else f.cast(a, 'float64') for a in args]
+                n = f.binary(self.op, args[0], args[1])
+            elif self.kind == 'call':
+                n = f.call(self.op, args, self.dtype)
+            elif self.kind == 'cast':
+                n = f.cast(args[0], self.dtype)
+        nodes[id(self)] = n
+        return n
+
+    def eval(self, out=None, broadcast=True):
+        """
+        eval(out=None, broadcast=True)
+
+        Compute the expression.
+
+        Parameters
+        ----------
+        out: GpuArray
+            where to put the result, allocated if not provided.  It
+            can be one of the arrays in the expression.
+        broadcast: bool
+            allow broadcasting of dimensions of size 1
+        """
+        arrays = []
+        self._arrays(arrays, set())
+        if len(arrays) == 0:
+            raise ValueError("expression has no array")
+        nd = max(a.ndim for a in arrays)
+        ctx = arrays[0].context
+        f = _get_fusion(ctx)
+        f.reset()
+        try:
+            node = self._record(f, {}, nd)
+            if out is None:
+                shapes = [((1,) * (nd - a.ndim)) + a.shape for a in arrays]
+                shape = tuple(max(s) for s in zip(*shapes))
+                out = gpuarray.empty(shape, dtype=f.dtype(node),
+                                     context=ctx, cls=arrays[0].__class__)
+            f.eval(node, out, broadcast=broadcast)
+        finally:
+            f.reset()
+        return out
+
+    def astype(self, dtype):
+        return Expr('cast', (self,), dtype=numpy.dtype(dtype))
+
+    def _unary(self, op):
+        return Expr('unary', (self,), op=op)
+
+    def _binary(self, op, other):
+        return Expr('binary', (self, _as_expr(other)), op=op)
+
+    def _rbinary(self, op, other):
+        return Expr('binary', (_as_expr(other), self), op=op)
+
+    def __neg__(self):
+        return self._unary('-')
+
+    def __pos__(self):
+        return self._unary('+')
+
+    def __invert__(self):
+        return self._unary('~')
+
+    def __add__(self, other):
+        return self._binary('+', other)
+
+    def __radd__(self, other):
+        return self._rbinary('+', other)
+
+    def __sub__(self, other):
+        return self._binary('-', other)
+
+    def __rsub__(self, other):
+        return self._rbinary('-', other)
+
+    def __mul__(self, other):
+        return self._binary('*', other)
+
+    def __rmul__(self, other):
+        return self._rbinary('*', other)
+
+    def __truediv__(self, other):
+        return self._binary('/', other)
+
+    def __rtruediv__(self, other):
+        return self._rbinary('/', other)
+
+    __div__ = __truediv__
+    __rdiv__ = __rtruediv__
+
+    def __mod__(self, other):
+        return self._binary('%', other)
+
+    def __rmod__(self, other):
+        return self._rbinary('%', other)
+
+    def __and__(self, other):
+        return self._binary('&', other)
+
+    def __rand__(self, other):
+        return self._rbinary('&', other)
+
+    def __or__(self, other):
+        return self._binary('|', other)
+
+    def __ror__(self, other):
+        return self._rbinary('|', other)
+
+    def __xor__(self, other):
+        return self._binary('^', other)
+
+    def __rxor__(self, other):
+        return self._rbinary('^', other)
+
+    def __lt__(self, other):
+        return self._binary('<', other)
+
+    def __le__(self, other):
+        return self._binary('<=', other)
+
+    def __gt__(self, other):
+        return self._binary('>', other)
+
+    def __ge__(self, other):
+        return self._binary('>=', other)
+
+    def __eq__(self, other):
+        return self._binary('==', other)
+
+    def __ne__(self, other):
+        return self._binary('!=', other)
+
+    __hash__ = object.__hash__
+
+
+def lazy(a):
+    """
+    lazy(a)
+
+    Wrap an array in an :class:`Expr` to build a fused expression.
+
+    >>> (lazy(a) * b + lazy(c) * d).eval()
+    """
+    return _as_expr(a)
+
+
+def lazy_call(fn, *args, **kwargs):
+    """
+    lazy_call(fn, *args, dtype=None)
+
+    Call the kernel function `fn` (like 'exp' or 'fmax') in a fused
+    expression.  The arguments are converted to `dtype`, which is the
+    promoted type of the arguments if not specified.
+    """
+    dtype = kwargs.pop('dtype', None)
+    if kwargs:
+        raise TypeError("unexpected keyword arguments: %s" %
+                        (', '.join(kwargs),))
+    if dtype is not None:
+        dtype = numpy.dtype(dtype)
+    return Expr('call', tuple(_as_expr(a) for a in args), op=fn, dtype=dtype)
@@ -71,6 +71,8 @@ cdef extern from "gpuarray/buffer.h":
         pass
     ctypedef struct gpukernel:
         pass
+    ctypedef struct gpustream:
+        pass
 
     int gpu_get_platform_count(const char* name, unsigned int* platcount)
     int gpu_get_device_count(const char* name, unsigned int platform, unsigned int* devcount)
@@ -83,6 +85,14 @@ cdef extern from "gpuarray/buffer.h":
     gpucontext *gpudata_context(gpudata *)
     gpucontext *gpukernel_context(gpukernel *)
 
+    gpustream *gpustream_new(gpucontext *ctx, int flags, int *ret)
+    void gpustream_retain(gpustream *s)
+    void gpustream_release(gpustream *s)
+    int gpustream_sync(gpustream *s)
+    int gpucontext_set_stream(gpucontext *ctx, gpustream *s)
+    gpustream *gpucontext_get_stream(gpucontext *ctx)
+    size_t gpucontext_trim(gpucontext *ctx, size_t keep)
+
     int GA_CTX_DEFAULT
     int GA_CTX_MULTI_THREAD
     int GA_CTX_SINGLE_THREAD
@@ -105,6 +115,21 @@ cdef extern from "gpuarray/buffer.h":
     int GA_CTX_PROP_MAXGSIZE1
     int GA_CTX_PROP_MAXGSIZE2
     int GA_CTX_PROP_LARGEST_MEMBLOCK
+    int GA_CTX_PROP_MEM_RESERVED
+    int GA_CTX_PROP_MEM_USED
+    int GA_CTX_PROP_MEM_PEAK
+    int GA_CTX_PROP_MEM_CACHED
+    int GA_CTX_PROP_MEM_FRAGMENTS
+    int GA_CTX_PROP_MEM_LARGEST_CACHED
+    int GA_CTX_PROP_MEM_NUM_ALLOCS
+    int GA_CTX_PROP_KERNEL_CACHE_HITS
+    int GA_CTX_PROP_KERNEL_CACHE_MISSES
+    int GA_CTX_PROP_KERNEL_CACHE_EVICTIONS
+    int GA_CTX_PROP_KERNEL_CACHE_BYTES
+    int GA_CTX_PROP_ELEMWISE_CACHE_HITS
+    int GA_CTX_PROP_ELEMWISE_CACHE_MISSES
+    int GA_CTX_PROP_ELEMWISE_CACHE_EVICTIONS
+    int GA_CTX_PROP_ELEMWISE_CACHE_BYTES
 
     int GA_BUFFER_PROP_SIZE
 
@@ -124,7 +149,8 @@ cdef extern from "gpuarray/kernel.h":
     int GpuKernel_init(_GpuKernel *k, gpucontext *ctx,
                        unsigned int count, const char **strs,
                        const size_t *lens, const char *name,
-                       unsigned int argcount, const int *types, int flags, char **err_str)
+                       unsigned int argcount, const int *types,
+                       const int *access, int flags, char **err_str)
     void GpuKernel_clear(_GpuKernel *k)
     gpucontext *GpuKernel_context(_GpuKernel *k)
     int GpuKernel_sched(_GpuKernel *k, size_t n, size_t *gs, size_t *ls)
@@ -262,7 +288,7 @@ cdef const char *kernel_error(GpuKernel k, int err) except NULL
 cdef int kernel_init(GpuKernel k, gpucontext *ctx,
                      unsigned int count, const char **strs, const size_t *len,
                      const char *name, unsigned int argcount, const int *types,
-                     int flags) except -1
+                     const int *access, int flags) except -1
 cdef int kernel_clear(GpuKernel k) except -1
 cdef gpucontext *kernel_context(GpuKernel k) except NULL
 cdef int kernel_sched(GpuKernel k, size_t n, size_t *gs, size_t *ls) except -1
@@ -329,6 +355,11 @@ cdef api class GpuContext [type PyGpuContextType, object PyGpuContextObject]:
     cdef readonly bytes kind
     cdef object __weakref__
 
+cdef class GpuStream:
+    cdef gpustream *s
+    cdef readonly GpuContext context
+    cdef list prev
+
 cdef GpuArray new_GpuArray(object cls, GpuContext ctx, object base)
 
 cdef api class GpuArray [type PyGpuArrayType, object PyGpuArrayObject]:
@@ -422,11 +422,11 @@ cdef const char *kernel_error(GpuKernel k, int err) except NULL:
 cdef int kernel_init(GpuKernel k, gpucontext *ctx,
                      unsigned int count, const char **strs, const size_t *len,
                      const char *name, unsigned int argcount, const int *types,
-                     int flags) except -1:
+                     const int *access, int flags) except -1:
     cdef int err
     cdef char *err_str = NULL
     err = GpuKernel_init(&k.k, ctx, count, strs, len, name, argcount,
-                          types, flags, &err_str)
+                          types, access, flags, &err_str)
     if err != GA_NO_ERROR:
         if err_str != NULL:
             try:
@@ -561,6 +561,9 @@ cdef GpuContext pygpu_init(dev, int flags):
             raise ValueError, "OpenCL name incorrect. Should be opencl<int>:<int> instead got: " + dev
         else:
             devnum = int(devspec[0]) << 16 | int(devspec[1])
+    elif dev == 'host':
+        kind = b"host"
+        devnum = 0
     else:
         raise ValueError, "Unknown device format:" + dev
     return GpuContext(kind, devnum, flags)
@@ -586,6 +589,7 @@ def init(dev, sched='default', disable_alloc_cache=False, single_stream=False):
 
         "cuda0"
         "opencl0:1"
+        "host"
 
     For cuda the device id is the numeric identifier.  You can see
     what devices are available by running nvidia-smi on the machine.
@@ -599,6 +603,8 @@ def init(dev, sched='default', disable_alloc_cache=False, single_stream=False):
     list available platforms and devices.  You can experiement with
     the values, unavaiable ones will just raise an error, and there
     are no gaps in the valid numbers.
+
+    The host backend runs kernels on the CPU and has no device id.
     """
     cdef int flags = 0
     if sched == 'single':
@@ -993,7 +999,7 @@ cdef class GpuContext:
     :type flags: int
 
     The currently implemented modules (for the `kind` parameter) are
-    "cuda" and "opencl".  Which are available depends on the build
+    "cuda", "opencl" and "host".  Which are available depends on the build
     options for libgpuarray.
 
     The flag values are defined in the gpuarray/buffer.h header and
@@ -1152,6 +1158,159 @@ cdef class GpuContext:
             ctx_property(self, GA_CTX_PROP_LARGEST_MEMBLOCK, &res)
             return res
 
+    def trim(self, size_t keep=0):
+        """
+        trim(keep=0)
+
+        Return cached memory to the driver.
+
+        At most `keep` bytes stay in the allocation cache if it is not
+        fragmented.  Returns the number of bytes released.
+
+        Parameters
+        ----------
+        keep: int
+            number of bytes that can stay cached
+        """
+        return gpucontext_trim(self.ctx, keep)
+
+    def memory_stats(self):
+        """
+        memory_stats()
+
+        Return a dictionary describing the state of the allocator.
+
+        The keys are:
+
+          * `reserved`: bytes obtained from the driver
+          * `used`: bytes in allocated buffers
+          * `peak`: highest value of `used`
+          * `cached`: bytes free in the allocation cache
+          * `fragments`: number of free blocks in the cache
+          * `largest_cached`: size of the largest free block in the cache
+          * `num_allocs`: number of allocations requested from the driver
+        """
+        cdef size_t res
+        stats = {}
+        for name, prop in (('reserved', GA_CTX_PROP_MEM_RESERVED),
+                           ('used', GA_CTX_PROP_MEM_USED),
+                           ('peak', GA_CTX_PROP_MEM_PEAK),
+                           ('cached', GA_CTX_PROP_MEM_CACHED),
+                           ('fragments', GA_CTX_PROP_MEM_FRAGMENTS),
+                           ('largest_cached', GA_CTX_PROP_MEM_LARGEST_CACHED),
+                           ('num_allocs', GA_CTX_PROP_MEM_NUM_ALLOCS)):
+            ctx_property(self, prop, &res)
+            stats[name] = res
+        return stats
+
+    def cache_stats(self):
+        """
+        cache_stats()
+
+        Return a dictionary with the statistics of the kernel caches.
+
+        It has the keys `kernel` for compiled kernels and `elemwise`
+        for shared elemwise objects.  Each of them is a dictionary
+        with the keys `hits`, `misses`, `evictions` and `bytes`.
+
+        The size of the caches can be limited with the
+        GPUARRAY_KERNEL_CACHE_SIZE environment variable (in MB).
+        """
+        cdef size_t res
+        stats = {}
+        for cname, props in (('kernel', (GA_CTX_PROP_KERNEL_CACHE_HITS,
+                                         GA_CTX_PROP_KERNEL_CACHE_MISSES,
+                                         GA_CTX_PROP_KERNEL_CACHE_EVICTIONS,
+                                         GA_CTX_PROP_KERNEL_CACHE_BYTES)),
+                             ('elemwise', (GA_CTX_PROP_ELEMWISE_CACHE_HITS,
+                                           GA_CTX_PROP_ELEMWISE_CACHE_MISSES,
+                                           GA_CTX_PROP_ELEMWISE_CACHE_EVICTIONS,
+                                           GA_CTX_PROP_ELEMWISE_CACHE_BYTES))):
+            stats[cname] = {}
+            for name, prop in zip(('hits', 'misses', 'evictions', 'bytes'),
+                                  props):
+                ctx_property(self, prop, &res)
+                stats[cname][name] = res
+        return stats
+
+
+cdef class GpuStream:
+    """
+    GpuStream(context)
+
+    Independent queue of operations on a context.
+
+    Use it as a context manager to make the operations (kernel calls,
+    copies, blas calls) issued in the `with` block go to this stream.
+    The previous stream is restored on exit.
+
+    .. code-block:: python
+
+        s = GpuStream(ctx)
+        with s:
+            c = a + b
+        s.sync()
+
+    Dependencies between streams through the arrays they use are
+    handled by the library.
+
+    :param context: context for the stream
+    :type context: GpuContext
+    """
+    def __dealloc__(self):
+        if self.s != NULL:
+            gpustream_release(self.s)
+
+    def __reduce__(self):
+        raise RuntimeError, "Cannot pickle GpuStream object"
+
+    def __cinit__(self, GpuContext context):
+        cdef int err = GA_NO_ERROR
+        self.context = context
+        self.prev = []
+        self.s = gpustream_new(context.ctx, 0, &err)
+        if self.s == NULL:
+            raise get_exc(err), gpucontext_error(context.ctx, err)
+
+    def __enter__(self):
+        cdef gpustream *prev = gpucontext_get_stream(self.context.ctx)
+        cdef int err
+        # Keep the previous stream alive until we put it back
+        if prev != NULL:
+            gpustream_retain(prev)
+        err = gpucontext_set_stream(self.context.ctx, self.s)
+        if err != GA_NO_ERROR:
+            if prev != NULL:
+                gpustream_release(prev)
+            raise get_exc(err), gpucontext_error(self.context.ctx, err)
+        self.prev.append(<size_t>prev)
+        return self
+
+    def __exit__(self, t, v, tb):
+        cdef gpustream *prev = <gpustream *><size_t>self.prev.pop()
+        cdef int err
+        err = gpucontext_set_stream(self.context.ctx, prev)
+        if prev != NULL:
+            gpustream_release(prev)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), gpucontext_error(self.context.ctx, err)
+
+    def sync(self):
+        """
+        sync()
+
+        Wait for all the operations issued on this stream to finish.
+        """
+        cdef int err
+        err = gpustream_sync(self.s)
+        if err != GA_NO_ERROR:
+            raise get_exc(err), gpucontext_error(self.context.ctx, err)
+
+    property ptr:
+        "Raw pointer value for the stream object"
+        def __get__(self):
+            return <size_t>self.s
+
 
 cdef class flags(object):
     cdef int fl
@@ -2299,7 +2458,7 @@ cdef class GpuKernel:
                     if self.callbuf[i] == NULL:
                         raise MemoryError
             kernel_init(self, self.context.ctx, 1, s, &l,
-                        name, numargs, _types, flags)
+                        name, numargs, _types, NULL, flags)
         finally:
             free(_types)
 
@@ -34,7 +34,8 @@ ${preamble}
 
 #define REDUCE(a, b) (${reduce_expr})
 
-KERNEL void ${name}(const unsigned int n, ${out_arg.decltype()} out
+KERNEL void ${name}(const unsigned int n, const unsigned int nsplit,
+                    ${out_arg.decltype()} out
 % for d in range(nd):
                     , const unsigned int dim${d}
 % endfor
@@ -52,6 +53,9 @@ KERNEL void ${name}(const unsigned int n, ${out_arg.decltype()} out
 ) {
   LOCAL_MEM ${out_arg.ctype()} ldata[${local_size}];
   const unsigned int lid = LID_0;
+  /* With nsplit > 1, each output is shared by nsplit groups which
+     produce partial results */
+  const unsigned int part = GID_0 % nsplit;
   unsigned int i;
   GLOBAL_MEM char *tmp;
 
@@ -62,7 +66,7 @@ KERNEL void ${name}(const unsigned int n, ${out_arg.decltype()} out
   % endif
 % endfor
 
-  i = GID_0;
+  i = GID_0 / nsplit;
 % for i in range(nd-1, -1, -1):
   % if not redux[i]:
     % if i > 0:
@@ -76,7 +80,7 @@ KERNEL void ${name}(const unsigned int n, ${out_arg.decltype()} out
 
   ${out_arg.ctype()} acc = ${neutral};
 
-  for (i = lid; i < n; i += LDIM_0) {
+  for (i = part * LDIM_0 + lid; i < n; i += LDIM_0 * nsplit) {
     int ii = i;
     int pos;
 % for arg in arguments:
@@ -224,7 +228,7 @@ class ReductionKernel(object):
                                   redux=self.redux,
                                   neutral=self.neutral,
                                   map_expr=self.expression)
-        spec = ['uint32', gpuarray.GpuArray]
+        spec = ['uint32', 'uint32', gpuarray.GpuArray]
         spec.extend('uint32' for _ in range(nd))
         for i, arg in enumerate(self.arguments):
             spec.append(arg.spec())
@@ -239,6 +243,29 @@ class ReductionKernel(object):
     def _get_basic_kernel(self, maxls, nd):
         return self._find_kernel_ls(self._gen_basic, maxls, nd)
 
+    @lru_cache()
+    def _get_combine_kernel(self, out_nd):
+        # Reduces the partial results of a split reduction along
+        # their last axis.
+        return ReductionKernel(self.context, self.dtype_out, self.neutral,
+                               self.reduce_expr,
+                               [False] * out_nd + [True],
+                               arguments=[ArrayArg(self.out_arg.dtype,
+                                                   '_reduce_partial')],
+                               preamble=self.preamble)
+
+    def _split_factor(self, gs, n, ls):
+        # When there are too few outputs to keep all the processors
+        # busy, split the reduced extent of each output between
+        # multiple groups.  Each of those must still get a good
+        # amount of work.
+        target = self.context.numprocs * 4
+        if gs >= target or n < 2 * ls:
+            return 1
+        nsplit = min((target + gs - 1) // gs, (n + ls - 1) // ls,
+                     self.context.maxgsize // gs)
+        return max(nsplit, 1)
+
     def __call__(self, *args, **kwargs):
         broadcast = kwargs.pop('broadcast', None)
         out = kwargs.pop('out', None)
@@ -254,7 +281,7 @@ class ReductionKernel(object):
         gs = prod(out_shape)
         if gs == 0:
             gs = 1
-        n /= gs
+        n //= gs
         if gs > self.context.maxgsize:
             raise ValueError("Array too big to be reduced along the "
                              "selected axes")
@@ -274,7 +301,14 @@ class ReductionKernel(object):
         else:
             k, _, _, ls = self._get_basic_kernel(2**_ceil_log2(n), nd)
 
-        kargs = [n, out]
+        nsplit = self._split_factor(gs, n, ls)
+        if nsplit > 1:
+            partial = gpuarray.empty(out_shape + (nsplit,),
+                                     context=self.context,
+                                     dtype=self.dtype_out)
+            kargs = [n, nsplit, partial]
+        else:
+            kargs = [n, nsplit, out]
         kargs.extend(dims)
         for i, arg in enumerate(args):
             kargs.append(arg)
@@ -282,7 +316,10 @@ class ReductionKernel(object):
                 kargs.append(offsets[i])
                 kargs.extend(strs[i])
 
-        k(*kargs, gs=gs, ls=ls)
+        k(*kargs, gs=gs * nsplit, ls=ls)
+
+        if nsplit > 1:
+            self._get_combine_kernel(len(out_shape))(partial, out=out)
 
         return out
 
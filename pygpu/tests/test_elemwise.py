@@ -5,7 +5,7 @@ from mako.template import Template
 from unittest import TestCase
 from pygpu import gpuarray, ndgpuarray as elemary
 from pygpu.dtypes import dtype_to_ctype, get_common_dtype
-from pygpu.elemwise import as_argument, ielemwise2
+from pygpu.elemwise import as_argument, ielemwise2, lazy, lazy_call
 from pygpu._elemwise import GpuElemwise, arg
 
 from six import PY2
@@ -332,3 +332,32 @@ def test_infinity():
                              preamble=preamble)
         kernel(out_g)
         assert numpy.array_equal(ac, numpy.asarray(out_g))
+
+
+@guard_devsup
+def test_lazy():
+    ac, ag = gen_gpuarray((3, 5), 'float32', ctx=context, cls=elemary)
+    bc, bg = gen_gpuarray((3, 5), 'float32', ctx=context, cls=elemary)
+    cc, cg = gen_gpuarray((1, 5), 'float32', ctx=context, cls=elemary)
+    dc, dg = gen_gpuarray((5,), 'int32', ctx=context, cls=elemary)
+
+    out_g = (lazy(ag) * bg + lazy(cg) * ag).eval()
+    assert out_g.dtype == numpy.float32
+    assert numpy.allclose(ac * bc + cc * ac, numpy.asarray(out_g))
+
+    # Scalars do not upcast, int32 with float32 gives float64
+    out_g = (lazy(ag) * 2 - dg).eval()
+    out_c = ac * 2 - dc
+    assert out_g.dtype == out_c.dtype
+    assert numpy.allclose(out_c, numpy.asarray(out_g))
+
+    out_g = (lazy(ag) > bg).eval()
+    assert out_g.dtype == numpy.bool_
+    assert numpy.array_equal(ac > bc, numpy.asarray(out_g))
+
+    out_g = lazy_call('exp', lazy(dg) / 4).eval()
+    assert numpy.allclose(numpy.exp(dc / 4), numpy.asarray(out_g))
+
+    # In place
+    (lazy(ag) + bg).eval(out=ag)
+    assert numpy.allclose(ac + bc, numpy.asarray(ag))
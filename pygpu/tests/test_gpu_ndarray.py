@@ -10,7 +10,7 @@ import numpy
 
 from nose.tools import assert_raises
 import pygpu
-from pygpu.gpuarray import GpuArray, GpuContext, GpuKernel
+from pygpu.gpuarray import GpuArray, GpuContext, GpuKernel, GpuStream
 
 from .support import (guard_devsup, check_meta, check_flags, check_all,
                       check_content, gen_gpuarray, context as ctx, dtypes_all,
@@ -52,6 +52,39 @@ def test_bool():
         assert bool(pygpu.asarray(data, context=ctx)) == bool(numpy.asarray(data))
 
 
+def test_stream():
+    a = numpy.random.rand(10, 11).astype('float32')
+    s = GpuStream(ctx)
+    with s:
+        g = pygpu.array(a, context=ctx)
+        with GpuStream(ctx):
+            g2 = g.copy()
+    s.sync()
+    numpy.testing.assert_equal(numpy.asarray(g2), a)
+
+
+def test_memory_stats():
+    before = ctx.memory_stats()
+    g = pygpu.empty((1024,), dtype='float32', context=ctx)
+    stats = ctx.memory_stats()
+    assert stats['used'] >= before['used'] + 4096
+    assert stats['peak'] >= stats['used']
+    assert stats['reserved'] >= stats['used'] + stats['cached']
+    del g
+    assert ctx.memory_stats()['used'] == before['used']
+    ctx.trim()
+    assert ctx.memory_stats()['reserved'] <= stats['reserved']
+
+
+def test_cache_stats():
+    a = pygpu.zeros((10,), dtype='float32', context=ctx)
+    a + a
+    stats = ctx.cache_stats()
+    assert set(stats) == {'kernel', 'elemwise'}
+    assert stats['kernel']['misses'] > 0
+    assert stats['kernel']['bytes'] > 0
+
+
 def test_transfer():
     for shp in [(), (5,), (6, 7), (4, 8, 9), (1, 8, 9)]:
         for dtype in dtypes_all:
@@ -53,6 +53,15 @@ def test_red_big_array():
         yield red_array_sum, 'float32', (2000, 30, 100), redux
 
 
+def test_red_split():
+    # Few outputs over a long extent, which splits each output
+    # between multiple groups.
+    for shape, redux in [((300000,), [True]),
+                         ((3, 100000), [False, True]),
+                         ((100000, 3), [True, False])]:
+        yield red_array_sum, 'float64', shape, redux
+
+
 def test_red_broadcast():
     from pygpu.tools import as_argument
 
@@ -4,17 +4,35 @@
 #include <stdlib.h>
 #include <gpuarray/config.h>
 #include "private_config.h"
+#include "util/strb.h"
 
 typedef void *cache_key_t;
 typedef void *cache_value_t;
 
 typedef int (*cache_eq_fn)(cache_key_t, cache_key_t);
-typedef uint32_t (*cache_hash_fn)(cache_key_t);
+typedef uint64_t (*cache_hash_fn)(cache_key_t);
 typedef void (*cache_freek_fn)(cache_key_t);
 typedef void (*cache_freev_fn)(cache_value_t);
+typedef void (*cache_vref_fn)(cache_value_t);
+typedef size_t (*cache_cost_fn)(cache_key_t, cache_value_t);
+
+/* Serialization functions for cache_disk() */
+typedef int (*cache_kwrite_fn)(strb *res, cache_key_t k);
+typedef int (*cache_vwrite_fn)(strb *res, cache_value_t v);
+typedef cache_key_t (*cache_kread_fn)(const strb *b);
+typedef cache_value_t (*cache_vread_fn)(const strb *b);
 
 typedef struct _cache cache;
 
+typedef struct _cache_stats {
+  size_t hits;
+  size_t misses;
+  /* Entries removed to make room, not through del() or replacement */
+  size_t evictions;
+  /* Sum of the cost of the entries in the cache */
+  size_t cost;
+} cache_stats;
+
 struct _cache {
   /**
    * Add the specified value to the cache under the key k, replacing
@@ -55,6 +73,28 @@ struct _cache {
    */
   cache_value_t (*get)(cache *c, const cache_key_t k);
 
+  /**
+   * Get the value associated with k or add v under k if there is
+   * none, with a single lookup.
+   *
+   * The key and value are claimed by the cache like for add().  If
+   * k was already present, they are freed right away with the
+   * supplied free functions.
+   *
+   * Can be NULL, in which case cache_get_or_add() uses get() and
+   * add().
+   *
+   * Returns the value in the cache or NULL on error.
+   */
+  cache_value_t (*get_or_add)(cache *c, cache_key_t k, cache_value_t v);
+
+  /**
+   * Fill `res` with the statistics of the cache.
+   *
+   * Can be NULL, in which case cache_get_stats() returns `st`.
+   */
+  void (*stats)(cache *c, cache_stats *res);
+
   /**
    * Releases all entries in the cache as well as all of the support
    * structures.
@@ -66,6 +106,33 @@ struct _cache {
   cache_hash_fn khash;
   cache_freek_fn kfree;
   cache_freev_fn vfree;
+  /*
+   * If not NULL, this is called on every value returned by get() and
+   * get_or_add() before the call returns.  It is meant to take a
+   * reference on values that are shared with the caller so that the
+   * cache can release its own at any time.  For cache_sharded() it
+   * runs with the shard locked so no other thread can evict the value
+   * in between.
+   *
+   * It is NULL after creation and can be set afterwards.  cache_disk()
+   * ignores it.
+   */
+  cache_vref_fn vref;
+  /*
+   * If `cost` is not NULL and `max_cost` is not 0, entries are also
+   * evicted while the sum of their cost is over `max_cost`, in
+   * addition to the limits on their number.  The most recently added
+   * entry is always kept, even if it is over the budget by itself.
+   * The cost of an entry is computed once when it is added.
+   *
+   * Both are 0 after creation and should be set before the first
+   * add.  Only cache_lru() and cache_twoq() support them, set them on
+   * the shards for cache_sharded().
+   */
+  cache_cost_fn cost;
+  size_t max_cost;
+  /* Counters kept up to date by cache_lru() and cache_twoq() */
+  cache_stats st;
   /* Extra data goes here depending on cache type */
 };
 
@@ -78,6 +145,49 @@ cache *cache_twoq(size_t hot_size, size_t warm_size,
                   cache_eq_fn keq, cache_hash_fn khash,
                   cache_freek_fn kfree, cache_freev_fn vfree);
 
+/*
+ * Persistent cache stored in the directory `dirpath` (which is
+ * created if needed) with `mem` as an in-memory front.
+ *
+ * Entries are written to disk on add through `kwrite` and `vwrite`
+ * and read back on a miss in `mem` through `kread` and `vread`.  Each
+ * entry is a file named after the hash of the serialized key which
+ * is written to a temporary file and then renamed so that concurrent
+ * processes never see a partial entry.  The full key is stored in the
+ * file and compared on read.
+ *
+ * When the files in the directory go over `max_size` bytes, the least
+ * recently used ones are removed.
+ *
+ * `mem` belongs to the returned cache, even if this fails.  Its free
+ * functions are used for all keys and values.
+ *
+ * Returns NULL on error or if disk caching is not supported on this
+ * platform.
+ */
+cache *cache_disk(const char *dirpath, cache *mem, size_t max_size,
+                  cache_kwrite_fn kwrite, cache_vwrite_fn vwrite,
+                  cache_kread_fn kread, cache_vread_fn vread);
+
+/*
+ * Thread-safe cache that spreads the keys over `nshards` caches
+ * according to their hash.  Each shard has its own lock which is
+ * held for the duration of every operation on it, so threads only
+ * contend when they use keys of the same shard.
+ *
+ * The shards belong to the returned cache, even if this fails.  They
+ * must all use the same key and value functions and must not be used
+ * directly afterwards.
+ *
+ * A value can be evicted by one thread while another still uses it
+ * unless the cache has a vref function.  Shards for values without
+ * one must not evict (see gpucontext_cache()), so their size is not
+ * bounded.
+ *
+ * Returns NULL on error.
+ */
+cache *cache_sharded(size_t nshards, cache **shards);
+
 /* API functions */
 static inline int cache_add(cache *c, cache_key_t k, cache_value_t v) {
   return c->add(c, k, v);
@@ -91,6 +201,27 @@ static inline cache_value_t cache_get(cache *c, cache_key_t k) {
   return c->get(c, k);
 }
 
+static inline cache_value_t cache_get_or_add(cache *c, cache_key_t k,
+                                             cache_value_t v) {
+  cache_value_t res;
+  if (c->get_or_add != NULL)
+    return c->get_or_add(c, k, v);
+  res = cache_get(c, k);
+  if (res != NULL) {
+    c->kfree(k);
+    c->vfree(v);
+    return res;
+  }
+  return cache_add(c, k, v) == 0 ? v : NULL;
+}
+
+static inline void cache_get_stats(cache *c, cache_stats *res) {
+  if (c->stats != NULL)
+    c->stats(c, res);
+  else
+    *res = c->st;
+}
+
 static inline void cache_destroy(cache *c) {
   c->destroy(c);
   free(c);
@@ -0,0 +1,403 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "private_config.h"
+
+#include "util/xxhash.h"
+
+#ifdef _MSC_VER
+
+cache *cache_disk(const char *dirpath, cache *mem, size_t max_size,
+                  cache_kwrite_fn kwrite, cache_vwrite_fn vwrite,
+                  cache_kread_fn kread, cache_vread_fn vread) {
+  cache_destroy(mem);
+  return NULL;
+}
+
+#else
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+
+typedef struct _disk_cache disk_cache;
+
+struct _disk_cache {
+  cache c;
+  cache *mem;
+  char *dirp;
+  size_t max_size;
+  /* Estimated size of the files in the directory */
+  size_t size;
+  cache_kwrite_fn kwrite;
+  cache_vwrite_fn vwrite;
+  cache_kread_fn kread;
+  cache_vread_fn vread;
+};
+
+/* Start of every entry file, bump the version if the format changes */
+static const char MAGIC[8] = "GADC0001";
+
+/* Entry files are named with the 8 hex digits of the key hash */
+#define NAME_LEN 8
+
+typedef struct _entry {
+  char name[NAME_LEN + 1];
+  time_t mtime;
+  size_t size;
+} entry;
+
+static int is_entry(const char *name) {
+  size_t i;
+  for (i = 0; i < NAME_LEN; i++)
+    if (!((name[i] >= '0' && name[i] <= '9') ||
+          (name[i] >= 'a' && name[i] <= 'f')))
+      return 0;
+  return name[NAME_LEN] == '\0';
+}
+
+static int mkdirs(char *path) {
+  char *p;
+  struct stat st;
+
+  for (p = path + 1; *p != '\0'; p++) {
+    if (*p == '/') {
+      *p = '\0';
+      if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        *p = '/';
+        return -1;
+      }
+      *p = '/';
+    }
+  }
+  if (mkdir(path, 0700) != 0 && errno != EEXIST)
+    return -1;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    return -1;
+  return 0;
+}
+
+/*
+ * List the entries in the directory.  If `res` is NULL, only the
+ * total size is computed.
+ */
+static size_t scan(disk_cache *c, entry **res, size_t *n) {
+  DIR *dir;
+  struct dirent *de;
+  struct stat st;
+  strb path = STRB_STATIC_INIT;
+  entry *ents = NULL, *tmp;
+  size_t nents = 0, aents = 0;
+  size_t total = 0;
+
+  dir = opendir(c->dirp);
+  if (dir == NULL)
+    return 0;
+  while ((de = readdir(dir)) != NULL) {
+    if (!is_entry(de->d_name))
+      continue;
+    strb_reset(&path);
+    strb_appendf(&path, "%s/%s", c->dirp, de->d_name);
+    strb_append0(&path);
+    if (strb_error(&path))
+      break;
+    if (stat(path.s, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    total += st.st_size;
+    if (res == NULL)
+      continue;
+    if (nents == aents) {
+      aents = aents == 0 ? 64 : aents * 2;
+      tmp = realloc(ents, aents * sizeof(entry));
+      if (tmp == NULL)
+        break;
+      ents = tmp;
+    }
+    memcpy(ents[nents].name, de->d_name, NAME_LEN + 1);
+    ents[nents].mtime = st.st_mtime;
+    ents[nents].size = st.st_size;
+    nents++;
+  }
+  closedir(dir);
+  strb_clear(&path);
+  if (res != NULL) {
+    *res = ents;
+    *n = nents;
+  }
+  return total;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+  const entry *ea = (const entry *)a;
+  const entry *eb = (const entry *)b;
+  if (ea->mtime < eb->mtime) return -1;
+  if (ea->mtime > eb->mtime) return 1;
+  return 0;
+}
+
+/*
+ * Remove the least recently used entries until the directory is
+ * below 3/4 of the maximum size so that we don't do this on every
+ * add.  Other processes may be writing to the same directory, so the
+ * size is recomputed.
+ *
+ * The entry named `keep` (which can be NULL) is never removed.
+ */
+static void evict(disk_cache *c, const char *keep) {
+  entry *ents = NULL;
+  size_t n = 0, i;
+  strb path = STRB_STATIC_INIT;
+
+  c->size = scan(c, &ents, &n);
+  if (c->size <= c->max_size) {
+    free(ents);
+    return;
+  }
+  qsort(ents, n, sizeof(entry), entry_cmp);
+  for (i = 0; i < n && c->size > (c->max_size / 4) * 3; i++) {
+    if (keep != NULL && strcmp(ents[i].name, keep) == 0)
+      continue;
+    strb_reset(&path);
+    strb_appendf(&path, "%s/%s", c->dirp, ents[i].name);
+    strb_append0(&path);
+    if (strb_error(&path))
+      break;
+    if (unlink(path.s) == 0)
+      c->size -= ents[i].size;
+  }
+  strb_clear(&path);
+  free(ents);
+}
+
+static int entry_path(disk_cache *c, strb *path, const strb *key) {
+  strb_appendf(path, "%s/%08x", c->dirp,
+               XXH32(key->s, key->l, 42));
+  strb_append0(path);
+  return strb_error(path);
+}
+
+static int write_all(int fd, const char *p, size_t sz) {
+  ssize_t r;
+  while (sz > 0) {
+    r = write(fd, p, sz);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += r;
+    sz -= r;
+  }
+  return 0;
+}
+
+static int disk_write(disk_cache *c, const strb *key, const strb *val) {
+  strb path = STRB_STATIC_INIT;
+  strb tmp = STRB_STATIC_INIT;
+  uint64_t lens[2];
+  int fd;
+  int res = -1;
+
+  if (entry_path(c, &path, key))
+    goto end;
+  strb_appendf(&tmp, "%s/tmp.XXXXXX", c->dirp);
+  strb_append0(&tmp);
+  if (strb_error(&tmp))
+    goto end;
+
+  fd = mkstemp(tmp.s);
+  if (fd == -1)
+    goto end;
+  lens[0] = key->l;
+  lens[1] = val->l;
+  if (write_all(fd, MAGIC, sizeof(MAGIC)) ||
+      write_all(fd, (const char *)lens, sizeof(lens)) ||
+      write_all(fd, key->s, key->l) ||
+      write_all(fd, val->s, val->l)) {
+    close(fd);
+    unlink(tmp.s);
+    goto end;
+  }
+  if (close(fd) != 0 || rename(tmp.s, path.s) != 0) {
+    unlink(tmp.s);
+    goto end;
+  }
+  c->size += sizeof(MAGIC) + sizeof(lens) + key->l + val->l;
+  if (c->size > c->max_size)
+    evict(c, path.s + strlen(c->dirp) + 1);
+  res = 0;
+ end:
+  strb_clear(&path);
+  strb_clear(&tmp);
+  return res;
+}
+
+/*
+ * Read the entry for `key`.  On success the value part of the file
+ * is in `val` and `data` holds the whole file.
+ */
+static int disk_read(disk_cache *c, const strb *key, strb *data,
+                     strb *val) {
+  strb path = STRB_STATIC_INIT;
+  struct stat st;
+  uint64_t lens[2];
+  FILE *f = NULL;
+  int res = -1;
+
+  if (entry_path(c, &path, key))
+    goto end;
+  f = fopen(path.s, "rb");
+  if (f == NULL)
+    goto end;
+  if (fstat(fileno(f), &st) != 0 ||
+      (size_t)st.st_size < sizeof(MAGIC) + sizeof(lens))
+    goto end;
+  if (strb_ensure(data, st.st_size))
+    goto end;
+  if (fread(data->s, 1, st.st_size, f) != (size_t)st.st_size)
+    goto end;
+  data->l = st.st_size;
+
+  if (memcmp(data->s, MAGIC, sizeof(MAGIC)) != 0)
+    goto end;
+  memcpy(lens, data->s + sizeof(MAGIC), sizeof(lens));
+  if (sizeof(MAGIC) + sizeof(lens) + lens[0] + lens[1] != data->l)
+    goto end;
+  /* Another key with the same hash */
+  if (lens[0] != key->l ||
+      memcmp(data->s + sizeof(MAGIC) + sizeof(lens), key->s, key->l) != 0)
+    goto end;
+
+  val->s = data->s + sizeof(MAGIC) + sizeof(lens) + key->l;
+  val->l = lens[1];
+  val->a = lens[1];
+  /* Mark it as recently used for eviction */
+  utime(path.s, NULL);
+  res = 0;
+ end:
+  if (f != NULL)
+    fclose(f);
+  strb_clear(&path);
+  return res;
+}
+
+static int disk_add(cache *_c, cache_key_t k, cache_value_t v) {
+  disk_cache *c = (disk_cache *)_c;
+  strb ks = STRB_STATIC_INIT;
+  strb vs = STRB_STATIC_INIT;
+
+  /* Failure to write to disk is not an error, we still have the
+     memory cache */
+  if (c->kwrite(&ks, k) == 0 && c->vwrite(&vs, v) == 0 &&
+      !strb_error(&ks) && !strb_error(&vs)) {
+    disk_write(c, &ks, &vs);
+  }
+  strb_clear(&ks);
+  strb_clear(&vs);
+  return cache_add(c->mem, k, v);
+}
+
+static int disk_del(cache *_c, const cache_key_t k) {
+  disk_cache *c = (disk_cache *)_c;
+  strb ks = STRB_STATIC_INIT;
+  strb path = STRB_STATIC_INIT;
+
+  if (c->kwrite(&ks, k) == 0 && !strb_error(&ks) &&
+      entry_path(c, &path, &ks) == 0)
+    unlink(path.s);
+  strb_clear(&ks);
+  strb_clear(&path);
+  return cache_del(c->mem, k);
+}
+
+static cache_value_t disk_get(cache *_c, const cache_key_t k) {
+  disk_cache *c = (disk_cache *)_c;
+  strb ks = STRB_STATIC_INIT;
+  strb data = STRB_STATIC_INIT;
+  strb vs;
+  cache_key_t nk = NULL;
+  cache_value_t v;
+
+  v = cache_get(c->mem, k);
+  if (v != NULL)
+    return v;
+
+  if (c->kwrite(&ks, k) != 0 || strb_error(&ks))
+    goto end;
+  if (disk_read(c, &ks, &data, &vs) != 0)
+    goto end;
+  nk = c->kread(&ks);
+  if (nk == NULL)
+    goto end;
+  v = c->vread(&vs);
+  if (v == NULL) {
+    c->mem->kfree(nk);
+    goto end;
+  }
+  /* The memory cache owns them now */
+  if (cache_add(c->mem, nk, v) != 0)
+    v = NULL;
+ end:
+  strb_clear(&ks);
+  strb_clear(&data);
+  return v;
+}
+
+static void disk_destroy(cache *_c) {
+  disk_cache *c = (disk_cache *)_c;
+  cache_destroy(c->mem);
+  free(c->dirp);
+}
+
+cache *cache_disk(const char *dirpath, cache *mem, size_t max_size,
+                  cache_kwrite_fn kwrite, cache_vwrite_fn vwrite,
+                  cache_kread_fn kread, cache_vread_fn vread) {
+  disk_cache *res;
+
+  if (mem == NULL)
+    return NULL;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    goto fail;
+  res->dirp = strdup(dirpath);
+  if (res->dirp == NULL)
+    goto fail;
+  if (mkdirs(res->dirp) != 0)
+    goto fail;
+
+  res->mem = mem;
+  res->max_size = max_size;
+  res->kwrite = kwrite;
+  res->vwrite = vwrite;
+  res->kread = kread;
+  res->vread = vread;
+  res->size = scan(res, NULL, NULL);
+  if (res->size > res->max_size)
+    evict(res, NULL);
+
+  res->c.add = disk_add;
+  res->c.del = disk_del;
+  res->c.get = disk_get;
+  res->c.destroy = disk_destroy;
+  res->c.keq = mem->keq;
+  res->c.khash = mem->khash;
+  res->c.kfree = mem->kfree;
+  res->c.vfree = mem->vfree;
+  return (cache *)res;
+
+ fail:
+  if (res != NULL)
+    free(res->dirp);
+  free(res);
+  cache_destroy(mem);
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "private_config.h"
+
+#include "util/lock.h"
+
+typedef struct _shard {
+  ga_lock_t lock;
+  cache *c;
+} shard;
+
+typedef struct _sharded_cache {
+  cache c;
+  size_t nshards;
+  shard *shards;
+} sharded_cache;
+
+static inline shard *get_shard(sharded_cache *c, const cache_key_t k) {
+  /* The shards index their tables with the low bits of the hash,
+     use the high bits here so that each shard sees all of them. */
+  return &c->shards[(c->c.khash(k) >> 32) % c->nshards];
+}
+
+static int sharded_add(cache *_c, cache_key_t k, cache_value_t v) {
+  shard *s = get_shard((sharded_cache *)_c, k);
+  int res;
+  ga_lock_acquire(&s->lock);
+  res = cache_add(s->c, k, v);
+  ga_lock_release(&s->lock);
+  return res;
+}
+
+static int sharded_del(cache *_c, const cache_key_t k) {
+  shard *s = get_shard((sharded_cache *)_c, k);
+  int res;
+  ga_lock_acquire(&s->lock);
+  res = cache_del(s->c, k);
+  ga_lock_release(&s->lock);
+  return res;
+}
+
+static cache_value_t sharded_get(cache *_c, const cache_key_t k) {
+  shard *s = get_shard((sharded_cache *)_c, k);
+  cache_value_t res;
+  ga_lock_acquire(&s->lock);
+  res = cache_get(s->c, k);
+  if (res != NULL && _c->vref != NULL)
+    _c->vref(res);
+  ga_lock_release(&s->lock);
+  return res;
+}
+
+static cache_value_t sharded_get_or_add(cache *_c, cache_key_t k,
+                                        cache_value_t v) {
+  shard *s = get_shard((sharded_cache *)_c, k);
+  cache_value_t res;
+  ga_lock_acquire(&s->lock);
+  res = cache_get_or_add(s->c, k, v);
+  if (res != NULL && _c->vref != NULL)
+    _c->vref(res);
+  ga_lock_release(&s->lock);
+  return res;
+}
+
+static void sharded_stats(cache *_c, cache_stats *res) {
+  sharded_cache *c = (sharded_cache *)_c;
+  cache_stats st;
+  size_t i;
+
+  memset(res, 0, sizeof(*res));
+  for (i = 0; i < c->nshards; i++) {
+    ga_lock_acquire(&c->shards[i].lock);
+    cache_get_stats(c->shards[i].c, &st);
+    ga_lock_release(&c->shards[i].lock);
+    res->hits += st.hits;
+    res->misses += st.misses;
+    res->evictions += st.evictions;
+    res->cost += st.cost;
+  }
+}
+
+static void sharded_destroy(cache *_c) {
+  sharded_cache *c = (sharded_cache *)_c;
+  size_t i;
+  for (i = 0; i < c->nshards; i++) {
+    cache_destroy(c->shards[i].c);
+    ga_lock_fini(&c->shards[i].lock);
+  }
+  free(c->shards);
+}
+
+cache *cache_sharded(size_t nshards, cache **shards) {
+  sharded_cache *res;
+  size_t i;
+
+  res = NULL;
+  if (nshards == 0)
+    return NULL;
+  for (i = 0; i < nshards; i++)
+    if (shards[i] == NULL)
+      goto fail;
+
+  i = 0;
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    goto fail;
+  res->shards = calloc(nshards, sizeof(shard));
+  if (res->shards == NULL)
+    goto fail;
+  for (i = 0; i < nshards; i++) {
+    if (ga_lock_init(&res->shards[i].lock) != 0)
+      goto fail;
+    /* Only the outer cache calls vref, under the lock */
+    shards[i]->vref = NULL;
+    res->shards[i].c = shards[i];
+  }
+  res->nshards = nshards;
+
+  res->c.add = sharded_add;
+  res->c.del = sharded_del;
+  res->c.get = sharded_get;
+  res->c.get_or_add = sharded_get_or_add;
+  res->c.stats = sharded_stats;
+  res->c.destroy = sharded_destroy;
+  res->c.keq = shards[0]->keq;
+  res->c.khash = shards[0]->khash;
+  res->c.kfree = shards[0]->kfree;
+  res->c.vfree = shards[0]->vfree;
+  res->c.vref = NULL;
+  return (cache *)res;
+
+ fail:
+  if (res != NULL && res->shards != NULL) {
+    size_t j;
+    for (j = 0; j < i; j++)
+      ga_lock_fini(&res->shards[j].lock);
+    free(res->shards);
+  }
+  free(res);
+  for (i = 0; i < nshards; i++)
+    if (shards[i] != NULL)
+      cache_destroy(shards[i]);
+  return NULL;
+}
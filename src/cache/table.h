@@ -0,0 +1,316 @@
+#ifndef CACHE_TABLE_H
+#define CACHE_TABLE_H
+
+/*
+ * Support structures shared by the in-memory caches.
+ *
+ * Entries live in nodes that are carved out of slabs owned by the
+ * cache, so adding and removing entries does not go through malloc
+ * once the cache is warm.  Each node is linked in a recency list and
+ * indexed by an open addressing table with linear probing.  The table
+ * stores the hash of each key next to the node pointer so lookups
+ * only compare keys on a full hash match and nothing is rehashed on
+ * delete or resize.
+ */
+
+#include <stdlib.h>
+
+#include "cache.h"
+#include "private_config.h"
+
+typedef struct _node node;
+typedef struct _list list;
+typedef struct _slot slot;
+typedef struct _slab slab;
+typedef struct _table table;
+
+struct _node {
+  node *prev;
+  node *next;
+  cache_key_t key;
+  cache_value_t val;
+  uint64_t hash;
+  size_t cost;
+  /* Free for use by the cache type */
+  int temp;
+};
+
+static inline void node_unlink(node *n) {
+  if (n->next != NULL)
+    n->next->prev = n->prev;
+  if (n->prev != NULL)
+    n->prev->next = n->next;
+  n->next = NULL;
+  n->prev = NULL;
+}
+
+struct _list {
+  node *head;
+  node *tail;
+  size_t size;
+};
+
+static inline void list_init(list *l) {
+  l->head = NULL;
+  l->tail = NULL;
+  l->size = 0;
+}
+
+static inline void list_clear(list *l) {
+  l->head = NULL;
+  l->tail = NULL;
+  l->size = 0;
+}
+
+static inline node *list_pop(list *l) {
+  if (l->head == NULL)
+    return NULL;
+  else {
+    node *oldHead = l->head;
+    l->head = l->head->next;
+    node_unlink(oldHead);
+    l->size--;
+    if (l->size == 0) {
+      l->tail = NULL;
+    }
+    return oldHead;
+  }
+}
+
+static inline node *list_remove(list *l, node *n) {
+  if (n == l->head)
+    l->head = n->next;
+  if (n == l->tail)
+    l->tail = n->prev;
+  node_unlink(n);
+  l->size--;
+  return n;
+}
+
+static inline void list_push(list *l, node *n) {
+  node_unlink(n);
+  if (l->head == NULL) {
+    l->head = n;
+  } else if (l->head == l->tail) {
+    l->head->next = n;
+    n->prev = l->head;
+  } else {
+    l->tail->next = n;
+    n->prev = l->tail;
+  }
+  l->tail = n;
+  l->size++;
+}
+
+#define SLAB_NODES 64
+
+struct _slab {
+  slab *next;
+  node nodes[SLAB_NODES];
+};
+
+struct _slot {
+  uint64_t hash;
+  node *n; /* NULL if the slot is empty */
+};
+
+struct _table {
+  slot *slots;
+  size_t mask; /* Number of slots - 1, it is a power of 2 */
+  size_t size;
+  slab *slabs;
+  /* Unused nodes, linked through next */
+  node *spare;
+};
+
+static inline size_t roundup2(size_t s) {
+  s--;
+  s |= s >> 1;
+  s |= s >> 2;
+  s |= s >> 4;
+  s |= s >> 8;
+  s |= s >> 16;
+  if (sizeof(size_t) >= 8)
+    s |= s >> 32;
+  s++;
+  return s;
+}
+
+/* Keep the load factor under 1/2 */
+static inline size_t table_nslots(size_t size) {
+  size_t n = roundup2(size * 2);
+  return n < 16 ? 16 : n;
+}
+
+static inline int table_init(table *t, size_t size) {
+  size_t n = table_nslots(size);
+  t->slots = calloc(n, sizeof(*t->slots));
+  if (t->slots == NULL)
+    return -1;
+  t->mask = n - 1;
+  t->size = 0;
+  t->slabs = NULL;
+  t->spare = NULL;
+  return 0;
+}
+
+static inline void table_clear(table *t, cache_freek_fn kfree,
+                               cache_freev_fn vfree) {
+  size_t i;
+  slab *s;
+
+  for (i = 0; i <= t->mask; i++) {
+    if (t->slots[i].n != NULL) {
+      kfree(t->slots[i].n->key);
+      vfree(t->slots[i].n->val);
+    }
+  }
+  free(t->slots);
+  while (t->slabs != NULL) {
+    s = t->slabs;
+    t->slabs = s->next;
+    free(s);
+  }
+  t->slots = NULL;
+  t->mask = 0;
+  t->size = 0;
+  t->spare = NULL;
+}
+
+static inline node *table_find(table *t, const cache_key_t key,
+                               uint64_t h, cache_eq_fn keq) {
+  size_t i = h & t->mask;
+  while (t->slots[i].n != NULL) {
+    if (t->slots[i].hash == h && keq(t->slots[i].n->key, key))
+      return t->slots[i].n;
+    i = (i + 1) & t->mask;
+  }
+  return NULL;
+}
+
+static inline void table_place(slot *slots, size_t mask, node *n) {
+  size_t i = n->hash & mask;
+  while (slots[i].n != NULL)
+    i = (i + 1) & mask;
+  slots[i].hash = n->hash;
+  slots[i].n = n;
+}
+
+static inline int table_grow(table *t) {
+  size_t n = (t->mask + 1) * 2;
+  size_t i;
+  slot *slots = calloc(n, sizeof(*slots));
+  if (slots == NULL)
+    return -1;
+  for (i = 0; i <= t->mask; i++)
+    if (t->slots[i].n != NULL)
+      table_place(slots, n - 1, t->slots[i].n);
+  free(t->slots);
+  t->slots = slots;
+  t->mask = n - 1;
+  return 0;
+}
+
+static inline node *node_alloc(table *t) {
+  node *res;
+  slab *s;
+  size_t i;
+
+  if (t->spare == NULL) {
+    s = malloc(sizeof(*s));
+    if (s == NULL)
+      return NULL;
+    s->next = t->slabs;
+    t->slabs = s;
+    for (i = 0; i < SLAB_NODES; i++) {
+      s->nodes[i].next = t->spare;
+      t->spare = &s->nodes[i];
+    }
+  }
+  res = t->spare;
+  t->spare = res->next;
+  res->next = NULL;
+  return res;
+}
+
+static inline size_t entry_cost(cache *c, const cache_key_t key,
+                                const cache_value_t val) {
+  return c->cost == NULL ? 0 : c->cost(key, val);
+}
+
+/*
+ * Add a new entry for `key` which must not be in the table already
+ * and account for its cost in `c`.  Returns NULL on allocation
+ * failure.
+ */
+static inline node *table_add(table *t, cache *c, const cache_key_t key,
+                              const cache_value_t val, uint64_t h) {
+  node *n;
+
+  if ((t->size + 1) * 2 > t->mask + 1)
+    if (table_grow(t))
+      return NULL;
+  n = node_alloc(t);
+  if (n == NULL)
+    return NULL;
+  n->prev = NULL;
+  n->next = NULL;
+  n->key = key;
+  n->val = val;
+  n->hash = h;
+  n->cost = entry_cost(c, key, val);
+  n->temp = 0;
+  table_place(t->slots, t->mask, n);
+  t->size++;
+  c->st.cost += n->cost;
+  return n;
+}
+
+/* Replace the key and value of `n`, freeing the previous ones */
+static inline void node_replace(cache *c, node *n, const cache_key_t key,
+                                const cache_value_t val) {
+  c->kfree(n->key);
+  c->vfree(n->val);
+  c->st.cost -= n->cost;
+  n->key = key;
+  n->val = val;
+  n->cost = entry_cost(c, key, val);
+  c->st.cost += n->cost;
+}
+
+/*
+ * Remove `n` from the table and free its key and value with the
+ * functions of `c`.  The node must not be in a list anymore.
+ */
+static inline void table_del(table *t, cache *c, node *n) {
+  size_t i = n->hash & t->mask;
+  size_t j, k;
+
+  while (t->slots[i].n != n)
+    i = (i + 1) & t->mask;
+
+  /* Move back the entries that would not be found with a hole at i */
+  j = i;
+  for (;;) {
+    j = (j + 1) & t->mask;
+    if (t->slots[j].n == NULL)
+      break;
+    k = t->slots[j].hash & t->mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+  t->slots[i].n = NULL;
+  t->size--;
+
+  c->kfree(n->key);
+  c->vfree(n->val);
+  c->st.cost -= n->cost;
+  n->key = NULL;
+  n->val = NULL;
+  n->next = t->spare;
+  t->spare = n;
+}
+
+#endif
@@ -1,223 +1,21 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "cache.h"
 #include "private_config.h"
 
-typedef struct _node node;
-typedef struct _list list;
-typedef struct _hash hash;
+#include "table.h"
+
 typedef struct _twoq_cache twoq_cache;
 
 #define HOT 0
 #define WARM 1
 #define COLD 2
 
-struct _node {
-  node *prev;
-  node *next;
-  node *h_next;
-  cache_key_t key;
-  cache_value_t val;
-  int temp;
-};
-
-static inline void node_init(node *n, const cache_key_t k,
-                             const cache_value_t v) {
-  n->prev = NULL;
-  n->next = NULL;
-  n->h_next = NULL;
-  n->key = k;
-  n->val = v;
-  n->temp = HOT;
-}
-
-static inline node *node_alloc(const cache_key_t key,
-                               const cache_value_t val) {
-  node *res = malloc(sizeof(node));
-  if (res != NULL)
-    node_init(res, key, val);
-  return res;
-}
-
-static inline void node_free(node *n, cache_freek_fn kfree,
-                             cache_freev_fn vfree) {
-  kfree(n->key);
-  vfree(n->val);
-  if (n->h_next != NULL)
-    node_free(n->h_next, kfree, vfree);
-  free(n);
-}
-
-static inline void node_unlink(node *n) {
-  if (n->next != NULL)
-    n->next->prev = n->prev;
-  if (n->prev != NULL)
-    n->prev->next = n->next;
-  n->next = NULL;
-  n->prev = NULL;
-}
-
-struct _list {
-  node *head;
-  node *tail;
-  size_t size;
-};
-
-static inline void list_init(list *l) {
-  l->head = NULL;
-  l->tail = NULL;
-  l->size = 0;
-}
-
-static inline void list_clear(list *l) {
-  l->head = NULL;
-  l->tail = NULL;
-  l->size = 0;
-}
-
-static inline node *list_pop(list *l) {
-  if (l->head == NULL)
-    return NULL;
-  else {
-    node *oldHead = l->head;
-    l->head = l->head->next;
-    node_unlink(oldHead);
-    l->size--;
-    if (l->size == 0) {
-      l->tail = NULL;
-    }
-    return oldHead;
-  }
-}
-
-static inline node *list_remove(list *l, node *n) {
-  if (n == l->head)
-    l->head = n->next;
-  if (n == l->tail)
-    l->tail = n->prev;
-  node_unlink(n);
-  l->size--;
-  return n;
-}
-
-static inline void list_push(list *l, node *n) {
-  node_unlink(n);
-  if (l->head == NULL) {
-    l->head = n;
-  } else if (l->head == l->tail) {
-    l->head->next = n;
-    n->prev = l->head;
-  } else {
-    l->tail->next = n;
-    n->prev = l->tail;
-  }
-  l->tail = n;
-  l->size++;
-}
-
-struct _hash {
-  node **keyval;
-  size_t nbuckets;
-  size_t size;
-};
-
-static inline size_t roundup2(size_t s) {
-  s--;
-  s |= s >> 1;
-  s |= s >> 2;
-  s |= s >> 4;
-  s |= s >> 8;
-  s |= s >> 16;
-  if (sizeof(size_t) >= 8)
-    s |= s >> 32;
-  s++;
-  return s;
-}
-
-static inline int hash_init(hash *h, size_t size) {
-  h->nbuckets = roundup2(size + (size/6));
-  h->keyval = calloc(h->nbuckets, sizeof(*h->keyval));
-  if (h->keyval == NULL) {
-    return -1;
-  }
-  h->size = 0;
-  return 0;
-}
-
-static inline void hash_clear(hash *h, cache_freek_fn kfree,
-                              cache_freev_fn vfree) {
-  size_t i;
-  for (i = 0; i < h->nbuckets; i++) {
-    if (h->keyval[i] != NULL)
-      node_free(h->keyval[i], kfree, vfree);
-  }
-  free(h->keyval);
-  h->nbuckets = 0;
-  h->size = 0;
-  h->keyval = NULL;
-}
-
-static inline node *hash_find(hash *h, const cache_key_t key,
-                              cache_eq_fn keq, cache_hash_fn khash) {
-  size_t p = khash(key) & (h->nbuckets - 1);
-  node *n;
-  if (h->keyval[p] != NULL) {
-    n = h->keyval[p];
-    do {
-      if (keq(n->key, key))
-        return n;
-      n = n->h_next;
-    } while (n != NULL);
-  }
-  return NULL;
-}
-
-static inline node *hash_add(hash *h, const cache_key_t key,
-                             const cache_value_t val,
-                             cache_hash_fn khash) {
-  size_t p = khash(key) & (h->nbuckets - 1);
-  node *n = node_alloc(key, val);
-  if (n == NULL) return NULL;
-  if (h->keyval[p] == NULL) {
-    h->keyval[p] = n;
-  } else {
-    n->h_next = h->keyval[p];
-    h->keyval[p] = n;
-  }
-  h->size++;
-  return n;
-}
-
-static inline void hash_del(hash *h, node *n,
-                            cache_freek_fn kfree,
-                            cache_freev_fn vfree,
-                            cache_hash_fn khash) {
-  size_t p = khash(n->key) & (h->nbuckets - 1);
-  node *np;
-  if (n == h->keyval[p]) {
-    h->keyval[p] = n->h_next;
-    n->h_next = NULL;
-    node_free(n, kfree, vfree);
-    h->size--;
-  } else {
-    np = h->keyval[p];
-    while (np->h_next != NULL) {
-      if (np->h_next == n) {
-        np->h_next = n->h_next;
-        n->h_next = NULL;
-        node_free(n, kfree, vfree);
-        h->size--;
-        break;
-      }
-      np = np->h_next;
-    }
-  }
-}
-
 struct _twoq_cache {
   cache c;
-  hash data;
+  table data;
   list hot;
   list warm;
   list cold;
@@ -236,29 +34,51 @@ static inline void twoq_prune(twoq_cache *c) {
   if (c->cold.size > c->cold_size + c->elasticity) {
     while (c->cold.size > c->cold_size) {
       node *n = list_pop(&c->cold);
-      hash_del(&c->data, n, c->c.kfree, c->c.vfree, c->c.khash);
+      table_del(&c->data, &c->c, n);
+      c->c.st.evictions++;
     }
   }
+  /* Over budget, take from the coldest entries first.  The newest
+     entry is the last one in the hot list and stays. */
+  if (c->c.max_cost > 0) {
+    while (c->c.st.cost > c->c.max_cost) {
+      node *n;
+      if (c->cold.size > 0)
+        n = list_pop(&c->cold);
+      else if (c->warm.size > 0)
+        n = list_pop(&c->warm);
+      else if (c->hot.size > 1)
+        n = list_pop(&c->hot);
+      else
+        break;
+      table_del(&c->data, &c->c, n);
+      c->c.st.evictions++;
+    }
+  }
+}
+
+static void twoq_unlink(twoq_cache *c, node *n) {
+  switch (n->temp) {
+  case HOT:
+    list_remove(&c->hot, n);
+    break;
+  case WARM:
+    list_remove(&c->warm, n);
+    break;
+  case COLD:
+    list_remove(&c->cold, n);
+    break;
+  default:
+    assert(0 && "node temperature is not within expected values");
+  }
 }
 
 static int twoq_del(cache *_c, const cache_key_t k) {
   twoq_cache *c = (twoq_cache *)_c;
-  node *n = hash_find(&c->data, k, c->c.keq, c->c.khash);
+  node *n = table_find(&c->data, k, c->c.khash(k), c->c.keq);
   if (n != NULL) {
-    switch (n->temp) {
-    case HOT:
-      list_remove(&c->hot, n);
-      break;
-    case WARM:
-      list_remove(&c->warm, n);
-      break;
-    case COLD:
-      list_remove(&c->cold, n);
-      break;
-    default:
-      assert(0 && "node temperature is not within expected values");
-    }
-    hash_del(&c->data, n, c->c.kfree, c->c.vfree, c->c.khash);
+    twoq_unlink(c, n);
+    table_del(&c->data, &c->c, n);
     return 1;
   }
   return 0;
@@ -266,56 +86,99 @@ static int twoq_del(cache *_c, const cache_key_t k) {
 
 static int twoq_add(cache *_c, cache_key_t key, cache_value_t val) {
   twoq_cache *c = (twoq_cache *)_c;
-  node *n;
-  /* XXX: possible optimization here to combine remove and add.
-          currently needs to be done this way since hash_add does not
-          overwrite previous values */
-  twoq_del(_c, key);
-  n = hash_add(&c->data, key, val, c->c.khash);
-  if (n == NULL) {
-    return -1;
+  uint64_t h = c->c.khash(key);
+  node *n = table_find(&c->data, key, h, c->c.keq);
+  if (n != NULL) {
+    /* Replace the previous entry in place, it starts over as hot */
+    node_replace(&c->c, n, key, val);
+    twoq_unlink(c, n);
+  } else {
+    n = table_add(&c->data, &c->c, key, val, h);
+    if (n == NULL) {
+      c->c.kfree(key);
+      c->c.vfree(val);
+      return -1;
+    }
   }
+  n->temp = HOT;
   list_push(&c->hot, n);
   twoq_prune(c);
   return 0;
 }
 
+/* Move `n` up after a hit */
+static void twoq_touch(twoq_cache *c, node *n) {
+  node *nn;
+  switch (n->temp) {
+  case HOT:
+    list_remove(&c->hot, n);
+    list_push(&c->hot, n);
+    break;
+  case WARM:
+    list_remove(&c->warm, n);
+    list_push(&c->warm, n);
+    break;
+  case COLD:
+    list_remove(&c->cold, n);
+    n->temp = WARM;
+    list_push(&c->warm, n);
+    if (c->warm.size > c->warm_size) {
+      nn = list_pop(&c->warm);
+      nn->temp = COLD;
+      list_push(&c->cold, nn);
+    }
+    break;
+  default:
+    assert(0 && "node temperature is not within expected values");
+  }
+}
+
 static cache_value_t twoq_get(cache *_c, const cache_key_t key) {
   twoq_cache *c = (twoq_cache *)_c;
-  node *nn;
-  node *n = hash_find(&c->data, key, c->c.keq, c->c.khash);
+  node *n = table_find(&c->data, key, c->c.khash(key), c->c.keq);
   if (n == NULL) {
+    c->c.st.misses++;
     return NULL;
-  } else {
-    switch (n->temp) {
-    case HOT:
-      list_remove(&c->hot, n);
-      list_push(&c->hot, n);
-      break;
-    case WARM:
-      list_remove(&c->warm, n);
-      list_push(&c->warm, n);
-      break;
-    case COLD:
-      list_remove(&c->cold, n);
-      n->temp = WARM;
-      list_push(&c->warm, n);
-      if (c->warm.size > c->warm_size) {
-        nn = list_pop(&c->warm);
-        nn->temp = COLD;
-        list_push(&c->cold, nn);
-      }
-      break;
-    default:
-      assert(0 && "node temperature is not within expected values");
-    }
+  }
+  c->c.st.hits++;
+  twoq_touch(c, n);
+  if (c->c.vref != NULL)
+    c->c.vref(n->val);
+  return n->val;
+}
+
+static cache_value_t twoq_get_or_add(cache *_c, cache_key_t key,
+                                     cache_value_t val) {
+  twoq_cache *c = (twoq_cache *)_c;
+  uint64_t h = c->c.khash(key);
+  node *n = table_find(&c->data, key, h, c->c.keq);
+  if (n != NULL) {
+    c->c.st.hits++;
+    c->c.kfree(key);
+    c->c.vfree(val);
+    twoq_touch(c, n);
+    if (c->c.vref != NULL)
+      c->c.vref(n->val);
     return n->val;
   }
+  c->c.st.misses++;
+  n = table_add(&c->data, &c->c, key, val, h);
+  if (n == NULL) {
+    c->c.kfree(key);
+    c->c.vfree(val);
+    return NULL;
+  }
+  n->temp = HOT;
+  list_push(&c->hot, n);
+  if (c->c.vref != NULL)
+    c->c.vref(val);
+  twoq_prune(c);
+  return val;
 }
 
 static void twoq_destroy(cache *_c) {
   twoq_cache *c = (twoq_cache *)_c;
-  hash_clear(&c->data, c->c.kfree, c->c.vfree);
+  table_clear(&c->data, c->c.kfree, c->c.vfree);
   list_clear(&c->hot);
   list_clear(&c->warm);
   list_clear(&c->cold);
@@ -331,7 +194,7 @@ cache *cache_twoq(size_t hot_size, size_t warm_size, size_t cold_size,
   res = malloc(sizeof(*res));
   if (res == NULL) return NULL;
 
-  if (hash_init(&res->data, hot_size+warm_size+cold_size+elasticity)) {
+  if (table_init(&res->data, hot_size+warm_size+cold_size+elasticity)) {
     free(res);
     return NULL;
   }
@@ -346,10 +209,16 @@ cache *cache_twoq(size_t hot_size, size_t warm_size, size_t cold_size,
   res->c.add = twoq_add;
   res->c.del = twoq_del;
   res->c.get = twoq_get;
+  res->c.get_or_add = twoq_get_or_add;
   res->c.destroy = twoq_destroy;
   res->c.keq = keq;
   res->c.khash = khash;
   res->c.kfree = kfree;
   res->c.vfree = vfree;
+  res->c.stats = NULL;
+  res->c.vref = NULL;
+  res->c.cost = NULL;
+  res->c.max_cost = 0;
+  memset(&res->c.st, 0, sizeof(res->c.st));
   return (cache *)res;
 }
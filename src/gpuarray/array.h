@@ -567,9 +567,36 @@ GPUARRAY_PUBLIC int GpuArray_transfer(GpuArray *res, const GpuArray *a);
 GPUARRAY_PUBLIC int GpuArray_split(GpuArray **rs, const GpuArray *a, size_t n,
                                    size_t *p, unsigned int axis);
 
+/**
+ * Split an array into multiple new arrays.
+ *
+ * This is like GpuArray_split(), but the parts are copied into new C
+ * contiguous arrays instead of being views of `a`.  All the copies
+ * are done together, which is much faster than copying each part
+ * separately when there are many of them.
+ *
+ * If an error occurs during the operation, the created arrays will be
+ * cleared before returning.
+ *
+ * \param rs list of array pointers to store results (must be of length n+1)
+ * \param a array to split
+ * \param n number of splits (length of p)
+ * \param p list of split points (must be increasing)
+ * \param axis axis to split
+ *
+ * \return GA_NO_ERROR if the operation was succesful.
+ * \return an error code otherwise
+ */
+GPUARRAY_PUBLIC int GpuArray_split_copy(GpuArray **rs, const GpuArray *a,
+                                        size_t n, size_t *p,
+                                        unsigned int axis);
+
 /**
  * Concatenate the arrays in `as` along the axis `axis`.
  *
+ * If all the arrays in `as` have the same type, the copy is done in
+ * one pass over the result instead of one per array.
+ *
  * If an error occurs during the operation, the result array may be
  * cleared before returning.
  *
@@ -43,6 +43,20 @@ struct _gpukernel;
  */
 typedef struct _gpukernel gpukernel;
 
+struct _gpustream;
+
+/**
+ * Opaque struct for stream data.
+ */
+typedef struct _gpustream gpustream;
+
+struct _gpugraph;
+
+/**
+ * Opaque struct for captured work.
+ */
+typedef struct _gpugraph gpugraph;
+
 /**
  * \brief Gets information about the number of available platforms for the
  * backend specified in `name`.
@@ -101,6 +115,9 @@ GPUARRAY_PUBLIC gpucontext *gpucontext_init(const char *name, int dev,
 /**
  * Optimize parameters for multi-thread performance.
  *
+ * The kernel caches of the context are also split in independently
+ * locked shards so that they can be shared by many threads.
+ *
  * May decrease overall performance in single-thread scenarios.
  */
 #define GA_CTX_MULTI_THREAD  0x01
@@ -179,6 +196,256 @@ GPUARRAY_PUBLIC int gpucontext_property(gpucontext *ctx, int prop_id,
  */
 GPUARRAY_PUBLIC const char *gpucontext_error(gpucontext *ctx, int err);
 
+/**
+ * Create a new stream in a context.
+ *
+ * Operations that are queued on different streams can run
+ * concurrently on the device.  The dependencies between operations
+ * that use the same buffers on different streams are still tracked,
+ * so there is no need for explicit synchronization.
+ *
+ * Streams are reference counted and start with a reference count of
+ * 1.  They keep a reference to their context.
+ *
+ * This is not supported for contexts created with
+ * #GA_CTX_SINGLE_STREAM.
+ *
+ * \param ctx context
+ * \param flags must be 0 for now
+ * \param ret error return pointer
+ *
+ * \returns a new stream or NULL if an error occured.
+ */
+GPUARRAY_PUBLIC gpustream *gpustream_new(gpucontext *ctx, int flags,
+                                         int *ret);
+
+/**
+ * Retain a stream.
+ *
+ * \param s stream
+ */
+GPUARRAY_PUBLIC void gpustream_retain(gpustream *s);
+
+/**
+ * Release a stream.
+ *
+ * If this was the last reference and the stream is current for its
+ * context, the context goes back to its default stream.  Operations
+ * already queued on the stream will still run.
+ *
+ * \param s stream
+ */
+GPUARRAY_PUBLIC void gpustream_release(gpustream *s);
+
+/**
+ * Wait for all the operations queued on a stream to complete.
+ *
+ * \param s stream
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpustream_sync(gpustream *s);
+
+/**
+ * Get the context of a stream.
+ *
+ * \param s stream
+ */
+GPUARRAY_PUBLIC gpucontext *gpustream_context(gpustream *s);
+
+/**
+ * Select the stream used for the operations of a context.
+ *
+ * All the operations queued in the context after this call, kernel
+ * calls, copies between buffers and BLAS calls, go to `s`.  Transfers
+ * to and from the host keep using their own stream.
+ *
+ * The context does not hold a reference to the stream.
+ *
+ * \param ctx context
+ * \param s stream from `ctx` or NULL for the default stream
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpucontext_set_stream(gpucontext *ctx, gpustream *s);
+
+/**
+ * Get the current stream of a context.
+ *
+ * \param ctx context
+ *
+ * \returns the current stream or NULL if it is the default stream.
+ */
+GPUARRAY_PUBLIC gpustream *gpucontext_get_stream(gpucontext *ctx);
+
+/**
+ * Return memory kept in the allocation cache to the driver.
+ *
+ * Freed buffers are kept by the context to make later allocations
+ * faster.  This releases the cached memory until at most `keep`
+ * bytes remain.  Only the blocks obtained from the driver that are
+ * entirely free can be released so more than `keep` bytes may stay
+ * cached if the cache is fragmented.
+ *
+ * This is also done automatically with `keep` set to 0 when an
+ * allocation from the driver fails, before reporting the error.
+ *
+ * \param ctx context
+ * \param keep number of bytes that can stay cached
+ *
+ * \returns the number of bytes that were released
+ */
+GPUARRAY_PUBLIC size_t gpucontext_trim(gpucontext *ctx, size_t keep);
+
+/**
+ * Start recording the operations of a context.
+ *
+ * Kernel launches, copies, BLAS and collective operations are
+ * recorded with their name, sizes, stream and timestamps in a ring
+ * buffer of `size` events (rounded up to a power of 2).  When the
+ * buffer is full the oldest events are overwritten.
+ *
+ * Tracing can also be enabled for all contexts by setting the
+ * `GPUARRAY_TRACE` environment variable to a file name.  The trace
+ * is then written to that file when the context is destroyed (with
+ * a numbered suffix for contexts after the first).
+ *
+ * Recording is thread-safe.  When tracing is disabled, the cost is
+ * a single test per operation.  Starting and stopping are not
+ * synchronized with the operations though, so they must not run
+ * while other threads use the context.
+ *
+ * \param ctx context
+ * \param size number of events to keep or 0 for the default (65536)
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpucontext_trace_start(gpucontext *ctx, size_t size);
+
+/**
+ * Stop recording and drop the events that were not written.
+ *
+ * This must not run while other threads use the context, see
+ * gpucontext_trace_start().
+ *
+ * \param ctx context
+ */
+GPUARRAY_PUBLIC void gpucontext_trace_stop(gpucontext *ctx);
+
+/**
+ * Write the recorded events to a file and clear the buffer.
+ *
+ * The file uses the Chrome trace event format, which can be opened
+ * in chrome://tracing or Perfetto.  Each stream of the context is
+ * shown as a separate thread, with the default stream as thread 0.
+ * Kernels list their dynamic shared memory size as `shared_mem`,
+ * the other operations their size in `bytes`.
+ *
+ * Kernel launches are timed on the device when the backend allows it
+ * (with events in CUDA, with queue profiling in OpenCL if the queue
+ * was made with it, which is the case when `GPUARRAY_TRACE` is set).
+ * This waits for the recorded kernels to finish.  Their `clock`
+ * argument says which was used.  The other timestamps are taken on
+ * the host around the library calls, so asynchronous operations only
+ * show the time taken to queue them.
+ *
+ * Events recorded while this runs are kept for the next call.
+ *
+ * \param ctx context
+ * \param path name of the file to write
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpucontext_trace_dump(gpucontext *ctx,
+                                          const char *path);
+
+/**
+ * Start capturing the work queued on the current stream of a context.
+ *
+ * Until gpucontext_capture_end() is called, kernel launches, copies,
+ * memsets and BLAS operations on the context are recorded instead of
+ * executed.  Synchronous operations (like gpudata_read()) are not
+ * allowed while capturing and fail with GA_INVALID_ERROR.  The
+ * asynchronous transfers are captured on the current stream.
+ *
+ * The buffers used by the captured work, including the ones allocated
+ * during the capture, are held by the resulting graph so that their
+ * memory is not reused for something else while it exists.
+ *
+ * Work queued on the context before this call is completed first.
+ *
+ * This is only supported by the cuda backend with CUDA 11.4 or later.
+ *
+ * \param ctx context
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpucontext_capture_begin(gpucontext *ctx);
+
+/**
+ * Finish a capture and build a graph of the recorded work.
+ *
+ * \param ctx context
+ * \param ret error return pointer
+ *
+ * \returns the graph or NULL on error.  In all cases the capture is
+ * over.
+ */
+GPUARRAY_PUBLIC gpugraph *gpucontext_capture_end(gpucontext *ctx, int *ret);
+
+/**
+ * Queue all the work of a graph on the current stream of its context.
+ *
+ * This has the cost of a single launch, whatever the number of
+ * operations in the graph.  The operations use the arguments they
+ * were captured with unless they are changed with gpugraph_setargs().
+ *
+ * \param g graph
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpugraph_launch(gpugraph *g);
+
+/**
+ * Get the number of kernel launches in a graph.
+ *
+ * \param g graph
+ *
+ * \returns the number of kernels
+ */
+GPUARRAY_PUBLIC unsigned int gpugraph_numkernels(gpugraph *g);
+
+/**
+ * Change the arguments of a captured kernel launch for the following
+ * calls to gpugraph_launch().
+ *
+ * The kernel, grid and block sizes stay the same.  `args` has the
+ * same format as for gpukernel_call() and buffers in it are held by
+ * the graph like the captured ones.  The buffers they replace are
+ * released if nothing else in the graph uses them.
+ *
+ * \param g graph
+ * \param i index of the launch in the order of capture
+ * \param nargs number of arguments, must match the kernel
+ * \param types types of the arguments, must match the ones the
+ *              kernel was created with
+ * \param args new arguments for the kernel
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpugraph_setargs(gpugraph *g, unsigned int i,
+                                     unsigned int nargs, const int *types,
+                                     void **args);
+
+/**
+ * Free a graph and release the buffers it holds.
+ *
+ * This must not be called before the launches of the graph are done.
+ *
+ * \param g graph
+ */
+GPUARRAY_PUBLIC void gpugraph_release(gpugraph *g);
+
 /**
  * Allocates a buffer of size `sz` in context `ctx`.
  *
@@ -246,6 +513,12 @@ GPUARRAY_PUBLIC gpudata *gpudata_alloc(gpucontext *ctx, size_t sz, void *data,
  * Allocate the buffer in host-reachable memory enabling you to
  * retrieve a pointer to the contents as the
  * `GA_BUFFER_PROP_HOSTPOINTER` property.
+ *
+ * On CUDA this is page-locked memory that the device can access
+ * directly.  Copies between these buffers and device buffers with
+ * gpudata_move() don't block the host and transfers from or to the
+ * host pointer with gpudata_read_async() and gpudata_write_async()
+ * can overlap with other work.
  */
 #define GA_BUFFER_HOST       0x08
 
@@ -254,6 +527,37 @@ GPUARRAY_PUBLIC gpudata *gpudata_alloc(gpucontext *ctx, size_t sz, void *data,
 /* The upper 16 bits are private flags */
 #define GA_BUFFER_MASK       0xffff
 
+/**
+ * @}
+ */
+
+/**
+ * \defgroup arg_access Kernel argument access flags
+ *
+ * These describe how a kernel uses each of its buffer arguments (see
+ * gpukernel_init()).  Backends use them to avoid serializing kernels
+ * that only read from the same buffer.
+ *
+ * @{
+ */
+
+/**
+ * The kernel reads from the buffer.
+ */
+#define GA_ARG_READ          0x01
+
+/**
+ * The kernel writes to the buffer.
+ */
+#define GA_ARG_WRITE         0x02
+
+/**
+ * The kernel may read from and write to the buffer.
+ *
+ * This is what is assumed when no access flags are specified.
+ */
+#define GA_ARG_READ_WRITE    (GA_ARG_READ|GA_ARG_WRITE)
+
 /**
  * @}
  */
@@ -363,6 +667,53 @@ GPUARRAY_PUBLIC int gpudata_read(void *dst,
 GPUARRAY_PUBLIC int gpudata_write(gpudata *dst, size_t dstoff,
                                   const void *src, size_t sz);
 
+/**
+ * Start a transfer from a buffer to memory.
+ *
+ * This is like gpudata_read() except that it may return before the
+ * transfer is complete.  The contents of `dst` are undefined until
+ * gpudata_query() reports that `src` is done or gpudata_sync() is
+ * called on `src`.
+ *
+ * The transfer is only really asynchronous if `dst` is page-locked
+ * memory, like the host pointer of a #GA_BUFFER_HOST buffer.
+ * Backends that can't do asynchronous transfers complete it before
+ * returning.
+ *
+ * \param dst destination in memory
+ * \param src source buffer
+ * \param srcoff offset inside the source buffer
+ * \param sz size of data to copy (in bytes)
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpudata_read_async(void *dst,
+                                       gpudata *src, size_t srcoff,
+                                       size_t sz);
+
+/**
+ * Start a transfer from memory to a buffer.
+ *
+ * This is like gpudata_write() except that it may return before the
+ * transfer is complete.  The memory at `src` must not be modified or
+ * freed until gpudata_query() reports that `dst` is done or
+ * gpudata_sync() is called on `dst`.
+ *
+ * The transfer is only really asynchronous if `src` is page-locked
+ * memory, like the host pointer of a #GA_BUFFER_HOST buffer.
+ * Backends that can't do asynchronous transfers complete it before
+ * returning.
+ *
+ * \param dst destination buffer
+ * \param dstoff offset inside the destination buffer
+ * \param src source in memory
+ * \param sz size of data to copy (in bytes)
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpudata_write_async(gpudata *dst, size_t dstoff,
+                                        const void *src, size_t sz);
+
 /**
  * Set a buffer to a byte pattern.
  *
@@ -390,6 +741,21 @@ GPUARRAY_PUBLIC int gpudata_memset(gpudata *dst, size_t dstoff, int data);
  */
 GPUARRAY_PUBLIC int gpudata_sync(gpudata *b);
 
+/**
+ * Check if the operations on a buffer are finished.
+ *
+ * This is the non-blocking version of gpudata_sync().  It may report
+ * that the buffer is still busy because of unrelated operations that
+ * were queued before the last one that used it.
+ *
+ * \param b buffer
+ * \param done set to 1 if all previous operations involving the
+ *             buffer are finished and 0 otherwise
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int gpudata_query(gpudata *b, int *done);
+
 /**
  * Fetch a buffer property.
  *
@@ -422,6 +788,11 @@ GPUARRAY_PUBLIC gpucontext *gpudata_context(gpudata *b);
  * \param strings table of string pointers
  * \param lengths (optional) length for each string in the table
  * \param fname name of the kernel function (as defined in the code)
+ * \param numargs number of kernel arguments
+ * \param typecodes type of each argument
+ * \param access (optional) access flags for each argument (see
+ *        \ref arg_access), ignored for non-buffer arguments.  If NULL
+ *        all buffers are assumed to be read and written.
  * \param flags flags for compilation (see #ga_usefl)
  * \param ret error return pointer
  * \param err_str returns pointer to debug message from GPU backend
@@ -436,8 +807,8 @@ GPUARRAY_PUBLIC gpucontext *gpudata_context(gpudata *b);
 GPUARRAY_PUBLIC gpukernel *gpukernel_init(gpucontext *ctx, unsigned int count,
                                           const char **strings, const size_t *lengths,
                                           const char *fname, unsigned int numargs,
-                                          const int *typecodes, int flags, int *ret,
-                                          char **err_str);
+                                          const int *typecodes, const int *access,
+                                          int flags, int *ret, char **err_str);
 
 /**
  * Retain a kernel.
@@ -466,6 +837,10 @@ GPUARRAY_PUBLIC void gpukernel_release(gpukernel *k);
  * responsability of the caller to ensure that the value is still
  * valid whenever a call is made.
  *
+ * The value is stored in the kernel object itself.  Kernels that
+ * come from the cache of a context may be shared by many users, so
+ * prefer passing the arguments to gpukernel_call() directly.
+ *
  * \param k kernel
  * \param i argument index (starting at 0)
  * \param a pointer to argument
@@ -690,10 +1065,159 @@ GPUARRAY_PUBLIC gpucontext *gpukernel_context(gpukernel *k);
 /**
  * Get the largest single block of memory that can be allocted.
  *
+ * This is the bigger of the largest free block in the allocation
+ * cache and the free memory reported by the driver.  It is cheap to
+ * query but may be too high if the device memory is fragmented, see
+ * GA_CTX_PROP_LARGEST_MEMBLOCK_PROBED.
+ *
  * Type: `size_t`
  */
 #define GA_CTX_PROP_LARGEST_MEMBLOCK 20
 
+/**
+ * Get the number of bytes of device memory obtained from the driver
+ * and not yet returned to it.  This includes the memory that is in
+ * use and the memory kept in the allocation cache.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_MEM_RESERVED 21
+
+/**
+ * Get the number of bytes of device memory in allocated buffers.
+ *
+ * This counts the actual size of the buffers which may be larger
+ * than the requested sizes because of rounding.  Buffers that wrap
+ * external memory are not counted.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_MEM_USED 22
+
+/**
+ * Get the highest value of #GA_CTX_PROP_MEM_USED since the creation
+ * of the context.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_MEM_PEAK 23
+
+/**
+ * Get the number of bytes of device memory that are free in the
+ * allocation cache.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_MEM_CACHED 24
+
+/**
+ * Get the number of free blocks in the allocation cache.
+ *
+ * A high number compared to #GA_CTX_PROP_MEM_CACHED means the cache
+ * is fragmented.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_MEM_FRAGMENTS 25
+
+/**
+ * Get the size of the largest free block in the allocation cache.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_MEM_LARGEST_CACHED 26
+
+/**
+ * Get the number of allocations that were requested from the driver
+ * since the creation of the context.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_MEM_NUM_ALLOCS 27
+
+/**
+ * Get the number of lookups that found a compiled kernel in the
+ * kernel cache of the context.
+ *
+ * The size of that cache can be limited to a number of megabytes of
+ * source and binaries with the GPUARRAY_KERNEL_CACHE_SIZE environment
+ * variable, in addition to its limit on the number of kernels.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_KERNEL_CACHE_HITS 28
+
+/**
+ * Get the number of lookups in the kernel cache that missed and
+ * needed a compilation.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_KERNEL_CACHE_MISSES 29
+
+/**
+ * Get the number of kernels that were evicted from the kernel cache
+ * to stay within its limits.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_KERNEL_CACHE_EVICTIONS 30
+
+/**
+ * Get the size in bytes of the source and binaries held by the
+ * kernel cache.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_KERNEL_CACHE_BYTES 31
+
+/**
+ * Get the number of GpuElemwise_new() calls that found an existing
+ * object to share.
+ *
+ * The budget of GPUARRAY_KERNEL_CACHE_SIZE applies to this cache too,
+ * counting the size of the signatures and of the kernels that the
+ * objects hold.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_ELEMWISE_CACHE_HITS 32
+
+/**
+ * Get the number of GpuElemwise_new() calls that had to create a new
+ * object.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_ELEMWISE_CACHE_MISSES 33
+
+/**
+ * Get the number of GpuElemwise objects that were evicted from the
+ * cache.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_ELEMWISE_CACHE_EVICTIONS 34
+
+/**
+ * Get the size in bytes of the signatures and kernels in the
+ * GpuElemwise cache.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_ELEMWISE_CACHE_BYTES 35
+
+/**
+ * Like GA_CTX_PROP_LARGEST_MEMBLOCK, but for CUDA the size the driver
+ * can provide is found by trying allocations down to a precision of
+ * 2MB.  This is exact even with fragmented memory but not cheap, as
+ * each try allocates and frees device memory.  The other backends
+ * return the same thing as GA_CTX_PROP_LARGEST_MEMBLOCK.
+ *
+ * Type: `size_t`
+ */
+#define GA_CTX_PROP_LARGEST_MEMBLOCK_PROBED 36
+
 /* Start at 512 for GA_BUFFER_PROP_ */
 #define GA_BUFFER_PROP_START  512
 
@@ -721,6 +1245,18 @@ GPUARRAY_PUBLIC gpucontext *gpukernel_context(gpukernel *k);
  */
 #define GA_BUFFER_PROP_SIZE  514
 
+/**
+ * Host pointer to the contents of a buffer allocated with
+ * #GA_BUFFER_HOST.
+ *
+ * The contents should not be accessed while operations on the buffer
+ * are pending, use gpudata_sync() or gpudata_query() to make sure.
+ * Not all backends support this.
+ *
+ * Type: `void *`
+ */
+#define GA_BUFFER_PROP_HOSTPOINTER 515
+
 /* Start at 1024 for GA_KERNEL_PROP_ */
 #define GA_KERNEL_PROP_START     1024
 
@@ -764,6 +1300,35 @@ GPUARRAY_PUBLIC gpucontext *gpukernel_context(gpukernel *k);
  */
 #define GA_KERNEL_PROP_TYPES     1028
 
+/**
+ * Get the list of argument access flags for a kernel.
+ *
+ * This list is the same length as the number of arguments to the
+ * kernel.  Non-buffer arguments have a value of 0.  Do not modify the
+ * returned list.
+ *
+ * Type: `const int *`
+ */
+#define GA_KERNEL_PROP_ACCESS    1029
+
+/**
+ * Get the name of the kernel function.
+ *
+ * Do not modify or free the returned value.
+ *
+ * Type: `const char *`
+ */
+#define GA_KERNEL_PROP_NAME      1030
+
+/**
+ * Get the size of the compiled binary of the kernel.
+ *
+ * This is an estimate of the memory that the kernel keeps alive.
+ *
+ * Type: `size_t`
+ */
+#define GA_KERNEL_PROP_BINSIZE   1031
+
 /**
  * @}
  */
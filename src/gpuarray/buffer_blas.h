@@ -131,6 +131,30 @@ GPUARRAY_PUBLIC int gpublas_dgemmBatch(
   double beta, gpudata **C, size_t *offC, size_t ldc,
   size_t batchCount, int flags);
 
+GPUARRAY_PUBLIC int gpublas_hgemm3D(
+  cb_order order, cb_transpose transA, cb_transpose transB,
+  size_t M, size_t N, size_t K, float alpha,
+  gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+  gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+  float beta, gpudata *C, size_t offC, size_t ldc, ssize_t strideC,
+  size_t batchCount, int flags);
+
+GPUARRAY_PUBLIC int gpublas_sgemm3D(
+  cb_order order, cb_transpose transA, cb_transpose transB,
+  size_t M, size_t N, size_t K, float alpha,
+  gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+  gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+  float beta, gpudata *C, size_t offC, size_t ldc, ssize_t strideC,
+  size_t batchCount, int flags);
+
+GPUARRAY_PUBLIC int gpublas_dgemm3D(
+  cb_order order, cb_transpose transA, cb_transpose transB,
+  size_t M, size_t N, size_t K, double alpha,
+  gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+  gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+  double beta, gpudata *C, size_t offC, size_t ldc, ssize_t strideC,
+  size_t batchCount, int flags);
+
 GPUARRAY_PUBLIC int gpublas_hgemvBatch(
   cb_order order, cb_transpose transA,
   size_t M, size_t N, float alpha,
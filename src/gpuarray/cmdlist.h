@@ -0,0 +1,155 @@
+#ifndef GPUARRAY_CMDLIST_H
+#define GPUARRAY_CMDLIST_H
+/** \file cmdlist.h
+ *  \brief Recorded lists of operations for replay.
+ */
+
+#include <gpuarray/buffer.h>
+#include <gpuarray/buffer_blas.h>
+#include <gpuarray/kernel.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+struct _GpuCmdList;
+
+/**
+ * Command list.
+ *
+ * This records a sequence of kernel launches, copies, memsets and
+ * BLAS operations with a snapshot of their arguments so that it can
+ * be replayed any number of times for the cost of the launches
+ * alone.  The arguments are checked once when they are recorded and
+ * the kernels are not scheduled or given their arguments again on
+ * replay.
+ *
+ * The contents are private.
+ */
+typedef struct _GpuCmdList GpuCmdList;
+
+/**
+ * Always replay the operations one by one, even if the backend can
+ * capture them in a graph (see gpucontext_capture_begin()).
+ */
+#define GPUCMDLIST_NO_GRAPH 0x1
+
+/**
+ * Create a new empty command list.
+ *
+ * \param ctx the context in which to run the operations
+ * \param flags 0 or GPUCMDLIST_NO_GRAPH
+ *
+ * \returns a new GpuCmdList object or NULL
+ */
+GPUARRAY_PUBLIC GpuCmdList *GpuCmdList_new(gpucontext *ctx, int flags);
+
+/**
+ * Free all storage associated with a command list.
+ *
+ * This releases the buffers and kernels that were held by it.
+ *
+ * \param l the GpuCmdList object to free.
+ */
+GPUARRAY_PUBLIC void GpuCmdList_free(GpuCmdList *l);
+
+/**
+ * Forget all the recorded operations.
+ *
+ * \param l the GpuCmdList object
+ */
+GPUARRAY_PUBLIC void GpuCmdList_reset(GpuCmdList *l);
+
+/**
+ * Get the number of recorded operations.
+ *
+ * \param l the GpuCmdList object
+ */
+GPUARRAY_PUBLIC unsigned int GpuCmdList_size(GpuCmdList *l);
+
+/**
+ * Record a kernel launch.
+ *
+ * The scalar arguments are copied and the buffers are held by the
+ * list, so `args` can be changed or freed after this returns.  The
+ * grid and block sizes must be fully specified, use GpuKernel_sched()
+ * beforehand if needed.
+ *
+ * \param l the GpuCmdList object
+ * \param k the kernel
+ * \param n dimensionality of the grid/blocks
+ * \param gs sizes of launch grid
+ * \param ls sizes of launch blocks
+ * \param shared amount of dynamic shared memory to allocate
+ * \param args table of pointers to arguments or NULL to use the ones
+ *             set with GpuKernel_setarg()
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuCmdList_call(GpuCmdList *l, GpuKernel *k,
+                                    unsigned int n, const size_t *gs,
+                                    const size_t *ls, size_t shared,
+                                    void **args);
+
+/**
+ * Record a copy between two buffers of the context.
+ *
+ * See gpudata_move() for the parameters.
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuCmdList_move(GpuCmdList *l, gpudata *dst,
+                                    size_t dstoff, gpudata *src,
+                                    size_t srcoff, size_t sz);
+
+/**
+ * Record a memset.
+ *
+ * See gpudata_memset() for the parameters.
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuCmdList_memset(GpuCmdList *l, gpudata *dst,
+                                      size_t dstoff, int data);
+
+/**
+ * Record a matrix multiplication.
+ *
+ * This maps to gpublas_hgemm(), gpublas_sgemm() or gpublas_dgemm()
+ * depending on `typecode` and takes the same parameters.
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuCmdList_gemm(GpuCmdList *l, int typecode,
+                                    cb_order order, cb_transpose transA,
+                                    cb_transpose transB, size_t M, size_t N,
+                                    size_t K, double alpha,
+                                    gpudata *A, size_t offA, size_t lda,
+                                    gpudata *B, size_t offB, size_t ldb,
+                                    double beta,
+                                    gpudata *C, size_t offC, size_t ldc);
+
+/**
+ * Queue all the recorded operations in order on the current stream
+ * of the context.
+ *
+ * Unless GPUCMDLIST_NO_GRAPH was specified, the first run after a
+ * change to the list tries to capture the operations in a graph
+ * which is then launched as a whole by this run and the following
+ * ones.  If the backend doesn't support graphs or the capture fails,
+ * the operations are queued one by one.
+ *
+ * \param l the GpuCmdList object
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuCmdList_run(GpuCmdList *l);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -85,6 +85,14 @@ typedef struct _gpuelemwise_arg {
  * the indexing and selection of the right values is handled by the
  * GpuElemwise code.
  *
+ * Objects are shared per context: a call with the same preamble,
+ * expression, argument descriptors and flags as a live object
+ * returns that object with an extra reference.  The context keeps a
+ * number of recently used objects alive so that creating one for
+ * each operation is cheap.  Since they may be shared, the objects
+ * don't keep any state between calls and can be called from many
+ * threads at once.
+ *
  * \param ctx the context in which to run the operations
  * \param preamble code to be inserted before the kernel code
  * \param expr the expression to compute
@@ -123,9 +131,11 @@ GPUARRAY_PUBLIC GpuElemwise *GpuElemwise_new(gpucontext *ctx,
  */
 
 /**
- * Free all storage associated with a GpuElemwise.
+ * Release a reference to a GpuElemwise.
+ *
+ * The storage is freed when the last reference goes away.
  *
- * \param ge the GpuElemwise object to free.
+ * \param ge the GpuElemwise object to release.
  */
 GPUARRAY_PUBLIC void GpuElemwise_free(GpuElemwise *ge);
 
@@ -0,0 +1,195 @@
+#ifndef GPUARRAY_FUSION_H
+#define GPUARRAY_FUSION_H
+/** \file fusion.h
+ *  \brief Fused elementwise expressions.
+ */
+
+#include <gpuarray/buffer.h>
+#include <gpuarray/array.h>
+#include <gpuarray/elemwise.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+struct _GpuFusion;
+
+/**
+ * Fused expression builder.
+ *
+ * This records a graph of elementwise operations over arrays and
+ * scalars and evaluates it with a single GpuElemwise kernel.
+ *
+ * The contents are private.
+ */
+typedef struct _GpuFusion GpuFusion;
+
+/**
+ * Maximum number of arguments to a function node.
+ */
+#define GPUFUSION_MAXARGS 3
+
+/**
+ * Create a new GpuFusion.
+ *
+ * Graphs with the same structure and types evaluate with the same
+ * GpuElemwise, which is shared through the context.  An object can
+ * be reused for other expressions after GpuFusion_reset().
+ *
+ * \param ctx the context in which to run the operations
+ * \param flags must be 0 for now
+ *
+ * \returns a new GpuFusion object or NULL
+ */
+GPUARRAY_PUBLIC GpuFusion *GpuFusion_new(gpucontext *ctx, int flags);
+
+/**
+ * Free all storage associated with a GpuFusion.
+ *
+ * \param f the GpuFusion object to free.
+ */
+GPUARRAY_PUBLIC void GpuFusion_free(GpuFusion *f);
+
+/**
+ * Forget all the recorded nodes.
+ *
+ * \param f the GpuFusion object
+ */
+GPUARRAY_PUBLIC void GpuFusion_reset(GpuFusion *f);
+
+/**
+ * Add an array input.
+ *
+ * The array is not copied and must stay valid until the evaluation.
+ * Adding the same array more than once results in a single kernel
+ * argument.
+ *
+ * \param f the GpuFusion object
+ * \param a the array
+ * \param node (out) the id of the new node
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuFusion_array(GpuFusion *f, GpuArray *a, int *node);
+
+/**
+ * Add a scalar input.
+ *
+ * The value is copied.  In type promotion a scalar does not upcast
+ * arrays of the same kind (boolean, integer or floating point) so
+ * that `a * 2` keeps the type of `a`.
+ *
+ * \param f the GpuFusion object
+ * \param typecode the type of the value
+ * \param val pointer to the value
+ * \param node (out) the id of the new node
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuFusion_scalar(GpuFusion *f, int typecode,
+                                     const void *val, int *node);
+
+/**
+ * Add a unary operation.
+ *
+ * \param f the GpuFusion object
+ * \param op one of "-", "+", "~" or "!"
+ * \param a the operand node
+ * \param node (out) the id of the new node
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuFusion_unary(GpuFusion *f, const char *op, int a,
+                                    int *node);
+
+/**
+ * Add a binary operation.
+ *
+ * Arithmetic and bitwise operators produce the promoted type of the
+ * operands.  Comparisons and logical operators produce GA_BOOL.  The
+ * operands are converted to the promoted type before the operation
+ * and the operations follow the rules of C (for example, integer
+ * division truncates).
+ *
+ * \param f the GpuFusion object
+ * \param op a C binary operator ("+", "-", "*", "/", "%", "&", "|",
+ *           "^", "<<", ">>", "<", "<=", ">", ">=", "==", "!=", "&&"
+ *           or "||")
+ * \param a the left operand node
+ * \param b the right operand node
+ * \param node (out) the id of the new node
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuFusion_binary(GpuFusion *f, const char *op, int a,
+                                     int b, int *node);
+
+/**
+ * Add a function call.
+ *
+ * The function must be available in kernel code (like `exp` or
+ * `fmax`).  The arguments are converted to the result type before
+ * the call.
+ *
+ * \param f the GpuFusion object
+ * \param fn the name of the function
+ * \param typecode the type of the result or -1 for the promoted type
+ *                 of the arguments
+ * \param n the number of arguments (at most GPUFUSION_MAXARGS)
+ * \param args the argument nodes
+ * \param node (out) the id of the new node
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuFusion_call(GpuFusion *f, const char *fn,
+                                   int typecode, unsigned int n,
+                                   const int *args, int *node);
+
+/**
+ * Add a type conversion.
+ *
+ * \param f the GpuFusion object
+ * \param typecode the target type
+ * \param a the operand node
+ * \param node (out) the id of the new node
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuFusion_cast(GpuFusion *f, int typecode, int a,
+                                   int *node);
+
+/**
+ * Get the result type of a node.
+ *
+ * \param f the GpuFusion object
+ * \param node the node
+ *
+ * \returns the typecode or -1 if the node does not exist
+ */
+GPUARRAY_PUBLIC int GpuFusion_typecode(GpuFusion *f, int node);
+
+/**
+ * Evaluate a node into an array.
+ *
+ * All the operations that lead to the node are computed in a single
+ * kernel and the result is converted to the type of `out`.  The
+ * output can be one of the inputs of the graph.
+ *
+ * \param f the GpuFusion object
+ * \param node the node to evaluate
+ * \param out the output array, already allocated with the right shape
+ * \param flags see \ref elem_call_flags "GpuElemwise call flags"
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuFusion_eval(GpuFusion *f, int node, GpuArray *out,
+                                   int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -41,6 +41,10 @@ typedef struct _GpuKernel {
  * \param strs C array of source code strings
  * \param lens C array with the size of each string or NULL
  * \param name name of the kernel function
+ * \param argcount number of kernel arguments
+ * \param types typecode for each argument
+ * \param access access flags for each argument or NULL (see
+ *               \ref arg_access)
  * \param flags kernel use flags (see \ref ga_usefl)
  * \param err_str (if not NULL) location to write GPU-backend provided debug info 
  * 
@@ -53,7 +57,8 @@ GPUARRAY_PUBLIC int GpuKernel_init(GpuKernel *k, gpucontext *ctx,
                                    unsigned int count, const char **strs,
                                    const size_t *lens, const char *name,
                                    unsigned int argcount, const int *types,
-                                   int flags, char **err_str);
+                                   const int *access, int flags,
+                                   char **err_str);
 
 /**
  * Clear and release data associated with a kernel.
@@ -71,7 +76,21 @@ GPUARRAY_PUBLIC void GpuKernel_clear(GpuKernel *k);
  */
 GPUARRAY_PUBLIC gpucontext *GpuKernel_context(GpuKernel *k);
 
-
+/**
+ * Set a kernel argument for the next GpuKernel_call() with NULL args.
+ *
+ * The value is stored in `k` and not in the underlying gpukernel,
+ * which may be shared with other GpuKernel objects through the
+ * kernel cache of the context.  Many GpuKernel objects can thus use
+ * the same gpukernel from different threads, but a single GpuKernel
+ * must not be used by two threads at once.
+ *
+ * \param k the kernel
+ * \param i argument index (starting at 0)
+ * \param val pointer to the argument value
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
 GPUARRAY_PUBLIC int GpuKernel_setarg(GpuKernel *k, unsigned int i, void *val);
 
 /**
@@ -101,7 +120,8 @@ GPUARRAY_PUBLIC int GpuKernel_sched(GpuKernel *k, size_t n,
  * \param gs sizes of launch grid
  * \param ls sizes of launch blocks
  * \param amount of dynamic shared memory to allocate
- * \param args table of pointers to arguments
+ * \param args table of pointers to arguments or NULL to use the ones
+ *             set with GpuKernel_setarg()
  */
 GPUARRAY_PUBLIC int GpuKernel_call(GpuKernel *k, unsigned int n,
                                    const size_t *gs, const size_t *ls,
@@ -0,0 +1,128 @@
+#ifndef GPUARRAY_REDUCTION_H
+#define GPUARRAY_REDUCTION_H
+/** \file reduction.h
+ *  \brief Custom reduction operations generator.
+ */
+
+#include <gpuarray/buffer.h>
+#include <gpuarray/array.h>
+#include <gpuarray/elemwise.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+struct _GpuReduction;
+
+/**
+ * Reduction generator structure.
+ *
+ * The contents are private.
+ */
+typedef struct _GpuReduction GpuReduction;
+
+/**
+ * Output information structure for GpuReduction.
+ */
+typedef struct _gpureduction_out {
+  /**
+   * Name of this output in the associated expressions, mandatory.
+   */
+  const char *name;
+
+  /**
+   * Type of the output and of its accumulator, mandatory.
+   */
+  int typecode;
+
+  /**
+   * Neutral value for the reduction (as a C expression), mandatory.
+   */
+  const char *neutral;
+} gpureduction_out;
+
+/**
+ * Create a new GpuReduction.
+ *
+ * This will allocate and initialize a new GpuReduction object.  This
+ * object can be used to run the specified reduction on different sets
+ * of arrays and over different sets of axes.
+ *
+ * The input descriptors are the same as for GpuElemwise, except that
+ * GE_WRITE is not allowed.  All the array inputs must have the same
+ * shape.
+ *
+ * The map expression is run for every element of the inputs and must
+ * assign a value to each output name.  The values of the inputs are
+ * available under their names and the flattened (C order) index of
+ * the element along the reduced axes is available as `ridx`.
+ *
+ * The reduce expression combines two partial results.  It is given
+ * the values `a_<name>` and `b_<name>` for each output and must leave
+ * the combined result in the `a_<name>` variables.  It must be
+ * associative and each output must start from its neutral value.
+ *
+ * Kernels are compiled on demand and kept for each combination of
+ * dimensions and reduced axes that is seen.
+ *
+ * \param ctx the context in which to run the operations
+ * \param preamble code to be inserted before the kernel code
+ * \param map_expr the map expression (can be NULL if there is only
+ *                 one input and one output, in which case the input
+ *                 is used directly)
+ * \param reduce_expr the reduce expression
+ * \param n the number of inputs
+ * \param args the input descriptors
+ * \param nout the number of outputs
+ * \param outs the output descriptors
+ * \param flags must be 0 for now
+ *
+ * \returns a new GpuReduction object or NULL
+ */
+GPUARRAY_PUBLIC GpuReduction *GpuReduction_new(gpucontext *ctx,
+                                               const char *preamble,
+                                               const char *map_expr,
+                                               const char *reduce_expr,
+                                               unsigned int n,
+                                               gpuelemwise_arg *args,
+                                               unsigned int nout,
+                                               gpureduction_out *outs,
+                                               int flags);
+
+/**
+ * Free all storage associated with a GpuReduction.
+ *
+ * \param gr the GpuReduction object to free.
+ */
+GPUARRAY_PUBLIC void GpuReduction_free(GpuReduction *gr);
+
+/**
+ * Run a GpuReduction on some inputs.
+ *
+ * The outputs must have the shape of the inputs with the reduced axes
+ * removed.  The order in which the axes are listed in `redux` does
+ * not matter.  No state is kept between calls, so the same object can
+ * be called from many threads at once if the context was created with
+ * GA_CTX_MULTI_THREAD.
+ *
+ * \param gr the GpuReduction to run
+ * \param outs the output arrays (must match the output descriptors)
+ * \param args pointers to the inputs (must match the input descriptors)
+ * \param nredux number of axes to reduce over
+ * \param redux list of axes to reduce over
+ * \param flags must be 0 for now
+ *
+ * \returns GA_NO_ERROR or an error code if an error occurred.
+ */
+GPUARRAY_PUBLIC int GpuReduction_call(GpuReduction *gr, GpuArray **outs,
+                                      void **args, unsigned int nredux,
+                                      const unsigned int *redux, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
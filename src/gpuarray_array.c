@@ -16,6 +16,7 @@
 #include "gpuarray/kernel.h"
 #include "gpuarray/util.h"
 
+#include "util/intdiv.h"
 #include "util/strb.h"
 #include "util/xxhash.h"
 
@@ -30,23 +31,340 @@ static int extcopy_eq(cache_key_t _k1, cache_key_t _k2) {
   return k1->itype == k2->itype && k1->otype == k2->otype;
 }
 
+/* The cached values are boxed pointers, see cache_box_new() */
+static void extcopy_clearv(cache_value_t v) {
+  GpuElemwise_free(*(GpuElemwise **)v);
+}
+
 static void extcopy_free(cache_key_t k) {
   free(k);
 }
 
-static uint32_t extcopy_hash(cache_key_t k) {
-  return XXH32(k, sizeof(struct extcopy_args), 42);
+static uint64_t extcopy_hash(cache_key_t k) {
+  return XXH64(k, sizeof(struct extcopy_args), 42);
+}
+
+/*
+ * Copies where the fastest axis of the source is not the fastest
+ * axis of the destination (transposes, C <-> F order, NCHW <-> NHWC)
+ * go through a tile in local memory so that both the reads and the
+ * writes are coalesced.
+ */
+
+/* Size of the square tiles and number of rows handled at once */
+#define TRANSPOSE_TILE 32
+#define TRANSPOSE_ROWS 8
+/* Don't bother with tiles for smaller axes */
+#define TRANSPOSE_MIN 8
+
+struct transpose_args {
+  int typecode;
+  unsigned int nd;
+  unsigned int sa;
+  unsigned int da;
+};
+
+static int transpose_eq(cache_key_t _k1, cache_key_t _k2) {
+  struct transpose_args *k1 = _k1;
+  struct transpose_args *k2 = _k2;
+  return memcmp(k1, k2, sizeof(struct transpose_args)) == 0;
+}
+
+static uint64_t transpose_hash(cache_key_t k) {
+  return XXH64(k, sizeof(struct transpose_args), 42);
+}
+
+static void transpose_freek(cache_key_t k) {
+  free(k);
+}
+
+static void transpose_clearv(cache_value_t v) {
+  GpuKernel_clear((GpuKernel *)v);
+}
+
+static int gen_transpose_kernel(GpuKernel *k, gpucontext *ctx,
+                                const struct transpose_args *a) {
+  strb sb = STRB_STATIC_INIT;
+  int *ktypes, *kaccess;
+  const char *ctype = gpuarray_get_type(a->typecode)->cluda_name;
+  unsigned int i, p;
+  int flags = GA_USE_CLUDA;
+  int res;
+
+  p = 7 + 3 * a->nd;
+  ktypes = calloc(p, sizeof(int));
+  kaccess = calloc(p, sizeof(int));
+  if (ktypes == NULL || kaccess == NULL) {
+    res = GA_MEMORY_ERROR;
+    goto bail;
+  }
+
+  flags |= gpuarray_type_flags(a->typecode, -1);
+
+  p = 0;
+  strb_appends(&sb, "KERNEL void transpose(const ga_size ntiles, "
+               "const ga_size tiles_s, const ga_size tiles_d");
+  ktypes[p++] = GA_SIZE;
+  ktypes[p++] = GA_SIZE;
+  ktypes[p++] = GA_SIZE;
+  for (i = 0; i < a->nd; i++) {
+    strb_appendf(&sb, ", const ga_size dim%u", i);
+    ktypes[p++] = GA_SIZE;
+  }
+  strb_appends(&sb, ", GLOBAL_MEM char *src, const ga_size src_offset");
+  kaccess[p] = GA_ARG_READ;
+  ktypes[p++] = GA_BUFFER;
+  ktypes[p++] = GA_SIZE;
+  for (i = 0; i < a->nd; i++) {
+    strb_appendf(&sb, ", const ga_ssize src_str_%u", i);
+    ktypes[p++] = GA_SSIZE;
+  }
+  strb_appends(&sb, ", GLOBAL_MEM char *dst, const ga_size dst_offset");
+  kaccess[p] = GA_ARG_WRITE;
+  ktypes[p++] = GA_BUFFER;
+  ktypes[p++] = GA_SIZE;
+  for (i = 0; i < a->nd; i++) {
+    strb_appendf(&sb, ", const ga_ssize dst_str_%u", i);
+    ktypes[p++] = GA_SSIZE;
+  }
+  /* The extra column avoids bank conflicts when reading columns */
+  strb_appendf(&sb, ") {\n"
+               "LOCAL_MEM %s tile[%u][%u];\n"
+               "ga_size t;\n"
+               "for (t = GID_0; t < ntiles; t += GDIM_0) {\n"
+               "ga_size ii = t / tiles_s;\n"
+               "const ga_size ts = t %% tiles_s;\n"
+               "const ga_size td = ii %% tiles_d;\n"
+               "ga_ssize src_p = src_offset;\n"
+               "ga_ssize dst_p = dst_offset;\n"
+               "ga_size x, y, j, pos;\n"
+               "ii = ii / tiles_d;\n",
+               ctype, TRANSPOSE_TILE, TRANSPOSE_TILE + 1);
+  for (i = a->nd; i > 0; i--) {
+    if (i - 1 == a->sa || i - 1 == a->da)
+      continue;
+    strb_appendf(&sb, "pos = ii %% dim%u;\n"
+                 "ii = ii / dim%u;\n"
+                 "src_p += (ga_ssize)pos * src_str_%u;\n"
+                 "dst_p += (ga_ssize)pos * dst_str_%u;\n",
+                 i - 1, i - 1, i - 1, i - 1);
+  }
+  /* Read along the source fast axis (sa), write along the
+     destination fast axis (da) */
+  strb_appendf(&sb, "x = ts * %u + LID_0;\n"
+               "for (j = LID_1; j < %u; j += LDIM_1) {\n"
+               "y = td * %u + j;\n"
+               "if (x < dim%u && y < dim%u)\n"
+               "tile[j][LID_0] = *(GLOBAL_MEM %s *)(src + src_p + "
+               "(ga_ssize)x * src_str_%u + (ga_ssize)y * src_str_%u);\n"
+               "}\n"
+               "local_barrier();\n",
+               TRANSPOSE_TILE, TRANSPOSE_TILE, TRANSPOSE_TILE,
+               a->sa, a->da, ctype, a->sa, a->da);
+  strb_appendf(&sb, "x = td * %u + LID_0;\n"
+               "for (j = LID_1; j < %u; j += LDIM_1) {\n"
+               "y = ts * %u + j;\n"
+               "if (x < dim%u && y < dim%u)\n"
+               "*(GLOBAL_MEM %s *)(dst + dst_p + (ga_ssize)x * dst_str_%u + "
+               "(ga_ssize)y * dst_str_%u) = tile[LID_0][j];\n"
+               "}\n"
+               "local_barrier();\n"
+               "}\n"
+               "}\n",
+               TRANSPOSE_TILE, TRANSPOSE_TILE, TRANSPOSE_TILE,
+               a->da, a->sa, ctype, a->da, a->sa);
+
+  if (strb_error(&sb)) {
+    res = GA_MEMORY_ERROR;
+    goto bail;
+  }
+
+  res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "transpose",
+                       p, ktypes, kaccess, flags, NULL);
+ bail:
+  free(ktypes);
+  free(kaccess);
+  strb_clear(&sb);
+  return res;
+}
+
+/* The result has a reference for the caller, see cache_box_new() */
+static GpuKernel *get_transpose_kernel(gpucontext *ctx,
+                                       const struct transpose_args *a,
+                                       int *err) {
+  struct transpose_args *aa;
+  GpuKernel *k = NULL;
+
+  if (ctx->transpose_cache != NULL)
+    k = cache_get(ctx->transpose_cache, (cache_key_t)a);
+  if (k != NULL)
+    return k;
+
+  k = cache_box_new(sizeof(GpuKernel), transpose_clearv);
+  if (k == NULL) {
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+  *err = gen_transpose_kernel(k, ctx, a);
+  if (*err != GA_NO_ERROR) {
+    cache_box_release(k);
+    return NULL;
+  }
+  aa = memdup(a, sizeof(*a));
+  if (aa == NULL) {
+    cache_box_release(k);
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+  if (ctx->transpose_cache == NULL)
+    gpucontext_cache_install(&ctx->transpose_cache,
+                             gpucontext_cache(ctx->flags, 4, 8, 8, 2,
+                                              transpose_eq, transpose_hash,
+                                              transpose_freek,
+                                              cache_box_release,
+                                              cache_box_ref, NULL));
+  if (ctx->transpose_cache == NULL) {
+    transpose_freek(aa);
+    cache_box_release(k);
+    *err = GA_MISC_ERROR;
+    return NULL;
+  }
+  /* Another thread may have added the same kernel in the meantime */
+  k = cache_get_or_add(ctx->transpose_cache, aa, k);
+  if (k == NULL)
+    *err = GA_MISC_ERROR;
+  return k;
+}
+
+/*
+ * Returns GA_UNSUPPORTED_ERROR if the copy is not a transpose of the
+ * fast axes, in which case the caller should use a normal copy.
+ */
+static int ga_transpose(GpuArray *dst, const GpuArray *src) {
+  struct transpose_args args;
+  gpucontext *ctx = gpudata_context(dst->data);
+  GpuKernel *k = NULL;
+  void **kargs = NULL;
+  size_t *dims = NULL;
+  ssize_t *strs[2] = {NULL, NULL};
+  size_t elsize, ntiles, tiles_s, tiles_d, max_l;
+  size_t gs[2], ls[2];
+  unsigned int i, nd, argp;
+  int sa = -1, da = -1;
+  int err = GA_UNSUPPORTED_ERROR;
+
+  if (src->typecode != dst->typecode || src->nd != dst->nd ||
+      src->nd < 2 || gpudata_context(src->data) != ctx)
+    return GA_UNSUPPORTED_ERROR;
+  for (i = 0; i < src->nd; i++)
+    if (src->dimensions[i] != dst->dimensions[i])
+      return GA_UNSUPPORTED_ERROR;
+
+  elsize = gpuarray_get_elsize(src->typecode);
+  nd = src->nd;
+  dims = memdup(src->dimensions, nd * sizeof(size_t));
+  strs[0] = memdup(src->strides, nd * sizeof(ssize_t));
+  strs[1] = memdup(dst->strides, nd * sizeof(ssize_t));
+  if (dims == NULL || strs[0] == NULL || strs[1] == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto out;
+  }
+  gpuarray_elemwise_collapse(2, &nd, dims, strs);
+
+  for (i = 0; i < nd; i++) {
+    if (strs[0][i] == (ssize_t)elsize)
+      sa = i;
+    if (strs[1][i] == (ssize_t)elsize)
+      da = i;
+  }
+  if (sa == -1 || da == -1 || sa == da ||
+      dims[sa] < TRANSPOSE_MIN || dims[da] < TRANSPOSE_MIN)
+    goto out;
+
+  memset(&args, 0, sizeof(args));
+  args.typecode = src->typecode;
+  args.nd = nd;
+  args.sa = sa;
+  args.da = da;
+  k = get_transpose_kernel(ctx, &args, &err);
+  if (k == NULL)
+    goto out;
+  /* Not enough resources for a full group, use the normal copy */
+  err = gpukernel_property(k->k, GA_KERNEL_PROP_MAXLSIZE, &max_l);
+  if (err != GA_NO_ERROR)
+    goto out;
+  if (max_l < TRANSPOSE_TILE * TRANSPOSE_ROWS) {
+    err = GA_UNSUPPORTED_ERROR;
+    goto out;
+  }
+
+  tiles_s = (dims[sa] + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+  tiles_d = (dims[da] + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+  ntiles = tiles_s * tiles_d;
+  for (i = 0; i < nd; i++)
+    if (i != (unsigned int)sa && i != (unsigned int)da)
+      ntiles *= dims[i];
+  if (ntiles == 0) {
+    err = GA_NO_ERROR;
+    goto out;
+  }
+
+  /* The kernel is shared through the cache, so the arguments are
+     passed to the call rather than set on it */
+  kargs = calloc(7 + 3 * nd, sizeof(void *));
+  if (kargs == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto out;
+  }
+  argp = 0;
+  kargs[argp++] = &ntiles;
+  kargs[argp++] = &tiles_s;
+  kargs[argp++] = &tiles_d;
+  for (i = 0; i < nd; i++)
+    kargs[argp++] = &dims[i];
+  kargs[argp++] = src->data;
+  kargs[argp++] = (void *)&src->offset;
+  for (i = 0; i < nd; i++)
+    kargs[argp++] = &strs[0][i];
+  kargs[argp++] = dst->data;
+  kargs[argp++] = &dst->offset;
+  for (i = 0; i < nd; i++)
+    kargs[argp++] = &strs[1][i];
+
+  /* One group per tile, up to what the scheduler thinks is enough */
+  gs[0] = 0;
+  ls[0] = TRANSPOSE_TILE;
+  err = GpuKernel_sched(k, ntiles * TRANSPOSE_TILE, &gs[0], &ls[0]);
+  if (err != GA_NO_ERROR)
+    goto out;
+  gs[1] = 1;
+  ls[0] = TRANSPOSE_TILE;
+  ls[1] = TRANSPOSE_ROWS;
+  err = GpuKernel_call(k, 2, gs, ls, 0, kargs);
+
+ out:
+  cache_box_release(k);
+  free(kargs);
+  free(dims);
+  free(strs[0]);
+  free(strs[1]);
+  return err;
 }
 
 static int ga_extcopy(GpuArray *dst, const GpuArray *src) {
   struct extcopy_args a, *aa;
   gpucontext *ctx = gpudata_context(dst->data);
-  GpuElemwise *k = NULL;
+  GpuElemwise **k = NULL;
   void *args[2];
+  int err;
 
   if (ctx != gpudata_context(src->data))
     return GA_INVALID_ERROR;
 
+  err = ga_transpose(dst, src);
+  if (err != GA_UNSUPPORTED_ERROR)
+    return err;
+
   a.itype = src->typecode;
   a.otype = dst->typecode;
 
@@ -60,26 +378,485 @@ static int ga_extcopy(GpuArray *dst, const GpuArray *src) {
     gargs[1].name = "dst";
     gargs[1].typecode = dst->typecode;
     gargs[1].flags = GE_WRITE;
-    k = GpuElemwise_new(ctx, "", "dst = src", 2, gargs, 0, 0);
+    k = cache_box_new(sizeof(GpuElemwise *), extcopy_clearv);
     if (k == NULL)
+      return GA_MEMORY_ERROR;
+    *k = GpuElemwise_new(ctx, "", "dst = src", 2, gargs, 0, 0);
+    if (*k == NULL) {
+      cache_box_release(k);
       return GA_MISC_ERROR;
+    }
     aa = memdup(&a, sizeof(a));
     if (aa == NULL) {
-      GpuElemwise_free(k);
+      cache_box_release(k);
       return GA_MEMORY_ERROR;
     }
     if (ctx->extcopy_cache == NULL)
-      ctx->extcopy_cache = cache_twoq(4, 8, 8, 2, extcopy_eq, extcopy_hash,
-                                      extcopy_free,
-                                      (cache_freev_fn)GpuElemwise_free);
-    if (ctx->extcopy_cache == NULL)
+      gpucontext_cache_install(&ctx->extcopy_cache,
+                               gpucontext_cache(ctx->flags, 4, 8, 8, 2,
+                                                extcopy_eq, extcopy_hash,
+                                                extcopy_free,
+                                                cache_box_release,
+                                                cache_box_ref, NULL));
+    if (ctx->extcopy_cache == NULL) {
+      extcopy_free(aa);
+      cache_box_release(k);
       return GA_MISC_ERROR;
-    if (cache_add(ctx->extcopy_cache, aa, k) != 0)
+    }
+    /* Another thread may have added the same kernel in the meantime */
+    k = cache_get_or_add(ctx->extcopy_cache, aa, k);
+    if (k == NULL)
       return GA_MISC_ERROR;
   }
   args[0] = (void *)src;
   args[1] = (void *)dst;
-  return GpuElemwise_call(k, args, GE_BROADCAST);
+  err = GpuElemwise_call(*k, args, GE_BROADCAST);
+  cache_box_release(k);
+  return err;
+}
+
+/*
+ * Copies between one array and a list of pieces laid out along an
+ * axis of that array, all done in as few launches as possible.
+ *
+ * The layout of each piece (start along the axis, buffer slot, offset
+ * and strides) is uploaded to a table in device memory and each
+ * thread looks up the piece for its element.  The buffers themselves
+ * are passed as kernel arguments so there is a limit on the number of
+ * distinct buffers per launch, past that we launch again.
+ *
+ * The tables don't depend on the buffers so the uploaded ones are
+ * kept per context, keyed on their contents.  Repeated copies with
+ * the same layout then don't wait for an upload.
+ */
+
+/* Maximum number of distinct piece buffers for one launch */
+#define MULTICOPY_MAXBUF 32
+
+struct multicopy_args {
+  int btype;
+  int ptype;
+  unsigned int nd;
+  unsigned int axis;
+  unsigned int nbuf;
+  int scatter;
+};
+
+static int multicopy_eq(cache_key_t _k1, cache_key_t _k2) {
+  struct multicopy_args *k1 = _k1;
+  struct multicopy_args *k2 = _k2;
+  return memcmp(k1, k2, sizeof(struct multicopy_args)) == 0;
+}
+
+static uint64_t multicopy_hash(cache_key_t k) {
+  return XXH64(k, sizeof(struct multicopy_args), 42);
+}
+
+static void multicopy_freek(cache_key_t k) {
+  free(k);
+}
+
+static void multicopy_clearv(cache_value_t v) {
+  GpuKernel_clear((GpuKernel *)v);
+}
+
+/* Tables are keyed on their contents, with the length first */
+static int multicopy_tbl_eq(cache_key_t _k1, cache_key_t _k2) {
+  int64_t *k1 = _k1;
+  int64_t *k2 = _k2;
+  return k1[0] == k2[0] &&
+    memcmp(k1 + 1, k2 + 1, k1[0] * sizeof(int64_t)) == 0;
+}
+
+static uint64_t multicopy_tbl_hash(cache_key_t k) {
+  return XXH64(k, (((int64_t *)k)[0] + 1) * sizeof(int64_t), 42);
+}
+
+static void multicopy_tbl_freev(cache_value_t v) {
+  gpudata_release((gpudata *)v);
+}
+
+static void multicopy_tbl_ref(cache_value_t v) {
+  gpudata_retain((gpudata *)v);
+}
+
+/* Emit the conversion of `val` (a value of type `it`) to type `ot` */
+static void multicopy_store(strb *sb, int ot, int it, const char *dst,
+                            const char *val) {
+  const char *ctype = gpuarray_get_type(ot)->cluda_name;
+  if (ot == it)
+    strb_appendf(sb, "*(GLOBAL_MEM %s *)(%s) = %s;\n", ctype, dst, val);
+  else if (ot == GA_HALF)
+    strb_appendf(sb, "store_half((GLOBAL_MEM ga_half *)(%s), (ga_float)%s);\n",
+                 dst, val);
+  else
+    strb_appendf(sb, "*(GLOBAL_MEM %s *)(%s) = (%s)%s;\n", ctype, dst, ctype,
+                 val);
+}
+
+static int gen_multicopy_kernel(GpuKernel *k, gpucontext *ctx,
+                                const struct multicopy_args *a) {
+  strb sb = STRB_STATIC_INIT;
+  int *ktypes, *kaccess;
+  const char *src, *dst;
+  int stype, dtype;
+  unsigned int i, p, w = a->nd + 3;
+  int flags = GA_USE_CLUDA;
+  int res;
+
+  p = 6 + 2 * a->nd + a->nbuf;
+  ktypes = calloc(p, sizeof(int));
+  kaccess = calloc(p, sizeof(int));
+  if (ktypes == NULL || kaccess == NULL) {
+    res = GA_MEMORY_ERROR;
+    goto bail;
+  }
+
+  flags |= gpuarray_type_flags(a->btype, a->ptype, -1);
+
+  p = 0;
+  strb_appends(&sb, "KERNEL void multicopy(const ga_size n, ");
+  ktypes[p++] = GA_SIZE;
+  for (i = 0; i < a->nd; i++) {
+    strb_appendf(&sb, "const ga_size dim%u, ", i);
+    ktypes[p++] = GA_SIZE;
+  }
+  strb_appends(&sb, "GLOBAL_MEM ga_long *tbl, const ga_size tbl_row, "
+               "const ga_uint np, GLOBAL_MEM char *a_data, "
+               "const ga_size a_offset");
+  kaccess[p] = GA_ARG_READ;
+  ktypes[p++] = GA_BUFFER;
+  ktypes[p++] = GA_SIZE;
+  ktypes[p++] = GA_UINT;
+  kaccess[p] = a->scatter ? GA_ARG_READ : GA_ARG_WRITE;
+  ktypes[p++] = GA_BUFFER;
+  ktypes[p++] = GA_SIZE;
+  for (i = 0; i < a->nd; i++) {
+    strb_appendf(&sb, ", const ga_ssize a_str_%u", i);
+    ktypes[p++] = GA_SSIZE;
+  }
+  for (i = 0; i < a->nbuf; i++) {
+    strb_appendf(&sb, ", GLOBAL_MEM char *b%u", i);
+    kaccess[p] = a->scatter ? GA_ARG_WRITE : GA_ARG_READ;
+    ktypes[p++] = GA_BUFFER;
+  }
+  strb_appends(&sb, ") {\n"
+               "const ga_size idx = LDIM_0 * GID_0 + LID_0;\n"
+               "const ga_size numThreads = LDIM_0 * GDIM_0;\n"
+               "ga_size i;\n"
+               "tbl += tbl_row;\n"
+               "for (i = idx; i < n; i += numThreads) {\n"
+               "ga_size ii = i;\n"
+               "ga_ssize a_p = a_offset;\n"
+               "ga_ssize b_p;\n"
+               "ga_uint lo = 0, hi = np, mid;\n"
+               "GLOBAL_MEM ga_long *e;\n"
+               "GLOBAL_MEM char *b_data = b0;\n");
+  for (i = a->nd; i > 0; i--) {
+    strb_appendf(&sb, "const ga_size pos%u = ii %% dim%u;\n", i - 1, i - 1);
+    if (i > 1)
+      strb_appendf(&sb, "ii = ii / dim%u;\n", i - 1);
+    strb_appendf(&sb, "a_p += pos%u * a_str_%u;\n", i - 1, i - 1);
+  }
+  /* Find the piece that holds our element along the axis */
+  strb_appendf(&sb, "while (hi - lo > 1) {\n"
+               "mid = (lo + hi) / 2;\n"
+               "if ((ga_long)pos%u >= tbl[mid * %u]) lo = mid;\n"
+               "else hi = mid;\n"
+               "}\n"
+               "e = tbl + lo * %u;\n"
+               "switch (e[1]) {\n", a->axis, w, w);
+  for (i = 1; i < a->nbuf; i++)
+    strb_appendf(&sb, "case %u: b_data = b%u; break;\n", i, i);
+  strb_appendf(&sb, "}\n"
+               "b_p = e[2] + ((ga_long)pos%u - e[0]) * e[%u]",
+               a->axis, 3 + a->axis);
+  for (i = 0; i < a->nd; i++)
+    if (i != a->axis)
+      strb_appendf(&sb, " + pos%u * e[%u]", i, 3 + i);
+  strb_appends(&sb, ";\n");
+
+  if (a->scatter) {
+    src = "a_data + a_p";
+    stype = a->btype;
+    dst = "b_data + b_p";
+    dtype = a->ptype;
+  } else {
+    src = "b_data + b_p";
+    stype = a->ptype;
+    dst = "a_data + a_p";
+    dtype = a->btype;
+  }
+  if (stype == dtype || stype != GA_HALF) {
+    strb_appendf(&sb, "%s v = *(GLOBAL_MEM %s *)(%s);\n",
+                 gpuarray_get_type(stype)->cluda_name,
+                 gpuarray_get_type(stype)->cluda_name, src);
+  } else {
+    strb_appendf(&sb, "ga_float v = load_half((GLOBAL_MEM ga_half *)(%s));\n",
+                 src);
+    stype = GA_FLOAT;
+  }
+  multicopy_store(&sb, dtype, stype, dst, "v");
+  strb_appends(&sb, "}\n}\n");
+
+  if (strb_error(&sb)) {
+    res = GA_MEMORY_ERROR;
+    goto bail;
+  }
+
+  res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "multicopy",
+                       p, ktypes, kaccess, flags, NULL);
+ bail:
+  free(ktypes);
+  free(kaccess);
+  strb_clear(&sb);
+  return res;
+}
+
+/* The result has a reference for the caller, see cache_box_new() */
+static GpuKernel *get_multicopy_kernel(gpucontext *ctx,
+                                       const struct multicopy_args *a,
+                                       int *err) {
+  struct multicopy_args *aa;
+  GpuKernel *k = NULL;
+
+  if (ctx->multicopy_cache != NULL)
+    k = cache_get(ctx->multicopy_cache, (cache_key_t)a);
+  if (k != NULL)
+    return k;
+
+  k = cache_box_new(sizeof(GpuKernel), multicopy_clearv);
+  if (k == NULL) {
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+  *err = gen_multicopy_kernel(k, ctx, a);
+  if (*err != GA_NO_ERROR) {
+    cache_box_release(k);
+    return NULL;
+  }
+  aa = memdup(a, sizeof(*a));
+  if (aa == NULL) {
+    cache_box_release(k);
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+  if (ctx->multicopy_cache == NULL)
+    gpucontext_cache_install(&ctx->multicopy_cache,
+                             gpucontext_cache(ctx->flags, 4, 8, 8, 2,
+                                              multicopy_eq, multicopy_hash,
+                                              multicopy_freek,
+                                              cache_box_release,
+                                              cache_box_ref, NULL));
+  if (ctx->multicopy_cache == NULL) {
+    multicopy_freek(aa);
+    cache_box_release(k);
+    *err = GA_MISC_ERROR;
+    return NULL;
+  }
+  /* Another thread may have added the same kernel in the meantime */
+  k = cache_get_or_add(ctx->multicopy_cache, aa, k);
+  if (k == NULL)
+    *err = GA_MISC_ERROR;
+  return k;
+}
+
+/*
+ * Get the device copy of `tbl` (which starts with its length and
+ * belongs to this function), uploading it if it is not in the cache.
+ * The result has a reference for the caller.
+ */
+static gpudata *get_multicopy_tbl(gpucontext *ctx, int64_t *tbl,
+                                  int *err) {
+  gpudata *res = NULL;
+
+  if (ctx->multicopy_tbl_cache != NULL)
+    res = cache_get(ctx->multicopy_tbl_cache, (cache_key_t)tbl);
+  if (res != NULL) {
+    free(tbl);
+    return res;
+  }
+
+  res = gpudata_alloc(ctx, tbl[0] * sizeof(int64_t), tbl + 1,
+                      GA_BUFFER_READ_ONLY|GA_BUFFER_INIT, err);
+  if (res == NULL) {
+    free(tbl);
+    return NULL;
+  }
+  if (ctx->multicopy_tbl_cache == NULL)
+    gpucontext_cache_install(&ctx->multicopy_tbl_cache,
+                             gpucontext_cache(ctx->flags, 4, 8, 8, 2,
+                                              multicopy_tbl_eq,
+                                              multicopy_tbl_hash,
+                                              multicopy_freek,
+                                              multicopy_tbl_freev,
+                                              multicopy_tbl_ref, NULL));
+  if (ctx->multicopy_tbl_cache == NULL) {
+    free(tbl);
+    *err = GA_MISC_ERROR;
+    gpudata_release(res);
+    return NULL;
+  }
+  /* Another thread may have added the same table in the meantime */
+  res = cache_get_or_add(ctx->multicopy_tbl_cache, (cache_key_t)tbl, res);
+  if (res == NULL)
+    *err = GA_MISC_ERROR;
+  return res;
+}
+
+/*
+ * Copy the pieces `ps` into `a` (or `a` into the pieces if `scatter`)
+ * where the pieces follow each other along `axis`.
+ *
+ * Returns GA_UNSUPPORTED_ERROR if the pieces don't all have the same
+ * type, in which case the caller should copy them one at a time.
+ */
+static int ga_multicopy(GpuArray *a, const GpuArray **ps, size_t n,
+                        unsigned int axis, int scatter) {
+  struct multicopy_args args;
+  gpucontext *ctx = GpuArray_context(a);
+  gpudata *bufs[MULTICOPY_MAXBUF];
+  gpudata *tbl_buf = NULL;
+  GpuKernel *k;
+  void **kargs = NULL;
+  int64_t *tbl;
+  size_t *dims;
+  size_t w = a->nd + 3;
+  size_t i, j, first, np, start, chunk_start, row, total, a_off, gs, ls;
+  unsigned int d, nbuf, slot, argp;
+  unsigned int np32;
+  int err = GA_NO_ERROR;
+
+  if (n == 0)
+    return GA_NO_ERROR;
+  memset(&args, 0, sizeof(args));
+  args.btype = a->typecode;
+  args.ptype = ps[0]->typecode;
+  args.nd = a->nd;
+  args.axis = axis;
+  args.scatter = scatter;
+  for (i = 0; i < n; i++) {
+    if (ps[i]->typecode != args.ptype)
+      return GA_UNSUPPORTED_ERROR;
+    if (GpuArray_context(ps[i]) != ctx)
+      return GA_INVALID_ERROR;
+  }
+
+  /* The first entry is the length, see get_multicopy_tbl() */
+  tbl = calloc(n * w + 1, sizeof(int64_t));
+  dims = calloc(a->nd, sizeof(size_t));
+  /* The kernels are shared through the cache, so the arguments are
+     passed to the calls rather than set on them */
+  kargs = calloc(6 + 2 * a->nd + MULTICOPY_MAXBUF, sizeof(void *));
+  if (tbl == NULL || dims == NULL || kargs == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto out;
+  }
+  memcpy(dims, a->dimensions, a->nd * sizeof(size_t));
+  tbl[0] = n * w;
+
+  /* Fill the table, the start and buffer slot are relative to the
+     launch, which is grouped the same way below */
+  nbuf = 0;
+  start = 0;
+  for (i = 0; i < n; i++) {
+    for (slot = 0; slot < nbuf; slot++)
+      if (bufs[slot] == ps[i]->data)
+        break;
+    if (slot == MULTICOPY_MAXBUF) {
+      nbuf = 0;
+      slot = 0;
+      start = 0;
+    }
+    if (slot == nbuf)
+      bufs[nbuf++] = ps[i]->data;
+    row = 1 + i * w;
+    tbl[row] = start;
+    tbl[row + 1] = slot;
+    tbl[row + 2] = ps[i]->offset;
+    for (d = 0; d < a->nd; d++)
+      tbl[row + 3 + d] = ps[i]->dimensions[d] == 1 ? 0 : ps[i]->strides[d];
+    start += ps[i]->dimensions[axis];
+  }
+
+  tbl_buf = get_multicopy_tbl(ctx, tbl, &err);
+  tbl = NULL;
+  if (tbl_buf == NULL)
+    goto out;
+
+  /* Now launch for each group of pieces */
+  chunk_start = 0;
+  i = 0;
+  while (i < n) {
+    first = i;
+    nbuf = 0;
+    dims[axis] = 0;
+    for (; i < n; i++) {
+      for (slot = 0; slot < nbuf; slot++)
+        if (bufs[slot] == ps[i]->data)
+          break;
+      if (slot == MULTICOPY_MAXBUF)
+        break;
+      if (slot == nbuf)
+        bufs[nbuf++] = ps[i]->data;
+      dims[axis] += ps[i]->dimensions[axis];
+    }
+    np = i - first;
+
+    total = 1;
+    for (d = 0; d < a->nd; d++)
+      total *= dims[d];
+    if (total == 0) {
+      chunk_start += dims[axis];
+      continue;
+    }
+
+    /* Round the number of buffers up to limit the number of kernels */
+    args.nbuf = 1;
+    while (args.nbuf < nbuf)
+      args.nbuf *= 2;
+    for (j = nbuf; j < args.nbuf; j++)
+      bufs[j] = bufs[0];
+
+    k = get_multicopy_kernel(ctx, &args, &err);
+    if (k == NULL)
+      goto out;
+
+    argp = 0;
+    row = first * w;
+    np32 = (unsigned int)np;
+    a_off = a->offset + chunk_start * a->strides[axis];
+    kargs[argp++] = &total;
+    for (d = 0; d < a->nd; d++)
+      kargs[argp++] = &dims[d];
+    kargs[argp++] = tbl_buf;
+    kargs[argp++] = &row;
+    kargs[argp++] = &np32;
+    kargs[argp++] = a->data;
+    kargs[argp++] = &a_off;
+    for (d = 0; d < a->nd; d++)
+      kargs[argp++] = &a->strides[d];
+    for (j = 0; j < args.nbuf; j++)
+      kargs[argp++] = bufs[j];
+
+    gs = 0;
+    ls = 0;
+    err = GpuKernel_sched(k, total, &gs, &ls);
+    if (err == GA_NO_ERROR)
+      err = GpuKernel_call(k, 1, &gs, &ls, 0, kargs);
+    cache_box_release(k);
+    if (err != GA_NO_ERROR)
+      goto out;
+    chunk_start += dims[axis];
+  }
+
+ out:
+  if (tbl_buf != NULL)
+    gpudata_release(tbl_buf);
+  free(kargs);
+  free(tbl);
+  free(dims);
+  return err;
 }
 
 /* Value below which a size_t multiplication will never overflow. */
@@ -329,7 +1106,7 @@ static int gen_take1_kernel(GpuKernel *k, gpucontext *ctx, char **err_str,
                             GpuArray *a, const GpuArray *v,
                             const GpuArray *ind, int addr32) {
   strb sb = STRB_STATIC_INIT;
-  int *atypes;
+  int *atypes, *aaccess = NULL;
   size_t nargs, apos;
   char *sz, *ssz;
   unsigned int i, i2;
@@ -337,10 +1114,18 @@ static int gen_take1_kernel(GpuKernel *k, gpucontext *ctx, char **err_str,
   int res;
 
   nargs = 9 + 2 * v->nd;
+  /* Division constants for the inner dimensions */
+  if (addr32 && v->nd > 2)
+    nargs += 2 * (v->nd - 2);
 
   atypes = calloc(nargs, sizeof(int));
   if (atypes == NULL)
     return GA_MEMORY_ERROR;
+  aaccess = calloc(nargs, sizeof(int));
+  if (aaccess == NULL) {
+    free(atypes);
+    return GA_MEMORY_ERROR;
+  }
 
   if (addr32) {
     sz = "ga_uint";
@@ -355,8 +1140,10 @@ static int gen_take1_kernel(GpuKernel *k, gpucontext *ctx, char **err_str,
                "GLOBAL_MEM const %s *v, ga_size v_off,",
                gpuarray_get_type(a->typecode)->cluda_name,
                gpuarray_get_type(v->typecode)->cluda_name);
+  aaccess[apos] = GA_ARG_WRITE;
   atypes[apos++] = GA_BUFFER;
   atypes[apos++] = GA_SIZE;
+  aaccess[apos] = GA_ARG_READ;
   atypes[apos++] = GA_BUFFER;
   atypes[apos++] = GA_SIZE;
   for (i = 0; i < v->nd; i++) {
@@ -364,13 +1151,22 @@ static int gen_take1_kernel(GpuKernel *k, gpucontext *ctx, char **err_str,
     atypes[apos++] = GA_SSIZE;
     atypes[apos++] = GA_SIZE;
   }
+  if (addr32) {
+    for (i = 2; i < v->nd; i++) {
+      strb_appendf(&sb, " ga_uint d%u_m, ga_uint d%u_s,", i, i);
+      atypes[apos++] = GA_UINT;
+      atypes[apos++] = GA_UINT;
+    }
+  }
   strb_appendf(&sb, " GLOBAL_MEM const %s *ind, ga_size i_off, "
                "ga_size n0, ga_size n1, GLOBAL_MEM int* err) {\n",
                gpuarray_get_type(ind->typecode)->cluda_name);
+  aaccess[apos] = GA_ARG_READ;
   atypes[apos++] = GA_BUFFER;
   atypes[apos++] = GA_SIZE;
   atypes[apos++] = GA_SIZE;
   atypes[apos++] = GA_SIZE;
+  aaccess[apos] = GA_ARG_WRITE;
   atypes[apos++] = GA_BUFFER;
   assert(apos == nargs);
   strb_appendf(&sb, "  const %s idx0 = LDIM_0 * GID_0 + LID_0;\n"
@@ -396,9 +1192,16 @@ static int gen_take1_kernel(GpuKernel *k, gpucontext *ctx, char **err_str,
                "      %s p = pos0;\n", ssz, sz, sz, sz);
   if (v->nd > 1) {
     strb_appendf(&sb, "      %s pos, ii = i1;\n", sz);
+    if (addr32 && v->nd > 2)
+      strb_appends(&sb, "      ga_uint q;\n");
     for (i2 = v->nd; i2 > 1; i2--) {
       i = i2 - 1;
-      if (i > 1)
+      if (i > 1 && addr32) {
+        char d[16];
+        snprintf(d, sizeof(d), "d%u", i);
+        intdiv32_append(&sb, "q", "pos", "ii", d);
+        strb_appends(&sb, "      ii = q;\n");
+      } else if (i > 1)
         strb_appendf(&sb, "      pos = ii %% (%s)d%u;\n"
                      "      ii /= (%s)d%u;\n", sz, i, sz, i);
       else
@@ -417,9 +1220,10 @@ static int gen_take1_kernel(GpuKernel *k, gpucontext *ctx, char **err_str,
   }
   flags |= gpuarray_type_flags(a->typecode, v->typecode, GA_BYTE, -1);
   res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "take1",
-                       nargs, atypes, flags, err_str);
+                       nargs, atypes, aaccess, flags, err_str);
 bail:
   free(atypes);
+  free(aaccess);
   strb_clear(&sb);
   return res;
 }
@@ -428,6 +1232,7 @@ int GpuArray_take1(GpuArray *a, const GpuArray *v, const GpuArray *i,
                    int check_error) {
   size_t n[2], ls[2] = {0, 0}, gs[2] = {0, 0};
   size_t pl;
+  intdiv32 *divs = NULL;
   gpudata *errbuf;
 #if DEBUG
   char *errstr = NULL;
@@ -515,6 +1320,18 @@ int GpuArray_take1(GpuArray *a, const GpuArray *v, const GpuArray *i,
     GpuKernel_setarg(&k, argp++, &v->strides[j]);
     GpuKernel_setarg(&k, argp++, &v->dimensions[j]);
   }
+  if (addr32 && v->nd > 2) {
+    divs = calloc(v->nd, sizeof(intdiv32));
+    if (divs == NULL) {
+      err = GA_MEMORY_ERROR;
+      goto out;
+    }
+    for (j = 2; j < v->nd; j++) {
+      intdiv32_init(&divs[j], (uint32_t)v->dimensions[j]);
+      GpuKernel_setarg(&k, argp++, &divs[j].m);
+      GpuKernel_setarg(&k, argp++, &divs[j].s);
+    }
+  }
   GpuKernel_setarg(&k, argp++, i->data);
   GpuKernel_setarg(&k, argp++, (void *)&i->offset);
   GpuKernel_setarg(&k, argp++, &n[0]);
@@ -533,6 +1350,7 @@ int GpuArray_take1(GpuArray *a, const GpuArray *v, const GpuArray *i,
   }
 
 out:
+  free(divs);
   GpuKernel_clear(&k);
   return err;
 }
@@ -946,6 +1764,48 @@ int GpuArray_split(GpuArray **rs, const GpuArray *a, size_t n, size_t *p,
   return err;
 }
 
+int GpuArray_split_copy(GpuArray **rs, const GpuArray *a, size_t n,
+                        size_t *p, unsigned int axis) {
+  size_t *dims;
+  size_t i, ii, prev, next;
+  int err = GA_NO_ERROR;
+
+  if (axis >= a->nd)
+    return GA_VALUE_ERROR;
+  if (!GpuArray_ISALIGNED(a))
+    return GA_UNALIGNED_ERROR;
+
+  dims = calloc(a->nd, sizeof(size_t));
+  if (dims == NULL)
+    return GA_MEMORY_ERROR;
+  memcpy(dims, a->dimensions, a->nd * sizeof(size_t));
+
+  prev = 0;
+  for (i = 0; i <= n; i++) {
+    next = i < n ? p[i] : a->dimensions[axis];
+    if (next < prev || next > a->dimensions[axis]) {
+      err = GA_VALUE_ERROR;
+      break;
+    }
+    dims[axis] = next - prev;
+    err = GpuArray_empty(rs[i], GpuArray_context(a), a->typecode, a->nd,
+                         dims, GA_C_ORDER);
+    if (err != GA_NO_ERROR)
+      break;
+    prev = next;
+  }
+  free(dims);
+
+  if (err == GA_NO_ERROR)
+    err = ga_multicopy((GpuArray *)a, (const GpuArray **)rs, n + 1, axis, 1);
+
+  if (err != GA_NO_ERROR) {
+    for (ii = 0; ii < i; ii++)
+      GpuArray_clear(rs[ii]);
+  }
+  return err;
+}
+
 int GpuArray_concatenate(GpuArray *r, const GpuArray **as, size_t n,
                          unsigned int axis, int restype) {
   size_t *dims, *res_dims;
@@ -1002,6 +1862,14 @@ int GpuArray_concatenate(GpuArray *r, const GpuArray **as, size_t n,
     return err;
   }
 
+  err = ga_multicopy(r, as, n, axis, 0);
+  if (err != GA_UNSUPPORTED_ERROR) {
+    if (err != GA_NO_ERROR)
+      goto fail;
+    return GA_NO_ERROR;
+  }
+
+  /* The inputs have different types, copy them one at a time */
   res_off = r->offset;
   res_dims = r->dimensions;
   res_flags = r->flags;
@@ -439,6 +439,100 @@ int GpuArray_rger(double alpha, GpuArray *X, GpuArray *Y, GpuArray *A,
   return err;
 }
 
+/*
+ * Find how the matrices in the last two axes of a 3d array can be
+ * passed to BLAS.  Either axis can have any stride as long as the
+ * other one is contiguous, which gives the leading dimension.  The
+ * stride of the batch axis is not checked.
+ *
+ * Returns 0 on success and -1 if the array needs a copy.
+ */
+static int matrix_layout(GpuArray *a, size_t elsize, cb_order *o,
+                         size_t *ld) {
+  size_t r = a->dimensions[1], c = a->dimensions[2];
+  ssize_t s1 = a->strides[1], s2 = a->strides[2];
+  size_t mr = r > 1 ? r : 1, mc = c > 1 ? c : 1;
+
+  /* A stride along an axis of size 1 is never used */
+  if ((c == 1 || s2 == (ssize_t)elsize) &&
+      (r == 1 || (s1 % elsize == 0 && s1 >= (ssize_t)(mc * elsize)))) {
+    *o = cb_c;
+    *ld = r == 1 ? mc : s1 / elsize;
+    return 0;
+  }
+  if ((r == 1 || s1 == (ssize_t)elsize) &&
+      (c == 1 || (s2 % elsize == 0 && s2 >= (ssize_t)(mr * elsize)))) {
+    *o = cb_fortran;
+    *ld = c == 1 ? mr : s2 / elsize;
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Fallback for backends without a strided batched gemm: pass the
+ * matrices as lists of buffers and offsets.
+ */
+static int gemm_batch_list(cb_order o, cb_transpose transA,
+                           cb_transpose transB, size_t m, size_t n,
+                           size_t k, double alpha, GpuArray *A, size_t lda,
+                           GpuArray *B, size_t ldb, double beta,
+                           GpuArray *C, size_t ldc, size_t elsize) {
+  size_t batchCount = A->dimensions[0];
+  gpudata **datas;
+  size_t *offsets;
+  size_t i;
+  int err = GA_NO_ERROR;
+
+  datas = malloc(batchCount * 3 * sizeof(gpudata *));
+  offsets = malloc(batchCount * 3 * sizeof(size_t));
+  if (datas == NULL || offsets == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto cleanup;
+  }
+
+  for (i = 0; i < batchCount; i++) {
+    datas[i] = A->data;
+    datas[batchCount + i] = B->data;
+    datas[2 * batchCount + i] = C->data;
+    offsets[i] = (A->offset + i * A->strides[0]) / elsize;
+    offsets[batchCount + i] = (B->offset + i * B->strides[0]) / elsize;
+    offsets[2 * batchCount + i] = (C->offset + i * C->strides[0]) / elsize;
+  }
+
+  switch (C->typecode) {
+  case GA_HALF:
+    err = gpublas_hgemmBatch(o, transA, transB, m, n, k, (float)alpha,
+                             datas, offsets, lda,
+                             datas + batchCount, offsets + batchCount, ldb,
+                             (float)beta,
+                             datas + 2 * batchCount,
+                             offsets + 2 * batchCount, ldc, batchCount, 0);
+    break;
+  case GA_FLOAT:
+    err = gpublas_sgemmBatch(o, transA, transB, m, n, k, (float)alpha,
+                             datas, offsets, lda,
+                             datas + batchCount, offsets + batchCount, ldb,
+                             (float)beta,
+                             datas + 2 * batchCount,
+                             offsets + 2 * batchCount, ldc, batchCount, 0);
+    break;
+  case GA_DOUBLE:
+    err = gpublas_dgemmBatch(o, transA, transB, m, n, k, (double)alpha,
+                             datas, offsets, lda,
+                             datas + batchCount, offsets + batchCount, ldb,
+                             (double)beta,
+                             datas + 2 * batchCount,
+                             offsets + 2 * batchCount, ldc, batchCount, 0);
+    break;
+  }
+
+ cleanup:
+  free(datas);
+  free(offsets);
+  return err;
+}
+
 int GpuArray_rgemmBatch_3d(cb_transpose transA, cb_transpose transB, double alpha,
                            GpuArray *A, GpuArray *B, double beta, GpuArray *C,
                            int nocopy) {
@@ -450,11 +544,9 @@ int GpuArray_rgemmBatch_3d(cb_transpose transA, cb_transpose transB, double alph
   void *ctx;
   size_t elsize;
   size_t batchCount, m, n, k, lda, ldb, ldc;
-  cb_order o;
+  ssize_t strideA, strideB, strideC;
+  cb_order o, oA, oB;
   int err;
-  gpudata **A_datas = NULL, **B_datas = NULL, **C_datas = NULL;
-  size_t *A_offsets = NULL, *B_offsets = NULL, *C_offsets = NULL;
-  size_t i;
 
   if (A->typecode != GA_FLOAT && A->typecode != GA_DOUBLE)
     return GA_INVALID_ERROR;
@@ -495,132 +587,90 @@ int GpuArray_rgemmBatch_3d(cb_transpose transA, cb_transpose transB, double alph
 
   elsize = gpuarray_get_elsize(A->typecode);
 
-  // FIXME: these conditions are overly restrictive; the first axis need not be contiguous
-  if (!GpuArray_ISONESEGMENT(A)) {
+  /* Only the matrices need to be usable as is, the batch axis of the
+     inputs can have any stride. */
+  if (matrix_layout(A, elsize, &oA, &lda) != 0) {
     if (nocopy)
       return GA_COPY_ERROR;
-    else {
-      err = GpuArray_copy(&copyA, A, GA_F_ORDER);
-      if (err != GA_NO_ERROR)
-	goto cleanup;
-      Ap = &copyA;
-    }
+    err = GpuArray_copy(&copyA, A, GA_F_ORDER);
+    if (err != GA_NO_ERROR)
+      goto cleanup;
+    Ap = &copyA;
+    matrix_layout(Ap, elsize, &oA, &lda);
   }
-  if (!GpuArray_ISONESEGMENT(B)) {
-    if (nocopy)
-      return GA_COPY_ERROR;
-    else {
-      err = GpuArray_copy(&copyB, B, GA_F_ORDER);
-      if (err != GA_NO_ERROR)
-	goto cleanup;
-      Bp = &copyB;
+  if (matrix_layout(B, elsize, &oB, &ldb) != 0) {
+    if (nocopy) {
+      err = GA_COPY_ERROR;
+      goto cleanup;
     }
+    err = GpuArray_copy(&copyB, B, GA_F_ORDER);
+    if (err != GA_NO_ERROR)
+      goto cleanup;
+    Bp = &copyB;
+    matrix_layout(Bp, elsize, &oB, &ldb);
   }
-  if (!GpuArray_ISONESEGMENT(C)) {
-    err = GA_VALUE_ERROR;
-    goto cleanup;
-  }
-
-  if (Cp->flags & GA_F_CONTIGUOUS) {
-    o = cb_fortran;
-    ldc = Cp->dimensions[1];
-  } else if (Cp->flags & GA_C_CONTIGUOUS) {
-    o = cb_c;
-    ldc = Cp->dimensions[2];
-  } else {
-    err = GA_VALUE_ERROR;
-    goto cleanup;
-  }
-  if (Ap->flags & GA_F_CONTIGUOUS) {
-    lda = Ap->dimensions[1];
-    if (o == cb_c) {
-      if (transA == cb_no_trans)
-        transA = cb_trans;
-      else
-        transA = cb_no_trans;
-    }
-  } else if (Ap->flags & GA_C_CONTIGUOUS) {
-    lda = Ap->dimensions[2];
-    if (o == cb_fortran) {
-      if (transA == cb_no_trans)
-        transA = cb_trans;
-      else
-        transA = cb_no_trans;
-    }
-  } else {
+  if (matrix_layout(Cp, elsize, &o, &ldc) != 0) {
     err = GA_VALUE_ERROR;
     goto cleanup;
   }
-  if (Bp->flags & GA_F_CONTIGUOUS) {
-    ldb = Bp->dimensions[1];
-    if (o == cb_c) {
-      if (transB == cb_no_trans)
-        transB = cb_trans;
-      else
-        transB = cb_no_trans;
-    }
-  } else if (Bp->flags & GA_C_CONTIGUOUS) {
-    ldb = Bp->dimensions[2];
-    if (o == cb_fortran) {
-      if (transB == cb_no_trans)
-        transB = cb_trans;
-      else
-        transB = cb_no_trans;
+  /* The output matrices are written concurrently so they must not
+     overlap, which rules out a stride of 0 for example. */
+  if (batchCount > 1 && m > 0 && n > 0) {
+    size_t extent = (o == cb_c ? (m - 1) * ldc + n : (n - 1) * ldc + m);
+    size_t sC = Cp->strides[0] < 0 ? -Cp->strides[0] : Cp->strides[0];
+    if (sC < extent * elsize) {
+      err = GA_VALUE_ERROR;
+      goto cleanup;
     }
-  } else {
-    err = GA_VALUE_ERROR;
-    goto cleanup;
   }
 
+  /* A matrix in the other order is its transpose */
+  if (oA != o)
+    transA = transA == cb_no_trans ? cb_trans : cb_no_trans;
+  if (oB != o)
+    transB = transB == cb_no_trans ? cb_trans : cb_no_trans;
+
   ctx = gpudata_context(Ap->data);
   err = gpublas_setup(ctx);
   if (err != GA_NO_ERROR)
     goto cleanup;
 
-  A_datas = (gpudata**)malloc(batchCount * sizeof(gpudata*));
-  B_datas = (gpudata**)malloc(batchCount * sizeof(gpudata*));
-  C_datas = (gpudata**)malloc(batchCount * sizeof(gpudata*));
-
-  A_offsets = (size_t*)malloc(batchCount * sizeof(size_t));
-  B_offsets = (size_t*)malloc(batchCount * sizeof(size_t));
-  C_offsets = (size_t*)malloc(batchCount * sizeof(size_t));
-
-  for (i = 0; i < batchCount; i++) {
-    A_datas[i] = Ap->data;
-    B_datas[i] = Bp->data;
-    C_datas[i] = Cp->data;
-    A_offsets[i] = (Ap->offset + i * Ap->strides[0]) / elsize;
-    B_offsets[i] = (Bp->offset + i * Bp->strides[0]) / elsize;
-    C_offsets[i] = (Cp->offset + i * Cp->strides[0]) / elsize;
-  }
+  strideA = Ap->strides[0] / (ssize_t)elsize;
+  strideB = Bp->strides[0] / (ssize_t)elsize;
+  strideC = Cp->strides[0] / (ssize_t)elsize;
 
   switch (C->typecode) {
   case GA_HALF:
-    err = gpublas_hgemmBatch(o, transA, transB, m, n, k, (float)alpha,
-                             A_datas, A_offsets, lda,
-                             B_datas, B_offsets, ldb,
-                             (float)beta,
-                             C_datas, C_offsets, ldc, batchCount, 0);
+    err = gpublas_hgemm3D(o, transA, transB, m, n, k, (float)alpha,
+                          Ap->data, Ap->offset / elsize, lda, strideA,
+                          Bp->data, Bp->offset / elsize, ldb, strideB,
+                          (float)beta,
+                          Cp->data, Cp->offset / elsize, ldc, strideC,
+                          batchCount, 0);
     break;
   case GA_FLOAT:
-    err = gpublas_sgemmBatch(o, transA, transB, m, n, k, (float)alpha,
-                             A_datas, A_offsets, lda,
-                             B_datas, B_offsets, ldb,
-                             (float)beta,
-                             C_datas, C_offsets, ldc, batchCount, 0);
+    err = gpublas_sgemm3D(o, transA, transB, m, n, k, (float)alpha,
+                          Ap->data, Ap->offset / elsize, lda, strideA,
+                          Bp->data, Bp->offset / elsize, ldb, strideB,
+                          (float)beta,
+                          Cp->data, Cp->offset / elsize, ldc, strideC,
+                          batchCount, 0);
     break;
   case GA_DOUBLE:
-    err = gpublas_dgemmBatch(o, transA, transB, m, n, k, (double)alpha,
-                             A_datas, A_offsets, lda,
-                             B_datas, B_offsets, ldb,
-                             (double)beta,
-                             C_datas, C_offsets, ldc, batchCount, 0);
+    err = gpublas_dgemm3D(o, transA, transB, m, n, k, (double)alpha,
+                          Ap->data, Ap->offset / elsize, lda, strideA,
+                          Bp->data, Bp->offset / elsize, ldb, strideB,
+                          (double)beta,
+                          Cp->data, Cp->offset / elsize, ldc, strideC,
+                          batchCount, 0);
     break;
   }
 
-  cleanup:
-  free(A_datas); free(B_datas); free(C_datas);
-  free(A_offsets); free(B_offsets); free(C_offsets);
+  if (err == GA_DEVSUP_ERROR)
+    err = gemm_batch_list(o, transA, transB, m, n, k, alpha, Ap, lda,
+                          Bp, ldb, beta, Cp, ldc, elsize);
+
+ cleanup:
   if (Ap == &copyA)
     GpuArray_clear(&copyA);
   if (Bp == &copyB)
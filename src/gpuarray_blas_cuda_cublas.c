@@ -173,6 +173,12 @@ static int setup(gpucontext *c) {
   const char *tmp[2];
   cublasStatus_t err;
   int types[10];
+  /* The kernels only read the arrays of pointers, the callers take
+     care of the buffers they point to. */
+  static const int access[10] = {
+    GA_ARG_READ, GA_ARG_READ, GA_ARG_READ, GA_ARG_READ, GA_ARG_READ,
+    GA_ARG_READ, GA_ARG_READ, GA_ARG_READ, GA_ARG_READ, GA_ARG_READ,
+  };
   int e;
 
   if (ctx->blas_handle != NULL)
@@ -209,17 +215,17 @@ static int setup(gpucontext *c) {
   types[6] = GA_SIZE;
   types[7] = GA_SIZE;
   types[8] = GA_SIZE;
-  e = GpuKernel_init(&handle->sgemvBH_N_a1_b1_small, c, 1, &code_sgemvBH_N_a1_b1_small, NULL, "sgemv", 9, types, 0, NULL);
+  e = GpuKernel_init(&handle->sgemvBH_N_a1_b1_small, c, 1, &code_sgemvBH_N_a1_b1_small, NULL, "sgemv", 9, types, access, 0, NULL);
   if (e != GA_NO_ERROR) goto e1;
-  e = GpuKernel_init(&handle->sgemvBH_T_a1_b1_small, c, 1, &code_sgemvBH_T_a1_b1_small, NULL, "sgemv", 9, types, 0, NULL);
+  e = GpuKernel_init(&handle->sgemvBH_T_a1_b1_small, c, 1, &code_sgemvBH_T_a1_b1_small, NULL, "sgemv", 9, types, access, 0, NULL);
   if (e != GA_NO_ERROR) goto e2;
   tmp[0] = atomicadd_double;
   tmp[1] = code_dgemvBH_N_a1_b1_small;
-  e = GpuKernel_init(&handle->dgemvBH_N_a1_b1_small, c, 2, tmp, NULL, "dgemv", 9, types, GA_USE_DOUBLE, NULL);
+  e = GpuKernel_init(&handle->dgemvBH_N_a1_b1_small, c, 2, tmp, NULL, "dgemv", 9, types, access, GA_USE_DOUBLE, NULL);
   if (e != GA_NO_ERROR) goto e3;
   tmp[0] = atomicadd_double;
   tmp[1] = code_dgemvBH_T_a1_b1_small;
-  e = GpuKernel_init(&handle->dgemvBH_T_a1_b1_small, c, 2, tmp, NULL, "dgemv", 9, types, GA_USE_DOUBLE, NULL);
+  e = GpuKernel_init(&handle->dgemvBH_T_a1_b1_small, c, 2, tmp, NULL, "dgemv", 9, types, access, GA_USE_DOUBLE, NULL);
   if (e != GA_NO_ERROR) goto e4;
 
   types[0] = GA_BUFFER;
@@ -232,12 +238,12 @@ static int setup(gpucontext *c) {
   types[7] = GA_SIZE;
   types[8] = GA_SIZE;
   types[9] = GA_SIZE;
-  e = GpuKernel_init(&handle->sgerBH_gen_small, c, 1, &code_sgerBH_gen_small, NULL, "_sgerBH_gen_small", 10, types, 0, NULL);
+  e = GpuKernel_init(&handle->sgerBH_gen_small, c, 1, &code_sgerBH_gen_small, NULL, "_sgerBH_gen_small", 10, types, access, 0, NULL);
   if (e != GA_NO_ERROR) goto e5;
   types[4] = GA_DOUBLE;
   tmp[0] = atomicadd_double;
   tmp[1] = code_dgerBH_gen_small;
-  e = GpuKernel_init(&handle->dgerBH_gen_small, c, 2, tmp, NULL, "_dgerBH_gen_small", 10, types, GA_USE_DOUBLE, NULL);
+  e = GpuKernel_init(&handle->dgerBH_gen_small, c, 2, tmp, NULL, "_dgerBH_gen_small", 10, types, access, GA_USE_DOUBLE, NULL);
   if (e != GA_NO_ERROR) goto e6;
 
   ctx->blas_handle = handle;
@@ -283,6 +289,21 @@ static void teardown(gpucontext *c) {
   ctx->blas_handle = NULL;
 }
 
+static int set_stream(gpucontext *c) {
+  cuda_context *ctx = (cuda_context *)c;
+  blas_handle *handle = (blas_handle *)ctx->blas_handle;
+
+  if (handle == NULL)
+    return GA_NO_ERROR;
+
+  cuda_enter(ctx);
+  handle->err = cublasSetStream(handle->h, ctx->s);
+  cuda_exit(ctx);
+  if (handle->err != CUBLAS_STATUS_SUCCESS)
+    return GA_BLAS_ERROR;
+  return GA_NO_ERROR;
+}
+
 static const char *error(gpucontext *c) {
   cuda_context *ctx = (cuda_context *)c;
   blas_handle *handle = (blas_handle *)ctx->blas_handle;
@@ -784,6 +805,165 @@ static int dgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
   return GA_NO_ERROR;
 }
 
+static int hgemm3D(cb_order order, cb_transpose transA, cb_transpose transB,
+                   size_t M, size_t N, size_t K, float alpha,
+                   gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                   gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                   float beta, gpudata *C, size_t offC, size_t ldc,
+                   ssize_t strideC, size_t batchCount) {
+  return GA_DEVSUP_ERROR;
+}
+
+static int sgemm3D(cb_order order, cb_transpose transA, cb_transpose transB,
+                   size_t M, size_t N, size_t K, float alpha,
+                   gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                   gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                   float beta, gpudata *C, size_t offC, size_t ldc,
+                   ssize_t strideC, size_t batchCount) {
+  cuda_context *ctx = A->ctx;
+  blas_handle *h = (blas_handle *)ctx->blas_handle;
+  gpudata *T;
+  size_t t;
+  ssize_t st;
+  cb_transpose transT;
+
+  ASSERT_BUF(A);
+  ASSERT_BUF(B);
+  ASSERT_BUF(C);
+
+  /* Needs CUDA 8 */
+  if (cublasSgemmStridedBatched == NULL)
+    return GA_DEVSUP_ERROR;
+
+  if (LARGE_VAL(M) || LARGE_VAL(N) || LARGE_VAL(K) ||
+      LARGE_VAL(lda) || LARGE_VAL(ldb) || LARGE_VAL(ldc) ||
+      LARGE_VAL(M * N) || LARGE_VAL(M * K) || LARGE_VAL(K * N) ||
+      LARGE_VAL(batchCount))
+    return GA_XLARGE_ERROR;
+
+  if (order == cb_c) {
+    /* swap A and B */
+    t = N;
+    N = M;
+    M = t;
+    T = A;
+    A = B;
+    B = T;
+    t = lda;
+    lda = ldb;
+    ldb = t;
+    transT = transA;
+    transA = transB;
+    transB = transT;
+    t = offA;
+    offA = offB;
+    offB = t;
+    st = strideA;
+    strideA = strideB;
+    strideB = st;
+  }
+
+  cuda_enter(ctx);
+
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_wait(A, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_wait(B, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_wait(C, CUDA_WAIT_ALL));
+
+  h->err = cublasSgemmStridedBatched(
+    h->h, convT(transA), convT(transB), M, N, K,
+    &alpha, ((float *)A->ptr) + offA, lda, strideA,
+    ((float *)B->ptr) + offB, ldb, strideB,
+    &beta, ((float *)C->ptr) + offC, ldc, strideC, batchCount);
+  if (h->err != CUBLAS_STATUS_SUCCESS) {
+    cuda_exit(ctx);
+    if (h->err == CUBLAS_STATUS_ARCH_MISMATCH)
+      return GA_DEVSUP_ERROR;
+    return GA_BLAS_ERROR;
+  }
+
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_record(A, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_record(B, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_record(C, CUDA_WAIT_ALL));
+
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
+static int dgemm3D(cb_order order, cb_transpose transA, cb_transpose transB,
+                   size_t M, size_t N, size_t K, double alpha,
+                   gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                   gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                   double beta, gpudata *C, size_t offC, size_t ldc,
+                   ssize_t strideC, size_t batchCount) {
+  cuda_context *ctx = A->ctx;
+  blas_handle *h = (blas_handle *)ctx->blas_handle;
+  gpudata *T;
+  size_t t;
+  ssize_t st;
+  cb_transpose transT;
+
+  ASSERT_BUF(A);
+  ASSERT_BUF(B);
+  ASSERT_BUF(C);
+
+  /* Needs CUDA 8 */
+  if (cublasDgemmStridedBatched == NULL)
+    return GA_DEVSUP_ERROR;
+
+  if (LARGE_VAL(M) || LARGE_VAL(N) || LARGE_VAL(K) ||
+      LARGE_VAL(lda) || LARGE_VAL(ldb) || LARGE_VAL(ldc) ||
+      LARGE_VAL(M * N) || LARGE_VAL(M * K) || LARGE_VAL(K * N) ||
+      LARGE_VAL(batchCount))
+    return GA_XLARGE_ERROR;
+
+  if (order == cb_c) {
+    /* swap A and B */
+    t = N;
+    N = M;
+    M = t;
+    T = A;
+    A = B;
+    B = T;
+    t = lda;
+    lda = ldb;
+    ldb = t;
+    transT = transA;
+    transA = transB;
+    transB = transT;
+    t = offA;
+    offA = offB;
+    offB = t;
+    st = strideA;
+    strideA = strideB;
+    strideB = st;
+  }
+
+  cuda_enter(ctx);
+
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_wait(A, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_wait(B, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_wait(C, CUDA_WAIT_ALL));
+
+  h->err = cublasDgemmStridedBatched(
+    h->h, convT(transA), convT(transB), M, N, K,
+    &alpha, ((double *)A->ptr) + offA, lda, strideA,
+    ((double *)B->ptr) + offB, ldb, strideB,
+    &beta, ((double *)C->ptr) + offC, ldc, strideC, batchCount);
+  if (h->err != CUBLAS_STATUS_SUCCESS) {
+    cuda_exit(ctx);
+    if (h->err == CUBLAS_STATUS_ARCH_MISMATCH)
+      return GA_DEVSUP_ERROR;
+    return GA_BLAS_ERROR;
+  }
+
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_record(A, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_record(B, CUDA_WAIT_READ));
+  GA_CUDA_EXIT_ON_ERROR(ctx, cuda_record(C, CUDA_WAIT_ALL));
+
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
 static int hdot(
         size_t N,
         gpudata *X, size_t offX, size_t incX,
@@ -1644,6 +1824,7 @@ GPUARRAY_LOCAL gpuarray_blas_ops cublas_ops = {
   setup,
   teardown,
   error,
+  set_stream,
   hdot, /* TODO */
   sdot,
   ddot,
@@ -1664,5 +1845,8 @@ GPUARRAY_LOCAL gpuarray_blas_ops cublas_ops = {
   dgemvBatch,
   hgerBatch, /* TODO */
   sgerBatch,
-  dgerBatch
+  dgerBatch,
+  hgemm3D, /* TODO */
+  sgemm3D,
+  dgemm3D
 };
@@ -63,14 +63,10 @@ static const char *error(gpucontext *ctx) {
 }
 
 #define ARRAY_INIT(A)                           \
-  if (A->ev != NULL)                            \
-    evl[num_ev++] = A->ev
+  num_ev += cl_wait_list(A, GA_ARG_READ_WRITE, evl + num_ev)
 
 #define ARRAY_FINI(A)                           \
-  if (A->ev != NULL)                            \
-    clReleaseEvent(A->ev);                      \
-  A->ev = ev;                                   \
-  clRetainEvent(A->ev)
+  cl_record(A, GA_ARG_READ_WRITE, ev)
 
 static int hgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
                       size_t M, size_t N, size_t K, float alpha,
@@ -88,13 +84,14 @@ static int sgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
                       float beta, gpudata **C, size_t *offC, size_t ldc,
                       size_t batchCount) {
   cl_ctx *ctx = A[0]->ctx;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
   size_t i;
   cl_uint num_ev = 0;
   clblasStatus err;
 
   for (i = 0; i < batchCount; i++) {
+    num_ev = 0;
     ARRAY_INIT(A[i]);
     ARRAY_INIT(B[i]);
     ARRAY_INIT(C[i]);
@@ -120,13 +117,14 @@ static int dgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
                       double beta, gpudata **C, size_t *offC, size_t ldc,
                       size_t batchCount) {
   cl_ctx *ctx = A[0]->ctx;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
   size_t i;
   cl_uint num_ev = 0;
   clblasStatus err;
 
   for (i = 0; i < batchCount; i++) {
+    num_ev = 0;
     ARRAY_INIT(A[i]);
     ARRAY_INIT(B[i]);
     ARRAY_INIT(C[i]);
@@ -212,7 +210,7 @@ static int sdot(
   cl_ctx *ctx = X->ctx;
   clblasStatus err;
   cl_uint num_ev = 0;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
   gpudata *wbuf;
   int alloc_err;
@@ -255,7 +253,7 @@ static int ddot(
   cl_ctx *ctx = X->ctx;
   clblasStatus err;
   cl_uint num_ev = 0;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
   gpudata *wbuf;
   int alloc_err;
@@ -303,7 +301,7 @@ static int sgemv(cb_order order, cb_transpose transA, size_t M, size_t N,
   cl_ctx *ctx = A->ctx;
   clblasStatus err;
   cl_uint num_ev = 0;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
 
   ARRAY_INIT(A);
@@ -333,7 +331,7 @@ static int dgemv(cb_order order, cb_transpose transA, size_t M, size_t N,
   cl_ctx *ctx = A->ctx;
   clblasStatus err;
   cl_uint num_ev = 0;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
 
   ARRAY_INIT(A);
@@ -372,7 +370,7 @@ static int sgemm(cb_order order, cb_transpose transA, cb_transpose transB,
   cl_ctx *ctx = A->ctx;
   clblasStatus err;
   cl_uint num_ev = 0;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
 
   ARRAY_INIT(A);
@@ -403,7 +401,7 @@ static int dgemm(cb_order order, cb_transpose transA, cb_transpose transB,
   cl_ctx *ctx = A->ctx;
   clblasStatus err;
   cl_uint num_ev = 0;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
 
   ARRAY_INIT(A);
@@ -438,7 +436,7 @@ static int sger(cb_order order, size_t M, size_t N, float alpha,
                 gpudata *Y, size_t offY, int incY,
                 gpudata *A, size_t offA, size_t lda) {
   cl_ctx *ctx = X->ctx;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
   cl_uint num_ev = 0;
   clblasStatus err;
@@ -467,7 +465,7 @@ static int dger(cb_order order, size_t M, size_t N, double alpha,
                 gpudata *Y, size_t offY, int incY,
                 gpudata *A, size_t offA, size_t lda) {
   cl_ctx *ctx = X->ctx;
-  cl_event evl[3];
+  cl_event evl[3 * CL_MAX_WAIT];
   cl_event ev;
   cl_uint num_ev = 0;
   clblasStatus err;
@@ -495,6 +493,7 @@ GPUARRAY_LOCAL gpuarray_blas_ops clblas_ops = {
   setup,
   teardown,
   error,
+  NULL, /* The queue is passed on every call */
   hdot, /* TODO */
   sdot,
   ddot,
@@ -516,4 +515,7 @@ GPUARRAY_LOCAL gpuarray_blas_ops clblas_ops = {
   hgerBatch, /* TODO */
   sgerBatch, /* TODO */
   dgerBatch, /* TODO */
+  NULL, /* hgemm3D, no strided batch in clBLAS */
+  NULL, /* sgemm3D */
+  NULL, /* dgemm3D */
 };
@@ -42,14 +42,10 @@ static const char *error(gpucontext *ctx) {
 }
 
 #define ARRAY_INIT(A)                           \
-  if (A->ev != NULL)                            \
-    clWaitForEvents(1, &A->ev)
+  cl_wait(A, GA_ARG_READ_WRITE)
 
 #define ARRAY_FINI(A)                           \
-  if (A->ev != NULL)                            \
-    clReleaseEvent(A->ev);                      \
-  A->ev = ev;                                   \
-  clRetainEvent(A->ev)
+  cl_record(A, GA_ARG_READ_WRITE, ev)
 
 static int hgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
                       size_t M, size_t N, size_t K, float alpha,
@@ -68,7 +64,7 @@ static int hgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
     ARRAY_INIT(C[i]);
     err = CLBlastHgemm(convO(order), convT(transA), convT(transB), M, N, K,
                        float_to_half(alpha), A[i]->buf, offA[i], lda, B[i]->buf, offB[i], ldb,
-                       float_to_half(beta), C[i]->buf, offB[i], ldc, &ctx->q, &ev);
+                       float_to_half(beta), C[i]->buf, offC[i], ldc, &ctx->q, &ev);
     if (err != kSuccess)
       return GA_BLAS_ERROR;
     ARRAY_FINI(A[i]);
@@ -97,7 +93,7 @@ static int sgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
     ARRAY_INIT(C[i]);
     err = CLBlastSgemm(convO(order), convT(transA), convT(transB), M, N, K,
                       alpha, A[i]->buf, offA[i], lda, B[i]->buf, offB[i], ldb,
-                      beta, C[i]->buf, offB[i], ldc, &ctx->q, &ev);
+                      beta, C[i]->buf, offC[i], ldc, &ctx->q, &ev);
     if (err != kSuccess)
       return GA_BLAS_ERROR;
     ARRAY_FINI(A[i]);
@@ -126,7 +122,7 @@ static int dgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
     ARRAY_INIT(C[i]);
     err = CLBlastDgemm(convO(order), convT(transA), convT(transB), M, N, K,
                       alpha, A[i]->buf, offA[i], lda, B[i]->buf, offB[i], ldb,
-                      beta, C[i]->buf, offB[i], ldc, &ctx->q, &ev);
+                      beta, C[i]->buf, offC[i], ldc, &ctx->q, &ev);
     if (err != kSuccess)
       return GA_BLAS_ERROR;
     ARRAY_FINI(A[i]);
@@ -138,6 +134,105 @@ static int dgemmBatch(cb_order order, cb_transpose transA, cb_transpose transB,
   return GA_NO_ERROR;
 }
 
+static int hgemm3D(cb_order order, cb_transpose transA, cb_transpose transB,
+                   size_t M, size_t N, size_t K, float alpha,
+                   gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                   gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                   float beta, gpudata *C, size_t offC, size_t ldc,
+                   ssize_t strideC, size_t batchCount) {
+  cl_ctx *ctx = A->ctx;
+  cl_event ev;
+  StatusCode err;
+
+  if (CLBlastHgemmStridedBatched == NULL)
+    return GA_DEVSUP_ERROR;
+  /* The strides are unsigned here */
+  if (strideA < 0 || strideB < 0 || strideC < 0)
+    return GA_DEVSUP_ERROR;
+
+  ARRAY_INIT(A);
+  ARRAY_INIT(B);
+  ARRAY_INIT(C);
+  err = CLBlastHgemmStridedBatched(
+    convO(order), convT(transA), convT(transB), M, N, K,
+    float_to_half(alpha), A->buf, offA, lda, strideA, B->buf, offB, ldb, strideB,
+    float_to_half(beta), C->buf, offC, ldc, strideC, batchCount, &ctx->q, &ev);
+  if (err != kSuccess)
+    return GA_BLAS_ERROR;
+  ARRAY_FINI(A);
+  ARRAY_FINI(B);
+  ARRAY_FINI(C);
+  clReleaseEvent(ev);
+
+  return GA_NO_ERROR;
+}
+
+static int sgemm3D(cb_order order, cb_transpose transA, cb_transpose transB,
+                   size_t M, size_t N, size_t K, float alpha,
+                   gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                   gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                   float beta, gpudata *C, size_t offC, size_t ldc,
+                   ssize_t strideC, size_t batchCount) {
+  cl_ctx *ctx = A->ctx;
+  cl_event ev;
+  StatusCode err;
+
+  if (CLBlastSgemmStridedBatched == NULL)
+    return GA_DEVSUP_ERROR;
+  /* The strides are unsigned here */
+  if (strideA < 0 || strideB < 0 || strideC < 0)
+    return GA_DEVSUP_ERROR;
+
+  ARRAY_INIT(A);
+  ARRAY_INIT(B);
+  ARRAY_INIT(C);
+  err = CLBlastSgemmStridedBatched(
+    convO(order), convT(transA), convT(transB), M, N, K,
+    alpha, A->buf, offA, lda, strideA, B->buf, offB, ldb, strideB,
+    beta, C->buf, offC, ldc, strideC, batchCount, &ctx->q, &ev);
+  if (err != kSuccess)
+    return GA_BLAS_ERROR;
+  ARRAY_FINI(A);
+  ARRAY_FINI(B);
+  ARRAY_FINI(C);
+  clReleaseEvent(ev);
+
+  return GA_NO_ERROR;
+}
+
+static int dgemm3D(cb_order order, cb_transpose transA, cb_transpose transB,
+                   size_t M, size_t N, size_t K, double alpha,
+                   gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                   gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                   double beta, gpudata *C, size_t offC, size_t ldc,
+                   ssize_t strideC, size_t batchCount) {
+  cl_ctx *ctx = A->ctx;
+  cl_event ev;
+  StatusCode err;
+
+  if (CLBlastDgemmStridedBatched == NULL)
+    return GA_DEVSUP_ERROR;
+  /* The strides are unsigned here */
+  if (strideA < 0 || strideB < 0 || strideC < 0)
+    return GA_DEVSUP_ERROR;
+
+  ARRAY_INIT(A);
+  ARRAY_INIT(B);
+  ARRAY_INIT(C);
+  err = CLBlastDgemmStridedBatched(
+    convO(order), convT(transA), convT(transB), M, N, K,
+    alpha, A->buf, offA, lda, strideA, B->buf, offB, ldb, strideB,
+    beta, C->buf, offC, ldc, strideC, batchCount, &ctx->q, &ev);
+  if (err != kSuccess)
+    return GA_BLAS_ERROR;
+  ARRAY_FINI(A);
+  ARRAY_FINI(B);
+  ARRAY_FINI(C);
+  clReleaseEvent(ev);
+
+  return GA_NO_ERROR;
+}
+
 static int hgemvBatch(cb_order order, cb_transpose transA,
                       size_t M, size_t N, float alpha,
                       gpudata **A, size_t *offA, size_t lda,
@@ -529,6 +624,7 @@ GPUARRAY_LOCAL gpuarray_blas_ops clblast_ops = {
   setup,
   teardown,
   error,
+  NULL, /* The queue is passed on every call */
   hdot,
   sdot,
   ddot,
@@ -550,4 +646,7 @@ GPUARRAY_LOCAL gpuarray_blas_ops clblast_ops = {
   hgerBatch, /* TODO */
   sgerBatch, /* TODO */
   dgerBatch, /* TODO */
+  hgemm3D,
+  sgemm3D,
+  dgemm3D,
 };
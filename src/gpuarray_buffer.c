@@ -10,10 +10,16 @@
 
 extern const gpuarray_buffer_ops cuda_ops;
 extern const gpuarray_buffer_ops opencl_ops;
+#ifdef WITH_HOST
+extern const gpuarray_buffer_ops host_ops;
+#endif
 
 const gpuarray_buffer_ops *gpuarray_get_ops(const char *name) {
   if (strcmp("cuda", name) == 0) return &cuda_ops;
   if (strcmp("opencl", name) == 0) return &opencl_ops;
+#ifdef WITH_HOST
+  if (strcmp("host", name) == 0) return &host_ops;
+#endif
   return NULL;
 }
 
@@ -51,20 +57,55 @@ gpucontext *gpucontext_init(const char *name, int dev, int flags, int *ret) {
   if (gpucontext_property(res, GA_CTX_PROP_COMM_OPS, &res->comm_ops) != GA_NO_ERROR)
     res->comm_ops = NULL;
   res->extcopy_cache = NULL;
+  res->multicopy_cache = NULL;
+  res->multicopy_tbl_cache = NULL;
+  res->transpose_cache = NULL;
+  res->elemwise_cache = NULL;
+  res->reduction_cache = NULL;
+  gpuarray_trace_init(res);
   return res;
 }
 
 void gpucontext_deref(gpucontext *ctx) {
+  gpuarray_trace_fini(ctx);
   if (ctx->blas_handle != NULL)
     ctx->blas_ops->teardown(ctx);
   if (ctx->extcopy_cache != NULL) {
     cache_destroy(ctx->extcopy_cache);
     ctx->extcopy_cache = NULL;
   }
+  if (ctx->multicopy_cache != NULL) {
+    cache_destroy(ctx->multicopy_cache);
+    ctx->multicopy_cache = NULL;
+  }
+  if (ctx->multicopy_tbl_cache != NULL) {
+    cache_destroy(ctx->multicopy_tbl_cache);
+    ctx->multicopy_tbl_cache = NULL;
+  }
+  if (ctx->transpose_cache != NULL) {
+    cache_destroy(ctx->transpose_cache);
+    ctx->transpose_cache = NULL;
+  }
+  if (ctx->elemwise_cache != NULL) {
+    cache_destroy(ctx->elemwise_cache);
+    ctx->elemwise_cache = NULL;
+  }
+  if (ctx->reduction_cache != NULL) {
+    cache_destroy(ctx->reduction_cache);
+    ctx->reduction_cache = NULL;
+  }
   ctx->ops->buffer_deinit(ctx);
 }
 
 int gpucontext_property(gpucontext *ctx, int prop_id, void *res) {
+  switch (prop_id) {
+  case GA_CTX_PROP_ELEMWISE_CACHE_HITS:
+  case GA_CTX_PROP_ELEMWISE_CACHE_MISSES:
+  case GA_CTX_PROP_ELEMWISE_CACHE_EVICTIONS:
+  case GA_CTX_PROP_ELEMWISE_CACHE_BYTES:
+    *((size_t *)res) = gpucontext_cache_stat(ctx->elemwise_cache, prop_id);
+    return GA_NO_ERROR;
+  }
   return ctx->ops->property(ctx, NULL, NULL, prop_id, res);
 }
 
@@ -82,6 +123,76 @@ const char *gpucontext_error(gpucontext *ctx, int err) {
   return gpuarray_error_str(err);
 }
 
+gpustream *gpustream_new(gpucontext *ctx, int flags, int *ret) {
+  return ctx->ops->stream_alloc(ctx, flags, ret);
+}
+
+void gpustream_retain(gpustream *s) {
+  ((partial_gpustream *)s)->ctx->ops->stream_retain(s);
+}
+
+void gpustream_release(gpustream *s) {
+  if (s != NULL)
+    ((partial_gpustream *)s)->ctx->ops->stream_release(s);
+}
+
+int gpustream_sync(gpustream *s) {
+  return ((partial_gpustream *)s)->ctx->ops->stream_sync(s);
+}
+
+gpucontext *gpustream_context(gpustream *s) {
+  return ((partial_gpustream *)s)->ctx;
+}
+
+int gpucontext_set_stream(gpucontext *ctx, gpustream *s) {
+  if (s != NULL && ((partial_gpustream *)s)->ctx != ctx)
+    return GA_VALUE_ERROR;
+  if (s == ctx->stream)
+    return GA_NO_ERROR;
+  return ctx->ops->stream_set(ctx, s);
+}
+
+gpustream *gpucontext_get_stream(gpucontext *ctx) {
+  return ctx->stream;
+}
+
+size_t gpucontext_trim(gpucontext *ctx, size_t keep) {
+  if (ctx->ops->buffer_trim == NULL)
+    return 0;
+  return ctx->ops->buffer_trim(ctx, keep);
+}
+
+int gpucontext_capture_begin(gpucontext *ctx) {
+  if (ctx->ops->capture_begin == NULL)
+    return GA_UNSUPPORTED_ERROR;
+  return ctx->ops->capture_begin(ctx);
+}
+
+gpugraph *gpucontext_capture_end(gpucontext *ctx, int *ret) {
+  if (ctx->ops->capture_end == NULL)
+    FAIL(NULL, GA_UNSUPPORTED_ERROR);
+  return ctx->ops->capture_end(ctx, ret);
+}
+
+int gpugraph_launch(gpugraph *g) {
+  return ((partial_gpugraph *)g)->ctx->ops->graph_launch(g);
+}
+
+unsigned int gpugraph_numkernels(gpugraph *g) {
+  return ((partial_gpugraph *)g)->ctx->ops->graph_numkernels(g);
+}
+
+int gpugraph_setargs(gpugraph *g, unsigned int i, unsigned int nargs,
+                     const int *types, void **args) {
+  return ((partial_gpugraph *)g)->ctx->ops->graph_setargs(g, i, nargs, types,
+                                                          args);
+}
+
+void gpugraph_release(gpugraph *g) {
+  if (g == NULL) return;
+  ((partial_gpugraph *)g)->ctx->ops->graph_release(g);
+}
+
 gpudata *gpudata_alloc(gpucontext *ctx, size_t sz, void *data, int flags,
                        int *ret) {
   return ctx->ops->buffer_alloc(ctx, sz, data, flags, ret);
@@ -103,12 +214,13 @@ int gpudata_share(gpudata *a, gpudata *b, int *ret) {
 
 int gpudata_move(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
                  size_t sz) {
-  return ((partial_gpudata *)src)->ctx->ops->buffer_move(dst, dstoff,
-                                                         src, srcoff, sz);
+  gpucontext *ctx = ((partial_gpudata *)src)->ctx;
+  TRACE_RETURN(ctx, TRACE_COPY, "move", sz, 0, 0, 0,
+               ctx->ops->buffer_move(dst, dstoff, src, srcoff, sz));
 }
 
-int gpudata_transfer(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
-                     size_t sz) {
+static int transfer(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
+                    size_t sz) {
   gpucontext *src_ctx;
   gpucontext *dst_ctx;
   void *tmp;
@@ -137,23 +249,60 @@ int gpudata_transfer(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
   return res;
 }
 
+int gpudata_transfer(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
+                     size_t sz) {
+  TRACE_RETURN(((partial_gpudata *)src)->ctx, TRACE_COPY, "transfer", sz,
+               0, 0, 0, transfer(dst, dstoff, src, srcoff, sz));
+}
+
 int gpudata_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
-  return ((partial_gpudata *)src)->ctx->ops->buffer_read(dst, src, srcoff, sz);
+  gpucontext *ctx = ((partial_gpudata *)src)->ctx;
+  TRACE_RETURN(ctx, TRACE_COPY, "read", sz, 0, 0, 0,
+               ctx->ops->buffer_read(dst, src, srcoff, sz));
 }
 
 int gpudata_write(gpudata *dst, size_t dstoff, const void *src, size_t sz) {
-  return ((partial_gpudata *)dst)->ctx->ops->buffer_write(dst, dstoff,
-                                                          src, sz);
+  gpucontext *ctx = ((partial_gpudata *)dst)->ctx;
+  TRACE_RETURN(ctx, TRACE_COPY, "write", sz, 0, 0, 0,
+               ctx->ops->buffer_write(dst, dstoff, src, sz));
+}
+
+int gpudata_read_async(void *dst, gpudata *src, size_t srcoff, size_t sz) {
+  gpucontext *ctx = ((partial_gpudata *)src)->ctx;
+  if (ctx->ops->buffer_read_async == NULL)
+    return gpudata_read(dst, src, srcoff, sz);
+  TRACE_RETURN(ctx, TRACE_COPY, "read_async", sz, 0, 0, 0,
+               ctx->ops->buffer_read_async(dst, src, srcoff, sz));
+}
+
+int gpudata_write_async(gpudata *dst, size_t dstoff, const void *src,
+                        size_t sz) {
+  gpucontext *ctx = ((partial_gpudata *)dst)->ctx;
+  if (ctx->ops->buffer_write_async == NULL)
+    return gpudata_write(dst, dstoff, src, sz);
+  TRACE_RETURN(ctx, TRACE_COPY, "write_async", sz, 0, 0, 0,
+               ctx->ops->buffer_write_async(dst, dstoff, src, sz));
 }
 
 int gpudata_memset(gpudata *dst, size_t dstoff, int data) {
-  return ((partial_gpudata *)dst)->ctx->ops->buffer_memset(dst, dstoff, data);
+  gpucontext *ctx = ((partial_gpudata *)dst)->ctx;
+  TRACE_RETURN(ctx, TRACE_COPY, "memset", 0, 0, 0, 0,
+               ctx->ops->buffer_memset(dst, dstoff, data));
 }
 
 int gpudata_sync(gpudata *b) {
   return ((partial_gpudata *)b)->ctx->ops->buffer_sync(b);
 }
 
+int gpudata_query(gpudata *b, int *done) {
+  const gpuarray_buffer_ops *ops = ((partial_gpudata *)b)->ctx->ops;
+  if (ops->buffer_query == NULL) {
+    *done = 1;
+    return GA_NO_ERROR;
+  }
+  return ops->buffer_query(b, done);
+}
+
 int gpudata_property(gpudata *b, int prop_id, void *res) {
   return ((partial_gpudata *)b)->ctx->ops->property(NULL, b, NULL, prop_id,
                                                     res);
@@ -162,10 +311,10 @@ int gpudata_property(gpudata *b, int prop_id, void *res) {
 gpukernel *gpukernel_init(gpucontext *ctx, unsigned int count,
                           const char **strings, const size_t *lengths,
                           const char *fname, unsigned int numargs,
-                          const int *typecodes, int flags, int *ret,
-                          char **err_str) {
+                          const int *typecodes, const int *access,
+                          int flags, int *ret, char **err_str) {
   return ctx->ops->kernel_alloc(ctx, count, strings, lengths, fname, numargs,
-                                typecodes, flags, ret, err_str);
+                                typecodes, access, flags, ret, err_str);
 }
 
 void gpukernel_retain(gpukernel *k) {
@@ -182,8 +331,29 @@ int gpukernel_setarg(gpukernel *k, unsigned int i, void *a) {
 
 int gpukernel_call(gpukernel *k, unsigned int n, const size_t *gs,
                    const size_t *ls, size_t shared, void **args) {
-  return ((partial_gpukernel *)k)->ctx->ops->kernel_call(k, n, gs, ls,
-                                                         shared, args);
+  gpucontext *ctx = ((partial_gpukernel *)k)->ctx;
+  const char *name;
+  void *timer;
+  uint64_t start;
+  int res;
+
+  if (ctx->trace == NULL)
+    return ctx->ops->kernel_call(k, n, gs, ls, shared, args);
+  timer = gpuarray_trace_timer(ctx);
+  start = gpuarray_trace_now();
+  res = ctx->ops->kernel_call(k, n, gs, ls, shared, args);
+  if (timer != NULL &&
+      (res != GA_NO_ERROR ||
+       ctx->ops->timer_stop(ctx, k, timer) != GA_NO_ERROR)) {
+    ctx->ops->timer_release(ctx, timer);
+    timer = NULL;
+  }
+  if (ctx->ops->property(NULL, NULL, k, GA_KERNEL_PROP_NAME,
+                         &name) != GA_NO_ERROR)
+    name = NULL;
+  gpuarray_trace_add(ctx, TRACE_KERNEL, name, start, shared, n, gs, ls,
+                     timer);
+  return res;
 }
 
 int gpukernel_binary(gpukernel *k, size_t *sz, void **obj) {
@@ -24,8 +24,9 @@ int gpublas_hdot(
         gpudata *X, size_t offX, size_t incX,
         gpudata *Y, size_t offY, size_t incY,
         gpudata *Z, size_t offZ) {
-    return gpudata_context(X)->blas_ops->hdot(
-            N, X, offX, incX, Y, offY, incY, Z, offZ);
+    TRACE_RETURN(gpudata_context(X), TRACE_BLAS, "hdot", 0, N, 0, 0,
+      gpudata_context(X)->blas_ops->hdot(
+              N, X, offX, incX, Y, offY, incY, Z, offZ));
 }
 
 int gpublas_sdot(
@@ -33,8 +34,9 @@ int gpublas_sdot(
         gpudata *X, size_t offX, size_t incX,
         gpudata *Y, size_t offY, size_t incY,
         gpudata *Z, size_t offZ) {
-    return gpudata_context(X)->blas_ops->sdot(
-            N, X, offX, incX, Y, offY, incY, Z, offZ);
+    TRACE_RETURN(gpudata_context(X), TRACE_BLAS, "sdot", 0, N, 0, 0,
+      gpudata_context(X)->blas_ops->sdot(
+              N, X, offX, incX, Y, offY, incY, Z, offZ));
 }
 
 int gpublas_ddot(
@@ -42,8 +44,9 @@ int gpublas_ddot(
         gpudata *X, size_t offX, size_t incX,
         gpudata *Y, size_t offY, size_t incY,
         gpudata *Z, size_t offZ) {
-    return gpudata_context(X)->blas_ops->ddot(
-            N, X, offX, incX, Y, offY, incY, Z, offZ);
+    TRACE_RETURN(gpudata_context(X), TRACE_BLAS, "ddot", 0, N, 0, 0,
+      gpudata_context(X)->blas_ops->ddot(
+              N, X, offX, incX, Y, offY, incY, Z, offZ));
 }
 
 int gpublas_hgemv(cb_order order, cb_transpose transA,
@@ -52,9 +55,10 @@ int gpublas_hgemv(cb_order order, cb_transpose transA,
                   gpudata *X, size_t offX, int incX,
                   float beta,
                   gpudata *Y, size_t offY, int incY) {
-  return gpudata_context(A)->blas_ops->hgemv(
-    order, transA, M, N, alpha, A, offA, lda,
-    X, offX, incX, beta, Y, offY, incY);
+  TRACE_RETURN(gpudata_context(A), TRACE_BLAS, "hgemv", 0, M, N, 0,
+    gpudata_context(A)->blas_ops->hgemv(
+      order, transA, M, N, alpha, A, offA, lda,
+      X, offX, incX, beta, Y, offY, incY));
 }
 
 int gpublas_sgemv(cb_order order, cb_transpose transA,
@@ -63,9 +67,10 @@ int gpublas_sgemv(cb_order order, cb_transpose transA,
                   gpudata *X, size_t offX, int incX,
                   float beta,
                   gpudata *Y, size_t offY, int incY) {
-  return gpudata_context(A)->blas_ops->sgemv(
-    order, transA, M, N, alpha, A, offA, lda,
-    X, offX, incX, beta, Y, offY, incY);
+  TRACE_RETURN(gpudata_context(A), TRACE_BLAS, "sgemv", 0, M, N, 0,
+    gpudata_context(A)->blas_ops->sgemv(
+      order, transA, M, N, alpha, A, offA, lda,
+      X, offX, incX, beta, Y, offY, incY));
 }
 
 int gpublas_dgemv(cb_order order, cb_transpose transA,
@@ -74,9 +79,10 @@ int gpublas_dgemv(cb_order order, cb_transpose transA,
                   gpudata *X, size_t offX, int incX,
                   double beta,
                   gpudata *Y, size_t offY, int incY) {
-  return gpudata_context(A)->blas_ops->dgemv(
-    order, transA, M, N, alpha, A, offA, lda,
-    X, offX, incX, beta, Y, offY, incY);
+  TRACE_RETURN(gpudata_context(A), TRACE_BLAS, "dgemv", 0, M, N, 0,
+    gpudata_context(A)->blas_ops->dgemv(
+      order, transA, M, N, alpha, A, offA, lda,
+      X, offX, incX, beta, Y, offY, incY));
 }
 
 int gpublas_hgemm(cb_order order, cb_transpose transA, cb_transpose transB,
@@ -84,9 +90,10 @@ int gpublas_hgemm(cb_order order, cb_transpose transA, cb_transpose transB,
                   gpudata *A, size_t offA, size_t lda,
                   gpudata *B, size_t offB, size_t ldb,
                   float beta, gpudata *C, size_t offC, size_t ldc) {
-  return gpudata_context(A)->blas_ops->hgemm(
-    order, transA, transB, M, N, K, alpha, A, offA, lda,
-    B, offB, ldb, beta, C, offC, ldc);
+  TRACE_RETURN(gpudata_context(A), TRACE_BLAS, "hgemm", 0, M, N, K,
+    gpudata_context(A)->blas_ops->hgemm(
+      order, transA, transB, M, N, K, alpha, A, offA, lda,
+      B, offB, ldb, beta, C, offC, ldc));
 }
 
 int gpublas_sgemm(cb_order order, cb_transpose transA, cb_transpose transB,
@@ -94,9 +101,10 @@ int gpublas_sgemm(cb_order order, cb_transpose transA, cb_transpose transB,
                   gpudata *A, size_t offA, size_t lda,
                   gpudata *B, size_t offB, size_t ldb,
                   float beta, gpudata *C, size_t offC, size_t ldc) {
-  return gpudata_context(A)->blas_ops->sgemm(
-    order, transA, transB, M, N, K, alpha, A, offA, lda,
-    B, offB, ldb, beta, C, offC, ldc);
+  TRACE_RETURN(gpudata_context(A), TRACE_BLAS, "sgemm", 0, M, N, K,
+    gpudata_context(A)->blas_ops->sgemm(
+      order, transA, transB, M, N, K, alpha, A, offA, lda,
+      B, offB, ldb, beta, C, offC, ldc));
 }
 
 int gpublas_dgemm(cb_order order, cb_transpose transA, cb_transpose transB,
@@ -104,33 +112,37 @@ int gpublas_dgemm(cb_order order, cb_transpose transA, cb_transpose transB,
                   gpudata *A, size_t offA, size_t lda,
                   gpudata *B, size_t offB, size_t ldb,
                   double beta, gpudata *C, size_t offC, size_t ldc) {
-  return gpudata_context(A)->blas_ops->dgemm(
-    order, transA, transB, M, N, K, alpha, A, offA, lda,
-    B, offB, ldb, beta, C, offC, ldc);
+  TRACE_RETURN(gpudata_context(A), TRACE_BLAS, "dgemm", 0, M, N, K,
+    gpudata_context(A)->blas_ops->dgemm(
+      order, transA, transB, M, N, K, alpha, A, offA, lda,
+      B, offB, ldb, beta, C, offC, ldc));
 }
 
 int gpublas_hger(cb_order order, size_t M, size_t N, float alpha,
                  gpudata *X, size_t offX, int incX,
                  gpudata *Y, size_t offY, int incY,
                  gpudata *A, size_t offA, size_t lda) {
-  return gpudata_context(X)->blas_ops->hger(
-    order, M, N, alpha, X, offX, incX, Y, offY, incY, A, offA, lda);
+  TRACE_RETURN(gpudata_context(X), TRACE_BLAS, "hger", 0, M, N, 0,
+    gpudata_context(X)->blas_ops->hger(
+      order, M, N, alpha, X, offX, incX, Y, offY, incY, A, offA, lda));
 }
 
 int gpublas_sger(cb_order order, size_t M, size_t N, float alpha,
                  gpudata *X, size_t offX, int incX,
                  gpudata *Y, size_t offY, int incY,
                  gpudata *A, size_t offA, size_t lda) {
-  return gpudata_context(X)->blas_ops->sger(
-    order, M, N, alpha, X, offX, incX, Y, offY, incY, A, offA, lda);
+  TRACE_RETURN(gpudata_context(X), TRACE_BLAS, "sger", 0, M, N, 0,
+    gpudata_context(X)->blas_ops->sger(
+      order, M, N, alpha, X, offX, incX, Y, offY, incY, A, offA, lda));
 }
 
 int gpublas_dger(cb_order order, size_t M, size_t N, double alpha,
                  gpudata *X, size_t offX, int incX,
                  gpudata *Y, size_t offY, int incY,
                  gpudata *A, size_t offA, size_t lda) {
-  return gpudata_context(X)->blas_ops->dger(
-    order, M, N, alpha, X, offX, incX, Y, offY, incY, A, offA, lda);
+  TRACE_RETURN(gpudata_context(X), TRACE_BLAS, "dger", 0, M, N, 0,
+    gpudata_context(X)->blas_ops->dger(
+      order, M, N, alpha, X, offX, incX, Y, offY, incY, A, offA, lda));
 }
 
 int gpublas_hgemmBatch(
@@ -142,9 +154,10 @@ int gpublas_hgemmBatch(
   size_t batchCount, int flags) {
   if (flags != 0) return GA_INVALID_ERROR;
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(A[0])->blas_ops->hgemmBatch(
-    order, transA, transB, M, N, K, alpha, A, offA, lda,
-    B, offB, ldb, beta, C, offC, ldc, batchCount);
+  TRACE_RETURN(gpudata_context(A[0]), TRACE_BLAS, "hgemmBatch", 0, M, N, K,
+    gpudata_context(A[0])->blas_ops->hgemmBatch(
+      order, transA, transB, M, N, K, alpha, A, offA, lda,
+      B, offB, ldb, beta, C, offC, ldc, batchCount));
 }
 
 int gpublas_sgemmBatch(
@@ -156,9 +169,10 @@ int gpublas_sgemmBatch(
   size_t batchCount, int flags) {
   if (flags != 0) return GA_INVALID_ERROR;
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(A[0])->blas_ops->sgemmBatch(
-    order, transA, transB, M, N, K, alpha, A, offA, lda,
-    B, offB, ldb, beta, C, offC, ldc, batchCount);
+  TRACE_RETURN(gpudata_context(A[0]), TRACE_BLAS, "sgemmBatch", 0, M, N, K,
+    gpudata_context(A[0])->blas_ops->sgemmBatch(
+      order, transA, transB, M, N, K, alpha, A, offA, lda,
+      B, offB, ldb, beta, C, offC, ldc, batchCount));
 }
 
 int gpublas_dgemmBatch(
@@ -170,9 +184,58 @@ int gpublas_dgemmBatch(
   size_t batchCount, int flags) {
   if (flags != 0) return GA_INVALID_ERROR;
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(A[0])->blas_ops->dgemmBatch(
-    order, transA, transB, M, N, K, alpha, A, offA, lda,
-    B, offB, ldb, beta, C, offC, ldc, batchCount);
+  TRACE_RETURN(gpudata_context(A[0]), TRACE_BLAS, "dgemmBatch", 0, M, N, K,
+    gpudata_context(A[0])->blas_ops->dgemmBatch(
+      order, transA, transB, M, N, K, alpha, A, offA, lda,
+      B, offB, ldb, beta, C, offC, ldc, batchCount));
+}
+
+int gpublas_hgemm3D(
+  cb_order order, cb_transpose transA, cb_transpose transB,
+  size_t M, size_t N, size_t K, float alpha,
+  gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+  gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+  float beta, gpudata *C, size_t offC, size_t ldc, ssize_t strideC,
+  size_t batchCount, int flags) {
+  gpucontext *ctx = gpudata_context(A);
+  if (flags != 0) return GA_INVALID_ERROR;
+  if (batchCount == 0) return GA_NO_ERROR;
+  if (ctx->blas_ops->hgemm3D == NULL) return GA_DEVSUP_ERROR;
+  return ctx->blas_ops->hgemm3D(
+    order, transA, transB, M, N, K, alpha, A, offA, lda, strideA,
+    B, offB, ldb, strideB, beta, C, offC, ldc, strideC, batchCount);
+}
+
+int gpublas_sgemm3D(
+  cb_order order, cb_transpose transA, cb_transpose transB,
+  size_t M, size_t N, size_t K, float alpha,
+  gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+  gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+  float beta, gpudata *C, size_t offC, size_t ldc, ssize_t strideC,
+  size_t batchCount, int flags) {
+  gpucontext *ctx = gpudata_context(A);
+  if (flags != 0) return GA_INVALID_ERROR;
+  if (batchCount == 0) return GA_NO_ERROR;
+  if (ctx->blas_ops->sgemm3D == NULL) return GA_DEVSUP_ERROR;
+  return ctx->blas_ops->sgemm3D(
+    order, transA, transB, M, N, K, alpha, A, offA, lda, strideA,
+    B, offB, ldb, strideB, beta, C, offC, ldc, strideC, batchCount);
+}
+
+int gpublas_dgemm3D(
+  cb_order order, cb_transpose transA, cb_transpose transB,
+  size_t M, size_t N, size_t K, double alpha,
+  gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+  gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+  double beta, gpudata *C, size_t offC, size_t ldc, ssize_t strideC,
+  size_t batchCount, int flags) {
+  gpucontext *ctx = gpudata_context(A);
+  if (flags != 0) return GA_INVALID_ERROR;
+  if (batchCount == 0) return GA_NO_ERROR;
+  if (ctx->blas_ops->dgemm3D == NULL) return GA_DEVSUP_ERROR;
+  return ctx->blas_ops->dgemm3D(
+    order, transA, transB, M, N, K, alpha, A, offA, lda, strideA,
+    B, offB, ldb, strideB, beta, C, offC, ldc, strideC, batchCount);
 }
 
 int gpublas_hgemvBatch(
@@ -183,9 +246,10 @@ int gpublas_hgemvBatch(
   float beta, gpudata **y, size_t *offY, size_t incY,
   size_t batchCount, int flags) {
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(A[0])->blas_ops->hgemvBatch(
-    order, transA, M, N, alpha, A, offA, lda, x, offX, incX,
-    beta, y, offY, incY, batchCount, flags);
+  TRACE_RETURN(gpudata_context(A[0]), TRACE_BLAS, "hgemvBatch", 0, M, N, 0,
+    gpudata_context(A[0])->blas_ops->hgemvBatch(
+      order, transA, M, N, alpha, A, offA, lda, x, offX, incX,
+      beta, y, offY, incY, batchCount, flags));
 }
 
 int gpublas_sgemvBatch(
@@ -196,9 +260,10 @@ int gpublas_sgemvBatch(
   float beta, gpudata **y, size_t *offY, size_t incY,
   size_t batchCount, int flags) {
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(A[0])->blas_ops->sgemvBatch(
-    order, transA, M, N, alpha, A, offA, lda, x, offX, incX,
-    beta, y, offY, incY, batchCount, flags);
+  TRACE_RETURN(gpudata_context(A[0]), TRACE_BLAS, "sgemvBatch", 0, M, N, 0,
+    gpudata_context(A[0])->blas_ops->sgemvBatch(
+      order, transA, M, N, alpha, A, offA, lda, x, offX, incX,
+      beta, y, offY, incY, batchCount, flags));
 }
 
 int gpublas_dgemvBatch(
@@ -209,9 +274,10 @@ int gpublas_dgemvBatch(
   double beta, gpudata **y, size_t *offY, size_t incY,
   size_t batchCount, int flags) {
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(A[0])->blas_ops->dgemvBatch(
-    order, transA, M, N, alpha, A, offA, lda, x, offX, incX,
-    beta, y, offY, incY, batchCount, flags);
+  TRACE_RETURN(gpudata_context(A[0]), TRACE_BLAS, "dgemvBatch", 0, M, N, 0,
+    gpudata_context(A[0])->blas_ops->dgemvBatch(
+      order, transA, M, N, alpha, A, offA, lda, x, offX, incX,
+      beta, y, offY, incY, batchCount, flags));
 }
 
 int gpublas_hgerBatch(cb_order order, size_t M, size_t N, float alpha,
@@ -220,9 +286,10 @@ int gpublas_hgerBatch(cb_order order, size_t M, size_t N, float alpha,
                       gpudata **A, size_t *offA, size_t lda,
                       size_t batchCount, int flags) {
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(x[0])->blas_ops->hgerBatch(
-    order, M, N, alpha, x, offX, incX, y, offY, incY,
-    A, offA, lda, batchCount, flags);
+  TRACE_RETURN(gpudata_context(x[0]), TRACE_BLAS, "hgerBatch", 0, M, N, 0,
+    gpudata_context(x[0])->blas_ops->hgerBatch(
+      order, M, N, alpha, x, offX, incX, y, offY, incY,
+      A, offA, lda, batchCount, flags));
 }
 
 int gpublas_sgerBatch(cb_order order, size_t M, size_t N, float alpha,
@@ -231,9 +298,10 @@ int gpublas_sgerBatch(cb_order order, size_t M, size_t N, float alpha,
                       gpudata **A, size_t *offA, size_t lda,
                       size_t batchCount, int flags) {
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(x[0])->blas_ops->sgerBatch(
-    order, M, N, alpha, x, offX, incX, y, offY, incY,
-    A, offA, lda, batchCount, flags);
+  TRACE_RETURN(gpudata_context(x[0]), TRACE_BLAS, "sgerBatch", 0, M, N, 0,
+    gpudata_context(x[0])->blas_ops->sgerBatch(
+      order, M, N, alpha, x, offX, incX, y, offY, incY,
+      A, offA, lda, batchCount, flags));
 }
 
 int gpublas_dgerBatch(cb_order order, size_t M, size_t N, double alpha,
@@ -242,7 +310,8 @@ int gpublas_dgerBatch(cb_order order, size_t M, size_t N, double alpha,
                       gpudata **A, size_t *offA, size_t lda,
                       size_t batchCount, int flags) {
   if (batchCount == 0) return GA_NO_ERROR;
-  return gpudata_context(x[0])->blas_ops->dgerBatch(
-    order, M, N, alpha, x, offX, incX, y, offY, incY,
-    A, offA, lda, batchCount, flags);
+  TRACE_RETURN(gpudata_context(x[0]), TRACE_BLAS, "dgerBatch", 0, M, N, 0,
+    gpudata_context(x[0])->blas_ops->dgerBatch(
+      order, M, N, alpha, x, offX, incX, y, offY, incY,
+      A, offA, lda, batchCount, flags));
 }
@@ -1,6 +1,7 @@
 #include "gpuarray/buffer.h"
 #include "gpuarray/buffer_collectives.h"
 #include "gpuarray/error.h"
+#include "gpuarray/util.h"
 
 #include "private.h"
 
@@ -57,8 +58,10 @@ int gpucomm_reduce(gpudata* src, size_t offsrc, gpudata* dest, size_t offdest,
   gpucontext* ctx = gpucomm_context(comm);
   if (ctx->comm_ops == NULL)
     return GA_COMM_ERROR;
-  return ctx->comm_ops->reduce(src, offsrc, dest, offdest, count, typecode,
-                               opcode, root, comm);
+  TRACE_RETURN(ctx, TRACE_COMM, "reduce",
+               count * gpuarray_get_elsize(typecode), count, 0, 0,
+               ctx->comm_ops->reduce(src, offsrc, dest, offdest, count,
+                                     typecode, opcode, root, comm));
 }
 
 int gpucomm_all_reduce(gpudata* src, size_t offsrc, gpudata* dest,
@@ -67,8 +70,10 @@ int gpucomm_all_reduce(gpudata* src, size_t offsrc, gpudata* dest,
   gpucontext* ctx = gpucomm_context(comm);
   if (ctx->comm_ops == NULL)
     return GA_COMM_ERROR;
-  return ctx->comm_ops->all_reduce(src, offsrc, dest, offdest, count, typecode,
-                                   opcode, comm);
+  TRACE_RETURN(ctx, TRACE_COMM, "all_reduce",
+               count * gpuarray_get_elsize(typecode), count, 0, 0,
+               ctx->comm_ops->all_reduce(src, offsrc, dest, offdest, count,
+                                         typecode, opcode, comm));
 }
 
 int gpucomm_reduce_scatter(gpudata* src, size_t offsrc, gpudata* dest,
@@ -77,8 +82,10 @@ int gpucomm_reduce_scatter(gpudata* src, size_t offsrc, gpudata* dest,
   gpucontext* ctx = gpucomm_context(comm);
   if (ctx->comm_ops == NULL)
     return GA_COMM_ERROR;
-  return ctx->comm_ops->reduce_scatter(src, offsrc, dest, offdest, count,
-                                       typecode, opcode, comm);
+  TRACE_RETURN(ctx, TRACE_COMM, "reduce_scatter",
+               count * gpuarray_get_elsize(typecode), count, 0, 0,
+               ctx->comm_ops->reduce_scatter(src, offsrc, dest, offdest, count,
+                                             typecode, opcode, comm));
 }
 
 int gpucomm_broadcast(gpudata* array, size_t offset, size_t count, int typecode,
@@ -86,7 +93,10 @@ int gpucomm_broadcast(gpudata* array, size_t offset, size_t count, int typecode,
   gpucontext* ctx = gpucomm_context(comm);
   if (ctx->comm_ops == NULL)
     return GA_COMM_ERROR;
-  return ctx->comm_ops->broadcast(array, offset, count, typecode, root, comm);
+  TRACE_RETURN(ctx, TRACE_COMM, "broadcast",
+               count * gpuarray_get_elsize(typecode), count, 0, 0,
+               ctx->comm_ops->broadcast(array, offset, count, typecode, root,
+                                        comm));
 }
 
 int gpucomm_all_gather(gpudata* src, size_t offsrc, gpudata* dest,
@@ -95,6 +105,8 @@ int gpucomm_all_gather(gpudata* src, size_t offsrc, gpudata* dest,
   gpucontext* ctx = gpucomm_context(comm);
   if (ctx->comm_ops == NULL)
     return GA_COMM_ERROR;
-  return ctx->comm_ops->all_gather(src, offsrc, dest, offdest, count, typecode,
-                                   comm);
+  TRACE_RETURN(ctx, TRACE_COMM, "all_gather",
+               count * gpuarray_get_elsize(typecode), count, 0, 0,
+               ctx->comm_ops->all_gather(src, offsrc, dest, offdest, count,
+                                         typecode, comm));
 }
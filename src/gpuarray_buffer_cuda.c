@@ -12,6 +12,7 @@
 
 #include <cache.h>
 
+#include "util/lock.h"
 #include "util/strb.h"
 #include "util/xxhash.h"
 
@@ -42,6 +43,7 @@ static CUresult err;
 GPUARRAY_LOCAL const gpuarray_buffer_ops cuda_ops;
 
 static void cuda_freekernel(gpukernel *);
+static void cuda_retainkernel(gpukernel *);
 static int cuda_property(gpucontext *, gpudata *, gpukernel *, int, void *);
 static int cuda_waits(gpudata *, int, CUstream);
 static int cuda_records(gpudata *, int, CUstream);
@@ -56,15 +58,26 @@ static int strb_eq(void *_k1, void *_k2) {
           memcmp(k1->s, k2->s, k1->l) == 0);
 }
 
-static uint32_t strb_hash(void *_k) {
+/* The source and the binary, the module is about the same size */
+static size_t kernel_cost(void *k, void *v) {
+  return ((strb *)k)->l + ((gpukernel *)v)->bin_sz;
+}
+
+static uint64_t strb_hash(void *_k) {
   strb *k = (strb *)_k;
-  return XXH32(k->s, k->l, 42);
+  return XXH64(k->s, k->l, 42);
 }
 
 static int setup_done = 0;
 static int major = -1;
 static int minor = -1;
-static int setup_lib(void) {
+/* Driver and NVRTC versions for the disk cache keys */
+static int drv_ver = 0;
+static int nvrtc_major = 0;
+static int nvrtc_minor = 0;
+static cache *disk_cache = NULL;
+static ga_lock_t setup_lock = GA_LOCK_INITIALIZER;
+static int setup_lib_locked(void) {
   int res, tmp;
   const char *ver;
   if (!setup_done) {
@@ -90,11 +103,26 @@ static int setup_lib(void) {
     res = load_libnvrtc(major, minor);
     if (res != GA_NO_ERROR)
       return res;
+    err = cuDriverGetVersion(&drv_ver);
+    if (err != CUDA_SUCCESS)
+      return GA_IMPL_ERROR;
+    if (nvrtcVersion(&nvrtc_major, &nvrtc_minor) != NVRTC_SUCCESS)
+      return GA_IMPL_ERROR;
+    disk_cache = gpukernel_disk_cache("cuda");
     setup_done = 1;
   }
   return GA_NO_ERROR;
 }
 
+/* Contexts may be created from many threads at once */
+static int setup_lib(void) {
+  int res;
+  ga_lock_acquire(&setup_lock);
+  res = setup_lib_locked();
+  ga_lock_release(&setup_lock);
+  return res;
+}
+
 static int cuda_get_platform_count(unsigned int* platcount) {
   *platcount = 1;  // CUDA works on NVIDIA's GPUs
   return GA_NO_ERROR;
@@ -130,9 +158,17 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
   res->refcnt = 1;
   res->flags = flags;
   res->enter = 0;
+  res->nevpool = 0;
   res->major = major;
   res->minor = minor;
-  res->freeblocks = NULL;
+  res->freeblocks = malloc(sizeof(*res->freeblocks));
+  if (res->freeblocks == NULL)
+    goto fail_stream;
+  freelist_init(res->freeblocks);
+  res->hostblocks = malloc(sizeof(*res->hostblocks));
+  if (res->hostblocks == NULL)
+    goto fail_stream;
+  freelist_init(res->hostblocks);
   if (detect_arch(ARCH_PREFIX, res->bin_id, &err)) {
     goto fail_stream;
   }
@@ -142,6 +178,7 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
   if (err != CUDA_SUCCESS) {
     goto fail_stream;
   }
+  res->def_s = res->s;
   if (ISSET(res->flags, GA_CTX_SINGLE_STREAM)) {
     res->mem_s = res->s;
   } else {
@@ -152,9 +189,12 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
       goto fail_mem_stream;
     }
   }
-  res->kernel_cache = cache_twoq(64, 128, 64, 8, strb_eq, strb_hash,
-                                 (cache_freek_fn)strb_free,
-                                 (cache_freev_fn)cuda_freekernel);
+  res->kernel_cache = gpucontext_cache(res->flags, 64, 128, 64, 8,
+                                       strb_eq, strb_hash,
+                                       (cache_freek_fn)strb_free,
+                                       (cache_freev_fn)cuda_freekernel,
+                                       (cache_vref_fn)cuda_retainkernel,
+                                       kernel_cost);
   if (res->kernel_cache == NULL)
     goto fail_cache;
   err = cuMemAllocHost(&p, 16);
@@ -181,6 +221,8 @@ cuda_context *cuda_make_ctx(CUcontext ctx, int flags) {
  fail_mem_stream:
   cuStreamDestroy(res->s);
  fail_stream:
+  free(res->freeblocks);
+  free(res->hostblocks);
   free(res);
   return NULL;
 }
@@ -189,7 +231,8 @@ static void deallocate(gpudata *);
 
 static void cuda_free_ctx(cuda_context *ctx) {
   gpuarray_blas_ops *blas_ops;
-  gpudata *next, *curr;
+  gpustream *str;
+  fl_block *blk;
   CUdevice dev;
 
   ASSERT_CTX(ctx);
@@ -204,16 +247,33 @@ static void cuda_free_ctx(cuda_context *ctx) {
     cuMemFreeHost((void *)ctx->errbuf->ptr);
     deallocate(ctx->errbuf);
 
+    while (ctx->nevpool > 0)
+      cuEventDestroy(ctx->evpool[--ctx->nevpool]);
+
     if (ISCLR(ctx->flags, GA_CTX_SINGLE_STREAM))
       cuStreamDestroy(ctx->mem_s);
-    cuStreamDestroy(ctx->s);
+    cuStreamDestroy(ctx->def_s);
+    while (ctx->spool != NULL) {
+      str = ctx->spool;
+      ctx->spool = str->next;
+      cuStreamDestroy(str->s);
+      free(str);
+    }
 
     /* Clear out the freelist */
-    for (curr = ctx->freeblocks; curr != NULL; curr = next) {
-      next = curr->next;
-      cuMemFree(curr->ptr);
-      deallocate(curr);
+    while ((blk = freelist_next(ctx->freeblocks, NULL)) != NULL) {
+      freelist_remove_arena(ctx->freeblocks, blk);
+      ctx->mem_reserved -= blk->size;
+      cuMemFree(BLK_BUF(blk)->ptr);
+      deallocate(BLK_BUF(blk));
+    }
+    free(ctx->freeblocks);
+    while ((blk = freelist_next(ctx->hostblocks, NULL)) != NULL) {
+      freelist_remove_arena(ctx->hostblocks, blk);
+      cuMemFreeHost((void *)BLK_BUF(blk)->ptr);
+      deallocate(BLK_BUF(blk));
     }
+    free(ctx->hostblocks);
     cache_destroy(ctx->kernel_cache);
 
     if (!(ctx->flags & DONTFREE)) {
@@ -249,7 +309,6 @@ void cuda_exit(cuda_context *ctx) {
 
 static gpudata *new_gpudata(cuda_context *ctx, CUdeviceptr ptr, size_t size) {
   gpudata *res;
-  int fl = CU_EVENT_DISABLE_TIMING;
 
   res = malloc(sizeof(*res));
   if (res == NULL) return NULL;
@@ -258,31 +317,14 @@ static gpudata *new_gpudata(cuda_context *ctx, CUdeviceptr ptr, size_t size) {
   res->sz = size;
 
   res->flags = 0;
+  res->rs = NULL;
+  res->ws = NULL;
   res->ls = NULL;
 
-  cuda_enter(ctx);
-
-  if (ctx->flags & GA_CTX_MULTI_THREAD)
-    fl |= CU_EVENT_BLOCKING_SYNC;
-  ctx->err = cuEventCreate(&res->rev, fl);
-  if (ctx->err != CUDA_SUCCESS) {
-    cuda_exit(ctx);
-    free(res);
-    return NULL;
-  }
-
-  ctx->err = cuEventCreate(&res->wev, fl);
-  if (ctx->err != CUDA_SUCCESS) {
-    cuEventDestroy(res->rev);
-    cuda_exit(ctx);
-    free(res);
-    return NULL;
-  }
-
-  cuda_exit(ctx);
-
   res->ptr = ptr;
-  res->next = NULL;
+  memset(&res->blk, 0, sizeof(res->blk));
+  res->blk.addr = ptr;
+  res->blk.size = size;
   res->ctx = ctx;
   TAG_BUF(res);
 
@@ -350,13 +392,32 @@ static const char CUDA_PREAMBLE[] =
     "#define ga_ssize ptrdiff_t\n"
     "#define load_half(p) __half2float(*(p))\n"
     "#define store_half(p, v) (*(p) = __float2half_rn(v))\n"
+    "#define ga_int2 int2\n"
+    "#define ga_int4 int4\n"
+    "#define ga_uint2 uint2\n"
+    "#define ga_uint4 uint4\n"
+    "#define ga_long2 longlong2\n"
+    "#define ga_ulong2 ulonglong2\n"
+    "#define ga_float2 float2\n"
+    "#define ga_float4 float4\n"
+    "#define ga_double2 double2\n"
+    "#define load_half2(p, v) do { ushort2 _h = *(const ushort2 *)(p); "
+    "(v)[0] = __half2float(_h.x); (v)[1] = __half2float(_h.y); } while (0)\n"
+    "#define load_half4(p, v) do { ushort4 _h = *(const ushort4 *)(p); "
+    "(v)[0] = __half2float(_h.x); (v)[1] = __half2float(_h.y); "
+    "(v)[2] = __half2float(_h.z); (v)[3] = __half2float(_h.w); } while (0)\n"
+    "#define store_half2(p, v) (*(ushort2 *)(p) = make_ushort2("
+    "__float2half_rn((v)[0]), __float2half_rn((v)[1])))\n"
+    "#define store_half4(p, v) (*(ushort4 *)(p) = make_ushort4("
+    "__float2half_rn((v)[0]), __float2half_rn((v)[1]), "
+    "__float2half_rn((v)[2]), __float2half_rn((v)[3])))\n"
     "#define GA_DECL_SHARED_PARAM(type, name)\n"
     "#define GA_DECL_SHARED_BODY(type, name) extern __shared__ type name[];\n"
     "#define GA_WARP_SIZE warpSize\n"
     "#line 1\n";
 
 /* XXX: add complex, quads, longlong */
-/* XXX: add vector types */
+/* XXX: add the other vector types */
 
 static cuda_context *do_init(CUdevice dev, int flags, int *ret) {
     cuda_context *res;
@@ -431,81 +492,132 @@ static void cuda_deinit(gpucontext *c) {
 }
 
 /*
- * Find the block in the free list that is the best fit for the size
- * we want, which means the smallest that can still fit the size.
+ * Find a block in the free list that fits the size we want.  See
+ * freelist_find() for the details.
+ */
+static gpudata *find_best(freelist *fl, size_t size) {
+  fl_block *blk = freelist_find(fl, size);
+  return blk == NULL ? NULL : BLK_BUF(blk);
+}
+
+/* Granularity of driver allocations and precision of the search in
+   largest_size() */
+#define PROBE_SIZE (2 * 1024 * 1024)
+
+/*
+ * The driver maps device allocations in pages of PROBE_SIZE so the
+ * free memory it reports, rounded down to that, is normally usable
+ * as a single block.
+ *
+ * If `probe` is set we don't trust that and search for the largest
+ * allocation that succeeds instead.  This starts with the free size
+ * and bisects down to PROBE_SIZE, which takes about 10 trips through
+ * cuMemAlloc() and cuMemFree().
  */
-static void find_best(cuda_context *ctx, gpudata **best, gpudata **prev,
-                     size_t size) {
-  gpudata *temp, *tempPrev = NULL;
-  *best = NULL;
+static int largest_size(cuda_context *ctx, size_t *res, int probe) {
+  CUdeviceptr ptr;
+  size_t lo, hi, mid, dummy, fsz;
 
-  for (temp = ctx->freeblocks; temp; temp = temp->next) {
-    if (temp->sz >= size && (!*best || temp->sz < (*best)->sz)) {
-      *best = temp;
-      *prev = tempPrev;
+  cuda_enter(ctx);
+  ctx->err = cuMemGetInfo(&hi, &dummy);
+  if (ctx->err != CUDA_SUCCESS) {
+    cuda_exit(ctx);
+    return GA_IMPL_ERROR;
+  }
+  if (!probe) {
+    cuda_exit(ctx);
+    lo = hi - hi % PROBE_SIZE;
+    fsz = freelist_largest(ctx->freeblocks);
+    *res = lo > fsz ? lo : fsz;
+    return GA_NO_ERROR;
+  }
+  lo = 0;
+  if (cuMemAlloc(&ptr, hi) == CUDA_SUCCESS) {
+    cuMemFree(ptr);
+    lo = hi;
+  }
+  while (hi - lo > PROBE_SIZE) {
+    mid = lo + (hi - lo) / 2;
+    if (cuMemAlloc(&ptr, mid) == CUDA_SUCCESS) {
+      cuMemFree(ptr);
+      lo = mid;
+    } else {
+      hi = mid;
     }
-    tempPrev = temp;
   }
+  cuda_exit(ctx);
+  fsz = freelist_largest(ctx->freeblocks);
+  *res = lo > fsz ? lo : fsz;
+  return GA_NO_ERROR;
 }
 
-static size_t largest_size(cuda_context *ctx) {
-  gpudata *temp;
-  size_t sz, dummy;
-  cuda_enter(ctx);
-  ctx->err = cuMemGetInfo(&sz, &dummy);
-  cuda_exit(ctx);
-   /* We guess that we can allocate at least a quarter of the free size
-     in a single block. This might be wrong though. */
-  sz /= 4;
-  for (temp = ctx->freeblocks; temp; temp = temp->next) {
-    if (temp->sz > sz) sz = temp->sz;
-  }
-  return sz;
+static size_t cuda_trim(gpucontext *c, size_t keep);
+
+static void free_ptr(gpudata *d) {
+  if (d->flags & CUDA_HOST_ALLOC)
+    cuMemFreeHost((void *)d->ptr);
+  else
+    cuMemFree(d->ptr);
 }
 
 /*
  * Allocate a new block and place in on the freelist. Will allocate
  * the bigger of the requested size and BLOCK_SIZE to avoid allocating
  * multiple small blocks.
+ *
+ * If `host` is set the block is page-locked host memory and goes in
+ * the host freelist.
  */
-static int allocate(cuda_context *ctx, gpudata **res, gpudata **prev,
-                    size_t size) {
+static int allocate(cuda_context *ctx, gpudata **res, size_t size,
+                    int host) {
   CUdeviceptr ptr;
-  gpudata *next;
-  *prev = NULL;
+  void *hptr;
 
   if (!(ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE))
     if (size < BLOCK_SIZE) size = BLOCK_SIZE;
 
   cuda_enter(ctx);
 
-  ctx->err = cuMemAlloc(&ptr, size);
+  if (host) {
+    ctx->err = cuMemAllocHost(&hptr, size);
+    ptr = (CUdeviceptr)hptr;
+  } else {
+    ctx->err = cuMemAlloc(&ptr, size);
+    /* Give back what we have cached and try again */
+    if (ctx->err == CUDA_ERROR_OUT_OF_MEMORY &&
+        cuda_trim((gpucontext *)ctx, 0) != 0)
+      ctx->err = cuMemAlloc(&ptr, size);
+  }
   if (ctx->err != CUDA_SUCCESS) {
     cuda_exit(ctx);
     return GA_IMPL_ERROR;
   }
+  if (!host) {
+    ctx->mem_reserved += size;
+    ctx->mem_nallocs++;
+  }
 
   *res = new_gpudata(ctx, ptr, size);
 
   cuda_exit(ctx);
 
   if (*res == NULL) {
-    cuMemFree(ptr);
+    if (host) {
+      cuMemFreeHost(hptr);
+    } else {
+      cuMemFree(ptr);
+      ctx->mem_reserved -= size;
+    }
     return GA_MEMORY_ERROR;
   }
 
   (*res)->flags |= CUDA_HEAD_ALLOC;
+  if (host)
+    (*res)->flags |= CUDA_HOST_ALLOC|CUDA_MAPPED_PTR;
 
   /* Now that the block is allocated, enter it in the freelist */
-  next = ctx->freeblocks;
-  for (; next && next->ptr < (*res)->ptr; next = next->next) {
-    *prev = next;
-  }
-  (*res)->next = next;
-  if (*prev)
-    (*prev)->next = *res;
-  else
-    ctx->freeblocks = *res;
+  freelist_add_arena(host ? ctx->hostblocks : ctx->freeblocks,
+                     &(*res)->blk, ptr, size);
 
   return GA_NO_ERROR;
 }
@@ -513,38 +625,63 @@ static int allocate(cuda_context *ctx, gpudata **res, gpudata **prev,
 /*
  * Extract the `curr` block from the freelist, possibly splitting it
  * if it's too big for the requested size.  The remaining block will
- * stay on the freelist if there is a split.  `prev` is only to
- * facilitate the extraction so we don't have to go through the list
- * again.
+ * stay on the freelist if there is a split.
  */
-static int extract(gpudata *curr, gpudata *prev, size_t size) {
-  gpudata *next, *split;
-  size_t remaining = curr->sz - size;
+static int extract(gpudata *curr, size_t size) {
+  gpudata *split = NULL;
+  size_t remaining = curr->blk.size - size;
+  int host = curr->flags & CUDA_HOST_ALLOC;
 
-  if (remaining < FRAG_SIZE) {
-    /* No need to split, the remaining block would be too small */
-    next = curr->next;
-  } else {
+  if (remaining >= FRAG_SIZE) {
     split = new_gpudata(curr->ctx, curr->ptr + size, remaining);
     if (split == NULL)
       return GA_MEMORY_ERROR;
-    /* Make sure the chain keeps going */
-    split->next = curr->next;
-    curr->next = NULL;
+    if (host)
+      split->flags |= CUDA_HOST_ALLOC|CUDA_MAPPED_PTR;
+  }
+
+  if (freelist_take(host ? curr->ctx->hostblocks : curr->ctx->freeblocks,
+                    &curr->blk, size, FRAG_SIZE,
+                    split == NULL ? NULL : &split->blk)) {
     /* Make sure we don't start using the split buffer too soon */
     cuda_records(split, CUDA_WAIT_ALL, curr->ls);
-    next = split;
-    curr->sz = size;
   }
-
-  if (prev != NULL)
-    prev->next = next;
-  else
-    curr->ctx->freeblocks = next;
+  curr->sz = curr->blk.size;
 
   return GA_NO_ERROR;
 }
 
+/*
+ * Release the arenas that are completely free until the cache is down
+ * to `keep` bytes.  Arenas that are partly in use can't be returned.
+ */
+static size_t cuda_trim(gpucontext *c, size_t keep) {
+  cuda_context *ctx = (cuda_context *)c;
+  fl_block *blk, *next;
+  size_t res = 0;
+
+  ASSERT_CTX(ctx);
+  /* cuMemFree() would synchronize and break the capture */
+  if (ctx->cap != NULL)
+    return 0;
+  cuda_enter(ctx);
+  blk = freelist_next(ctx->freeblocks, NULL);
+  while (blk != NULL && ctx->freeblocks->free_bytes > keep) {
+    next = freelist_next(ctx->freeblocks, blk);
+    if ((blk->flags & FREELIST_HEAD) && blk->next_phys == NULL) {
+      freelist_remove_arena(ctx->freeblocks, blk);
+      ctx->mem_reserved -= blk->size;
+      res += blk->size;
+      /* This waits for the pending operations on the memory */
+      cuMemFree(BLK_BUF(blk)->ptr);
+      deallocate(BLK_BUF(blk));
+    }
+    blk = next;
+  }
+  cuda_exit(ctx);
+  return res;
+}
+
 static void cuda_free(gpudata *);
 static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
                       size_t sz);
@@ -555,38 +692,41 @@ static inline size_t roundup(size_t s, size_t m) {
 
 static gpudata *cuda_alloc(gpucontext *c, size_t size, void *data, int flags,
 			   int *ret) {
-  gpudata *res = NULL, *prev = NULL;
+  gpudata *res = NULL;
   cuda_context *ctx = (cuda_context *)c;
   size_t asize;
+  int host = flags & GA_BUFFER_HOST;
   int err;
 
   if ((flags & GA_BUFFER_INIT) && data == NULL) FAIL(NULL, GA_VALUE_ERROR);
   if ((flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) ==
       (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) FAIL(NULL, GA_VALUE_ERROR);
 
-  /* TODO: figure out how to make this work */
-  if (flags & GA_BUFFER_HOST) FAIL(NULL, GA_DEVSUP_ERROR);
-
   /* We don't want to manage really small allocations so we round up
    * to a multiple of FRAG_SIZE.  This also ensures that if we split a
    * block, the next block starts properly aligned for any data type.
    */
   if (!(ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE)) {
     asize = roundup(size, FRAG_SIZE);
-    find_best(ctx, &res, &prev, asize);
+    res = find_best(host ? ctx->hostblocks : ctx->freeblocks, asize);
   } else {
     asize = size;
   }
 
   if (res == NULL) {
-    err = allocate(ctx, &res, &prev, asize);
+    err = allocate(ctx, &res, asize, host);
     if (err != GA_NO_ERROR)
       FAIL(NULL, err);
   }
 
-  err = extract(res, prev, asize);
+  err = extract(res, asize);
   if (err != GA_NO_ERROR)
     FAIL(NULL, err);
+  if (!host) {
+    ctx->mem_used += res->sz;
+    if (ctx->mem_used > ctx->mem_peak)
+      ctx->mem_peak = ctx->mem_used;
+  }
   /* It's out of the freelist, so add a ref */
   res->ctx->refcnt++;
   /* We consider this buffer allocated and ready to go */
@@ -635,10 +775,6 @@ static void cuda_retain(gpudata *d) {
 }
 
 static void deallocate(gpudata *d) {
-  cuda_enter(d->ctx);
-  cuEventDestroy(d->rev);
-  cuEventDestroy(d->wev);
-  cuda_exit(d->ctx);
   CLEAR(d);
   free(d);
 }
@@ -659,41 +795,37 @@ static void cuda_free(gpudata *d) {
       deallocate(d);
     } else if (ctx->flags & GA_CTX_DISABLE_ALLOCATION_CACHE) {
       /* Just free the pointer */
-      cuMemFree(d->ptr);
+      if (!(d->flags & CUDA_HOST_ALLOC)) {
+        ctx->mem_used -= d->sz;
+        ctx->mem_reserved -= d->sz;
+      }
+      free_ptr(d);
       deallocate(d);
     } else {
-      /* Find the position in the freelist.  Freelist is kept in order
-         of allocation address */
-      gpudata *next = d->ctx->freeblocks, *prev = NULL;
-      for (; next && next->ptr < d->ptr; next = next->next) {
-        prev = next;
-      }
-      next = prev != NULL ? prev->next : d->ctx->freeblocks;
-
-      /* See if we can merge the block with the previous one */
-      if (!(d->flags & CUDA_HEAD_ALLOC) &&
-            prev != NULL && prev->ptr + prev->sz == d->ptr) {
-        prev->sz = prev->sz + d->sz;
-        cuda_waits(d, CUDA_WAIT_ALL, prev->ls);
-        cuda_records(prev, CUDA_WAIT_ALL, prev->ls);
-        deallocate(d);
-        d = prev;
-      } else if (prev != NULL) {
-        prev->next = d;
-      } else {
-        d->ctx->freeblocks = d;
-      }
-
-      /* See if we can merge with next */
-      if (next && !(next->flags & CUDA_HEAD_ALLOC) &&
-          d->ptr + d->sz == next->ptr) {
-        d->sz = d->sz + next->sz;
-        d->next = next->next;
-        cuda_wait(next, CUDA_WAIT_ALL);
-        cuda_record(d, CUDA_WAIT_ALL);
-        deallocate(next);
-      } else {
-        d->next = next;
+      /* Put it back in the freelist, merging with the neighbours */
+      fl_block *merged[2];
+      gpudata *res, *m;
+      int i;
+
+      if (!(d->flags & CUDA_HOST_ALLOC))
+        ctx->mem_used -= d->sz;
+      res = BLK_BUF(freelist_release((d->flags & CUDA_HOST_ALLOC) ?
+                                     ctx->hostblocks : ctx->freeblocks,
+                                     &d->blk, merged));
+      res->sz = res->blk.size;
+
+      for (i = 0; i < 2 && merged[i] != NULL; i++) {
+        m = BLK_BUF(merged[i]);
+        if (m == d) {
+          /* Merged with the previous one */
+          cuda_waits(d, CUDA_WAIT_ALL, res->ls);
+          cuda_records(res, CUDA_WAIT_ALL, res->ls);
+        } else {
+          /* Merged with the next one */
+          cuda_wait(m, CUDA_WAIT_ALL);
+          cuda_record(res, CUDA_WAIT_ALL);
+        }
+        deallocate(m);
       }
     }
     /* We keep this at the end since the freed buffer could be the
@@ -712,28 +844,143 @@ static int cuda_share(gpudata *a, gpudata *b, int *ret) {
            (b->ptr <= a->ptr && b->ptr + b->sz > a->ptr)));
 }
 
+static int get_event(cuda_context *ctx, CUevent *ev) {
+  if (ctx->nevpool > 0) {
+    *ev = ctx->evpool[--ctx->nevpool];
+    return GA_NO_ERROR;
+  }
+  ctx->err = cuEventCreate(ev, CU_EVENT_DISABLE_TIMING);
+  if (ctx->err != CUDA_SUCCESS)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+static void put_event(cuda_context *ctx, CUevent ev) {
+  if (ctx->nevpool < CUDA_EVPOOL_SIZE)
+    ctx->evpool[ctx->nevpool++] = ev;
+  else
+    cuEventDestroy(ev);
+}
+
+/*
+ * Make `s` wait for the work queued on `from` up to now.  The event
+ * can go back to the pool right away since a wait only depends on
+ * the record that came before it.
+ */
+static int stream_wait(cuda_context *ctx, CUstream s, CUstream from) {
+  CUevent ev;
+  int err;
+
+  err = get_event(ctx, &ev);
+  if (err != GA_NO_ERROR)
+    return err;
+  ctx->err = cuEventRecord(ev, from);
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuStreamWaitEvent(s, ev, 0);
+  put_event(ctx, ev);
+  if (ctx->err != CUDA_SUCCESS)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+static CUresult stream_sync(CUstream s) {
+  /* Never touched on that side */
+  if (s == NULL)
+    return CUDA_SUCCESS;
+  return cuStreamSynchronize(s);
+}
+
+/* Keep `b` alive as long as `g`, see "About graphs" */
+static int graph_pin(gpugraph *g, gpudata *b) {
+  gpudata **tmp;
+  unsigned int *ptmp;
+  size_t i, n;
+
+  for (i = g->nbufs; i > 0; i--) {
+    if (g->bufs[i - 1] == b) {
+      g->pins[i - 1]++;
+      return GA_NO_ERROR;
+    }
+  }
+  if (g->nbufs == g->abufs) {
+    n = g->abufs ? g->abufs * 2 : 16;
+    tmp = realloc(g->bufs, sizeof(*tmp) * n);
+    if (tmp == NULL)
+      return GA_MEMORY_ERROR;
+    g->bufs = tmp;
+    ptmp = realloc(g->pins, sizeof(*ptmp) * n);
+    if (ptmp == NULL)
+      return GA_MEMORY_ERROR;
+    g->pins = ptmp;
+    g->abufs = n;
+  }
+  b->refcnt++;
+  g->bufs[g->nbufs] = b;
+  g->pins[g->nbufs] = 1;
+  g->nbufs++;
+  return GA_NO_ERROR;
+}
+
+/* Drop one use of `b` by `g` and release it if it was the last */
+static void graph_unpin(gpugraph *g, gpudata *b) {
+  size_t i;
+
+  for (i = g->nbufs; i > 0; i--) {
+    if (g->bufs[i - 1] == b) {
+      if (--g->pins[i - 1] != 0)
+        return;
+      g->nbufs--;
+      g->bufs[i - 1] = g->bufs[g->nbufs];
+      g->pins[i - 1] = g->pins[g->nbufs];
+      cuda_free(b);
+      return;
+    }
+  }
+}
+
+/*
+ * Stream used for transfers.  During a capture they have to go on the
+ * captured stream since a wait between it and the memory stream
+ * would pull the latter into the capture.
+ */
+static CUstream mem_stream(cuda_context *ctx) {
+  return ctx->cap != NULL ? ctx->s : ctx->mem_s;
+}
+
 static int cuda_waits(gpudata *a, int flags, CUstream s) {
+  CUstream rs = a->rs, ws = a->ws;
   ASSERT_BUF(a);
 
+  /* Nothing runs during a capture */
+  if (a->ctx->cap != NULL && s == a->ctx->s)
+    return graph_pin(a->ctx->cap, a);
+
   /* Never skip the wait if CUDA_WAIT_FORCE */
   if (ISCLR(flags, CUDA_WAIT_FORCE)) {
     if (ISSET(a->ctx->flags, GA_CTX_SINGLE_STREAM))
       return GA_NO_ERROR;
 
-    /* If the last stream to touch this buffer is the same, we don't
-     * need to wait for anything. */
-    if (a->ls == s)
+    /* If the last stream to touch this buffer is the same, a read
+     * doesn't need to wait for anything.  Writes still have to wait
+     * for the reads on other streams. */
+    if (a->ls == s && ISCLR(flags, CUDA_WAIT_WRITE))
       return GA_NO_ERROR;
   }
 
+  /* Uses are not tracked in single stream contexts, but they all
+   * happened on the one stream */
+  if (ISSET(a->ctx->flags, GA_CTX_SINGLE_STREAM))
+    rs = ws = a->ctx->s;
+
   cuda_enter(a->ctx);
   /* We wait for writes that happened before since multiple reads at
    * the same time are fine */
-  if (ISSET(flags, CUDA_WAIT_READ) || ISSET(flags, CUDA_WAIT_WRITE))
-    CUDA_EXIT_ON_ERROR(a->ctx, cuStreamWaitEvent(s, a->wev, 0));
+  if ((ISSET(flags, CUDA_WAIT_READ) || ISSET(flags, CUDA_WAIT_WRITE)) &&
+      ws != NULL && ws != s)
+    GA_CUDA_EXIT_ON_ERROR(a->ctx, stream_wait(a->ctx, s, ws));
   /* Make sure to not disturb previous reads */
-  if (ISSET(flags, CUDA_WAIT_WRITE))
-    CUDA_EXIT_ON_ERROR(a->ctx, cuStreamWaitEvent(s, a->rev, 0));
+  if (ISSET(flags, CUDA_WAIT_WRITE) && rs != NULL && rs != s && rs != ws)
+    GA_CUDA_EXIT_ON_ERROR(a->ctx, stream_wait(a->ctx, s, rs));
   cuda_exit(a->ctx);
   return GA_NO_ERROR;
 }
@@ -743,16 +990,25 @@ int cuda_wait(gpudata *a, int flags) {
 }
 
 static int cuda_records(gpudata *a, int flags, CUstream s) {
+  CUstream rs = a->rs;
   ASSERT_BUF(a);
   if (ISCLR(flags, CUDA_WAIT_FORCE) &&
       ISSET(a->ctx->flags, GA_CTX_SINGLE_STREAM))
     return GA_NO_ERROR;
-  cuda_enter(a->ctx);
-  if (ISSET(flags, CUDA_WAIT_READ))
-    CUDA_EXIT_ON_ERROR(a->ctx, cuEventRecord(a->rev, s));
+  /* Nothing is recorded yet, see cuda_waits().  Only the last reader
+   * is remembered, so make it wait for the previous one to keep
+   * every pending read behind rs. */
+  if (ISSET(flags, CUDA_WAIT_READ)) {
+    if (rs != NULL && rs != s && rs != a->ws &&
+        !(a->ctx->cap != NULL && s == a->ctx->s)) {
+      cuda_enter(a->ctx);
+      GA_CUDA_EXIT_ON_ERROR(a->ctx, stream_wait(a->ctx, s, rs));
+      cuda_exit(a->ctx);
+    }
+    a->rs = s;
+  }
   if (ISSET(flags, CUDA_WAIT_WRITE))
-    CUDA_EXIT_ON_ERROR(a->ctx, cuEventRecord(a->wev, s));
-  cuda_exit(a->ctx);
+    a->ws = s;
   a->ls = s;
   return GA_NO_ERROR;
 }
@@ -793,8 +1049,18 @@ static int cuda_move(gpudata *dst, size_t dstoff, gpudata *src,
     return res;
 }
 
-static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
+/*
+ * Transfers with host memory go on the memory stream.  Unless `async`
+ * is set we wait for them to finish since the host memory could be
+ * page-locked, in which case the copy really is asynchronous.
+ *
+ * Buffers with a mapped pointer are accessed directly once the
+ * pending operations on them are done.
+ */
+static int read_buf(void *dst, gpudata *src, size_t srcoff, size_t sz,
+                    int async) {
     cuda_context *ctx = src->ctx;
+    CUstream s = mem_stream(ctx);
 
     ASSERT_BUF(src);
 
@@ -803,13 +1069,17 @@ static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
     if ((src->sz - srcoff) < sz)
         return GA_VALUE_ERROR;
 
+    /* The data would only be there when the graph is launched */
+    if (ctx->cap != NULL && (!async || (src->flags & CUDA_MAPPED_PTR)))
+      return GA_INVALID_ERROR;
+
     cuda_enter(ctx);
 
     if (src->flags & CUDA_MAPPED_PTR) {
       if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
         ctx->err = cuStreamSynchronize(ctx->s);
       else
-        ctx->err = cuEventSynchronize(src->wev);
+        ctx->err = stream_sync(src->ws);
       if (ctx->err != CUDA_SUCCESS) {
         cuda_exit(ctx);
         return GA_IMPL_ERROR;
@@ -817,21 +1087,34 @@ static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
       memcpy(dst, (void *)(src->ptr + srcoff), sz);
     } else {
       GA_CUDA_EXIT_ON_ERROR(ctx,
-          cuda_waits(src, CUDA_WAIT_READ, ctx->mem_s));
+          cuda_waits(src, CUDA_WAIT_READ, s));
 
       CUDA_EXIT_ON_ERROR(ctx,
-          cuMemcpyDtoHAsync(dst, src->ptr + srcoff, sz, ctx->mem_s));
+          cuMemcpyDtoHAsync(dst, src->ptr + srcoff, sz, s));
 
       GA_CUDA_EXIT_ON_ERROR(ctx,
-          cuda_records(src, CUDA_WAIT_READ, ctx->mem_s));
+          cuda_records(src, CUDA_WAIT_READ, s));
+
+      if (!async)
+        CUDA_EXIT_ON_ERROR(ctx, cuStreamSynchronize(s));
     }
     cuda_exit(ctx);
     return GA_NO_ERROR;
 }
 
-static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
-                      size_t sz) {
+static int cuda_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
+  return read_buf(dst, src, srcoff, sz, 0);
+}
+
+static int cuda_read_async(void *dst, gpudata *src, size_t srcoff,
+                           size_t sz) {
+  return read_buf(dst, src, srcoff, sz, 1);
+}
+
+static int write_buf(gpudata *dst, size_t dstoff, const void *src,
+                     size_t sz, int async) {
     cuda_context *ctx = dst->ctx;
+    CUstream s = mem_stream(ctx);
 
     ASSERT_BUF(dst);
 
@@ -840,13 +1123,21 @@ static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
     if ((dst->sz - dstoff) < sz)
         return GA_VALUE_ERROR;
 
+    /* Waiting for the copy would end the capture */
+    if (ctx->cap != NULL && (!async || (dst->flags & CUDA_MAPPED_PTR)))
+      return GA_INVALID_ERROR;
+
     cuda_enter(ctx);
 
     if (dst->flags & CUDA_MAPPED_PTR) {
-      if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
+      /* Both pending reads and writes must be done */
+      if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM)) {
         ctx->err = cuStreamSynchronize(ctx->s);
-      else
-        ctx->err = cuEventSynchronize(dst->rev);
+      } else {
+        ctx->err = stream_sync(dst->ws);
+        if (ctx->err == CUDA_SUCCESS)
+          ctx->err = stream_sync(dst->rs);
+      }
       if (ctx->err != CUDA_SUCCESS) {
         cuda_exit(ctx);
         return GA_IMPL_ERROR;
@@ -854,18 +1145,31 @@ static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
       memcpy((void *)(dst->ptr + dstoff), src, sz);
     } else {
       GA_CUDA_EXIT_ON_ERROR(ctx,
-          cuda_waits(dst, CUDA_WAIT_WRITE, ctx->mem_s));
+          cuda_waits(dst, CUDA_WAIT_WRITE, s));
 
       CUDA_EXIT_ON_ERROR(ctx,
-          cuMemcpyHtoDAsync(dst->ptr + dstoff, src, sz, ctx->mem_s));
+          cuMemcpyHtoDAsync(dst->ptr + dstoff, src, sz, s));
 
       GA_CUDA_EXIT_ON_ERROR(ctx,
-          cuda_records(dst, CUDA_WAIT_WRITE, ctx->mem_s));
+          cuda_records(dst, CUDA_WAIT_WRITE, s));
+
+      if (!async)
+        CUDA_EXIT_ON_ERROR(ctx, cuStreamSynchronize(s));
     }
     cuda_exit(ctx);
     return GA_NO_ERROR;
 }
 
+static int cuda_write(gpudata *dst, size_t dstoff, const void *src,
+                      size_t sz) {
+  return write_buf(dst, dstoff, src, sz, 0);
+}
+
+static int cuda_write_async(gpudata *dst, size_t dstoff, const void *src,
+                            size_t sz) {
+  return write_buf(dst, dstoff, src, sz, 1);
+}
+
 static int cuda_memset(gpudata *dst, size_t dstoff, int data) {
     cuda_context *ctx = dst->ctx;
 
@@ -974,9 +1278,23 @@ end:
   return buf;
 }
 
+/*
+ * Key for the disk cache.  This has everything that can change the
+ * output of call_compiler() for the source in `src`.
+ */
+static int make_bin_key(cuda_context *ctx, strb *key, strb *src) {
+  strb_appendf(key, "%s %d %d.%d", ctx->bin_id, drv_ver,
+               nvrtc_major, nvrtc_minor);
+#ifdef DEBUG
+  strb_appends(key, " -G -lineinfo");
+#endif
+  strb_append0(key);
+  strb_appendb(key, src);
+  return strb_error(key);
+}
+
 static void _cuda_freekernel(gpukernel *k) {
-  k->refcnt--;
-  if (k->refcnt == 0) {
+  if (ga_ref_dec(&k->refcnt) == 0) {
     if (k->ctx != NULL) {
       cuda_enter(k->ctx);
       cuModuleUnload(k->m);
@@ -987,6 +1305,8 @@ static void _cuda_freekernel(gpukernel *k) {
     free(k->args);
     free(k->bin);
     free(k->types);
+    free(k->access);
+    free(k->name);
     free(k);
   }
 }
@@ -994,12 +1314,13 @@ static void _cuda_freekernel(gpukernel *k) {
 static gpukernel *cuda_newkernel(gpucontext *c, unsigned int count,
                                  const char **strings, const size_t *lengths,
                                  const char *fname, unsigned int argcount,
-                                 const int *types, int flags, int *ret,
-                                 char **err_str) {
+                                 const int *types, const int *access,
+                                 int flags, int *ret, char **err_str) {
     cuda_context *ctx = (cuda_context *)c;
     strb sb = STRB_STATIC_INIT;
-    strb *psb;
-    char *bin, *log = NULL;
+    strb bkey = STRB_STATIC_INIT;
+    strb *psb, *bsb;
+    char *bin = NULL, *log = NULL;
     gpukernel *res;
     size_t bin_len = 0, log_len = 0;
     CUdevice dev;
@@ -1096,15 +1417,31 @@ static gpukernel *cuda_newkernel(gpucontext *c, unsigned int count,
         FAIL(NULL, GA_MEMORY_ERROR);
       }
 
+      /* The cache takes a reference for us */
       res = (gpukernel *)cache_get(ctx->kernel_cache, &sb);
       if (res != NULL) {
-        res->refcnt++;
+        gpukernel_merge_access(res->access, argcount, types, access);
         strb_clear(&sb);
         return res;
       }
-      bin = call_compiler(sb.s, sb.l, ctx->bin_id, &bin_len,
-                          &log, &log_len, ret);
+
+      /* Binaries from the disk cache go through the same path as
+         GA_USE_BINARY */
+      if (disk_cache != NULL && make_bin_key(ctx, &bkey, &sb) == 0) {
+        bsb = gpukernel_disk_cache_get(disk_cache, &bkey);
+        if (bsb != NULL) {
+          bin = memdup(bsb->s, bsb->l);
+          bin_len = bsb->l;
+          strb_free(bsb);
+        }
+      }
+      if (bin == NULL)
+        bin = call_compiler(sb.s, sb.l, ctx->bin_id, &bin_len,
+                            &log, &log_len, ret);
+      else
+        strb_clear(&bkey);
       if (bin == NULL) {
+        strb_clear(&bkey);
         if (err_str != NULL) {
 
           // We're substituting debug_msg for a string with this first line:
@@ -1127,6 +1464,22 @@ static gpukernel *cuda_newkernel(gpucontext *c, unsigned int count,
         cuda_exit(ctx);
         FAIL(NULL, GA_IMPL_ERROR);
       }
+      if (bkey.l != 0) {
+        /* Save it for the next processes, failures are ignored */
+        psb = memdup(&bkey, sizeof(strb));
+        if (psb == NULL) {
+          strb_clear(&bkey);
+        } else {
+          bsb = strb_alloc(bin_len);
+          if (bsb == NULL) {
+            strb_free(psb);
+          } else {
+            memcpy(bsb->s, bin, bin_len);
+            bsb->l = bin_len;
+            gpukernel_disk_cache_add(disk_cache, psb, bsb);
+          }
+        }
+      }
     }
 
     res = calloc(1, sizeof(*res));
@@ -1150,8 +1503,17 @@ static gpukernel *cuda_newkernel(gpucontext *c, unsigned int count,
       FAIL(NULL, GA_MEMORY_ERROR);
     }
     memcpy(res->types, types, argcount*sizeof(int));
+    res->access = calloc(argcount, sizeof(int));
+    if (res->access == NULL) {
+      _cuda_freekernel(res);
+      strb_clear(&sb);
+      cuda_exit(ctx);
+      FAIL(NULL, GA_MEMORY_ERROR);
+    }
+    gpukernel_merge_access(res->access, argcount, types, access);
+    res->name = strdup(fname);
     res->args = calloc(argcount, sizeof(void *));
-    if (res->args == NULL) {
+    if (res->name == NULL || res->args == NULL) {
       _cuda_freekernel(res);
       strb_clear(&sb);
       cuda_exit(ctx);
@@ -1225,7 +1587,7 @@ static gpukernel *cuda_newkernel(gpucontext *c, unsigned int count,
 
 static void cuda_retainkernel(gpukernel *k) {
   ASSERT_KER(k);
-  k->refcnt++;
+  ga_ref_inc(&k->refcnt);
 }
 
 static void cuda_freekernel(gpukernel *k) {
@@ -1240,6 +1602,64 @@ static int cuda_kernelsetarg(gpukernel *k, unsigned int i, void *arg) {
   return GA_NO_ERROR;
 }
 
+/* Map the kernel argument access flags to the ones for cuda_wait() */
+static int access_flags(int access) {
+  int res = 0;
+  if (access & GA_ARG_READ)
+    res |= CUDA_WAIT_READ;
+  if (access & GA_ARG_WRITE)
+    res |= CUDA_WAIT_WRITE;
+  return res;
+}
+
+/*
+ * Remember the kernel launch that was just captured.  Its node is the
+ * one the next captured operation would depend on.
+ */
+static int graph_addkernel(gpugraph *g, gpukernel *k, unsigned int n,
+                           const size_t *gs, const size_t *ls,
+                           size_t shared, void **args) {
+  cuda_context *ctx = g->ctx;
+  cuda_graph_kernel *tmp;
+  CUstreamCaptureStatus status;
+  const CUgraphNode *deps;
+  size_t ndeps;
+  unsigned int i;
+
+  ctx->err = cuStreamGetCaptureInfo(ctx->s, &status, NULL, NULL, &deps,
+                                    &ndeps);
+  if (ctx->err != CUDA_SUCCESS)
+    return GA_IMPL_ERROR;
+  if (status != CU_STREAM_CAPTURE_STATUS_ACTIVE || ndeps != 1)
+    return GA_IMPL_ERROR;
+
+  if (g->nkers == g->akers) {
+    tmp = realloc(g->kers, sizeof(*tmp) * (g->akers ? g->akers * 2 : 8));
+    if (tmp == NULL)
+      return GA_MEMORY_ERROR;
+    g->kers = tmp;
+    g->akers = g->akers ? g->akers * 2 : 8;
+  }
+  tmp = &g->kers[g->nkers];
+  tmp->bufs = calloc(k->argcount ? k->argcount : 1, sizeof(gpudata *));
+  if (tmp->bufs == NULL)
+    return GA_MEMORY_ERROR;
+  /* They were pinned by the waits before the launch */
+  for (i = 0; i < k->argcount; i++)
+    if (k->types[i] == GA_BUFFER)
+      tmp->bufs[i] = (gpudata *)args[i];
+  g->nkers++;
+  tmp->node = deps[0];
+  for (i = 0; i < 3; i++) {
+    tmp->gs[i] = i < n ? gs[i] : 1;
+    tmp->ls[i] = i < n ? ls[i] : 1;
+  }
+  tmp->shared = shared;
+  cuda_retainkernel(k);
+  tmp->k = k;
+  return GA_NO_ERROR;
+}
+
 static int cuda_callkernel(gpukernel *k, unsigned int n,
                            const size_t *gs, const size_t *ls,
                            size_t shared, void **args) {
@@ -1254,9 +1674,8 @@ static int cuda_callkernel(gpukernel *k, unsigned int n,
 
     for (i = 0; i < k->argcount; i++) {
       if (k->types[i] == GA_BUFFER) {
-        /* We don't have any better info for now */
         GA_CUDA_EXIT_ON_ERROR(ctx,
-            cuda_wait((gpudata *)args[i], CUDA_WAIT_ALL));
+            cuda_wait((gpudata *)args[i], access_flags(k->access[i])));
       }
     }
 
@@ -1282,11 +1701,14 @@ static int cuda_callkernel(gpukernel *k, unsigned int n,
       return GA_IMPL_ERROR;
     }
 
+    if (ctx->cap != NULL)
+      GA_CUDA_EXIT_ON_ERROR(ctx, graph_addkernel(ctx->cap, k, n, gs, ls,
+                                                 shared, args));
+
     for (i = 0; i < k->argcount; i++) {
       if (k->types[i] == GA_BUFFER) {
-        /* We don't have any better info for now */
         GA_CUDA_EXIT_ON_ERROR(ctx,
-            cuda_record((gpudata *)args[i], CUDA_WAIT_ALL));
+            cuda_record((gpudata *)args[i], access_flags(k->access[i])));
       }
     }
 
@@ -1313,10 +1735,10 @@ static int cuda_sync(gpudata *b) {
   if (ctx->flags & GA_CTX_SINGLE_STREAM) {
     cuStreamSynchronize(ctx->s);
   } else {
-    ctx->err = cuEventSynchronize(b->wev);
+    ctx->err = stream_sync(b->ws);
     if (ctx->err != CUDA_SUCCESS)
       err = GA_IMPL_ERROR;
-    ctx->err = cuEventSynchronize(b->rev);
+    ctx->err = stream_sync(b->rs);
     if (ctx->err != CUDA_SUCCESS)
       err = GA_IMPL_ERROR;
   }
@@ -1324,41 +1746,72 @@ static int cuda_sync(gpudata *b) {
   return err;
 }
 
+static CUresult stream_query(CUstream s) {
+  if (s == NULL)
+    return CUDA_SUCCESS;
+  return cuStreamQuery(s);
+}
+
+static int cuda_query(gpudata *b, int *done) {
+  cuda_context *ctx = (cuda_context *)b->ctx;
+
+  ASSERT_BUF(b);
+  cuda_enter(ctx);
+  if (ctx->flags & GA_CTX_SINGLE_STREAM) {
+    ctx->err = cuStreamQuery(ctx->s);
+  } else {
+    ctx->err = stream_query(b->ws);
+    if (ctx->err == CUDA_SUCCESS)
+      ctx->err = stream_query(b->rs);
+  }
+  cuda_exit(ctx);
+  *done = ctx->err == CUDA_SUCCESS;
+  if (ctx->err != CUDA_SUCCESS && ctx->err != CUDA_ERROR_NOT_READY)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
 static int cuda_transfer(gpudata *dst, size_t dstoff,
                          gpudata *src, size_t srcoff, size_t sz) {
+  CUstream ss, ds;
+
   ASSERT_BUF(src);
   ASSERT_BUF(dst);
 
   /* The forced synchronization are there because they are required
      for proper inter-device correctness. */
 
+  /* These are the memory streams, see mem_stream() */
+  ss = mem_stream(src->ctx);
+  ds = mem_stream(dst->ctx);
+
   cuda_enter(dst->ctx);
-  /* Make sure we have a rev for the source */
+  /* Mark the source as read on its memory stream */
   GA_CUDA_EXIT_ON_ERROR(dst->ctx,
-      cuda_records(src, CUDA_WAIT_READ|CUDA_WAIT_FORCE, src->ctx->mem_s));
+      cuda_records(src, CUDA_WAIT_READ|CUDA_WAIT_FORCE, ss));
   /* Make the destination stream wait for it */
   GA_CUDA_EXIT_ON_ERROR(dst->ctx,
-      cuda_waits(src, CUDA_WAIT_READ|CUDA_WAIT_FORCE, dst->ctx->mem_s));
+      cuda_waits(src, CUDA_WAIT_READ|CUDA_WAIT_FORCE, ds));
 
   /* Also wait on the destination buffer */
   GA_CUDA_EXIT_ON_ERROR(dst->ctx,
-      cuda_waits(dst, CUDA_WAIT_WRITE, dst->ctx->mem_s));
+      cuda_waits(dst, CUDA_WAIT_WRITE, ds));
 
   CUDA_EXIT_ON_ERROR(dst->ctx,
       cuMemcpyPeerAsync(dst->ptr+dstoff, dst->ctx->ctx,
                         src->ptr+srcoff, src->ctx->ctx,
-                        sz, dst->ctx->mem_s));
+                        sz, ds));
 
-  /* This records the event in dst->wev */
+  /* This marks dst as written on its memory stream */
   GA_CUDA_EXIT_ON_ERROR(dst->ctx,
-      cuda_records(dst, CUDA_WAIT_WRITE|CUDA_WAIT_FORCE, dst->ctx->mem_s));
-  /* This makes the source stream wait on the wev of dst */
+      cuda_records(dst, CUDA_WAIT_WRITE|CUDA_WAIT_FORCE, ds));
+  /* This makes the source stream wait on the write to dst */
   GA_CUDA_EXIT_ON_ERROR(dst->ctx,
-      cuda_waits(dst, CUDA_WAIT_WRITE|CUDA_WAIT_FORCE, src->ctx->mem_s));
+      cuda_waits(dst, CUDA_WAIT_WRITE|CUDA_WAIT_FORCE, ss));
 
-  /* This records the event on src->rev */
+  /* This marks the source as read on its memory stream */
   GA_CUDA_EXIT_ON_ERROR(dst->ctx,
-      cuda_records(src, CUDA_WAIT_READ, src->ctx->mem_s));
+      cuda_records(src, CUDA_WAIT_READ, ss));
 
   cuda_exit(dst->ctx);
   return GA_NO_ERROR;
@@ -1420,7 +1873,37 @@ static int cuda_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     return (ctx->err != CUDA_SUCCESS) ? GA_IMPL_ERROR : GA_NO_ERROR;
 
   case GA_CTX_PROP_LARGEST_MEMBLOCK:
-    *((size_t *)res) = largest_size(ctx);
+    return largest_size(ctx, (size_t *)res, 0);
+
+  case GA_CTX_PROP_LARGEST_MEMBLOCK_PROBED:
+    return largest_size(ctx, (size_t *)res, 1);
+
+  case GA_CTX_PROP_MEM_RESERVED:
+    *((size_t *)res) = ctx->mem_reserved;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_USED:
+    *((size_t *)res) = ctx->mem_used;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_PEAK:
+    *((size_t *)res) = ctx->mem_peak;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_CACHED:
+    *((size_t *)res) = ctx->freeblocks->free_bytes;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_FRAGMENTS:
+    *((size_t *)res) = ctx->freeblocks->nfree;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_LARGEST_CACHED:
+    *((size_t *)res) = freelist_largest(ctx->freeblocks);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_NUM_ALLOCS:
+    *((size_t *)res) = ctx->mem_nallocs;
     return GA_NO_ERROR;
 
   case GA_CTX_PROP_MAXLSIZE:
@@ -1525,6 +2008,13 @@ static int cuda_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     cuda_exit(ctx);
     return ctx->err == CUDA_SUCCESS ? GA_NO_ERROR : GA_IMPL_ERROR;
 
+  case GA_CTX_PROP_KERNEL_CACHE_HITS:
+  case GA_CTX_PROP_KERNEL_CACHE_MISSES:
+  case GA_CTX_PROP_KERNEL_CACHE_EVICTIONS:
+  case GA_CTX_PROP_KERNEL_CACHE_BYTES:
+    *((size_t *)res) = gpucontext_cache_stat(ctx->kernel_cache, prop_id);
+    return GA_NO_ERROR;
+
   case GA_CTX_PROP_NATIVE_FLOAT16:
     /* We claim that nobody supports this for now */
     *((int *)res) = 0;
@@ -1634,6 +2124,12 @@ static int cuda_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = buf->sz;
     return GA_NO_ERROR;
 
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    if (!(buf->flags & CUDA_HOST_ALLOC))
+      return GA_VALUE_ERROR;
+    *((void **)res) = (void *)buf->ptr;
+    return GA_NO_ERROR;
+
   case GA_BUFFER_PROP_CTX:
   case GA_KERNEL_PROP_CTX:
     *((gpucontext **)res) = (gpucontext *)ctx;
@@ -1674,6 +2170,18 @@ static int cuda_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((const int **)res) = k->types;
     return GA_NO_ERROR;
 
+  case GA_KERNEL_PROP_ACCESS:
+    *((const int **)res) = k->access;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_NAME:
+    *((const char **)res) = k->name;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_BINSIZE:
+    *((size_t *)res) = k->bin_sz;
+    return GA_NO_ERROR;
+
   default:
     return GA_INVALID_ERROR;
   }
@@ -1689,6 +2197,323 @@ static const char *cuda_error(gpucontext *c) {
   return errstr;
 }
 
+static int cuda_stream_set(gpucontext *c, gpustream *s) {
+  cuda_context *ctx = (cuda_context *)c;
+
+  ASSERT_CTX(ctx);
+  if (ctx->cap != NULL)
+    return GA_INVALID_ERROR;
+  ctx->s = s == NULL ? ctx->def_s : s->s;
+  ctx->stream = s;
+  if (ctx->blas_handle != NULL && ctx->blas_ops->set_stream != NULL)
+    return ctx->blas_ops->set_stream(c);
+  return GA_NO_ERROR;
+}
+
+static gpustream *cuda_stream_alloc(gpucontext *c, int flags, int *ret) {
+  cuda_context *ctx = (cuda_context *)c;
+  gpustream *res;
+
+  ASSERT_CTX(ctx);
+  if (flags != 0)
+    FAIL(NULL, GA_INVALID_ERROR);
+  if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
+    FAIL(NULL, GA_UNSUPPORTED_ERROR);
+
+  if (ctx->spool != NULL) {
+    res = ctx->spool;
+    ctx->spool = res->next;
+  } else {
+    res = calloc(1, sizeof(*res));
+    if (res == NULL)
+      FAIL(NULL, GA_MEMORY_ERROR);
+    cuda_enter(ctx);
+    /* Same as the default stream */
+    ctx->err = cuStreamCreate(&res->s, 0);
+    cuda_exit(ctx);
+    if (ctx->err != CUDA_SUCCESS) {
+      free(res);
+      FAIL(NULL, GA_IMPL_ERROR);
+    }
+  }
+  res->ctx = ctx;
+  res->refcnt = 1;
+  res->next = NULL;
+  ctx->refcnt++;
+  TAG_STR(res);
+  return res;
+}
+
+static void cuda_stream_retain(gpustream *s) {
+  ASSERT_STR(s);
+  s->refcnt++;
+}
+
+static void cuda_stream_release(gpustream *s) {
+  cuda_context *ctx = s->ctx;
+
+  ASSERT_STR(s);
+  s->refcnt--;
+  if (s->refcnt == 0) {
+    if (ctx->stream == s)
+      cuda_stream_set((gpucontext *)ctx, NULL);
+    CLEAR(s);
+    s->next = ctx->spool;
+    ctx->spool = s;
+    cuda_free_ctx(ctx);
+  }
+}
+
+static int cuda_stream_sync(gpustream *s) {
+  cuda_context *ctx = s->ctx;
+
+  ASSERT_STR(s);
+  cuda_enter(ctx);
+  CUDA_EXIT_ON_ERROR(ctx, cuStreamSynchronize(s->s));
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
+static void cuda_graph_release(gpugraph *g);
+
+static int cuda_capture_begin(gpucontext *c) {
+  cuda_context *ctx = (cuda_context *)c;
+  gpugraph *res;
+
+  ASSERT_CTX(ctx);
+  if (cuStreamBeginCapture == NULL || cuStreamEndCapture == NULL ||
+      cuStreamGetCaptureInfo == NULL || cuGraphInstantiateWithFlags == NULL ||
+      cuGraphLaunch == NULL || cuGraphExecKernelNodeSetParams == NULL ||
+      cuGraphExecDestroy == NULL || cuGraphDestroy == NULL)
+    return GA_UNSUPPORTED_ERROR;
+  if (ctx->cap != NULL)
+    return GA_INVALID_ERROR;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    return GA_MEMORY_ERROR;
+  res->ctx = ctx;
+
+  cuda_enter(ctx);
+  /* The waits across streams are skipped during the capture */
+  ctx->err = cuCtxSynchronize();
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuStreamBeginCapture(ctx->s, CU_STREAM_CAPTURE_MODE_RELAXED);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS) {
+    free(res);
+    return GA_IMPL_ERROR;
+  }
+  TAG_GRA(res);
+  ctx->refcnt++;
+  ctx->cap = res;
+  return GA_NO_ERROR;
+}
+
+static gpugraph *cuda_capture_end(gpucontext *c, int *ret) {
+  cuda_context *ctx = (cuda_context *)c;
+  gpugraph *res;
+
+  ASSERT_CTX(ctx);
+  if (ctx->cap == NULL)
+    FAIL(NULL, GA_INVALID_ERROR);
+  res = ctx->cap;
+  ctx->cap = NULL;
+
+  cuda_enter(ctx);
+  /* This ends the capture even if it was invalidated by an error */
+  ctx->err = cuStreamEndCapture(ctx->s, &res->g);
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuGraphInstantiateWithFlags(&res->e, res->g, 0);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS) {
+    cuda_graph_release(res);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  return res;
+}
+
+static int cuda_graph_launch(gpugraph *g) {
+  cuda_context *ctx = g->ctx;
+  size_t i;
+
+  ASSERT_GRA(g);
+  cuda_enter(ctx);
+  for (i = 0; i < g->nbufs; i++)
+    GA_CUDA_EXIT_ON_ERROR(ctx, cuda_waits(g->bufs[i], CUDA_WAIT_ALL,
+                                          ctx->s));
+  CUDA_EXIT_ON_ERROR(ctx, cuGraphLaunch(g->e, ctx->s));
+  for (i = 0; i < g->nbufs; i++)
+    GA_CUDA_EXIT_ON_ERROR(ctx, cuda_records(g->bufs[i], CUDA_WAIT_ALL,
+                                            ctx->s));
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
+static unsigned int cuda_graph_numkernels(gpugraph *g) {
+  ASSERT_GRA(g);
+  return g->nkers;
+}
+
+static int cuda_graph_setargs(gpugraph *g, unsigned int n,
+                              unsigned int nargs, const int *types,
+                              void **args) {
+  cuda_context *ctx = g->ctx;
+  CUDA_KERNEL_NODE_PARAMS p;
+  cuda_graph_kernel *gk;
+  unsigned int i, j;
+
+  ASSERT_GRA(g);
+  if (n >= g->nkers)
+    return GA_VALUE_ERROR;
+  gk = &g->kers[n];
+  if (nargs != gk->k->argcount)
+    return GA_VALUE_ERROR;
+  for (i = 0; i < nargs; i++) {
+    if (types[i] != gk->k->types[i] || args[i] == NULL)
+      return GA_VALUE_ERROR;
+    if (types[i] == GA_BUFFER && ((gpudata *)args[i])->ctx != ctx)
+      return GA_VALUE_ERROR;
+  }
+  for (i = 0; i < nargs; i++) {
+    if (types[i] == GA_BUFFER &&
+        graph_pin(g, (gpudata *)args[i]) != GA_NO_ERROR) {
+      for (j = 0; j < i; j++)
+        if (types[j] == GA_BUFFER)
+          graph_unpin(g, (gpudata *)args[j]);
+      return GA_MEMORY_ERROR;
+    }
+  }
+
+  p.func = gk->k->k;
+  p.gridDimX = gk->gs[0];
+  p.gridDimY = gk->gs[1];
+  p.gridDimZ = gk->gs[2];
+  p.blockDimX = gk->ls[0];
+  p.blockDimY = gk->ls[1];
+  p.blockDimZ = gk->ls[2];
+  p.sharedMemBytes = gk->shared;
+  p.kernelParams = args;
+  p.extra = NULL;
+
+  cuda_enter(ctx);
+  /* The values are copied so `args` doesn't have to stay around */
+  ctx->err = cuGraphExecKernelNodeSetParams(g->e, gk->node, &p);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS) {
+    for (i = 0; i < nargs; i++)
+      if (types[i] == GA_BUFFER)
+        graph_unpin(g, (gpudata *)args[i]);
+    return GA_IMPL_ERROR;
+  }
+  /* The previous buffers are not used by this launch anymore */
+  for (i = 0; i < nargs; i++) {
+    if (types[i] == GA_BUFFER) {
+      graph_unpin(g, gk->bufs[i]);
+      gk->bufs[i] = (gpudata *)args[i];
+    }
+  }
+  return GA_NO_ERROR;
+}
+
+static void cuda_graph_release(gpugraph *g) {
+  cuda_context *ctx = g->ctx;
+  size_t i;
+
+  ASSERT_GRA(g);
+  cuda_enter(ctx);
+  if (g->e != NULL)
+    cuGraphExecDestroy(g->e);
+  if (g->g != NULL)
+    cuGraphDestroy(g->g);
+  cuda_exit(ctx);
+  for (i = 0; i < g->nkers; i++) {
+    cuda_freekernel(g->kers[i].k);
+    free(g->kers[i].bufs);
+  }
+  for (i = 0; i < g->nbufs; i++)
+    cuda_free(g->bufs[i]);
+  free(g->kers);
+  free(g->bufs);
+  free(g->pins);
+  CLEAR(g);
+  free(g);
+  cuda_free_ctx(ctx);
+}
+
+typedef struct _cuda_timer {
+  CUevent start;
+  CUevent end;
+} cuda_timer;
+
+static void cuda_timer_release(gpucontext *c, void *t) {
+  cuda_context *ctx = (cuda_context *)c;
+  cuda_timer *tm = (cuda_timer *)t;
+
+  cuda_enter(ctx);
+  if (tm->start != NULL)
+    cuEventDestroy(tm->start);
+  if (tm->end != NULL)
+    cuEventDestroy(tm->end);
+  cuda_exit(ctx);
+  free(tm);
+}
+
+static int cuda_timer_start(gpucontext *c, void **t) {
+  cuda_context *ctx = (cuda_context *)c;
+  cuda_timer *res;
+
+  ASSERT_CTX(ctx);
+  /* The events would be recorded in the graph */
+  if (ctx->cap != NULL)
+    return GA_INVALID_ERROR;
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    return GA_MEMORY_ERROR;
+  cuda_enter(ctx);
+  ctx->err = cuEventCreate(&res->start, CU_EVENT_DEFAULT);
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuEventCreate(&res->end, CU_EVENT_DEFAULT);
+  if (ctx->err == CUDA_SUCCESS)
+    ctx->err = cuEventRecord(res->start, ctx->s);
+  cuda_exit(ctx);
+  if (ctx->err != CUDA_SUCCESS) {
+    cuda_timer_release(c, res);
+    return GA_IMPL_ERROR;
+  }
+  *t = res;
+  return GA_NO_ERROR;
+}
+
+static int cuda_timer_stop(gpucontext *c, gpukernel *k, void *t) {
+  cuda_context *ctx = (cuda_context *)c;
+  cuda_timer *tm = (cuda_timer *)t;
+
+  ASSERT_CTX(ctx);
+  cuda_enter(ctx);
+  CUDA_EXIT_ON_ERROR(ctx, cuEventRecord(tm->end, ctx->s));
+  cuda_exit(ctx);
+  return GA_NO_ERROR;
+}
+
+static int cuda_timer_read(gpucontext *c, void *ref, void *t,
+                           double *start, double *end) {
+  cuda_context *ctx = (cuda_context *)c;
+  cuda_timer *r = (cuda_timer *)ref;
+  cuda_timer *tm = (cuda_timer *)t;
+  float s, e;
+
+  ASSERT_CTX(ctx);
+  cuda_enter(ctx);
+  CUDA_EXIT_ON_ERROR(ctx, cuEventSynchronize(tm->end));
+  CUDA_EXIT_ON_ERROR(ctx, cuEventElapsedTime(&s, r->end, tm->start));
+  CUDA_EXIT_ON_ERROR(ctx, cuEventElapsedTime(&e, r->end, tm->end));
+  cuda_exit(ctx);
+  *start = (double)s * 1e6;
+  *end = (double)e * 1e6;
+  return GA_NO_ERROR;
+}
+
 GPUARRAY_LOCAL
 const gpuarray_buffer_ops cuda_ops = {cuda_get_platform_count,
                                       cuda_get_device_count,
@@ -1711,4 +2536,23 @@ const gpuarray_buffer_ops cuda_ops = {cuda_get_platform_count,
                                       cuda_sync,
                                       cuda_transfer,
                                       cuda_property,
-                                      cuda_error};
+                                      cuda_error,
+                                      cuda_stream_alloc,
+                                      cuda_stream_retain,
+                                      cuda_stream_release,
+                                      cuda_stream_sync,
+                                      cuda_stream_set,
+                                      cuda_read_async,
+                                      cuda_write_async,
+                                      cuda_query,
+                                      cuda_trim,
+                                      cuda_capture_begin,
+                                      cuda_capture_end,
+                                      cuda_graph_launch,
+                                      cuda_graph_numkernels,
+                                      cuda_graph_setargs,
+                                      cuda_graph_release,
+                                      cuda_timer_start,
+                                      cuda_timer_stop,
+                                      cuda_timer_read,
+                                      cuda_timer_release};
@@ -0,0 +1,1489 @@
+#include "private.h"
+#include "private_host.h"
+#include "loaders/dyn_load.h"
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+#include <cache.h>
+
+#include "util/lock.h"
+#include "util/strb.h"
+#include "util/xxhash.h"
+
+#include "gpuarray/buffer.h"
+#include "gpuarray/util.h"
+#include "gpuarray/error.h"
+
+/* Returned allocations will be aligned to this size. */
+#define ALIGN_SIZE (64)
+
+/* Stack size for each work-item of kernels that use local_barrier() */
+#define ITEM_STACK_SIZE (64 * 1024)
+
+/* Limits advertised for kernels */
+#define HOST_MAXLSIZE 1024
+#define HOST_MAXLSIZE_BARRIER 256
+#define HOST_LMEMSIZE (64 * 1024)
+#define HOST_MAXGSIZE 2147483647
+
+GPUARRAY_LOCAL const gpuarray_buffer_ops host_ops;
+
+static void host_freekernel(gpukernel *);
+static void host_retainkernel(gpukernel *);
+static int host_property(gpucontext *, gpudata *, gpukernel *, int, void *);
+
+static int strb_eq(void *_k1, void *_k2) {
+  strb *k1 = (strb *)_k1;
+  strb *k2 = (strb *)_k2;
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+/* The source and the shared object */
+static size_t kernel_cost(void *k, void *v) {
+  return ((strb *)k)->l + ((gpukernel *)v)->bin_sz;
+}
+
+static uint64_t strb_hash(void *_k) {
+  strb *k = (strb *)_k;
+  return XXH64(k->s, k->l, 42);
+}
+
+#define FAIL(v, e) { if (ret) *ret = e; return v; }
+
+static int disk_cache_done = 0;
+static cache *disk_cache = NULL;
+/* Contexts may be created from many threads at once */
+static ga_lock_t setup_lock = GA_LOCK_INITIALIZER;
+
+/*
+ * Thread pool
+ *
+ * Worker 0 is always the calling thread, the other ones have their
+ * own pthread.  A call is published by bumping `gen` and every worker
+ * then grabs chunks of work-groups from `next` until they run out.
+ */
+
+typedef struct _host_item {
+  host_workitem wi; /* Keep this first */
+  ucontext_t uc;
+  struct _host_worker *w;
+  int done;
+} host_item;
+
+typedef struct _host_worker {
+  host_pool *pool;
+  pthread_t th;
+  ucontext_t sched;
+  host_item *items;
+  char *stacks;
+  size_t nitems;
+  char *lmem;
+  size_t lmem_sz;
+} host_worker;
+
+struct _host_pool {
+  pthread_mutex_t call_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  host_worker *workers;
+  unsigned int nthreads;
+  unsigned int busy;
+  unsigned long gen;
+  int stop;
+  /* Current call */
+  gpukernel *k;
+  void **args;
+  size_t gs[3];
+  size_t ls[3];
+  size_t ngroups;
+  size_t chunk;
+  size_t next;
+};
+
+static __thread host_item *cur_item;
+
+static void host_barrier(host_workitem *wi) {
+  host_item *it = (host_item *)wi;
+  swapcontext(&it->uc, &it->w->sched);
+}
+
+static void item_start(void) {
+  host_item *it = cur_item;
+  it->w->pool->k->item(&it->wi, it->w->pool->args);
+  it->done = 1;
+  /* Returns to it->w->sched through uc_link */
+}
+
+static void init_wi(host_workitem *wi, host_worker *w, size_t g) {
+  host_pool *p = w->pool;
+  unsigned int i;
+
+  for (i = 0; i < 3; i++) {
+    wi->lid[i] = 0;
+    wi->ldim[i] = p->ls[i];
+    wi->gdim[i] = p->gs[i];
+  }
+  wi->gid[0] = g % p->gs[0];
+  wi->gid[1] = (g / p->gs[0]) % p->gs[1];
+  wi->gid[2] = g / (p->gs[0] * p->gs[1]);
+  wi->lmem = w->lmem;
+  wi->barrier = host_barrier;
+}
+
+static void run_group_barrier(host_worker *w, size_t g) {
+  host_pool *p = w->pool;
+  size_t n = p->ls[0] * p->ls[1] * p->ls[2];
+  size_t i, left;
+  host_item *it;
+
+  for (i = 0; i < n; i++) {
+    it = &w->items[i];
+    init_wi(&it->wi, w, g);
+    it->wi.lid[0] = i % p->ls[0];
+    it->wi.lid[1] = (i / p->ls[0]) % p->ls[1];
+    it->wi.lid[2] = i / (p->ls[0] * p->ls[1]);
+    it->w = w;
+    it->done = 0;
+    getcontext(&it->uc);
+    it->uc.uc_stack.ss_sp = w->stacks + i * ITEM_STACK_SIZE;
+    it->uc.uc_stack.ss_size = ITEM_STACK_SIZE;
+    it->uc.uc_link = &w->sched;
+    makecontext(&it->uc, item_start, 0);
+  }
+
+  /* Round-robin between the work-items, each one runs until its
+     next barrier (or its end). */
+  left = n;
+  while (left != 0) {
+    for (i = 0; i < n; i++) {
+      it = &w->items[i];
+      if (it->done)
+        continue;
+      cur_item = it;
+      swapcontext(&w->sched, &it->uc);
+      if (it->done)
+        left--;
+    }
+  }
+}
+
+static void run_groups(host_worker *w) {
+  host_pool *p = w->pool;
+  host_workitem wi;
+  size_t start, end, g;
+
+  for (;;) {
+    start = __sync_fetch_and_add(&p->next, p->chunk);
+    if (start >= p->ngroups)
+      break;
+    end = start + p->chunk;
+    if (end > p->ngroups)
+      end = p->ngroups;
+    for (g = start; g < end; g++) {
+      if (p->k->barrier) {
+        run_group_barrier(w, g);
+      } else {
+        init_wi(&wi, w, g);
+        p->k->group(&wi, p->args);
+      }
+    }
+  }
+}
+
+static void *worker_main(void *_w) {
+  host_worker *w = (host_worker *)_w;
+  host_pool *p = w->pool;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (!p->stop && p->gen == seen)
+      pthread_cond_wait(&p->start, &p->lock);
+    if (p->stop)
+      break;
+    seen = p->gen;
+    pthread_mutex_unlock(&p->lock);
+    run_groups(w);
+    pthread_mutex_lock(&p->lock);
+    if (--p->busy == 0)
+      pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void pool_free(host_pool *p) {
+  unsigned int i;
+
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (i = 1; i < p->nthreads; i++)
+    pthread_join(p->workers[i].th, NULL);
+
+  for (i = 0; i < p->nthreads; i++) {
+    free(p->workers[i].items);
+    free(p->workers[i].stacks);
+    free(p->workers[i].lmem);
+  }
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->start);
+  pthread_mutex_destroy(&p->lock);
+  pthread_mutex_destroy(&p->call_lock);
+  free(p->workers);
+  free(p);
+}
+
+static host_pool *pool_new(unsigned int nthreads) {
+  host_pool *p;
+  unsigned int i;
+
+  p = calloc(1, sizeof(*p));
+  if (p == NULL)
+    return NULL;
+  p->workers = calloc(nthreads, sizeof(host_worker));
+  if (p->workers == NULL) {
+    free(p);
+    return NULL;
+  }
+  pthread_mutex_init(&p->call_lock, NULL);
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->workers[0].pool = p;
+  p->nthreads = 1;
+  for (i = 1; i < nthreads; i++) {
+    p->workers[i].pool = p;
+    if (pthread_create(&p->workers[i].th, NULL, worker_main,
+                       &p->workers[i]) != 0) {
+      pool_free(p);
+      return NULL;
+    }
+    p->nthreads++;
+  }
+  return p;
+}
+
+/*
+ * Make sure every worker has enough work-item slots and local memory
+ * for the upcoming call.  This is done beforehand so that the workers
+ * can't fail.
+ */
+static int pool_prepare(host_pool *p, size_t nitems, size_t shared) {
+  host_worker *w;
+  unsigned int i;
+
+  for (i = 0; i < p->nthreads; i++) {
+    w = &p->workers[i];
+    if (nitems > w->nitems) {
+      free(w->items);
+      free(w->stacks);
+      w->nitems = 0;
+      w->items = calloc(nitems, sizeof(host_item));
+      w->stacks = malloc(nitems * ITEM_STACK_SIZE);
+      if (w->items == NULL || w->stacks == NULL)
+        return GA_MEMORY_ERROR;
+      w->nitems = nitems;
+    }
+    if (shared > w->lmem_sz) {
+      free(w->lmem);
+      w->lmem_sz = 0;
+      w->lmem = malloc(shared);
+      if (w->lmem == NULL)
+        return GA_MEMORY_ERROR;
+      w->lmem_sz = shared;
+    }
+  }
+  return GA_NO_ERROR;
+}
+
+static unsigned int default_nthreads(void) {
+  const char *env = getenv("GPUARRAY_HOST_THREADS");
+  long n = 0;
+
+  if (env != NULL)
+    n = strtol(env, NULL, 10);
+  if (n <= 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n <= 0)
+    n = 1;
+  return (unsigned int)n;
+}
+
+static int host_get_platform_count(unsigned int* platcount) {
+  *platcount = 1;
+  return GA_NO_ERROR;
+}
+
+static int host_get_device_count(unsigned int platform,
+                                 unsigned int* devcount) {
+  /* The whole machine is one device */
+  *devcount = 1;
+  return GA_NO_ERROR;
+}
+
+static void deallocate(gpudata *d) {
+  if (!(d->flags & DONTFREE))
+    free(d->ptr);
+  CLEAR(d);
+  free(d);
+}
+
+static void host_free_ctx(host_context *ctx) {
+  gpuarray_blas_ops *blas_ops;
+
+  ASSERT_CTX(ctx);
+  ctx->refcnt--;
+  if (ctx->refcnt == 0) {
+    if (ctx->blas_handle != NULL) {
+      host_property((gpucontext *)ctx, NULL, NULL, GA_CTX_PROP_BLAS_OPS,
+                    &blas_ops);
+      blas_ops->teardown((gpucontext *)ctx);
+    }
+    deallocate(ctx->errbuf);
+    cache_destroy(ctx->kernel_cache);
+    pool_free(ctx->pool);
+    CLEAR(ctx);
+    free(ctx);
+  }
+}
+
+static gpudata *new_gpudata(host_context *ctx, size_t size) {
+  gpudata *res;
+  void *p;
+
+  res = malloc(sizeof(*res));
+  if (res == NULL) return NULL;
+
+  /* malloc(0) may return NULL, so always get at least one byte */
+  if (posix_memalign(&p, ALIGN_SIZE, size == 0 ? 1 : size) != 0) {
+    free(res);
+    return NULL;
+  }
+
+  res->ptr = p;
+  res->ctx = ctx;
+  res->sz = size;
+  res->refcnt = 0;
+  res->flags = 0;
+  TAG_BUF(res);
+
+  return res;
+}
+
+static gpucontext *host_init(int ord, int flags, int *ret) {
+  host_context *res;
+  const char *cc;
+
+  if (ord != -1 && ord != 0)
+    FAIL(NULL, GA_VALUE_ERROR);
+
+  ga_lock_acquire(&setup_lock);
+  if (!disk_cache_done) {
+    disk_cache = gpukernel_disk_cache("host");
+    disk_cache_done = 1;
+  }
+  ga_lock_release(&setup_lock);
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    FAIL(NULL, GA_SYS_ERROR);
+  res->ops = &host_ops;
+  res->refcnt = 1;
+  res->flags = flags;
+  res->err_str = NULL;
+  res->nthreads = default_nthreads();
+  cc = getenv("GPUARRAY_HOST_CC");
+  /* The binaries depend on the compiler so put it in the id */
+  snprintf(res->bin_id, sizeof(res->bin_id), "host:%s",
+           cc == NULL ? "cc" : cc);
+  TAG_CTX(res);
+
+  res->pool = pool_new(res->nthreads);
+  if (res->pool == NULL)
+    goto fail_pool;
+  res->nthreads = res->pool->nthreads;
+  res->kernel_cache = gpucontext_cache(res->flags, 64, 128, 64, 8,
+                                       strb_eq, strb_hash,
+                                       (cache_freek_fn)strb_free,
+                                       (cache_freev_fn)host_freekernel,
+                                       (cache_vref_fn)host_retainkernel,
+                                       kernel_cost);
+  if (res->kernel_cache == NULL)
+    goto fail_cache;
+  res->errbuf = new_gpudata(res, 16);
+  if (res->errbuf == NULL)
+    goto fail_errbuf;
+  memset(res->errbuf->ptr, 0, 16);
+  return (gpucontext *)res;
+
+ fail_errbuf:
+  cache_destroy(res->kernel_cache);
+ fail_cache:
+  pool_free(res->pool);
+ fail_pool:
+  free(res);
+  FAIL(NULL, GA_MEMORY_ERROR);
+}
+
+static void host_deinit(gpucontext *c) {
+  host_free_ctx((host_context *)c);
+}
+
+static gpudata *host_alloc(gpucontext *c, size_t size, void *data, int flags,
+                           int *ret) {
+  host_context *ctx = (host_context *)c;
+  gpudata *res;
+
+  ASSERT_CTX(ctx);
+
+  if ((flags & GA_BUFFER_INIT) && data == NULL) FAIL(NULL, GA_VALUE_ERROR);
+  if ((flags & (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) ==
+      (GA_BUFFER_READ_ONLY|GA_BUFFER_WRITE_ONLY)) FAIL(NULL, GA_VALUE_ERROR);
+
+  /* GA_BUFFER_HOST is implied, all memory is host memory */
+
+  res = new_gpudata(ctx, size);
+  if (res == NULL)
+    FAIL(NULL, GA_MEMORY_ERROR);
+  ctx->mem_nallocs++;
+  ctx->mem_used += size;
+  if (ctx->mem_used > ctx->mem_peak)
+    ctx->mem_peak = ctx->mem_used;
+
+  if (flags & GA_BUFFER_INIT)
+    memcpy(res->ptr, data, size);
+
+  res->refcnt = 1;
+  ctx->refcnt++;
+  return res;
+}
+
+static void host_retain(gpudata *d) {
+  ASSERT_BUF(d);
+  d->refcnt++;
+}
+
+static void host_release(gpudata *d) {
+  ASSERT_BUF(d);
+  d->refcnt--;
+  if (d->refcnt == 0) {
+    /* Keep a reference to the context since we deallocate the gpudata
+     * object */
+    host_context *ctx = d->ctx;
+    if (!(d->flags & DONTFREE))
+      ctx->mem_used -= d->sz;
+    deallocate(d);
+    host_free_ctx(ctx);
+  }
+}
+
+static int host_share(gpudata *a, gpudata *b, int *ret) {
+  ASSERT_BUF(a);
+  ASSERT_BUF(b);
+  return (a->ctx == b->ctx && a->sz != 0 && b->sz != 0 &&
+          ((a->ptr <= b->ptr && a->ptr + a->sz > b->ptr) ||
+           (b->ptr <= a->ptr && b->ptr + b->sz > a->ptr)));
+}
+
+static int host_move(gpudata *dst, size_t dstoff, gpudata *src,
+                     size_t srcoff, size_t sz) {
+  ASSERT_BUF(dst);
+  ASSERT_BUF(src);
+  if (src->ctx != dst->ctx) return GA_VALUE_ERROR;
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if ((dst->sz - dstoff) < sz || (src->sz - srcoff) < sz)
+    return GA_VALUE_ERROR;
+
+  memmove(dst->ptr + dstoff, src->ptr + srcoff, sz);
+  return GA_NO_ERROR;
+}
+
+static int host_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
+  ASSERT_BUF(src);
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if ((src->sz - srcoff) < sz)
+    return GA_VALUE_ERROR;
+
+  memcpy(dst, src->ptr + srcoff, sz);
+  return GA_NO_ERROR;
+}
+
+static int host_write(gpudata *dst, size_t dstoff, const void *src,
+                      size_t sz) {
+  ASSERT_BUF(dst);
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if ((dst->sz - dstoff) < sz)
+    return GA_VALUE_ERROR;
+
+  memcpy(dst->ptr + dstoff, src, sz);
+  return GA_NO_ERROR;
+}
+
+static int host_memset(gpudata *dst, size_t dstoff, int data) {
+  ASSERT_BUF(dst);
+
+  if ((dst->sz - dstoff) == 0) return GA_NO_ERROR;
+
+  memset(dst->ptr + dstoff, data, dst->sz - dstoff);
+  return GA_NO_ERROR;
+}
+
+/* Keep the struct in sync with host_workitem in private_host.h */
+static const char HOST_WI_DECL[] =
+    "#include <stddef.h>\n"
+    "typedef struct _host_workitem {\n"
+    "  size_t lid[3];\n"
+    "  size_t ldim[3];\n"
+    "  size_t gid[3];\n"
+    "  size_t gdim[3];\n"
+    "  void *lmem;\n"
+    "  void (*barrier)(struct _host_workitem *);\n"
+    "} host_workitem;\n"
+    "static __thread host_workitem *ga__wi;\n"
+    "static void ga__barrier(void) {\n"
+    "  host_workitem *me = ga__wi;\n"
+    "  me->barrier(me);\n"
+    "  ga__wi = me;\n"
+    "}\n";
+
+static const char HOST_PREAMBLE[] =
+    "#include <math.h>\n"
+    "#define local_barrier() ga__barrier()\n"
+    "#define WITHIN_KERNEL static inline\n"
+    "#define KERNEL static\n"
+    "#define GLOBAL_MEM /* empty */\n"
+    "#define LOCAL_MEM static __thread\n"
+    "#define LOCAL_MEM_ARG /* empty */\n"
+    "#define REQD_WG_SIZE(X,Y,Z) /* empty */\n"
+    "#define LID_0 (ga__wi->lid[0])\n"
+    "#define LID_1 (ga__wi->lid[1])\n"
+    "#define LID_2 (ga__wi->lid[2])\n"
+    "#define LDIM_0 (ga__wi->ldim[0])\n"
+    "#define LDIM_1 (ga__wi->ldim[1])\n"
+    "#define LDIM_2 (ga__wi->ldim[2])\n"
+    "#define GID_0 (ga__wi->gid[0])\n"
+    "#define GID_1 (ga__wi->gid[1])\n"
+    "#define GID_2 (ga__wi->gid[2])\n"
+    "#define GDIM_0 (ga__wi->gdim[0])\n"
+    "#define GDIM_1 (ga__wi->gdim[1])\n"
+    "#define GDIM_2 (ga__wi->gdim[2])\n"
+    "#define ga_bool unsigned char\n"
+    "#define ga_byte signed char\n"
+    "#define ga_ubyte unsigned char\n"
+    "#define ga_short short\n"
+    "#define ga_ushort unsigned short\n"
+    "#define ga_int int\n"
+    "#define ga_uint unsigned int\n"
+    "#define ga_long long long\n"
+    "#define ga_ulong unsigned long long\n"
+    "#define ga_float float\n"
+    "#define ga_double double\n"
+    "#define ga_half ga_ushort\n"
+    "#define ga_size size_t\n"
+    "#define ga_ssize ptrdiff_t\n"
+    "static inline float ga__half2float(ga_ushort h) {\n"
+    "  union { ga_uint u; float f; } v;\n"
+    "  ga_uint s = ((ga_uint)h & 0x8000) << 16;\n"
+    "  ga_uint e = (h >> 10) & 0x1f;\n"
+    "  ga_uint m = h & 0x3ff;\n"
+    "  if (e == 0) {\n"
+    "    if (m == 0) { v.u = s; return v.f; }\n"
+    "    e = 113;\n"
+    "    while (!(m & 0x400)) { m <<= 1; e--; }\n"
+    "    v.u = s | (e << 23) | ((m & 0x3ff) << 13);\n"
+    "  } else if (e == 31) {\n"
+    "    v.u = s | 0x7f800000 | (m << 13);\n"
+    "  } else {\n"
+    "    v.u = s | ((e + 112) << 23) | (m << 13);\n"
+    "  }\n"
+    "  return v.f;\n"
+    "}\n"
+    "static inline ga_ushort ga__float2half_rn(float f) {\n"
+    "  union { ga_uint u; float f; } v;\n"
+    "  ga_uint s, e, m, r, rem, half, shift;\n"
+    "  v.f = f;\n"
+    "  s = (v.u >> 16) & 0x8000;\n"
+    "  e = (v.u >> 23) & 0xff;\n"
+    "  m = v.u & 0x7fffff;\n"
+    "  if (e == 0xff) return s | 0x7c00 | (m ? 0x200 : 0);\n"
+    "  if (e > 142) return s | 0x7c00;\n"
+    "  if (e < 102) return s;\n"
+    "  if (e < 113) {\n"
+    "    m |= 0x800000;\n"
+    "    shift = 126 - e;\n"
+    "    r = m >> shift;\n"
+    "    rem = m & ((1u << shift) - 1);\n"
+    "    half = 1u << (shift - 1);\n"
+    "  } else {\n"
+    "    r = ((e - 112) << 10) | (m >> 13);\n"
+    "    rem = m & 0x1fff;\n"
+    "    half = 0x1000;\n"
+    "  }\n"
+    "  if (rem > half || (rem == half && (r & 1))) r++;\n"
+    "  return s | r;\n"
+    "}\n"
+    "#define load_half(p) ga__half2float(*(p))\n"
+    "#define store_half(p, v) (*(p) = ga__float2half_rn(v))\n"
+    "typedef struct { ga_int x, y; } ga_int2;\n"
+    "typedef struct { ga_int x, y, z, w; } ga_int4;\n"
+    "typedef struct { ga_uint x, y; } ga_uint2;\n"
+    "typedef struct { ga_uint x, y, z, w; } ga_uint4;\n"
+    "typedef struct { ga_long x, y; } ga_long2;\n"
+    "typedef struct { ga_ulong x, y; } ga_ulong2;\n"
+    "typedef struct { ga_float x, y; } ga_float2;\n"
+    "typedef struct { ga_float x, y, z, w; } ga_float4;\n"
+    "typedef struct { ga_double x, y; } ga_double2;\n"
+    "#define load_half2(p, v) do { (v)[0] = load_half(p); "
+    "(v)[1] = load_half((p) + 1); } while (0)\n"
+    "#define load_half4(p, v) do { (v)[0] = load_half(p); "
+    "(v)[1] = load_half((p) + 1); (v)[2] = load_half((p) + 2); "
+    "(v)[3] = load_half((p) + 3); } while (0)\n"
+    "#define store_half2(p, v) do { store_half(p, (v)[0]); "
+    "store_half((p) + 1, (v)[1]); } while (0)\n"
+    "#define store_half4(p, v) do { store_half(p, (v)[0]); "
+    "store_half((p) + 1, (v)[1]); store_half((p) + 2, (v)[2]); "
+    "store_half((p) + 3, (v)[3]); } while (0)\n"
+    "#define GA_DECL_SHARED_PARAM(type, name)\n"
+    "#define GA_DECL_SHARED_BODY(type, name) type *name = (type *)ga__wi->lmem;\n"
+    "#define GA_WARP_SIZE 1\n"
+    "#line 1\n";
+
+/*
+ * Emit the entry points of the kernel object.  They unpack the
+ * argument array and call the kernel for a whole work-group
+ * (ga__group) or a single work-item (ga__item).
+ */
+static int gen_entry(strb *sb, const char *fname, unsigned int argcount,
+                     const int *types, int barrier) {
+  strb call = STRB_STATIC_INIT;
+  const char *tname;
+  unsigned int i;
+
+  strb_appendf(&call, "%s(", fname);
+  for (i = 0; i < argcount; i++) {
+    if (i != 0)
+      strb_appends(&call, ", ");
+    if (types[i] == GA_BUFFER) {
+      strb_appendf(&call, "a[%u]", i);
+    } else {
+      tname = gpuarray_get_type(types[i])->cluda_name;
+      if (tname == NULL) {
+        strb_clear(&call);
+        return GA_VALUE_ERROR;
+      }
+      strb_appendf(&call, "*(%s *)a[%u]", tname, i);
+    }
+  }
+  strb_appends(&call, ");\n");
+  if (strb_error(&call)) {
+    strb_clear(&call);
+    return GA_MEMORY_ERROR;
+  }
+
+  strb_appendf(sb, "\nconst int ga__uses_barrier = %d;\n", barrier);
+  strb_appends(sb, "void ga__group(host_workitem *wi, void **a) {\n"
+               "  ga__wi = wi;\n"
+               "  for (wi->lid[2] = 0; wi->lid[2] < wi->ldim[2]; "
+               "wi->lid[2]++)\n"
+               "  for (wi->lid[1] = 0; wi->lid[1] < wi->ldim[1]; "
+               "wi->lid[1]++)\n"
+               "  for (wi->lid[0] = 0; wi->lid[0] < wi->ldim[0]; "
+               "wi->lid[0]++)\n"
+               "    ");
+  strb_appendn(sb, call.s, call.l);
+  strb_appends(sb, "}\n"
+               "void ga__item(host_workitem *wi, void **a) {\n"
+               "  ga__wi = wi;\n"
+               "  ");
+  strb_appendn(sb, call.s, call.l);
+  strb_appends(sb, "}\n");
+  strb_clear(&call);
+  return GA_NO_ERROR;
+}
+
+static int make_tmp(char *path, size_t len) {
+  const char *tmpdir = getenv("TMPDIR");
+  if (tmpdir == NULL)
+    tmpdir = "/tmp";
+  if ((size_t)snprintf(path, len, "%s/gpuarray-host-XXXXXX", tmpdir) >= len)
+    return -1;
+  return mkstemp(path);
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+  ssize_t s;
+  while (len > 0) {
+    s = write(fd, data, len);
+    if (s < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    data += s;
+    len -= s;
+  }
+  return 0;
+}
+
+static const char *host_cc(void) {
+  const char *cc = getenv("GPUARRAY_HOST_CC");
+  return cc == NULL ? "cc" : cc;
+}
+
+static const char *host_cflags(void) {
+  const char *cflags = getenv("GPUARRAY_HOST_CFLAGS");
+  return cflags == NULL ? "-O2" : cflags;
+}
+
+/*
+ * Key for the disk cache.  This has everything that can change the
+ * output of call_compiler() for the source in `src`.
+ */
+static int make_bin_key(host_context *ctx, strb *key, strb *src) {
+  strb_appendf(key, "%s %s %s", ctx->bin_id, host_cc(), host_cflags());
+  strb_append0(key);
+  strb_appendb(key, src);
+  return strb_error(key);
+}
+
+/*
+ * Run the host compiler on the source to produce a shared object.
+ * The compiler output is appended to `log`.
+ */
+static void *call_compiler(host_context *ctx, const char *src, size_t len,
+                           size_t *bin_len, strb *log, int *ret) {
+  char src_path[1024];
+  char obj_path[1024];
+  char buf[1024];
+  strb cmd = STRB_STATIC_INIT;
+  strb obj = STRB_STATIC_INIT;
+  const char *cc, *cflags;
+  FILE *f;
+  size_t n;
+  int fd, status;
+
+  cc = host_cc();
+  cflags = host_cflags();
+
+  fd = make_tmp(src_path, sizeof(src_path));
+  if (fd == -1)
+    FAIL(NULL, GA_SYS_ERROR);
+  if (write_all(fd, src, len) != 0) {
+    close(fd);
+    unlink(src_path);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+  close(fd);
+  fd = make_tmp(obj_path, sizeof(obj_path));
+  if (fd == -1) {
+    unlink(src_path);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+  close(fd);
+
+  strb_appendf(&cmd, "%s %s -fPIC -shared -x c -o '%s' '%s' -lm 2>&1",
+               cc, cflags, obj_path, src_path);
+  strb_append0(&cmd);
+  if (strb_error(&cmd)) {
+    unlink(src_path);
+    unlink(obj_path);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+
+  f = popen(cmd.s, "r");
+  strb_clear(&cmd);
+  if (f == NULL) {
+    unlink(src_path);
+    unlink(obj_path);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    strb_appendn(log, buf, n);
+  status = pclose(f);
+  unlink(src_path);
+
+  if (status != 0) {
+    ctx->err_str = "Host compiler invocation failed";
+    unlink(obj_path);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+
+  f = fopen(obj_path, "rb");
+  unlink(obj_path);
+  if (f == NULL)
+    FAIL(NULL, GA_SYS_ERROR);
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    strb_appendn(&obj, buf, n);
+  fclose(f);
+  if (strb_error(&obj))
+    FAIL(NULL, GA_MEMORY_ERROR);
+
+  *bin_len = obj.l;
+  return obj.s;
+}
+
+/*
+ * Load a kernel object.  dlopen() needs a file so the binary is
+ * written out to a temporary one first.
+ */
+static int load_kernel(host_context *ctx, gpukernel *k) {
+  char path[1024];
+  const int *uses_barrier;
+  int fd;
+
+  fd = make_tmp(path, sizeof(path));
+  if (fd == -1)
+    return GA_SYS_ERROR;
+  if (write_all(fd, k->bin, k->bin_sz) != 0) {
+    close(fd);
+    unlink(path);
+    return GA_SYS_ERROR;
+  }
+  close(fd);
+  k->lib = ga_load_library(path);
+  unlink(path);
+  if (k->lib == NULL) {
+    ctx->err_str = "Could not load kernel object";
+    return GA_IMPL_ERROR;
+  }
+  k->group = (host_entry_fn)ga_func_ptr(k->lib, "ga__group");
+  k->item = (host_entry_fn)ga_func_ptr(k->lib, "ga__item");
+  uses_barrier = (const int *)ga_func_ptr(k->lib, "ga__uses_barrier");
+  if (k->group == NULL || k->item == NULL || uses_barrier == NULL) {
+    ctx->err_str = "Kernel object is missing entry points";
+    return GA_IMPL_ERROR;
+  }
+  k->barrier = *uses_barrier;
+  return GA_NO_ERROR;
+}
+
+static void _host_freekernel(gpukernel *k) {
+  if (ga_ref_dec(&k->refcnt) == 0) {
+    if (k->lib != NULL)
+      dlclose(k->lib);
+    CLEAR(k);
+    free(k->args);
+    free(k->bin);
+    free(k->types);
+    free(k->access);
+    free(k->name);
+    free(k);
+  }
+}
+
+static gpukernel *host_newkernel(gpucontext *c, unsigned int count,
+                                 const char **strings, const size_t *lengths,
+                                 const char *fname, unsigned int argcount,
+                                 const int *types, const int *access,
+                                 int flags, int *ret, char **err_str) {
+  host_context *ctx = (host_context *)c;
+  strb sb = STRB_STATIC_INIT;
+  strb src = STRB_STATIC_INIT;
+  strb log = STRB_STATIC_INIT;
+  strb debug_msg = STRB_STATIC_INIT;
+  strb bkey = STRB_STATIC_INIT;
+  strb *psb, *bsb;
+  char *bin = NULL;
+  gpukernel *res;
+  size_t bin_len = 0;
+  unsigned int i;
+  int err;
+
+  ASSERT_CTX(ctx);
+
+  if (count == 0) FAIL(NULL, GA_VALUE_ERROR);
+
+  if (flags & (GA_USE_CUDA|GA_USE_OPENCL))
+    FAIL(NULL, GA_DEVSUP_ERROR);
+
+  if (flags & GA_USE_BINARY) {
+    // GA_USE_BINARY is exclusive
+    if (flags & ~GA_USE_BINARY)
+      FAIL(NULL, GA_INVALID_ERROR);
+    // We need the length for binary data and there is only one blob.
+    if (count != 1 || lengths == NULL || lengths[0] == 0)
+      FAIL(NULL, GA_VALUE_ERROR);
+  }
+
+  // GA_USE_SMALL, GA_USE_DOUBLE and GA_USE_HALF always work
+  if (flags & GA_USE_COMPLEX) {
+    // Same as the other backends for now
+    FAIL(NULL, GA_DEVSUP_ERROR);
+  }
+
+  if (flags & GA_USE_BINARY) {
+    bin = memdup(strings[0], lengths[0]);
+    bin_len = lengths[0];
+    if (bin == NULL)
+      FAIL(NULL, GA_MEMORY_ERROR);
+  } else {
+    if (lengths == NULL) {
+      for (i = 0; i < count; i++)
+        strb_appends(&src, strings[i]);
+    } else {
+      for (i = 0; i < count; i++) {
+        if (lengths[i] == 0)
+          strb_appends(&src, strings[i]);
+        else
+          strb_appendn(&src, strings[i], lengths[i]);
+      }
+    }
+    strb_append0(&src);
+
+    strb_appends(&sb, HOST_WI_DECL);
+    if (flags & GA_USE_CLUDA)
+      strb_appends(&sb, HOST_PREAMBLE);
+    if (!strb_error(&src)) {
+      strb_appendn(&sb, src.s, src.l - 1);
+      err = gen_entry(&sb, fname, argcount, types,
+                      strstr(src.s, "local_barrier") != NULL);
+    } else {
+      err = GA_MEMORY_ERROR;
+    }
+    strb_clear(&src);
+    if (err != GA_NO_ERROR) {
+      strb_clear(&sb);
+      FAIL(NULL, err);
+    }
+
+    if (strb_error(&sb)) {
+      strb_clear(&sb);
+      FAIL(NULL, GA_MEMORY_ERROR);
+    }
+
+    /* The cache takes a reference for us */
+    res = (gpukernel *)cache_get(ctx->kernel_cache, &sb);
+    if (res != NULL) {
+      gpukernel_merge_access(res->access, argcount, types, access);
+      strb_clear(&sb);
+      return res;
+    }
+
+    /* Binaries from the disk cache go through the same path as
+       GA_USE_BINARY */
+    if (disk_cache != NULL && make_bin_key(ctx, &bkey, &sb) == 0) {
+      bsb = gpukernel_disk_cache_get(disk_cache, &bkey);
+      if (bsb != NULL) {
+        bin = memdup(bsb->s, bsb->l);
+        bin_len = bsb->l;
+        strb_free(bsb);
+      }
+    }
+    if (bin == NULL)
+      bin = call_compiler(ctx, sb.s, sb.l, &bin_len, &log, ret);
+    else
+      strb_clear(&bkey);
+    if (bin == NULL) {
+      strb_clear(&bkey);
+      if (err_str != NULL) {
+        strb_appends(&debug_msg, "Host kernel compile failure ::\n");
+        gpukernel_source_with_line_numbers(1, (const char **)&sb.s,
+                                           &sb.l, &debug_msg);
+        if (log.l != 0) {
+          strb_appends(&debug_msg, "\nCompiler log:\n");
+          strb_appendn(&debug_msg, log.s, log.l);
+        }
+        *err_str = strb_cstr(&debug_msg);
+        // *err_str will be free()d by the caller (see docs in kernel.h)
+      }
+      strb_clear(&log);
+      strb_clear(&sb);
+      return NULL;
+    }
+    strb_clear(&log);
+    if (bkey.l != 0) {
+      /* Save it for the next processes, failures are ignored */
+      psb = memdup(&bkey, sizeof(strb));
+      if (psb == NULL) {
+        strb_clear(&bkey);
+      } else {
+        bsb = strb_alloc(bin_len);
+        if (bsb == NULL) {
+          strb_free(psb);
+        } else {
+          memcpy(bsb->s, bin, bin_len);
+          bsb->l = bin_len;
+          gpukernel_disk_cache_add(disk_cache, psb, bsb);
+        }
+      }
+    }
+  }
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) {
+    free(bin);
+    strb_clear(&sb);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
+
+  res->bin_sz = bin_len;
+  res->bin = bin;
+  res->refcnt = 1;
+  res->argcount = argcount;
+  res->types = calloc(argcount, sizeof(int));
+  if (res->types == NULL) {
+    _host_freekernel(res);
+    strb_clear(&sb);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  memcpy(res->types, types, argcount*sizeof(int));
+  res->access = calloc(argcount, sizeof(int));
+  if (res->access == NULL) {
+    _host_freekernel(res);
+    strb_clear(&sb);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  gpukernel_merge_access(res->access, argcount, types, access);
+  res->name = strdup(fname);
+  res->args = calloc(argcount, sizeof(void *));
+  if (res->name == NULL || res->args == NULL) {
+    _host_freekernel(res);
+    strb_clear(&sb);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+
+  err = load_kernel(ctx, res);
+  if (err != GA_NO_ERROR) {
+    _host_freekernel(res);
+    strb_clear(&sb);
+    FAIL(NULL, err);
+  }
+
+  /* Kernels don't hold a reference to the context since the
+     context's cache holds references to the kernels. */
+  res->ctx = ctx;
+  TAG_KER(res);
+
+  if (flags & GA_USE_BINARY)
+    return res;
+
+  psb = memdup(&sb, sizeof(strb));
+  if (psb == NULL) {
+    host_freekernel(res);
+    strb_clear(&sb);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  /* One of the refs is for the cache */
+  res->refcnt++;
+  /* If this fails, it will free the key and remove a ref from the kernel. */
+  cache_add(ctx->kernel_cache, psb, res);
+  return res;
+}
+
+static void host_retainkernel(gpukernel *k) {
+  ASSERT_KER(k);
+  ga_ref_inc(&k->refcnt);
+}
+
+static void host_freekernel(gpukernel *k) {
+  ASSERT_KER(k);
+  _host_freekernel(k);
+}
+
+static int host_kernelsetarg(gpukernel *k, unsigned int i, void *arg) {
+  if (i >= k->argcount)
+    return GA_VALUE_ERROR;
+  k->args[i] = arg;
+  return GA_NO_ERROR;
+}
+
+static int host_callkernel(gpukernel *k, unsigned int n,
+                           const size_t *gs, const size_t *ls,
+                           size_t shared, void **args) {
+  host_context *ctx = k->ctx;
+  host_pool *p = ctx->pool;
+  void **vals;
+  unsigned int i;
+  int err;
+
+  ASSERT_KER(k);
+
+  if (n < 1 || n > 3)
+    return GA_VALUE_ERROR;
+
+  if (args == NULL)
+    args = k->args;
+
+  /* The kernel gets the raw pointer for buffers */
+  vals = calloc(k->argcount, sizeof(void *));
+  if (k->argcount != 0 && vals == NULL)
+    return GA_MEMORY_ERROR;
+  for (i = 0; i < k->argcount; i++) {
+    if (k->types[i] == GA_BUFFER)
+      vals[i] = ((gpudata *)args[i])->ptr;
+    else
+      vals[i] = args[i];
+  }
+
+  pthread_mutex_lock(&p->call_lock);
+
+  for (i = 0; i < 3; i++) {
+    p->gs[i] = i < n ? gs[i] : 1;
+    p->ls[i] = i < n ? ls[i] : 1;
+  }
+  if (p->ls[0] * p->ls[1] * p->ls[2] >
+      (size_t)(k->barrier ? HOST_MAXLSIZE_BARRIER : HOST_MAXLSIZE) ||
+      shared > HOST_LMEMSIZE) {
+    err = GA_VALUE_ERROR;
+    goto out;
+  }
+  err = pool_prepare(p, k->barrier ? p->ls[0] * p->ls[1] * p->ls[2] : 0,
+                     shared);
+  if (err != GA_NO_ERROR)
+    goto out;
+
+  p->k = k;
+  p->args = vals;
+  p->ngroups = p->gs[0] * p->gs[1] * p->gs[2];
+  p->next = 0;
+  /* A few chunks per thread to balance uneven groups */
+  p->chunk = p->ngroups / (p->nthreads * 4);
+  if (p->chunk == 0)
+    p->chunk = 1;
+
+  if (p->nthreads == 1 || p->ngroups == 1) {
+    run_groups(&p->workers[0]);
+  } else {
+    pthread_mutex_lock(&p->lock);
+    p->busy = p->nthreads - 1;
+    p->gen++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    run_groups(&p->workers[0]);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy != 0)
+      pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+  }
+  p->k = NULL;
+  p->args = NULL;
+
+ out:
+  pthread_mutex_unlock(&p->call_lock);
+  free(vals);
+  return err;
+}
+
+static int host_kernelbin(gpukernel *k, size_t *sz, void **obj) {
+  void *res = malloc(k->bin_sz);
+  if (res == NULL)
+    return GA_MEMORY_ERROR;
+  memcpy(res, k->bin, k->bin_sz);
+  *sz = k->bin_sz;
+  *obj = res;
+  return GA_NO_ERROR;
+}
+
+static int host_sync(gpudata *b) {
+  ASSERT_BUF(b);
+  /* Everything is synchronous */
+  return GA_NO_ERROR;
+}
+
+static int host_transfer(gpudata *dst, size_t dstoff,
+                         gpudata *src, size_t srcoff, size_t sz) {
+  ASSERT_BUF(src);
+  ASSERT_BUF(dst);
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  if ((dst->sz - dstoff) < sz || (src->sz - srcoff) < sz)
+    return GA_VALUE_ERROR;
+
+  /* Both contexts share the same memory, but maybe not the same
+     worker pool, which doesn't matter since calls are synchronous. */
+  memmove(dst->ptr + dstoff, src->ptr + srcoff, sz);
+  return GA_NO_ERROR;
+}
+
+static int host_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
+                         void *res) {
+  host_context *ctx = NULL;
+  if (c != NULL) {
+    ctx = (host_context *)c;
+    ASSERT_CTX(ctx);
+  } else if (buf != NULL) {
+    ASSERT_BUF(buf);
+    ctx = buf->ctx;
+  } else if (k != NULL) {
+    ASSERT_KER(k);
+    ctx = k->ctx;
+  }
+
+  if (prop_id < GA_BUFFER_PROP_START) {
+    if (ctx == NULL)
+      return GA_VALUE_ERROR;
+  } else if (prop_id < GA_KERNEL_PROP_START) {
+    if (buf == NULL)
+      return GA_VALUE_ERROR;
+  } else {
+    if (k == NULL)
+      return GA_VALUE_ERROR;
+  }
+
+  switch (prop_id) {
+    long pages;
+
+  case GA_CTX_PROP_DEVNAME:
+    snprintf((char *)res, 256, "Host (%u threads)", ctx->nthreads);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_PCIBUSID:
+    return GA_DEVSUP_ERROR;
+
+  case GA_CTX_PROP_MAXLSIZE:
+  case GA_CTX_PROP_MAXLSIZE0:
+  case GA_CTX_PROP_MAXLSIZE1:
+  case GA_CTX_PROP_MAXLSIZE2:
+    *((size_t *)res) = HOST_MAXLSIZE;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_LMEMSIZE:
+    *((size_t *)res) = HOST_LMEMSIZE;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NUMPROCS:
+    *((unsigned int *)res) = ctx->nthreads;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MAXGSIZE:
+  case GA_CTX_PROP_MAXGSIZE0:
+  case GA_CTX_PROP_MAXGSIZE1:
+  case GA_CTX_PROP_MAXGSIZE2:
+    *((size_t *)res) = HOST_MAXGSIZE;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_BLAS_OPS:
+    /* No BLAS on the host for now */
+    return GA_DEVSUP_ERROR;
+
+  case GA_CTX_PROP_COMM_OPS:
+    return GA_DEVSUP_ERROR;
+
+  case GA_CTX_PROP_BIN_ID:
+    *((const char **)res) = ctx->bin_id;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_ERRBUF:
+    *((gpudata **)res) = ctx->errbuf;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_TOTAL_GMEM:
+    pages = sysconf(_SC_PHYS_PAGES);
+    if (pages < 0)
+      return GA_SYS_ERROR;
+    *((size_t *)res) = (size_t)pages * sysconf(_SC_PAGESIZE);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_FREE_GMEM:
+  case GA_CTX_PROP_LARGEST_MEMBLOCK:
+  case GA_CTX_PROP_LARGEST_MEMBLOCK_PROBED:
+#ifdef _SC_AVPHYS_PAGES
+    pages = sysconf(_SC_AVPHYS_PAGES);
+#else
+    pages = sysconf(_SC_PHYS_PAGES);
+#endif
+    if (pages < 0)
+      return GA_SYS_ERROR;
+    *((size_t *)res) = (size_t)pages * sysconf(_SC_PAGESIZE);
+    return GA_NO_ERROR;
+
+  /* There is no cache, buffers are allocated and freed directly */
+  case GA_CTX_PROP_MEM_RESERVED:
+  case GA_CTX_PROP_MEM_USED:
+    *((size_t *)res) = ctx->mem_used;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_PEAK:
+    *((size_t *)res) = ctx->mem_peak;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_CACHED:
+  case GA_CTX_PROP_MEM_FRAGMENTS:
+  case GA_CTX_PROP_MEM_LARGEST_CACHED:
+    *((size_t *)res) = 0;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_MEM_NUM_ALLOCS:
+    *((size_t *)res) = ctx->mem_nallocs;
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_KERNEL_CACHE_HITS:
+  case GA_CTX_PROP_KERNEL_CACHE_MISSES:
+  case GA_CTX_PROP_KERNEL_CACHE_EVICTIONS:
+  case GA_CTX_PROP_KERNEL_CACHE_BYTES:
+    *((size_t *)res) = gpucontext_cache_stat(ctx->kernel_cache, prop_id);
+    return GA_NO_ERROR;
+
+  case GA_CTX_PROP_NATIVE_FLOAT16:
+    *((int *)res) = 0;
+    return GA_NO_ERROR;
+
+  case GA_BUFFER_PROP_REFCNT:
+    *((unsigned int *)res) = buf->refcnt;
+    return GA_NO_ERROR;
+
+  case GA_BUFFER_PROP_SIZE:
+    *((size_t *)res) = buf->sz;
+    return GA_NO_ERROR;
+
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    *((void **)res) = buf->ptr;
+    return GA_NO_ERROR;
+
+  case GA_BUFFER_PROP_CTX:
+  case GA_KERNEL_PROP_CTX:
+    *((gpucontext **)res) = (gpucontext *)ctx;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_MAXLSIZE:
+    *((size_t *)res) = k->barrier ? HOST_MAXLSIZE_BARRIER : HOST_MAXLSIZE;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_PREFLSIZE:
+    /* Work-items are run one at a time, there is no warp */
+    *((size_t *)res) = 1;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_NUMARGS:
+    *((unsigned int *)res) = k->argcount;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_TYPES:
+    *((const int **)res) = k->types;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_ACCESS:
+    *((const int **)res) = k->access;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_NAME:
+    *((const char **)res) = k->name;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_BINSIZE:
+    *((size_t *)res) = k->bin_sz;
+    return GA_NO_ERROR;
+
+  default:
+    return GA_INVALID_ERROR;
+  }
+}
+
+static const char *host_error(gpucontext *c) {
+  host_context *ctx = (host_context *)c;
+  if (ctx == NULL || ctx->err_str == NULL)
+    return "Unknown host error";
+  return ctx->err_str;
+}
+
+static int host_stream_set(gpucontext *c, gpustream *s) {
+  ASSERT_CTX((host_context *)c);
+  c->stream = s;
+  return GA_NO_ERROR;
+}
+
+static gpustream *host_stream_alloc(gpucontext *c, int flags, int *ret) {
+  host_context *ctx = (host_context *)c;
+  gpustream *res;
+
+  ASSERT_CTX(ctx);
+  if (flags != 0)
+    FAIL(NULL, GA_INVALID_ERROR);
+  if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
+    FAIL(NULL, GA_UNSUPPORTED_ERROR);
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    FAIL(NULL, GA_MEMORY_ERROR);
+  res->ctx = ctx;
+  res->refcnt = 1;
+  ctx->refcnt++;
+  TAG_STR(res);
+  return res;
+}
+
+static void host_stream_retain(gpustream *s) {
+  ASSERT_STR(s);
+  s->refcnt++;
+}
+
+static void host_stream_release(gpustream *s) {
+  host_context *ctx = s->ctx;
+
+  ASSERT_STR(s);
+  s->refcnt--;
+  if (s->refcnt == 0) {
+    if (ctx->stream == s)
+      host_stream_set((gpucontext *)ctx, NULL);
+    CLEAR(s);
+    free(s);
+    host_free_ctx(ctx);
+  }
+}
+
+static int host_stream_sync(gpustream *s) {
+  ASSERT_STR(s);
+  return GA_NO_ERROR;
+}
+
+GPUARRAY_LOCAL
+const gpuarray_buffer_ops host_ops = {host_get_platform_count,
+                                      host_get_device_count,
+                                      host_init,
+                                      host_deinit,
+                                      host_alloc,
+                                      host_retain,
+                                      host_release,
+                                      host_share,
+                                      host_move,
+                                      host_read,
+                                      host_write,
+                                      host_memset,
+                                      host_newkernel,
+                                      host_retainkernel,
+                                      host_freekernel,
+                                      host_kernelsetarg,
+                                      host_callkernel,
+                                      host_kernelbin,
+                                      host_sync,
+                                      host_transfer,
+                                      host_property,
+                                      host_error,
+                                      host_stream_alloc,
+                                      host_stream_retain,
+                                      host_stream_release,
+                                      host_stream_sync,
+                                      host_stream_set,
+                                      NULL, /* buffer_read_async */
+                                      NULL, /* buffer_write_async */
+                                      NULL, /* buffer_query */
+                                      NULL, /* buffer_trim */
+                                      NULL, /* capture_begin */
+                                      NULL, /* capture_end */
+                                      NULL, /* graph_launch */
+                                      NULL, /* graph_numkernels */
+                                      NULL, /* graph_setargs */
+                                      NULL, /* graph_release */
+                                      NULL, /* timer_start */
+                                      NULL, /* timer_stop */
+                                      NULL, /* timer_read */
+                                      NULL}; /* timer_release */
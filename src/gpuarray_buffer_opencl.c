@@ -15,6 +15,9 @@
 #include "loaders/libclblas.h"
 #include "loaders/libclblast.h"
 
+#include "util/lock.h"
+#include "util/xxhash.h"
+
 #ifdef _MSC_VER
 #define strdup _strdup
 #endif
@@ -38,20 +41,60 @@ static void cl_free_ctx(cl_ctx *ctx);
 static gpukernel *cl_newkernel(gpucontext *ctx, unsigned int count,
                                const char **strings, const size_t *lengths,
                                const char *fname, unsigned int argcount,
-                               const int *types, int flags, int *ret,
-                               char **err_str);
+                               const int *types, const int *access,
+                               int flags, int *ret, char **err_str);
 static const char CL_CONTEXT_PREAMBLE[] =
 "#define GA_WARP_SIZE %lu\n";  // to be filled by cl_make_ctx()
 
+static int strb_eq(void *_k1, void *_k2) {
+  strb *k1 = (strb *)_k1;
+  strb *k2 = (strb *)_k2;
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint64_t strb_hash(void *_k) {
+  strb *k = (strb *)_k;
+  return XXH64(k->s, k->l, 42);
+}
+
+static void release_program(void *p) {
+  clReleaseProgram((cl_program)p);
+}
+
+static void retain_program(void *p) {
+  clRetainProgram((cl_program)p);
+}
+
+/* The source and the binary for the (only) device */
+static size_t program_cost(void *k, void *p) {
+  size_t sz = 0;
+  clGetProgramInfo((cl_program)p, CL_PROGRAM_BINARY_SIZES, sizeof(sz), &sz,
+                   NULL);
+  return ((strb *)k)->l + sz;
+}
+
 static int setup_done = 0;
-static int setup_lib(void) {
+static cache *disk_cache = NULL;
+static ga_lock_t setup_lock = GA_LOCK_INITIALIZER;
+static int setup_lib_locked(void) {
   if (setup_done)
     return GA_NO_ERROR;
   GA_CHECK(load_libopencl());
+  disk_cache = gpukernel_disk_cache("opencl");
   setup_done = 1;
   return GA_NO_ERROR;
 }
 
+/* Contexts may be created from many threads at once */
+static int setup_lib(void) {
+  int res;
+  ga_lock_acquire(&setup_lock);
+  res = setup_lib_locked();
+  ga_lock_release(&setup_lock);
+  return res;
+}
+
 static int cl_get_platform_count(unsigned int* platcount) {
   cl_uint nump;
 
@@ -90,6 +133,16 @@ static int cl_get_device_count(unsigned int platform, unsigned int* devcount) {
   return GA_NO_ERROR;
 }
 
+/* Kernels can only be timed on the device (see cl_timer_start()) by
+   queues made with profiling, so do that when tracing from the start */
+static cl_command_queue_properties trace_qprop(void) {
+  const char *path = getenv("GPUARRAY_TRACE");
+
+  if (path == NULL || path[0] == '\0')
+    return 0;
+  return CL_QUEUE_PROFILING_ENABLE;
+}
+
 static cl_device_id get_dev(cl_context ctx, int *ret) {
   size_t sz;
   cl_device_id res;
@@ -154,17 +207,32 @@ cl_ctx *cl_make_ctx(cl_context ctx, int flags) {
   res->ops = &opencl_ops;
   res->err = CL_SUCCESS;
   res->refcnt = 1;
+  res->flags = flags;
   res->exts = NULL;
   res->blas_handle = NULL;
   res->preamble = NULL;
+  res->kernel_cache = NULL;
   res->q = clCreateCommandQueue(
     ctx, id,
-    ISSET(flags, GA_CTX_SINGLE_STREAM) ? 0 : qprop&CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE,
+    (ISSET(flags, GA_CTX_SINGLE_STREAM) ? 0 : qprop&CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) |
+    trace_qprop(),
     &err);
   if (res->q == NULL) {
     free(res);
     return NULL;
   }
+  res->def_q = res->q;
+  res->stream = NULL;
+  res->kernel_cache = gpucontext_cache(flags, 16, 64, 64, 8,
+                                       strb_eq, strb_hash,
+                                       (cache_freek_fn)strb_free,
+                                       release_program, retain_program,
+                                       program_cost);
+  if (res->kernel_cache == NULL) {
+    clReleaseCommandQueue(res->q);
+    free(res);
+    return NULL;
+  }
 
   /* Can't overflow (source is 32 + 16 + 12 and buffer is 64) */
   len = strlcpy(res->bin_id, vendor, sizeof(res->bin_id));
@@ -185,7 +253,8 @@ cl_ctx *cl_make_ctx(cl_context ctx, int flags) {
   rlk[0] = dummy_kern;
   len = sizeof(dummy_kern);
   // this dummy kernel does not require a CLUDA preamble
-  m = cl_newkernel((gpucontext *)res, 1, rlk, &len, "kdummy", 0, NULL, 0, &ret, NULL);
+  m = cl_newkernel((gpucontext *)res, 1, rlk, &len, "kdummy", 0, NULL, NULL,
+                   0, &ret, NULL);
   if (m == NULL)
     goto fail;
   ret = cl_property((gpucontext *)res, NULL, m, GA_KERNEL_PROP_PREFLSIZE, &warp_size);
@@ -226,7 +295,9 @@ static void cl_free_ctx(cl_ctx *ctx) {
       ctx->refcnt = 2; /* Avoid recursive release */
       cl_release(ctx->errbuf);
     }
-    clReleaseCommandQueue(ctx->q);
+    if (ctx->kernel_cache != NULL)
+      cache_destroy(ctx->kernel_cache);
+    clReleaseCommandQueue(ctx->def_q);
     clReleaseContext(ctx->ctx);
     if (ctx->preamble != NULL)
       free(ctx->preamble);
@@ -251,6 +322,7 @@ gpudata *cl_make_buf(gpucontext *c, cl_mem buf) {
 
   res->buf = buf;
   res->ev = NULL;
+  res->nrev = 0;
   res->refcnt = 1;
   ctx->err = clRetainMemObject(buf);
   if (ctx->err != CL_SUCCESS) {
@@ -266,6 +338,78 @@ gpudata *cl_make_buf(gpucontext *c, cl_mem buf) {
 
 cl_mem cl_get_buf(gpudata *g) { ASSERT_BUF(g); return g->buf; }
 
+/*
+ * Reads only need to wait for the last write, so that they can
+ * overlap with each other.  Writes need to wait for everything.
+ *
+ * Only CL_MAX_READERS reads are tracked.  When that is reached, the
+ * next read also waits for all of them and replaces them.
+ */
+cl_uint cl_wait_list(gpudata *b, int access, cl_event *evl) {
+  cl_uint n = 0, i;
+
+  ASSERT_BUF(b);
+  if (b->ev != NULL && (access & GA_ARG_READ_WRITE))
+    evl[n++] = b->ev;
+  if ((access & GA_ARG_WRITE) || b->nrev == CL_MAX_READERS)
+    for (i = 0; i < b->nrev; i++)
+      evl[n++] = b->rev[i];
+  return n;
+}
+
+static void clear_reads(gpudata *b) {
+  cl_uint i;
+  for (i = 0; i < b->nrev; i++)
+    clReleaseEvent(b->rev[i]);
+  b->nrev = 0;
+}
+
+void cl_record(gpudata *b, int access, cl_event ev) {
+  cl_uint i;
+
+  ASSERT_BUF(b);
+  /* The same buffer can be passed more than once to a kernel */
+  if (ev == b->ev)
+    return;
+  if (access & GA_ARG_WRITE) {
+    clear_reads(b);
+    if (b->ev != NULL)
+      clReleaseEvent(b->ev);
+    b->ev = ev;
+    clRetainEvent(ev);
+  } else if (access & GA_ARG_READ) {
+    for (i = 0; i < b->nrev; i++)
+      if (b->rev[i] == ev)
+        return;
+    /* cl_wait_list() made us wait for all of these */
+    if (b->nrev == CL_MAX_READERS)
+      clear_reads(b);
+    b->rev[b->nrev++] = ev;
+    clRetainEvent(ev);
+  }
+}
+
+int cl_wait(gpudata *b, int access) {
+  cl_ctx *ctx = b->ctx;
+  cl_event evl[CL_MAX_WAIT];
+  cl_uint n;
+
+  ASSERT_BUF(b);
+  n = cl_wait_list(b, access, evl);
+  if (n == 0)
+    return GA_NO_ERROR;
+  ctx->err = clWaitForEvents(n, evl);
+  if (ctx->err != CL_SUCCESS)
+    return GA_IMPL_ERROR;
+  if (b->nrev == CL_MAX_READERS || (access & GA_ARG_WRITE))
+    clear_reads(b);
+  if (b->ev != NULL) {
+    clReleaseEvent(b->ev);
+    b->ev = NULL;
+  }
+  return GA_NO_ERROR;
+}
+
 #define PRAGMA "#pragma OPENCL EXTENSION "
 #define ENABLE " : enable\n"
 #define CL_SMALL "cl_khr_byte_addressable_store"
@@ -316,6 +460,22 @@ static const char CL_PREAMBLE[] =
   "#define ga_ssize long\n"
   "#define load_half(p) vload_half(0, p)\n"
   "#define store_half(p, v) vstore_half_rtn(v, 0, p)\n"
+  "#define ga_int2 int2\n"
+  "#define ga_int4 int4\n"
+  "#define ga_uint2 uint2\n"
+  "#define ga_uint4 uint4\n"
+  "#define ga_long2 long2\n"
+  "#define ga_ulong2 ulong2\n"
+  "#define ga_float2 float2\n"
+  "#define ga_float4 float4\n"
+  "#define ga_double2 double2\n"
+  "#define load_half2(p, v) do { float2 _h = vload_half2(0, p); "
+  "(v)[0] = _h.x; (v)[1] = _h.y; } while (0)\n"
+  "#define load_half4(p, v) do { float4 _h = vload_half4(0, p); "
+  "(v)[0] = _h.x; (v)[1] = _h.y; (v)[2] = _h.z; (v)[3] = _h.w; } while (0)\n"
+  "#define store_half2(p, v) vstore_half2_rtn((float2)((v)[0], (v)[1]), 0, p)\n"
+  "#define store_half4(p, v) vstore_half4_rtn((float4)((v)[0], (v)[1], "
+  "(v)[2], (v)[3]), 0, p)\n"
   "#define GA_DECL_SHARED_PARAM(type, name) , __local type *name\n"
   "#define GA_DECL_SHARED_BODY(type, name)\n";
 
@@ -517,6 +677,7 @@ static gpudata *cl_alloc(gpucontext *c, size_t size, void *data, int flags,
 
   res->buf = clCreateBuffer(ctx->ctx, clflags, size, hostp, &ctx->err);
   res->ev = NULL;
+  res->nrev = 0;
   if (ctx->err != CL_SUCCESS) {
     free(res);
     FAIL(NULL, GA_IMPL_ERROR);
@@ -542,6 +703,7 @@ static void cl_release(gpudata *b) {
     clReleaseMemObject(b->buf);
     if (b->ev != NULL)
       clReleaseEvent(b->ev);
+    clear_reads(b);
     cl_free_ctx(b->ctx);
     free(b);
   }
@@ -572,8 +734,7 @@ static int cl_move(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
                    size_t sz) {
   cl_ctx *ctx;
   cl_event ev;
-  cl_event evw[2];
-  cl_event *evl = NULL;
+  cl_event evw[2 * CL_MAX_WAIT];
   cl_uint num_ev = 0;
 
   ASSERT_BUF(dst);
@@ -586,80 +747,99 @@ static int cl_move(gpudata *dst, size_t dstoff, gpudata *src, size_t srcoff,
 
   if (sz == 0) return GA_NO_ERROR;
 
-  if (src->ev != NULL)
-    evw[num_ev++] = src->ev;
-  if (dst->ev != NULL && src != dst)
-    evw[num_ev++] = dst->ev;
-
-  if (num_ev > 0)
-    evl = evw;
+  num_ev += cl_wait_list(src, GA_ARG_READ, evw);
+  num_ev += cl_wait_list(dst, GA_ARG_WRITE, evw + num_ev);
 
   ctx->err = clEnqueueCopyBuffer(ctx->q, src->buf, dst->buf, srcoff, dstoff,
-                                 sz, num_ev, evl, &ev);
+                                 sz, num_ev, num_ev == 0 ? NULL : evw, &ev);
   if (ctx->err != CL_SUCCESS) {
     return GA_IMPL_ERROR;
   }
-  if (src->ev != NULL)
-    clReleaseEvent(src->ev);
-  if (dst->ev != NULL && src != dst)
-    clReleaseEvent(dst->ev);
-
-  src->ev = ev;
-  dst->ev = ev;
-  clRetainEvent(ev);
+  cl_record(src, GA_ARG_READ, ev);
+  cl_record(dst, GA_ARG_WRITE, ev);
+  clReleaseEvent(ev);
 
   return GA_NO_ERROR;
 }
 
 static int cl_read(void *dst, gpudata *src, size_t srcoff, size_t sz) {
   cl_ctx *ctx = src->ctx;
-  cl_event ev[1];
-  cl_event *evl = NULL;
-  cl_uint num_ev = 0;
+  cl_event evl[CL_MAX_WAIT];
+  cl_uint num_ev;
 
   ASSERT_BUF(src);
   ASSERT_CTX(ctx);
 
   if (sz == 0) return GA_NO_ERROR;
 
-  if (src->ev != NULL) {
-    ev[0] = src->ev;
-    evl = ev;
-    num_ev = 1;
-  }
+  num_ev = cl_wait_list(src, GA_ARG_READ, evl);
 
   ctx->err = clEnqueueReadBuffer(ctx->q, src->buf, CL_TRUE, srcoff, sz, dst,
-                                 num_ev, evl, NULL);
+                                 num_ev, num_ev == 0 ? NULL : evl, NULL);
   if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
-  if (src->ev != NULL) clReleaseEvent(src->ev);
-  src->ev = NULL;
-
-  return GA_NO_ERROR;
+  /* This was blocking so all of those are done */
+  return cl_wait(src, GA_ARG_READ);
 }
 
 static int cl_write(gpudata *dst, size_t dstoff, const void *src, size_t sz) {
   cl_ctx *ctx = dst->ctx;
-  cl_event ev[1];
-  cl_event *evl = NULL;
-  cl_uint num_ev = 0;
+  cl_event evl[CL_MAX_WAIT];
+  cl_uint num_ev;
 
   ASSERT_BUF(dst);
   ASSERT_CTX(ctx);
 
   if (sz == 0) return GA_NO_ERROR;
 
-  if (dst->ev != NULL) {
-    ev[0] = dst->ev;
-    evl = ev;
-    num_ev = 1;
-  }
+  num_ev = cl_wait_list(dst, GA_ARG_WRITE, evl);
 
   ctx->err = clEnqueueWriteBuffer(ctx->q, dst->buf, CL_TRUE, dstoff, sz, src,
-                                  num_ev, evl, NULL);
-  if (err != CL_SUCCESS) return GA_IMPL_ERROR;
-  if (dst->ev != NULL) clReleaseEvent(dst->ev);
-  dst->ev = NULL;
+                                  num_ev, num_ev == 0 ? NULL : evl, NULL);
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  return cl_wait(dst, GA_ARG_WRITE);
+}
+
+static int cl_read_async(void *dst, gpudata *src, size_t srcoff,
+                         size_t sz) {
+  cl_ctx *ctx = src->ctx;
+  cl_event evl[CL_MAX_WAIT];
+  cl_event ev;
+  cl_uint num_ev;
+
+  ASSERT_BUF(src);
+  ASSERT_CTX(ctx);
+
+  if (sz == 0) return GA_NO_ERROR;
 
+  num_ev = cl_wait_list(src, GA_ARG_READ, evl);
+
+  ctx->err = clEnqueueReadBuffer(ctx->q, src->buf, CL_FALSE, srcoff, sz, dst,
+                                 num_ev, num_ev == 0 ? NULL : evl, &ev);
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  cl_record(src, GA_ARG_READ, ev);
+  clReleaseEvent(ev);
+  return GA_NO_ERROR;
+}
+
+static int cl_write_async(gpudata *dst, size_t dstoff, const void *src,
+                          size_t sz) {
+  cl_ctx *ctx = dst->ctx;
+  cl_event evl[CL_MAX_WAIT];
+  cl_event ev;
+  cl_uint num_ev;
+
+  ASSERT_BUF(dst);
+  ASSERT_CTX(ctx);
+
+  if (sz == 0) return GA_NO_ERROR;
+
+  num_ev = cl_wait_list(dst, GA_ARG_WRITE, evl);
+
+  ctx->err = clEnqueueWriteBuffer(ctx->q, dst->buf, CL_FALSE, dstoff, sz, src,
+                                  num_ev, num_ev == 0 ? NULL : evl, &ev);
+  if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
+  cl_record(dst, GA_ARG_WRITE, ev);
+  clReleaseEvent(ev);
   return GA_NO_ERROR;
 }
 
@@ -671,7 +851,7 @@ static int cl_memset(gpudata *dst, size_t offset, int data) {
   size_t sz, bytes, n, ls, gs;
   gpukernel *m;
   cl_mem_flags fl;
-  int type;
+  int type, access;
   int r, res = GA_IMPL_ERROR;
 
   unsigned char val = (unsigned char)data;
@@ -739,8 +919,10 @@ static int cl_memset(gpudata *dst, size_t offset, int data) {
   sz = strlen(local_kern);
   rlk[0] = local_kern;
   type = GA_BUFFER;
+  access = GA_ARG_WRITE;
 
-  m = cl_newkernel((gpucontext *)ctx, 1, rlk, &sz, "kmemset", 1, &type, 0, &res, NULL);
+  m = cl_newkernel((gpucontext *)ctx, 1, rlk, &sz, "kmemset", 1, &type,
+                   &access, 0, &res, NULL);
   if (m == NULL) return res;
 
   /* Cheap kernel scheduling */
@@ -792,21 +974,101 @@ static int cl_check_extensions(const char **preamble, unsigned int *count,
   return GA_NO_ERROR;
 }
 
+/*
+ * Key for the disk cache.  The bin_id has the vendor and driver
+ * version but we also need the device since the binaries are
+ * specific to it.
+ */
+static int make_bin_key(cl_ctx *ctx, cl_device_id dev, strb *key,
+                        strb *src) {
+  char name[256];
+
+  if (clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(name), name,
+                      NULL) != CL_SUCCESS)
+    return -1;
+  strb_appends(key, ctx->bin_id);
+  strb_append0(key);
+  strb_appends(key, name);
+  strb_append0(key);
+  strb_appendb(key, src);
+  return strb_error(key);
+}
+
+/*
+ * Build a program from a binary in the disk cache.  Returns NULL if
+ * the binary is not usable, in which case it is removed from the
+ * cache.
+ */
+static cl_program load_bin(cl_ctx *ctx, cl_device_id dev, strb *key,
+                           strb *bin) {
+  cl_program p;
+  const unsigned char *b = (const unsigned char *)bin->s;
+
+  p = clCreateProgramWithBinary(ctx->ctx, 1, &dev, &bin->l, &b, NULL,
+                                &ctx->err);
+  if (ctx->err == CL_SUCCESS) {
+    ctx->err = clBuildProgram(p, 0, NULL, NULL, NULL, NULL);
+    if (ctx->err == CL_SUCCESS)
+      return p;
+    clReleaseProgram(p);
+  }
+  gpukernel_disk_cache_del(disk_cache, key);
+  return NULL;
+}
+
+/*
+ * Save the binary for `p` in the disk cache.  Failures are ignored.
+ * This takes ownership of the data in `key`.
+ */
+static void save_bin(cl_program p, strb *key) {
+  strb *k, *v;
+  unsigned char *b;
+  size_t sz;
+
+  k = memdup(key, sizeof(strb));
+  if (k == NULL) {
+    strb_clear(key);
+    return;
+  }
+  if (clGetProgramInfo(p, CL_PROGRAM_BINARY_SIZES, sizeof(sz), &sz,
+                       NULL) != CL_SUCCESS || sz == 0) {
+    strb_free(k);
+    return;
+  }
+  v = strb_alloc(sz);
+  if (v == NULL) {
+    strb_free(k);
+    return;
+  }
+  b = (unsigned char *)v->s;
+  if (clGetProgramInfo(p, CL_PROGRAM_BINARIES, sizeof(b), &b,
+                       NULL) != CL_SUCCESS) {
+    strb_free(k);
+    strb_free(v);
+    return;
+  }
+  v->l = sz;
+  gpukernel_disk_cache_add(disk_cache, k, v);
+}
+
 static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
                                const char **strings, const size_t *lengths,
                                const char *fname, unsigned int argcount,
-                               const int *types, int flags, int *ret,
-                               char **err_str) {
+                               const int *types, const int *access,
+                               int flags, int *ret, char **err_str) {
   cl_ctx *ctx = (cl_ctx *)c;
   gpukernel *res;
   cl_device_id dev;
   cl_program p;
+  strb sb = STRB_STATIC_INIT;
+  strb bkey = STRB_STATIC_INIT;
+  strb *psb, *bsb;
   // Sync this table size with the number of flags that can add stuff
   // at the beginning
   const char *preamble[5];
   size_t *newl = NULL;
   const char **news = NULL;
-  unsigned int n = 0;
+  unsigned int n = 0, i;
   int error;
   strb debug_msg = STRB_STATIC_INIT;
   size_t log_size;
@@ -856,8 +1118,46 @@ static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
       newl = (size_t *)lengths;
     }
 
+    for (i = 0; i < count+n; i++) {
+      if (newl == NULL || newl[i] == 0)
+        strb_appends(&sb, news[i]);
+      else
+        strb_appendn(&sb, news[i], newl[i]);
+    }
+    if (strb_error(&sb)) {
+      strb_clear(&sb);
+      if (n != 0) {
+        free(news);
+        free(newl);
+      }
+      FAIL(NULL, GA_MEMORY_ERROR);
+    }
+
+    /* Every kernel gets its own cl_kernel from the program so that
+       they don't share the arguments set with clSetKernelArg(). */
+    /* The cache takes a reference for us */
+    p = (cl_program)cache_get(ctx->kernel_cache, &sb);
+    if (p != NULL) {
+      strb_clear(&sb);
+      goto built;
+    }
+
+    if (disk_cache != NULL && make_bin_key(ctx, dev, &bkey, &sb) == 0) {
+      bsb = gpukernel_disk_cache_get(disk_cache, &bkey);
+      if (bsb != NULL) {
+        p = load_bin(ctx, dev, &bkey, bsb);
+        strb_free(bsb);
+        if (p != NULL) {
+          strb_clear(&bkey);
+          goto built;
+        }
+      }
+    }
+
     p = clCreateProgramWithSource(ctx->ctx, count+n, news, newl, &ctx->err);
     if (ctx->err != CL_SUCCESS) {
+      strb_clear(&sb);
+      strb_clear(&bkey);
       if (n != 0) {
         free(news);
         free(newl);
@@ -899,6 +1199,8 @@ static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
       // *err_str will be free()d by the caller (see docs in kernel.h)
     }
 
+    strb_clear(&sb);
+    strb_clear(&bkey);
     clReleaseProgram(p);
     if (n != 0) {
       free(news);
@@ -907,19 +1209,45 @@ static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
     FAIL(NULL, GA_IMPL_ERROR);
   }
 
+  if (bkey.l != 0)
+    save_bin(p, &bkey);
+
+ built:
   if (n != 0) {
     free(news);
     free(newl);
   }
 
+  if (sb.l != 0) {
+    psb = memdup(&sb, sizeof(strb));
+    if (psb == NULL) {
+      strb_clear(&sb);
+    } else {
+      /* One of the refs is for the cache.  If this fails, it will
+         free the key and release the program. */
+      clRetainProgram(p);
+      cache_add(ctx->kernel_cache, psb, p);
+    }
+  }
+
   res = malloc(sizeof(*res));
-  if (res == NULL) FAIL(NULL, GA_MEMORY_ERROR);
+  if (res == NULL) {
+    clReleaseProgram(p);
+    FAIL(NULL, GA_MEMORY_ERROR);
+  }
+  if (ga_lock_init(&res->lock) != 0) {
+    free(res);
+    clReleaseProgram(p);
+    FAIL(NULL, GA_SYS_ERROR);
+  }
   res->refcnt = 1;
   res->ev = NULL;
   res->argcount = argcount;
   res->k = clCreateKernel(p, fname, &ctx->err);
   res->types = NULL;  /* This avoids a crash in cl_releasekernel */
-  res->evr = NULL;   /* This avoids a crash in cl_releasekernel */
+  res->access = NULL;
+  res->name = NULL;
+  res->bufs = NULL;
   res->ctx = ctx;
   ctx->refcnt++;
   clReleaseProgram(p);
@@ -935,8 +1263,16 @@ static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
   }
   memcpy(res->types, types, argcount * sizeof(int));
 
-  res->evr = calloc(argcount, sizeof(cl_event *));
-  if (res->evr == NULL) {
+  res->access = calloc(argcount, sizeof(int));
+  if (res->access == NULL) {
+    cl_releasekernel(res);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  gpukernel_merge_access(res->access, argcount, types, access);
+
+  res->name = strdup(fname);
+  res->bufs = calloc(argcount, sizeof(gpudata *));
+  if (res->name == NULL || res->bufs == NULL) {
     cl_releasekernel(res);
     FAIL(NULL, GA_IMPL_ERROR);
   }
@@ -946,25 +1282,28 @@ static gpukernel *cl_newkernel(gpucontext *c, unsigned int count,
 
 static void cl_retainkernel(gpukernel *k) {
   ASSERT_KER(k);
-  k->refcnt++;
+  ga_ref_inc(&k->refcnt);
 }
 
 static void cl_releasekernel(gpukernel *k) {
   ASSERT_KER(k);
 
-  k->refcnt--;
-  if (k->refcnt == 0) {
+  if (ga_ref_dec(&k->refcnt) == 0) {
     CLEAR(k);
+    ga_lock_fini(&k->lock);
     if (k->ev != NULL) clReleaseEvent(k->ev);
     if (k->k) clReleaseKernel(k->k);
     cl_free_ctx(k->ctx);
     free(k->types);
-    free(k->evr);
+    free(k->access);
+    free(k->name);
+    free(k->bufs);
     free(k);
   }
 }
 
-static int cl_setkernelarg(gpukernel *k, unsigned int i, void *a) {
+/* Must be called with k->lock held */
+static int setkernelarg(gpukernel *k, unsigned int i, void *a) {
   cl_ctx *ctx = k->ctx;
   gpudata *btmp;
   cl_ulong temp;
@@ -975,21 +1314,21 @@ static int cl_setkernelarg(gpukernel *k, unsigned int i, void *a) {
   case GA_BUFFER:
     btmp = (gpudata *)a;
     ctx->err = clSetKernelArg(k->k, i, sizeof(cl_mem), &btmp->buf);
-    k->evr[i] = &btmp->ev;
+    k->bufs[i] = btmp;
     break;
   case GA_SIZE:
     temp = *((size_t *)a);
     ctx->err = clSetKernelArg(k->k, i, gpuarray_get_elsize(GA_ULONG), &temp);
-    k->evr[i] = NULL;
+    k->bufs[i] = NULL;
     break;
   case GA_SSIZE:
     stemp = *((ssize_t *)a);
     ctx->err = clSetKernelArg(k->k, i, gpuarray_get_elsize(GA_LONG), &stemp);
-    k->evr[i] = NULL;
+    k->bufs[i] = NULL;
     break;
   default:
     ctx->err = clSetKernelArg(k->k, i, gpuarray_get_elsize(k->types[i]), a);
-    k->evr[i] = NULL;
+    k->bufs[i] = NULL;
   }
   if (ctx->err != CL_SUCCESS) {
     return GA_IMPL_ERROR;
@@ -997,31 +1336,37 @@ static int cl_setkernelarg(gpukernel *k, unsigned int i, void *a) {
   return GA_NO_ERROR;
 }
 
-static int cl_callkernel(gpukernel *k, unsigned int n,
-                         const size_t *gs, const size_t *ls,
-                         size_t shared, void **args) {
+static int cl_setkernelarg(gpukernel *k, unsigned int i, void *a) {
+  int res;
+
+  ASSERT_KER(k);
+
+  if (i >= k->argcount)
+    return GA_VALUE_ERROR;
+
+  ga_lock_acquire(&k->lock);
+  res = setkernelarg(k, i, a);
+  ga_lock_release(&k->lock);
+  return res;
+}
+
+/* The arguments live on the shared cl_kernel, so this must be called
+   with k->lock held up to the point where the launch is enqueued and
+   k->ev updated. */
+static int launch(gpukernel *k, unsigned int n, const size_t *gs,
+                  const size_t *ls, size_t shared, void **args) {
   cl_ctx *ctx = k->ctx;
   size_t _gs[3];
   cl_event ev;
   cl_event *evw;
-  cl_device_id dev;
   cl_uint num_ev;
   cl_uint i;
-  int res = 0;
-
-  ASSERT_KER(k);
-  ASSERT_CTX(ctx);
-
-  if (n > 3)
-    return GA_VALUE_ERROR;
-
-  dev = get_dev(ctx->ctx, &res);
-  if (dev == NULL) return res;
+  int res;
 
   if (args != NULL) {
     for (i = 0; i < k->argcount; i++) {
-      err = cl_setkernelarg(k, i, args[i]);
-      if (err != GA_NO_ERROR) return err;
+      res = setkernelarg(k, i, args[i]);
+      if (res != GA_NO_ERROR) return res;
     }
   }
 
@@ -1031,21 +1376,23 @@ static int cl_callkernel(gpukernel *k, unsigned int n,
     if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
   }
 
-  evw = calloc(sizeof(cl_event), k->argcount);
-  if (evw == NULL) {
-    return GA_MEMORY_ERROR;
-  }
-
   num_ev = 0;
-  for (i = 0; i < k->argcount; i++) {
-    if (k->evr[i] != NULL && *k->evr[i] != NULL) {
-      evw[num_ev++] = *k->evr[i];
+  for (i = 0; i < k->argcount; i++)
+    if (k->bufs[i] != NULL)
+      num_ev += CL_MAX_WAIT;
+
+  evw = NULL;
+  if (num_ev != 0) {
+    evw = calloc(sizeof(cl_event), num_ev);
+    if (evw == NULL) {
+      return GA_MEMORY_ERROR;
     }
   }
 
-  if (num_ev == 0) {
-    free(evw);
-    evw = NULL;
+  num_ev = 0;
+  for (i = 0; i < k->argcount; i++) {
+    if (k->bufs[i] != NULL)
+      num_ev += cl_wait_list(k->bufs[i], k->access[i], evw + num_ev);
   }
 
   switch (n) {
@@ -1057,17 +1404,13 @@ static int cl_callkernel(gpukernel *k, unsigned int n,
     _gs[0] = gs[0] * ls[0];
   }
   ctx->err = clEnqueueNDRangeKernel(ctx->q, k->k, n, NULL, _gs, ls,
-                                    num_ev, evw, &ev);
+                                    num_ev, num_ev == 0 ? NULL : evw, &ev);
   free(evw);
   if (ctx->err != CL_SUCCESS) return GA_IMPL_ERROR;
 
   for (i = 0; i < k->argcount; i++) {
-    if (k->types[i] == GA_BUFFER) {
-      if (*k->evr[i] != NULL)
-        clReleaseEvent(*k->evr[i]);
-      *k->evr[i] = ev;
-      clRetainEvent(ev);
-    }
+    if (k->bufs[i] != NULL)
+      cl_record(k->bufs[i], k->access[i], ev);
   }
   if (k->ev != NULL)
     clReleaseEvent(k->ev);
@@ -1076,6 +1419,28 @@ static int cl_callkernel(gpukernel *k, unsigned int n,
   return GA_NO_ERROR;
 }
 
+static int cl_callkernel(gpukernel *k, unsigned int n,
+                         const size_t *gs, const size_t *ls,
+                         size_t shared, void **args) {
+  cl_ctx *ctx = k->ctx;
+  cl_device_id dev;
+  int res = 0;
+
+  ASSERT_KER(k);
+  ASSERT_CTX(ctx);
+
+  if (n > 3)
+    return GA_VALUE_ERROR;
+
+  dev = get_dev(ctx->ctx, &res);
+  if (dev == NULL) return res;
+
+  ga_lock_acquire(&k->lock);
+  res = launch(k, n, gs, ls, shared, args);
+  ga_lock_release(&k->lock);
+  return res;
+}
+
 static int cl_kernelbin(gpukernel *k, size_t *sz, void **obj) {
   cl_ctx *ctx = k->ctx;
   cl_program p;
@@ -1105,17 +1470,37 @@ static int cl_kernelbin(gpukernel *k, size_t *sz, void **obj) {
 }
 
 static int cl_sync(gpudata *b) {
-  cl_ctx *ctx = (cl_ctx *)b->ctx;
+  ASSERT_BUF(b);
+  ASSERT_CTX(b->ctx);
+
+  return cl_wait(b, GA_ARG_READ_WRITE);
+}
+
+static int cl_query(gpudata *b, int *done) {
+  cl_ctx *ctx = b->ctx;
+  cl_event evl[CL_MAX_WAIT];
+  cl_int status;
+  cl_uint n, i;
 
   ASSERT_BUF(b);
   ASSERT_CTX(ctx);
 
-  if (b->ev != NULL) {
-    ctx->err = clWaitForEvents(1, &b->ev);
-    if (ctx->err != GA_NO_ERROR)
+  *done = 1;
+  n = cl_wait_list(b, GA_ARG_READ_WRITE, evl);
+  for (i = 0; i < n; i++) {
+    ctx->err = clGetEventInfo(evl[i], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                              sizeof(status), &status, NULL);
+    if (ctx->err != CL_SUCCESS)
       return GA_IMPL_ERROR;
-    clReleaseEvent(b->ev);
-    b->ev = NULL;
+    /* Negative values are errors */
+    if (status < 0) {
+      ctx->err = status;
+      return GA_IMPL_ERROR;
+    }
+    if (status != CL_COMPLETE) {
+      *done = 0;
+      break;
+    }
   }
   return GA_NO_ERROR;
 }
@@ -1207,6 +1592,10 @@ static int cl_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = sz;
     return GA_NO_ERROR;
 
+  case GA_BUFFER_PROP_HOSTPOINTER:
+    /* Would need to keep the buffer mapped */
+    return GA_DEVSUP_ERROR;
+
   case GA_CTX_PROP_NUMPROCS:
     ctx->err = clGetContextInfo(ctx->ctx, CL_CONTEXT_DEVICES, sizeof(id),
                                 &id, NULL);
@@ -1286,6 +1675,7 @@ static int cl_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     /* There is no way to query free memory so we just return the
         largest block size */
   case GA_CTX_PROP_LARGEST_MEMBLOCK:
+  case GA_CTX_PROP_LARGEST_MEMBLOCK_PROBED:
     ctx->err = clGetContextInfo(ctx->ctx, CL_CONTEXT_DEVICES, sizeof(id), &id,
                                 NULL);
     if (ctx->err != GA_NO_ERROR)
@@ -1297,6 +1687,13 @@ static int cl_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((size_t *)res) = sz;
     return GA_NO_ERROR;
 
+  case GA_CTX_PROP_KERNEL_CACHE_HITS:
+  case GA_CTX_PROP_KERNEL_CACHE_MISSES:
+  case GA_CTX_PROP_KERNEL_CACHE_EVICTIONS:
+  case GA_CTX_PROP_KERNEL_CACHE_BYTES:
+    *((size_t *)res) = gpucontext_cache_stat(ctx->kernel_cache, prop_id);
+    return GA_NO_ERROR;
+
   case GA_CTX_PROP_NATIVE_FLOAT16:
     *((int *)res) = 0;
     return GA_NO_ERROR;
@@ -1433,6 +1830,30 @@ static int cl_property(gpucontext *c, gpudata *buf, gpukernel *k, int prop_id,
     *((const int **)res) = k->types;
     return GA_NO_ERROR;
 
+  case GA_KERNEL_PROP_ACCESS:
+    *((const int **)res) = k->access;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_NAME:
+    *((const char **)res) = k->name;
+    return GA_NO_ERROR;
+
+  case GA_KERNEL_PROP_BINSIZE:
+    {
+      cl_program p;
+      ctx->err = clGetKernelInfo(k->k, CL_KERNEL_PROGRAM, sizeof(p), &p, NULL);
+      if (ctx->err != CL_SUCCESS)
+        return GA_IMPL_ERROR;
+      /* There is only one device per context */
+      sz = 0;
+      ctx->err = clGetProgramInfo(p, CL_PROGRAM_BINARY_SIZES, sizeof(sz), &sz,
+                                  NULL);
+      if (ctx->err != CL_SUCCESS)
+        return GA_IMPL_ERROR;
+      *((size_t *)res) = sz;
+      return GA_NO_ERROR;
+    }
+
   default:
     return GA_INVALID_ERROR;
   }
@@ -1448,6 +1869,163 @@ static const char *cl_error(gpucontext *c) {
   }
 }
 
+static int cl_stream_set(gpucontext *c, gpustream *s) {
+  cl_ctx *ctx = (cl_ctx *)c;
+
+  ASSERT_CTX(ctx);
+  ctx->q = s == NULL ? ctx->def_q : s->q;
+  ctx->stream = s;
+  return GA_NO_ERROR;
+}
+
+static gpustream *cl_stream_alloc(gpucontext *c, int flags, int *ret) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  cl_command_queue_properties qprop;
+  cl_device_id id;
+  gpustream *res;
+
+  ASSERT_CTX(ctx);
+  if (flags != 0)
+    FAIL(NULL, GA_INVALID_ERROR);
+  if (ISSET(ctx->flags, GA_CTX_SINGLE_STREAM))
+    FAIL(NULL, GA_UNSUPPORTED_ERROR);
+
+  id = get_dev(ctx->ctx, ret);
+  if (id == NULL)
+    return NULL;
+  ctx->err = clGetDeviceInfo(id, CL_DEVICE_QUEUE_PROPERTIES, sizeof(qprop),
+                             &qprop, NULL);
+  if (ctx->err != CL_SUCCESS)
+    FAIL(NULL, GA_IMPL_ERROR);
+
+  res = malloc(sizeof(*res));
+  if (res == NULL)
+    FAIL(NULL, GA_MEMORY_ERROR);
+  /* Same properties as the default queue */
+  res->q = clCreateCommandQueue(ctx->ctx, id,
+                                (qprop&CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) |
+                                trace_qprop(),
+                                &ctx->err);
+  if (res->q == NULL) {
+    free(res);
+    FAIL(NULL, GA_IMPL_ERROR);
+  }
+  res->ctx = ctx;
+  res->refcnt = 1;
+  ctx->refcnt++;
+  TAG_STR(res);
+  return res;
+}
+
+static void cl_stream_retain(gpustream *s) {
+  ASSERT_STR(s);
+  s->refcnt++;
+}
+
+static void cl_stream_release(gpustream *s) {
+  cl_ctx *ctx = s->ctx;
+
+  ASSERT_STR(s);
+  s->refcnt--;
+  if (s->refcnt == 0) {
+    if (ctx->stream == s)
+      cl_stream_set((gpucontext *)ctx, NULL);
+    /* Pending commands still complete */
+    clReleaseCommandQueue(s->q);
+    CLEAR(s);
+    free(s);
+    cl_free_ctx(ctx);
+  }
+}
+
+static int cl_stream_sync(gpustream *s) {
+  cl_ctx *ctx = s->ctx;
+
+  ASSERT_STR(s);
+  ctx->err = clFinish(s->q);
+  if (ctx->err != CL_SUCCESS)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+/* Markers around the launch rather than the event of the launch,
+   which is kept on the kernel and may be replaced by another thread */
+typedef struct _cl_timer {
+  cl_event start;
+  cl_event end;
+} cl_timer;
+
+static int cl_timer_start(gpucontext *c, void **t) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  cl_command_queue_properties qprop;
+  cl_timer *res;
+
+  ASSERT_CTX(ctx);
+  ctx->err = clGetCommandQueueInfo(ctx->q, CL_QUEUE_PROPERTIES,
+                                   sizeof(qprop), &qprop, NULL);
+  if (ctx->err != CL_SUCCESS)
+    return GA_IMPL_ERROR;
+  /* The queue has to be created with profiling, see trace_qprop() */
+  if (!(qprop & CL_QUEUE_PROFILING_ENABLE))
+    return GA_DEVSUP_ERROR;
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    return GA_MEMORY_ERROR;
+  ctx->err = clEnqueueMarker(ctx->q, &res->start);
+  if (ctx->err != CL_SUCCESS) {
+    free(res);
+    return GA_IMPL_ERROR;
+  }
+  *t = res;
+  return GA_NO_ERROR;
+}
+
+static int cl_timer_stop(gpucontext *c, gpukernel *k, void *t) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  cl_timer *tm = (cl_timer *)t;
+
+  ASSERT_CTX(ctx);
+  ctx->err = clEnqueueMarker(ctx->q, &tm->end);
+  if (ctx->err != CL_SUCCESS)
+    return GA_IMPL_ERROR;
+  return GA_NO_ERROR;
+}
+
+static int cl_timer_read(gpucontext *c, void *ref, void *t,
+                         double *start, double *end) {
+  cl_ctx *ctx = (cl_ctx *)c;
+  cl_timer *r = (cl_timer *)ref;
+  cl_timer *tm = (cl_timer *)t;
+  cl_ulong r_end, s, e;
+
+  ASSERT_CTX(ctx);
+  ctx->err = clWaitForEvents(1, &tm->end);
+  if (ctx->err == CL_SUCCESS)
+    ctx->err = clGetEventProfilingInfo(r->end, CL_PROFILING_COMMAND_END,
+                                       sizeof(r_end), &r_end, NULL);
+  if (ctx->err == CL_SUCCESS)
+    ctx->err = clGetEventProfilingInfo(tm->start, CL_PROFILING_COMMAND_END,
+                                       sizeof(s), &s, NULL);
+  if (ctx->err == CL_SUCCESS)
+    ctx->err = clGetEventProfilingInfo(tm->end, CL_PROFILING_COMMAND_END,
+                                       sizeof(e), &e, NULL);
+  if (ctx->err != CL_SUCCESS)
+    return GA_IMPL_ERROR;
+  *start = (double)(int64_t)(s - r_end);
+  *end = (double)(int64_t)(e - r_end);
+  return GA_NO_ERROR;
+}
+
+static void cl_timer_release(gpucontext *c, void *t) {
+  cl_timer *tm = (cl_timer *)t;
+
+  if (tm->start != NULL)
+    clReleaseEvent(tm->start);
+  if (tm->end != NULL)
+    clReleaseEvent(tm->end);
+  free(tm);
+}
+
 GPUARRAY_LOCAL
 const gpuarray_buffer_ops opencl_ops = {cl_get_platform_count,
                                         cl_get_device_count,
@@ -1470,4 +2048,23 @@ const gpuarray_buffer_ops opencl_ops = {cl_get_platform_count,
                                         cl_sync,
                                         cl_transfer,
                                         cl_property,
-                                        cl_error};
+                                        cl_error,
+                                        cl_stream_alloc,
+                                        cl_stream_retain,
+                                        cl_stream_release,
+                                        cl_stream_sync,
+                                        cl_stream_set,
+                                        cl_read_async,
+                                        cl_write_async,
+                                        cl_query,
+                                        NULL, /* buffer_trim */
+                                        NULL, /* capture_begin */
+                                        NULL, /* capture_end */
+                                        NULL, /* graph_launch */
+                                        NULL, /* graph_numkernels */
+                                        NULL, /* graph_setargs */
+                                        NULL, /* graph_release */
+                                        cl_timer_start,
+                                        cl_timer_stop,
+                                        cl_timer_read,
+                                        cl_timer_release};
@@ -0,0 +1,428 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <gpuarray/cmdlist.h>
+#include <gpuarray/error.h>
+#include <gpuarray/types.h>
+#include <gpuarray/util.h>
+
+#include "private.h"
+
+#define OP_CALL   0
+#define OP_MOVE   1
+#define OP_MEMSET 2
+#define OP_GEMM   3
+
+typedef struct _cmd {
+  int kind;
+  union {
+    struct {
+      gpukernel *k;
+      const int *types; /* Belongs to k */
+      /* Pointers to the arguments followed by the scalar values */
+      void **args;
+      unsigned int nargs;
+      unsigned int n;
+      size_t gs[3];
+      size_t ls[3];
+      size_t shared;
+    } call;
+    struct {
+      gpudata *dst;
+      gpudata *src;
+      size_t dstoff;
+      size_t srcoff;
+      size_t sz;
+    } move;
+    struct {
+      gpudata *dst;
+      size_t dstoff;
+      int data;
+    } memset;
+    struct {
+      int typecode;
+      cb_order order;
+      cb_transpose transA;
+      cb_transpose transB;
+      size_t M, N, K;
+      double alpha;
+      double beta;
+      gpudata *A, *B, *C;
+      size_t offA, offB, offC;
+      size_t lda, ldb, ldc;
+    } gemm;
+  } u;
+} cmd;
+
+struct _GpuCmdList {
+  gpucontext *ctx;
+  cmd *cmds;
+  unsigned int n; /* Number of commands */
+  unsigned int alloc; /* Allocated size of cmds */
+  int flags;
+  /* Graph of the current commands, see GpuCmdList_run() */
+  gpugraph *graph;
+  int captured;
+};
+
+/* Scalar arguments are stored at this alignment */
+#define ARG_ALIGN 8
+#define ROUND_ARG(sz) (((sz) + ARG_ALIGN - 1) & ~(size_t)(ARG_ALIGN - 1))
+
+static size_t arg_size(int typecode) {
+  const gpuarray_type *t;
+  if (typecode == GA_POINTER)
+    return sizeof(void *);
+  t = gpuarray_get_type(typecode);
+  return t->size;
+}
+
+/* Any change to the list makes the graph out of date */
+static void drop_graph(GpuCmdList *l) {
+  if (l->graph != NULL)
+    gpugraph_release(l->graph);
+  l->graph = NULL;
+  l->captured = 0;
+}
+
+static cmd *new_cmd(GpuCmdList *l, int kind) {
+  cmd *tmp;
+
+  if (l->n == l->alloc) {
+    tmp = realloc(l->cmds, l->alloc * 2 * sizeof(cmd));
+    if (tmp == NULL)
+      return NULL;
+    l->cmds = tmp;
+    l->alloc *= 2;
+  }
+  drop_graph(l);
+  tmp = &l->cmds[l->n++];
+  memset(tmp, 0, sizeof(*tmp));
+  tmp->kind = kind;
+  return tmp;
+}
+
+static void clear_cmd(cmd *c) {
+  unsigned int i;
+
+  switch (c->kind) {
+  case OP_CALL:
+    for (i = 0; i < c->u.call.nargs; i++)
+      if (c->u.call.types[i] == GA_BUFFER)
+        gpudata_release((gpudata *)c->u.call.args[i]);
+    free(c->u.call.args);
+    gpukernel_release(c->u.call.k);
+    break;
+  case OP_MOVE:
+    gpudata_release(c->u.move.dst);
+    gpudata_release(c->u.move.src);
+    break;
+  case OP_MEMSET:
+    gpudata_release(c->u.memset.dst);
+    break;
+  case OP_GEMM:
+    gpudata_release(c->u.gemm.A);
+    gpudata_release(c->u.gemm.B);
+    gpudata_release(c->u.gemm.C);
+    break;
+  }
+}
+
+static int check_buf(GpuCmdList *l, gpudata *b, size_t off, size_t sz) {
+  size_t bsz;
+  int err;
+
+  if (b == NULL || gpudata_context(b) != l->ctx)
+    return GA_VALUE_ERROR;
+  err = gpudata_property(b, GA_BUFFER_PROP_SIZE, &bsz);
+  if (err != GA_NO_ERROR)
+    return err;
+  if (off > bsz || bsz - off < sz)
+    return GA_VALUE_ERROR;
+  return GA_NO_ERROR;
+}
+
+GpuCmdList *GpuCmdList_new(gpucontext *ctx, int flags) {
+  GpuCmdList *res;
+
+  if (flags & ~GPUCMDLIST_NO_GRAPH)
+    return NULL;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    return NULL;
+  res->ctx = ctx;
+  res->flags = flags;
+  res->alloc = 16;
+  res->cmds = calloc(res->alloc, sizeof(cmd));
+  if (res->cmds == NULL) {
+    free(res);
+    return NULL;
+  }
+  return res;
+}
+
+void GpuCmdList_reset(GpuCmdList *l) {
+  unsigned int i;
+  drop_graph(l);
+  for (i = 0; i < l->n; i++)
+    clear_cmd(&l->cmds[i]);
+  l->n = 0;
+}
+
+void GpuCmdList_free(GpuCmdList *l) {
+  GpuCmdList_reset(l);
+  free(l->cmds);
+  free(l);
+}
+
+unsigned int GpuCmdList_size(GpuCmdList *l) {
+  return l->n;
+}
+
+int GpuCmdList_call(GpuCmdList *l, GpuKernel *k, unsigned int n,
+                    const size_t *gs, const size_t *ls, size_t shared,
+                    void **args) {
+  const int *types;
+  unsigned int nargs, i;
+  size_t sz, off;
+  void **copy;
+  char *data;
+  cmd *c;
+  int err;
+
+  if (gpukernel_context(k->k) != l->ctx)
+    return GA_VALUE_ERROR;
+  if (n == 0 || n > 3)
+    return GA_VALUE_ERROR;
+  for (i = 0; i < n; i++)
+    if (gs[i] == 0 || ls[i] == 0)
+      return GA_VALUE_ERROR;
+  if (args == NULL)
+    args = k->args;
+
+  err = gpukernel_property(k->k, GA_KERNEL_PROP_NUMARGS, &nargs);
+  if (err != GA_NO_ERROR)
+    return err;
+  err = gpukernel_property(k->k, GA_KERNEL_PROP_TYPES, &types);
+  if (err != GA_NO_ERROR)
+    return err;
+
+  off = ROUND_ARG(nargs * sizeof(void *));
+  sz = off;
+  for (i = 0; i < nargs; i++) {
+    if (args[i] == NULL)
+      return GA_VALUE_ERROR;
+    if (types[i] == GA_BUFFER) {
+      if (gpudata_context((gpudata *)args[i]) != l->ctx)
+        return GA_VALUE_ERROR;
+    } else {
+      if (arg_size(types[i]) == (size_t)-1)
+        return GA_VALUE_ERROR;
+      sz += ROUND_ARG(arg_size(types[i]));
+    }
+  }
+
+  copy = malloc(sz);
+  if (copy == NULL)
+    return GA_MEMORY_ERROR;
+  c = new_cmd(l, OP_CALL);
+  if (c == NULL) {
+    free(copy);
+    return GA_MEMORY_ERROR;
+  }
+
+  data = (char *)copy;
+  for (i = 0; i < nargs; i++) {
+    if (types[i] == GA_BUFFER) {
+      copy[i] = args[i];
+      gpudata_retain((gpudata *)args[i]);
+    } else {
+      copy[i] = data + off;
+      memcpy(copy[i], args[i], arg_size(types[i]));
+      off += ROUND_ARG(arg_size(types[i]));
+    }
+  }
+  gpukernel_retain(k->k);
+  c->u.call.k = k->k;
+  c->u.call.types = types;
+  c->u.call.args = copy;
+  c->u.call.nargs = nargs;
+  c->u.call.n = n;
+  for (i = 0; i < n; i++) {
+    c->u.call.gs[i] = gs[i];
+    c->u.call.ls[i] = ls[i];
+  }
+  c->u.call.shared = shared;
+  return GA_NO_ERROR;
+}
+
+int GpuCmdList_move(GpuCmdList *l, gpudata *dst, size_t dstoff,
+                    gpudata *src, size_t srcoff, size_t sz) {
+  cmd *c;
+  int err;
+
+  err = check_buf(l, dst, dstoff, sz);
+  if (err != GA_NO_ERROR)
+    return err;
+  err = check_buf(l, src, srcoff, sz);
+  if (err != GA_NO_ERROR)
+    return err;
+  c = new_cmd(l, OP_MOVE);
+  if (c == NULL)
+    return GA_MEMORY_ERROR;
+  gpudata_retain(dst);
+  gpudata_retain(src);
+  c->u.move.dst = dst;
+  c->u.move.dstoff = dstoff;
+  c->u.move.src = src;
+  c->u.move.srcoff = srcoff;
+  c->u.move.sz = sz;
+  return GA_NO_ERROR;
+}
+
+int GpuCmdList_memset(GpuCmdList *l, gpudata *dst, size_t dstoff, int data) {
+  cmd *c;
+  int err;
+
+  err = check_buf(l, dst, dstoff, 0);
+  if (err != GA_NO_ERROR)
+    return err;
+  c = new_cmd(l, OP_MEMSET);
+  if (c == NULL)
+    return GA_MEMORY_ERROR;
+  gpudata_retain(dst);
+  c->u.memset.dst = dst;
+  c->u.memset.dstoff = dstoff;
+  c->u.memset.data = data;
+  return GA_NO_ERROR;
+}
+
+int GpuCmdList_gemm(GpuCmdList *l, int typecode, cb_order order,
+                    cb_transpose transA, cb_transpose transB,
+                    size_t M, size_t N, size_t K, double alpha,
+                    gpudata *A, size_t offA, size_t lda,
+                    gpudata *B, size_t offB, size_t ldb, double beta,
+                    gpudata *C, size_t offC, size_t ldc) {
+  cmd *c;
+  int err;
+
+  if (typecode != GA_HALF && typecode != GA_FLOAT && typecode != GA_DOUBLE)
+    return GA_UNSUPPORTED_ERROR;
+  if ((err = check_buf(l, A, 0, 0)) != GA_NO_ERROR ||
+      (err = check_buf(l, B, 0, 0)) != GA_NO_ERROR ||
+      (err = check_buf(l, C, 0, 0)) != GA_NO_ERROR)
+    return err;
+  err = gpublas_setup(l->ctx);
+  if (err != GA_NO_ERROR)
+    return err;
+  c = new_cmd(l, OP_GEMM);
+  if (c == NULL)
+    return GA_MEMORY_ERROR;
+  gpudata_retain(A);
+  gpudata_retain(B);
+  gpudata_retain(C);
+  c->u.gemm.typecode = typecode;
+  c->u.gemm.order = order;
+  c->u.gemm.transA = transA;
+  c->u.gemm.transB = transB;
+  c->u.gemm.M = M;
+  c->u.gemm.N = N;
+  c->u.gemm.K = K;
+  c->u.gemm.alpha = alpha;
+  c->u.gemm.A = A;
+  c->u.gemm.offA = offA;
+  c->u.gemm.lda = lda;
+  c->u.gemm.B = B;
+  c->u.gemm.offB = offB;
+  c->u.gemm.ldb = ldb;
+  c->u.gemm.beta = beta;
+  c->u.gemm.C = C;
+  c->u.gemm.offC = offC;
+  c->u.gemm.ldc = ldc;
+  return GA_NO_ERROR;
+}
+
+static int run_gemm(const cmd *c) {
+  switch (c->u.gemm.typecode) {
+  case GA_HALF:
+    return gpublas_hgemm(c->u.gemm.order, c->u.gemm.transA, c->u.gemm.transB,
+                         c->u.gemm.M, c->u.gemm.N, c->u.gemm.K,
+                         (float)c->u.gemm.alpha,
+                         c->u.gemm.A, c->u.gemm.offA, c->u.gemm.lda,
+                         c->u.gemm.B, c->u.gemm.offB, c->u.gemm.ldb,
+                         (float)c->u.gemm.beta,
+                         c->u.gemm.C, c->u.gemm.offC, c->u.gemm.ldc);
+  case GA_FLOAT:
+    return gpublas_sgemm(c->u.gemm.order, c->u.gemm.transA, c->u.gemm.transB,
+                         c->u.gemm.M, c->u.gemm.N, c->u.gemm.K,
+                         (float)c->u.gemm.alpha,
+                         c->u.gemm.A, c->u.gemm.offA, c->u.gemm.lda,
+                         c->u.gemm.B, c->u.gemm.offB, c->u.gemm.ldb,
+                         (float)c->u.gemm.beta,
+                         c->u.gemm.C, c->u.gemm.offC, c->u.gemm.ldc);
+  default:
+    return gpublas_dgemm(c->u.gemm.order, c->u.gemm.transA, c->u.gemm.transB,
+                         c->u.gemm.M, c->u.gemm.N, c->u.gemm.K,
+                         c->u.gemm.alpha,
+                         c->u.gemm.A, c->u.gemm.offA, c->u.gemm.lda,
+                         c->u.gemm.B, c->u.gemm.offB, c->u.gemm.ldb,
+                         c->u.gemm.beta,
+                         c->u.gemm.C, c->u.gemm.offC, c->u.gemm.ldc);
+  }
+}
+
+/* Queue the commands one by one */
+static int replay(GpuCmdList *l) {
+  const cmd *c;
+  unsigned int i;
+  int err = GA_NO_ERROR;
+
+  for (i = 0; i < l->n && err == GA_NO_ERROR; i++) {
+    c = &l->cmds[i];
+    switch (c->kind) {
+    case OP_CALL:
+      err = gpukernel_call(c->u.call.k, c->u.call.n, c->u.call.gs,
+                           c->u.call.ls, c->u.call.shared, c->u.call.args);
+      break;
+    case OP_MOVE:
+      err = gpudata_move(c->u.move.dst, c->u.move.dstoff, c->u.move.src,
+                         c->u.move.srcoff, c->u.move.sz);
+      break;
+    case OP_MEMSET:
+      err = gpudata_memset(c->u.memset.dst, c->u.memset.dstoff,
+                           c->u.memset.data);
+      break;
+    case OP_GEMM:
+      err = run_gemm(c);
+      break;
+    }
+  }
+  return err;
+}
+
+int GpuCmdList_run(GpuCmdList *l) {
+  gpugraph *g;
+  int err;
+
+  if (l->graph != NULL)
+    return gpugraph_launch(l->graph);
+  if (l->n == 0)
+    return GA_NO_ERROR;
+
+  /* Only try once per version of the list, if this fails we stay
+     with the plain replay. */
+  if (!(l->flags & GPUCMDLIST_NO_GRAPH) && !l->captured) {
+    l->captured = 1;
+    if (gpucontext_capture_begin(l->ctx) == GA_NO_ERROR) {
+      err = replay(l);
+      g = gpucontext_capture_end(l->ctx, NULL);
+      if (err == GA_NO_ERROR && g != NULL) {
+        l->graph = g;
+        return gpugraph_launch(g);
+      }
+      gpugraph_release(g);
+    }
+  }
+  return replay(l);
+}
@@ -7,20 +7,23 @@
 #include <gpuarray/util.h>
 
 #include "private.h"
+#include "util/intdiv.h"
 #include "util/strb.h"
+#include "util/xxhash.h"
 
 struct _GpuElemwise {
   const char *expr; /* Expression code (to be able to build kernels on-demand) */
   const char *preamble; /* Preamble code */
   gpuelemwise_arg *args; /* Argument descriptors */
-  GpuKernel k_contig; /* Contiguous kernel */
-  GpuKernel *k_basic; /* Normal basic kernels */
-  GpuKernel *k_basic_32; /* 32-bit address basic kernels */
-  size_t *dims; /* Preallocated shape buffer for dimension collapsing */
-  ssize_t **strides; /* Preallocated strides buffer for dimension collapsing */
-  unsigned int nd; /* Current maximum number of dimensions allocated */
+  gpukernel *k_contig; /* Contiguous kernel */
+  gpukernel *k_vec; /* Contiguous kernel with vector loads (on demand) */
+  gpukernel **k_basic; /* Normal basic kernels */
+  gpukernel **k_basic_32; /* 32-bit address basic kernels */
+  unsigned int nd; /* Number of dimensions kept in k_basic and k_basic_32 */
   unsigned int n; /* Number of arguments */
   unsigned int narray; /* Number of array arguments */
+  unsigned int vec; /* Elements per vector load or 0 if not possible */
+  unsigned int refcnt; /* Shared through the context cache */
   int flags; /* Flags for the operation (none at the moment */
 };
 
@@ -32,9 +35,19 @@ STATIC_ASSERT(GEN_CONVERT_F16 == GE_CONVERT_F16, same_flags_value_elem1);
 
 #define is_array(a) (ISCLR((a).flags, GE_SCALAR))
 #define is_output(a) (ISSET((a).flags, GE_WRITE))
-
-static inline int k_initialized(GpuKernel *k) {
-  return k->k != NULL;
+/* Kernel argument access flags for an array */
+#define arg_access(a) ((ISSET((a).flags, GE_READ) ? GA_ARG_READ : 0) |  \
+                       (ISSET((a).flags, GE_WRITE) ? GA_ARG_WRITE : 0))
+
+/*
+ * Keep only the kernel from a GpuKernel built by one of the gen_*
+ * functions, the arguments are per call (see struct ge_scratch).
+ */
+static gpukernel *take_kernel(GpuKernel *k) {
+  gpukernel *res = k->k;
+  k->k = NULL;
+  GpuKernel_clear(k);
+  return res;
 }
 
 static inline const char *ctype(int typecode) {
@@ -85,41 +98,6 @@ static void free_args(unsigned int n, gpuelemwise_arg *args) {
   free(args);
 }
 
-#define MUL_NO_OVERFLOW ((size_t)1 << (sizeof(size_t) * 4))
-
-static int reallocaz(void **p, size_t elsz, size_t old, size_t new) {
-  char *res;
-
-  assert(old <= new);
-
-  if ((new >= MUL_NO_OVERFLOW || elsz >= MUL_NO_OVERFLOW) &&
-      new > 0 && SIZE_MAX / new < elsz) {
-    return 1;
-  }
-  res = realloc(*p, elsz*new);
-  if (res == NULL) return 1;
-  memset(res + (elsz*old), 0, elsz*(new-old));
-  *p = (void *)res;
-  return 0;
-}
-
-static int ge_grow(GpuElemwise *ge, unsigned int nd) {
-  unsigned int i;
-
-  assert(nd > ge->nd);
-
-  if (reallocaz((void **)&ge->k_basic, sizeof(GpuKernel), ge->nd, nd) ||
-      reallocaz((void **)&ge->k_basic_32, sizeof(GpuKernel), ge->nd, nd) ||
-      reallocaz((void **)&ge->dims, sizeof(size_t), ge->nd, nd))
-    return 1;
-  for (i = 0; i < ge->narray; i++) {
-    if (reallocaz((void **)&ge->strides[i], sizeof(ssize_t), ge->nd, nd))
-      return 1;
-  }
-  ge->nd = nd;
-  return 0;
-}
-
 static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
                                      char **err_str,
                                      const char *preamble,
@@ -130,7 +108,7 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
                                      int gen_flags) {
   strb sb = STRB_STATIC_INIT;
   unsigned int i, _i, j;
-  int *ktypes;
+  int *ktypes, *kaccess;
   size_t p;
   char *size = "ga_size", *ssize = "ga_ssize";
   int flags = GA_USE_CLUDA;
@@ -144,6 +122,9 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
   flags |= gpuarray_type_flagsa(n, args);
 
   p = 1 + nd;
+  /* The 32-bit version divides with a multiply and a shift */
+  if (ISSET(gen_flags, GEN_ADDR32) && nd > 1)
+    p += 2 * (nd - 1);
   for (j = 0; j < n; j++) {
     p += ISSET(args[j].flags, GE_SCALAR) ? 1 : (2 + nd);
   }
@@ -151,6 +132,11 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
   ktypes = calloc(p, sizeof(int));
   if (ktypes == NULL)
     return GA_MEMORY_ERROR;
+  kaccess = calloc(p, sizeof(int));
+  if (kaccess == NULL) {
+    free(ktypes);
+    return GA_MEMORY_ERROR;
+  }
 
   p = 0;
 
@@ -162,11 +148,20 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
     strb_appendf(&sb, "const ga_size dim%u, ", i);
     ktypes[p++] = GA_SIZE;
   }
+  if (ISSET(gen_flags, GEN_ADDR32)) {
+    for (i = 1; i < nd; i++) {
+      strb_appendf(&sb, "const ga_uint dim%u_m, const ga_uint dim%u_s, ",
+                   i, i);
+      ktypes[p++] = GA_UINT;
+      ktypes[p++] = GA_UINT;
+    }
+  }
   for (j = 0; j < n; j++) {
     if (is_array(args[j])) {
       strb_appendf(&sb, "GLOBAL_MEM %s *%s_data, const ga_size %s_offset%s",
                    ctype(args[j].typecode), args[j].name, args[j].name,
                    nd == 0 ? "" : ", ");
+      kaccess[p] = arg_access(args[j]);
       ktypes[p++] = GA_BUFFER;
       ktypes[p++] = GA_SIZE;
 
@@ -189,6 +184,8 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
   strb_appends(&sb, "for(i = idx; i < n; i += numThreads) {\n");
   if (nd > 0)
     strb_appendf(&sb, "%s ii = i;\n%s pos;\n", size, size);
+  if (nd > 1 && ISSET(gen_flags, GEN_ADDR32))
+    strb_appends(&sb, "ga_uint q;\n");
   for (j = 0; j < n; j++) {
     if (is_array(args[j]))
       strb_appendf(&sb, "%s %s_p = %s_offset;\n",
@@ -196,7 +193,12 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
   }
   for (_i = nd; _i > 0; _i--) {
     i = _i - 1;
-    if (i > 0)
+    if (i > 0 && ISSET(gen_flags, GEN_ADDR32)) {
+      char dim[16];
+      snprintf(dim, sizeof(dim), "dim%u", i);
+      intdiv32_append(&sb, "q", "pos", "ii", dim);
+      strb_appends(&sb, "ii = q;\n");
+    } else if (i > 0)
       strb_appendf(&sb, "pos = ii %% (%s)dim%u;\nii = ii / (%s)dim%u;\n", size, i, size, i);
     else
       strb_appends(&sb, "pos = ii;\n");
@@ -241,40 +243,74 @@ static int gen_elemwise_basic_kernel(GpuKernel *k, gpucontext *ctx,
   }
 
   res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "elem",
-                       p, ktypes, flags, err_str);
+                       p, ktypes, kaccess, flags, err_str);
  bail:
   free(ktypes);
+  free(kaccess);
   strb_clear(&sb);
   return res;
 }
 
-static ssize_t **strides_array(unsigned int num, unsigned int nd) {
-  ssize_t **res = calloc(num, sizeof(ssize_t *));
+/*
+ * Storage for the dimension collapsing and the kernel arguments of a
+ * single call.  It lives on the stack of GpuElemwise_call() so that
+ * the same GpuElemwise can be used by many threads at once.  Small
+ * calls fit in `buf`, bigger ones use `heap`.
+ */
+struct ge_scratch {
+  size_t *dims;
+  ssize_t **strides;
+  void **kargs;
+  intdiv32 *divs;
+  void *heap;
+  size_t buf[128];
+};
+
+static int scratch_init(struct ge_scratch *s, unsigned int nd,
+                        unsigned int narray, unsigned int nargs) {
+  size_t sz;
+  char *p;
   unsigned int i;
 
-  if (res == NULL) return NULL;
-  for (i = 0; i < num; i++) {
-    res[i] = calloc(nd, sizeof(ssize_t));
-    if (res[i] == NULL)
-      goto bail;
+  /* Everything but the divs is pointer-sized, so it stays aligned */
+  sz = nd * sizeof(size_t) + narray * (sizeof(ssize_t *) +
+                                       nd * sizeof(ssize_t)) +
+    nargs * sizeof(void *) + nd * sizeof(intdiv32);
+  if (sz <= sizeof(s->buf)) {
+    p = (char *)s->buf;
+  } else {
+    s->heap = malloc(sz);
+    if (s->heap == NULL)
+      return GA_MEMORY_ERROR;
+    p = s->heap;
   }
+  s->dims = (size_t *)p;
+  p += nd * sizeof(size_t);
+  s->strides = (ssize_t **)p;
+  p += narray * sizeof(ssize_t *);
+  for (i = 0; i < narray; i++) {
+    s->strides[i] = (ssize_t *)p;
+    p += nd * sizeof(ssize_t);
+  }
+  s->kargs = (void **)p;
+  p += nargs * sizeof(void *);
+  s->divs = (intdiv32 *)p;
+  return GA_NO_ERROR;
+}
 
-  return res;
-
- bail:
-  for (i = 0; i < num; i++)
-    free(res[i]);
-  free(res);
-  return NULL;
+static void scratch_clear(struct ge_scratch *s) {
+  free(s->heap);
+  s->heap = NULL;
 }
 
 static int check_basic(GpuElemwise *ge, void **args, int flags,
-                       size_t *_n, unsigned int *_nd, size_t **_dims,
-                       ssize_t ***_strides, int *_call32) {
+                       struct ge_scratch *s, size_t *_n, unsigned int *_nd,
+                       int *_call32) {
   size_t n;
   GpuArray *a = NULL, *v;
-  unsigned int i, j, p, num_arrays = 0, nd = 0, nnd;
+  unsigned int i, j, p, num_arrays = 0, nd = 0;
   int call32 = 1;
+  int err;
 
   /* Go through the list and grab some info */
   for (i = 0; i < ge->n; i++) {
@@ -293,23 +329,21 @@ static int check_basic(GpuElemwise *ge, void **args, int flags,
   if (a == NULL)
     return GA_VALUE_ERROR;
 
-  /* Check if we need to grow the internal buffers */
-  if (nd > ge->nd) {
-    nnd = ge->nd * 2;
-    while (nd > nnd) nnd *= 2;
-    if (ge_grow(ge, nnd))
-      return GA_MEMORY_ERROR;
-  }
+  /* n, the dims, the divs and then each array with its strides */
+  err = scratch_init(s, nd, num_arrays,
+                     1 + 3 * nd + num_arrays * (2 + nd) + ge->n);
+  if (err != GA_NO_ERROR)
+    return err;
 
   /* Now we know that all array arguments have the same number of
      dimensions and that the expected output size is the size of a */
 
   /* And copy their initial values in */
-  memcpy(ge->dims, a->dimensions, nd*sizeof(size_t));
+  memcpy(s->dims, a->dimensions, nd*sizeof(size_t));
   p = 0;
   for (i = 0; i < ge->n; i++) {
     if (is_array(ge->args[i])) {
-      memcpy(ge->strides[p], ((GpuArray *)args[i])->strides, nd*sizeof(ssize_t));
+      memcpy(s->strides[p], ((GpuArray *)args[i])->strides, nd*sizeof(ssize_t));
       p++;
     }
   }
@@ -326,7 +360,7 @@ static int check_basic(GpuElemwise *ge, void **args, int flags,
     for (i = 0; i < ge->n; i++) {
       if (is_array(ge->args[i])) {
         v = (GpuArray *)args[i];
-        if (ge->dims[j] != v->dimensions[j]) {
+        if (s->dims[j] != v->dimensions[j]) {
           /* We can't broadcast outputs */
           if (ISCLR(flags, GE_BROADCAST) || is_output(ge->args[i]) ||
               v->dimensions[j] != 1) {
@@ -336,62 +370,76 @@ static int check_basic(GpuElemwise *ge, void **args, int flags,
         /* If the dimension is 1 set the strides to 0 regardless since
            it won't change anything in the non-broadcast case. */
         if (v->dimensions[j] == 1) {
-          ge->strides[p][j] = 0;
+          s->strides[p][j] = 0;
         }
         call32 &= v->offset < ADDR32_MAX;
-        call32 &= (SADDR32_MIN < ge->strides[p][j] &&
-                   ge->strides[p][j] < SADDR32_MAX);
+        call32 &= (SADDR32_MIN < s->strides[p][j] &&
+                   s->strides[p][j] < SADDR32_MAX);
         p++;
       } /* is_array() */
     } /* for each arg */
     /* We have the final value in dims[j] */
-    n *= ge->dims[j];
+    n *= s->dims[j];
   } /* for each dim */
 
   call32 &= n < ADDR32_MAX;
 
   if (ISCLR(flags, GE_NOCOLLAPSE) && nd > 1) {
-    gpuarray_elemwise_collapse(num_arrays, &nd, ge->dims, ge->strides);
+    gpuarray_elemwise_collapse(num_arrays, &nd, s->dims, s->strides);
   }
 
   *_n = n;
   *_nd = nd;
-  *_dims = ge->dims;
-  *_strides = ge->strides;
   *_call32 = call32;
 
   return GA_NO_ERROR;
 }
 
 static int call_basic(GpuElemwise *ge, void **args, size_t n, unsigned int nd,
-                      size_t *dims, ssize_t **strs, int call32) {
-  GpuKernel *k;
+                      struct ge_scratch *s, int call32) {
+  GpuKernel k;
+  GpuKernel tmp;
+  gpukernel **slot = NULL;
+  size_t *dims = s->dims;
+  ssize_t **strs = s->strides;
   size_t ls = 0, gs = 0;
   unsigned int p = 0, i, j, l;
   int err;
 
   if (nd == 0) return GA_VALUE_ERROR;
 
-  if (call32)
-    k = &ge->k_basic_32[nd-1];
-  else
-    k = &ge->k_basic[nd-1];
+  /* Kernels for more dimensions than we keep are built for the call,
+     the kernel cache of the context still makes that cheap */
+  if (nd <= ge->nd)
+    slot = call32 ? &ge->k_basic_32[nd-1] : &ge->k_basic[nd-1];
+  k.k = slot != NULL ? *slot : NULL;
+  k.args = s->kargs;
 
-  if (!k_initialized(k)) {
-    err = gen_elemwise_basic_kernel(k, GpuKernel_context(&ge->k_contig), NULL,
-                                    ge->preamble, ge->expr, nd, ge->n,
+  if (k.k == NULL) {
+    err = gen_elemwise_basic_kernel(&tmp, gpukernel_context(ge->k_contig),
+                                    NULL, ge->preamble, ge->expr, nd, ge->n,
                                     ge->args, ((call32 ? GEN_ADDR32 : 0) |
                                                (ge->flags & GE_CONVERT_F16)));
     if (err != GA_NO_ERROR)
       return err;
+    k.k = take_kernel(&tmp);
+    /* Another thread may have built it in the meantime */
+    if (slot != NULL && !ga_install_ptr((void **)slot, k.k)) {
+      gpukernel_release(k.k);
+      k.k = *slot;
+    }
   }
 
-  err = GpuKernel_setarg(k, p++, &n);
-  if (err != GA_NO_ERROR) goto error;
+  s->kargs[p++] = &n;
+  for (i = 0; i < nd; i++)
+    s->kargs[p++] = &dims[i];
 
-  for (i = 0; i < nd; i++) {
-    err = GpuKernel_setarg(k, p++, &dims[i]);
-    if (err != GA_NO_ERROR) goto error;
+  if (call32) {
+    for (i = 1; i < nd; i++) {
+      intdiv32_init(&s->divs[i], (uint32_t)dims[i]);
+      s->kargs[p++] = &s->divs[i].m;
+      s->kargs[p++] = &s->divs[i].s;
+    }
   }
 
   /* l is the number of arrays to date */
@@ -399,26 +447,21 @@ static int call_basic(GpuElemwise *ge, void **args, size_t n, unsigned int nd,
   for (j = 0; j < ge->n; j++) {
     if (is_array(ge->args[j])) {
       GpuArray *v = (GpuArray *)args[j];
-      err = GpuKernel_setarg(k, p++, v->data);
-      if (err != GA_NO_ERROR) goto error;
-      err = GpuKernel_setarg(k, p++, &v->offset);
-      if (err != GA_NO_ERROR) goto error;
-      for (i = 0; i < nd; i++) {
-        err = GpuKernel_setarg(k, p++, &strs[l][i]);
-        if (err != GA_NO_ERROR) goto error;
-      }
+      s->kargs[p++] = v->data;
+      s->kargs[p++] = &v->offset;
+      for (i = 0; i < nd; i++)
+        s->kargs[p++] = &strs[l][i];
       l++;
     } else {
-      err = GpuKernel_setarg(k, p++, args[j]);
-      if (err != GA_NO_ERROR) goto error;
+      s->kargs[p++] = args[j];
     }
   }
 
-  err = GpuKernel_sched(k, n, &gs, &ls);
-  if (err != GA_NO_ERROR) goto error;
-
-  err = GpuKernel_call(k, 1, &gs, &ls, 0, NULL);
- error:
+  err = GpuKernel_sched(&k, n, &gs, &ls);
+  if (err == GA_NO_ERROR)
+    err = GpuKernel_call(&k, 1, &gs, &ls, 0, s->kargs);
+  if (slot == NULL)
+    gpukernel_release(k.k);
   return err;
 }
 
@@ -431,6 +474,7 @@ static int gen_elemwise_contig_kernel(GpuKernel *k,
                                       int gen_flags) {
   strb sb = STRB_STATIC_INIT;
   int *ktypes = NULL;
+  int *kaccess = NULL;
   unsigned int p;
   unsigned int j;
   int flags = GA_USE_CLUDA;
@@ -445,6 +489,9 @@ static int gen_elemwise_contig_kernel(GpuKernel *k,
   ktypes = calloc(p, sizeof(int));
   if (ktypes == NULL)
     goto bail;
+  kaccess = calloc(p, sizeof(int));
+  if (kaccess == NULL)
+    goto bail;
 
   p = 0;
 
@@ -456,6 +503,7 @@ static int gen_elemwise_contig_kernel(GpuKernel *k,
     if (is_array(args[j])) {
       strb_appendf(&sb, "GLOBAL_MEM %s *%s_p,  const ga_size %s_offset",
                    ctype(args[j].typecode), args[j].name, args[j].name);
+      kaccess[p] = arg_access(args[j]);
       ktypes[p++] = GA_BUFFER;
       ktypes[p++] = GA_SIZE;
     } else {
@@ -513,10 +561,223 @@ static int gen_elemwise_contig_kernel(GpuKernel *k,
     goto bail;
 
   res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "elem",
-                       p, ktypes, flags, err_str);
+                       p, ktypes, kaccess, flags, err_str);
+ bail:
+  strb_clear(&sb);
+  free(ktypes);
+  free(kaccess);
+  return res;
+}
+
+/*
+ * Number of elements that can be loaded at once for this type, the
+ * vector types must be defined in all the CLUDA preambles.
+ */
+static unsigned int vec_width(int typecode, int gen_flags) {
+  switch (typecode) {
+  case GA_INT:
+  case GA_UINT:
+  case GA_FLOAT:
+    return 4;
+  case GA_LONG:
+  case GA_ULONG:
+  case GA_DOUBLE:
+    return 2;
+  case GA_HALF:
+    /* Without conversion there is nothing portable to load into */
+    return ISSET(gen_flags, GEN_CONVERT_F16) ? 4 : 0;
+  default:
+    return 0;
+  }
+}
+
+static unsigned int ge_vec_width(unsigned int n, gpuelemwise_arg *args,
+                                 int gen_flags) {
+  unsigned int j, w, res = 4;
+
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j])) {
+      w = vec_width(args[j].typecode, gen_flags);
+      if (w < res)
+        res = w;
+    }
+  }
+  return res;
+}
+
+static const char *lanes[4] = {"x", "y", "z", "w"};
+
+/*
+ * Same as the contiguous kernel, but each thread loads `vec` elements
+ * of every array at once through a vector type.  The remaining
+ * elements (if n is not a multiple of vec) are done one by one at the
+ * end.
+ */
+static int gen_elemwise_vec_kernel(GpuKernel *k,
+                                   gpucontext *ctx, char **err_str,
+                                   const char *preamble,
+                                   const char *expr,
+                                   unsigned int n,
+                                   gpuelemwise_arg *args,
+                                   unsigned int vec,
+                                   int gen_flags) {
+  strb sb = STRB_STATIC_INIT;
+  int *ktypes = NULL;
+  int *kaccess = NULL;
+  unsigned int p;
+  unsigned int j, l;
+  int flags = GA_USE_CLUDA;
+  int res = GA_MEMORY_ERROR;
+
+#define is_half_conv(a) ((a).typecode == GA_HALF && \
+                         ISSET(gen_flags, GEN_CONVERT_F16))
+
+  flags |= gpuarray_type_flagsa(n, args);
+
+  p = 1;
+  for (j = 0; j < n; j++)
+    p += ISSET(args[j].flags, GE_SCALAR) ? 1 : 2;
+
+  ktypes = calloc(p, sizeof(int));
+  if (ktypes == NULL)
+    goto bail;
+  kaccess = calloc(p, sizeof(int));
+  if (kaccess == NULL)
+    goto bail;
+
+  p = 0;
+
+  if (preamble)
+    strb_appends(&sb, preamble);
+  strb_appends(&sb, "\nKERNEL void elem_vec(const ga_size n, ");
+  ktypes[p++] = GA_SIZE;
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j])) {
+      strb_appendf(&sb, "GLOBAL_MEM %s *%s_p,  const ga_size %s_offset",
+                   ctype(args[j].typecode), args[j].name, args[j].name);
+      kaccess[p] = arg_access(args[j]);
+      ktypes[p++] = GA_BUFFER;
+      ktypes[p++] = GA_SIZE;
+    } else {
+      strb_appendf(&sb, "%s %s", ctype(args[j].typecode), args[j].name);
+      ktypes[p++] = args[j].typecode;
+    }
+    if (j != (n - 1))
+      strb_appends(&sb, ", ");
+  }
+  strb_appendf(&sb, ") {\n"
+               "const ga_size idx = LDIM_0 * GID_0 + LID_0;\n"
+               "const ga_size numThreads = LDIM_0 * GDIM_0;\n"
+               "const ga_size nv = n / %u;\n"
+               "ga_size i;\n"
+               "GLOBAL_MEM char *tmp;\n\n", vec);
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j])) {
+      strb_appendf(&sb, "tmp = (GLOBAL_MEM char *)%s_p;"
+                   "tmp += %s_offset; %s_p = (GLOBAL_MEM %s *)tmp;",
+                   args[j].name, args[j].name, args[j].name,
+                   ctype(args[j].typecode));
+    }
+  }
+
+  strb_appends(&sb, "for (i = idx; i < nv; i += numThreads) {\n");
+  for (j = 0; j < n; j++) {
+    if (!is_array(args[j]))
+      continue;
+    if (is_half_conv(args[j])) {
+      strb_appendf(&sb, "ga_float %s_v[%u];\n", args[j].name, vec);
+      if (ISSET(args[j].flags, GE_READ))
+        strb_appendf(&sb, "load_half%u(&%s_p[i * %u], %s_v);\n", vec,
+                     args[j].name, vec, args[j].name);
+    } else {
+      strb_appendf(&sb, "%s%u %s_v", ctype(args[j].typecode), vec,
+                   args[j].name);
+      if (ISSET(args[j].flags, GE_READ))
+        strb_appendf(&sb, " = ((GLOBAL_MEM %s%u *)%s_p)[i]",
+                     ctype(args[j].typecode), vec, args[j].name);
+      strb_appends(&sb, ";\n");
+    }
+  }
+  for (l = 0; l < vec; l++) {
+    strb_appends(&sb, "{\n");
+    for (j = 0; j < n; j++) {
+      if (!is_array(args[j]))
+        continue;
+      strb_appendf(&sb, "%s %s;\n",
+                   ctype(is_half_conv(args[j]) ? GA_FLOAT : args[j].typecode),
+                   args[j].name);
+      if (ISSET(args[j].flags, GE_READ)) {
+        if (is_half_conv(args[j]))
+          strb_appendf(&sb, "%s = %s_v[%u];\n", args[j].name, args[j].name, l);
+        else
+          strb_appendf(&sb, "%s = %s_v.%s;\n", args[j].name, args[j].name,
+                       lanes[l]);
+      }
+    }
+    strb_appends(&sb, expr);
+    strb_appends(&sb, ";\n");
+    for (j = 0; j < n; j++) {
+      if (!is_array(args[j]) || !ISSET(args[j].flags, GE_WRITE))
+        continue;
+      if (is_half_conv(args[j]))
+        strb_appendf(&sb, "%s_v[%u] = %s;\n", args[j].name, l, args[j].name);
+      else
+        strb_appendf(&sb, "%s_v.%s = %s;\n", args[j].name, lanes[l],
+                     args[j].name);
+    }
+    strb_appends(&sb, "}\n");
+  }
+  for (j = 0; j < n; j++) {
+    if (!is_array(args[j]) || !ISSET(args[j].flags, GE_WRITE))
+      continue;
+    if (is_half_conv(args[j]))
+      strb_appendf(&sb, "store_half%u(&%s_p[i * %u], %s_v);\n", vec,
+                   args[j].name, vec, args[j].name);
+    else
+      strb_appendf(&sb, "((GLOBAL_MEM %s%u *)%s_p)[i] = %s_v;\n",
+                   ctype(args[j].typecode), vec, args[j].name, args[j].name);
+  }
+  strb_appends(&sb, "}\n");
+
+  /* The tail */
+  strb_appendf(&sb, "for (i = nv * %u + idx; i < n; i += numThreads) {\n",
+               vec);
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j])) {
+      strb_appendf(&sb, "%s %s;\n",
+                   ctype(is_half_conv(args[j]) ? GA_FLOAT : args[j].typecode),
+                   args[j].name);
+      if (ISSET(args[j].flags, GE_READ)) {
+        if (is_half_conv(args[j]))
+          strb_appendf(&sb, "%s = load_half(&%s_p[i]);\n", args[j].name, args[j].name);
+        else
+          strb_appendf(&sb, "%s = %s_p[i];\n", args[j].name, args[j].name);
+      }
+    }
+  }
+  strb_appends(&sb, expr);
+  strb_appends(&sb, ";\n");
+  for (j = 0; j < n; j++) {
+    if (is_array(args[j]) && ISSET(args[j].flags, GE_WRITE)) {
+      if (is_half_conv(args[j]))
+        strb_appendf(&sb, "store_half(&%s_p[i], %s);\n", args[j].name, args[j].name);
+      else
+        strb_appendf(&sb, "%s_p[i] = %s;\n", args[j].name, args[j].name);
+    }
+  }
+  strb_appends(&sb, "}\n}\n");
+
+#undef is_half_conv
+
+  if (strb_error(&sb))
+    goto bail;
+
+  res = GpuKernel_init(k, ctx, 1, (const char **)&sb.s, &sb.l, "elem_vec",
+                       p, ktypes, kaccess, flags, err_str);
  bail:
   strb_clear(&sb);
   free(ktypes);
+  free(kaccess);
   return res;
 }
 
@@ -551,37 +812,104 @@ static int check_contig(GpuElemwise *ge, void **args,
   return GA_NO_ERROR;
 }
 
-static int call_contig(GpuElemwise *ge, void **args, size_t n) {
+/* The contiguous and vector kernels take the same arguments */
+static void contig_args(GpuElemwise *ge, void **args, size_t *n,
+                        void **kargs) {
   GpuArray *a;
-  size_t ls = 0, gs = 0;
   unsigned int i, p;
-  int err;
 
   p = 0;
-  err = GpuKernel_setarg(&ge->k_contig, p++, &n);
-  if (err != GA_NO_ERROR) return err;
+  kargs[p++] = n;
   for (i = 0; i < ge->n; i++) {
     if (is_array(ge->args[i])) {
       a = (GpuArray *)args[i];
-      err = GpuKernel_setarg(&ge->k_contig, p++, a->data);
-      if (err != GA_NO_ERROR) return err;
-      err = GpuKernel_setarg(&ge->k_contig, p++, &a->offset);
-      if (err != GA_NO_ERROR) return err;
+      kargs[p++] = a->data;
+      kargs[p++] = &a->offset;
     } else {
-      err = GpuKernel_setarg(&ge->k_contig, p++, args[i]);
-      if (err != GA_NO_ERROR) return err;
+      kargs[p++] = args[i];
     }
   }
-  err = GpuKernel_sched(&ge->k_contig, n, &gs, &ls);
+}
+
+static int call_contig(GpuElemwise *ge, void **args, size_t n,
+                       struct ge_scratch *s) {
+  GpuKernel k;
+  size_t ls = 0, gs = 0;
+  int err;
+
+  k.k = ge->k_contig;
+  k.args = s->kargs;
+  contig_args(ge, args, &n, s->kargs);
+  err = GpuKernel_sched(&k, n, &gs, &ls);
   if (err != GA_NO_ERROR) return err;
-  return GpuKernel_call(&ge->k_contig, 1, &gs, &ls, 0, NULL);
+  return GpuKernel_call(&k, 1, &gs, &ls, 0, s->kargs);
 }
 
-GpuElemwise *GpuElemwise_new(gpucontext *ctx,
-                             const char *preamble, const char *expr,
-                             unsigned int n, gpuelemwise_arg *args,
-                             unsigned int nd, int flags) {
+/*
+ * The vector loads need every array to start on a multiple of the
+ * vector size.  Buffers themselves are always allocated with at least
+ * that alignment, so only the offsets need to be checked.
+ *
+ * Returns the vector width to use or 0.  ge->vec may be cleared by
+ * another thread, so the caller uses the returned value.
+ */
+static unsigned int can_vec(GpuElemwise *ge, void **args, size_t n) {
+  GpuArray *a;
+  unsigned int i, vec = ge->vec;
+
+  if (vec == 0 || n < vec)
+    return 0;
+  for (i = 0; i < ge->n; i++) {
+    if (is_array(ge->args[i])) {
+      a = (GpuArray *)args[i];
+      if (a->offset % (gpuarray_get_elsize(a->typecode) * vec) != 0)
+        return 0;
+    }
+  }
+  return vec;
+}
+
+static int call_vec(GpuElemwise *ge, void **args, size_t n,
+                    unsigned int vec, struct ge_scratch *s) {
+  GpuKernel k;
+  GpuKernel tmp;
+  size_t ls = 0, gs = 0;
+  int err;
+
+  k.k = ge->k_vec;
+  k.args = s->kargs;
+  if (k.k == NULL) {
+    err = gen_elemwise_vec_kernel(&tmp, gpukernel_context(ge->k_contig),
+                                  NULL, ge->preamble, ge->expr, ge->n,
+                                  ge->args, vec,
+                                  ge->flags & GE_CONVERT_F16);
+    if (err != GA_NO_ERROR) {
+      /* Don't try again */
+      ge->vec = 0;
+      return call_contig(ge, args, n, s);
+    }
+    k.k = take_kernel(&tmp);
+    /* Another thread may have built it in the meantime */
+    if (!ga_install_ptr((void **)&ge->k_vec, k.k)) {
+      gpukernel_release(k.k);
+      k.k = ge->k_vec;
+    }
+  }
+
+  contig_args(ge, args, &n, s->kargs);
+  err = GpuKernel_sched(&k, n / vec, &gs, &ls);
+  if (err != GA_NO_ERROR) return err;
+  return GpuKernel_call(&k, 1, &gs, &ls, 0, s->kargs);
+}
+
+static void ge_clear(GpuElemwise *ge);
+
+static GpuElemwise *ge_new(gpucontext *ctx,
+                           const char *preamble, const char *expr,
+                           unsigned int n, gpuelemwise_arg *args,
+                           unsigned int nd, int flags) {
   GpuElemwise *res;
+  GpuKernel tmp;
 #ifdef DEBUG
   char *errstr = NULL;
 #endif
@@ -591,6 +919,7 @@ GpuElemwise *GpuElemwise_new(gpucontext *ctx,
   res = calloc(1, sizeof(*res));
   if (res == NULL) return NULL;
 
+  res->refcnt = 1;
   res->flags = flags;
   res->nd = 8;
   res->n = n;
@@ -613,22 +942,18 @@ GpuElemwise *GpuElemwise_new(gpucontext *ctx,
   for (i = 0; i < res->n; i++)
     if (is_array(res->args[i])) res->narray++;
 
+  res->vec = ge_vec_width(res->n, res->args, res->flags & GE_CONVERT_F16);
+
   while (res->nd < nd) res->nd *= 2;
-  res->dims = calloc(res->nd, sizeof(size_t));
-  if (res->dims == NULL)
-    goto fail;
-  res->strides = strides_array(res->narray, res->nd);
-  if (res->strides == NULL)
-    goto fail;
-  res->k_basic = calloc(res->nd, sizeof(GpuKernel));
+  res->k_basic = calloc(res->nd, sizeof(gpukernel *));
   if (res->k_basic == NULL)
     goto fail;
 
-  res->k_basic_32 = calloc(res->nd, sizeof(GpuKernel));
+  res->k_basic_32 = calloc(res->nd, sizeof(gpukernel *));
   if (res->k_basic_32 == NULL)
     goto fail;
 
-  ret = gen_elemwise_contig_kernel(&res->k_contig, ctx,
+  ret = gen_elemwise_contig_kernel(&tmp, ctx,
 #ifdef DEBUG
                                    &errstr,
 #else
@@ -645,10 +970,11 @@ GpuElemwise *GpuElemwise_new(gpucontext *ctx,
 #endif
     goto fail;
   }
+  res->k_contig = take_kernel(&tmp);
 
   if (ISCLR(flags, GE_NOADDR64)) {
     for (i = 0; i < nd; i++) {
-      ret = gen_elemwise_basic_kernel(&res->k_basic[i], ctx,
+      ret = gen_elemwise_basic_kernel(&tmp, ctx,
 #ifdef DEBUG
                                       &errstr,
 #else
@@ -665,11 +991,12 @@ GpuElemwise *GpuElemwise_new(gpucontext *ctx,
 #endif
         goto fail;
       }
+      res->k_basic[i] = take_kernel(&tmp);
     }
   }
 
   for (i = 0; i < nd; i++) {
-    ret = gen_elemwise_basic_kernel(&res->k_basic_32[i], ctx,
+    ret = gen_elemwise_basic_kernel(&tmp, ctx,
 #ifdef DEBUG
                                     &errstr,
 #else
@@ -686,55 +1013,180 @@ GpuElemwise *GpuElemwise_new(gpucontext *ctx,
 #endif
       goto fail;
     }
+    res->k_basic_32[i] = take_kernel(&tmp);
   }
 
   return res;
 
  fail:
-  GpuElemwise_free(res);
+  ge_clear(res);
   return NULL;
 }
 
-void GpuElemwise_free(GpuElemwise *ge) {
+/*
+ * The signature of a GpuElemwise is everything that goes into
+ * generating its kernels.
+ */
+static strb *ge_signature(const char *preamble, const char *expr,
+                          unsigned int n, gpuelemwise_arg *args,
+                          int flags) {
+  strb *res = strb_new();
   unsigned int i;
-  for (i = 0; i < ge->nd; i++) {
-    if (k_initialized(&ge->k_basic_32[i]))
-      GpuKernel_clear(&ge->k_basic_32[i]);
-    if (k_initialized(&ge->k_basic[i]))
-      GpuKernel_clear(&ge->k_basic[i]);
-  }
-  if (ge->strides != NULL)
-    for (i = 0; i < ge->narray; i++) {
-      free(ge->strides[i]);
+
+  if (res == NULL)
+    return NULL;
+  strb_appendn(res, (const char *)&flags, sizeof(flags));
+  if (preamble != NULL)
+    strb_appends(res, preamble);
+  strb_appendc(res, '\0');
+  strb_appends(res, expr);
+  strb_appendc(res, '\0');
+  for (i = 0; i < n; i++) {
+    strb_appends(res, args[i].name);
+    strb_appendc(res, '\0');
+    strb_appendn(res, (const char *)&args[i].typecode, sizeof(int));
+    strb_appendn(res, (const char *)&args[i].flags, sizeof(int));
+  }
+  if (strb_error(res)) {
+    strb_free(res);
+    return NULL;
+  }
+  return res;
+}
+
+static int sig_eq(cache_key_t _k1, cache_key_t _k2) {
+  strb *k1 = (strb *)_k1;
+  strb *k2 = (strb *)_k2;
+  return (k1->l == k2->l && memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint64_t sig_hash(cache_key_t _k) {
+  strb *k = (strb *)_k;
+  return XXH64(k->s, k->l, 42);
+}
+
+static void sig_release(cache_value_t ge) {
+  GpuElemwise_free((GpuElemwise *)ge);
+}
+
+static void sig_ref(cache_value_t ge) {
+  ga_ref_inc(&((GpuElemwise *)ge)->refcnt);
+}
+
+static size_t kernel_binsize(gpukernel *k) {
+  size_t sz = 0;
+  if (k != NULL)
+    gpukernel_property(k, GA_KERNEL_PROP_BINSIZE, &sz);
+  return sz;
+}
+
+/*
+ * The object keeps its kernels alive even after the kernel cache has
+ * dropped them, so they count here too.  The cost is computed when
+ * the object is added, which is after the kernels for the requested
+ * dimensions are built but before those built on demand.
+ */
+static size_t sig_cost(cache_key_t sig, cache_value_t _ge) {
+  GpuElemwise *ge = (GpuElemwise *)_ge;
+  size_t res = ((strb *)sig)->l;
+  unsigned int i;
+
+  res += kernel_binsize(ge->k_contig) + kernel_binsize(ge->k_vec);
+  for (i = 0; i < ge->nd; i++)
+    res += kernel_binsize(ge->k_basic[i]) + kernel_binsize(ge->k_basic_32[i]);
+  return res;
+}
+
+GpuElemwise *GpuElemwise_new(gpucontext *ctx,
+                             const char *preamble, const char *expr,
+                             unsigned int n, gpuelemwise_arg *args,
+                             unsigned int nd, int flags) {
+  GpuElemwise *res;
+  strb *sig;
+
+  /* Failures of the cache are not errors, we just don't share */
+  if (ctx->elemwise_cache == NULL)
+    gpucontext_cache_install(&ctx->elemwise_cache,
+                             gpucontext_cache(ctx->flags, 16, 64, 64, 8,
+                                              sig_eq, sig_hash,
+                                              (cache_freek_fn)strb_free,
+                                              sig_release, sig_ref,
+                                              sig_cost));
+  sig = NULL;
+  if (ctx->elemwise_cache != NULL)
+    sig = ge_signature(preamble, expr, n, args, flags);
+
+  if (sig != NULL) {
+    /* The cache takes a reference for us */
+    res = (GpuElemwise *)cache_get(ctx->elemwise_cache, sig);
+    if (res != NULL) {
+      strb_free(sig);
+      return res;
     }
-  if (k_initialized(&ge->k_contig))
-    GpuKernel_clear(&ge->k_contig);
+  }
+
+  res = ge_new(ctx, preamble, expr, n, args, nd, flags);
+  if (res != NULL && sig != NULL) {
+    /* The cache holds its own reference, it drops it if the add fails */
+    res->refcnt++;
+    cache_add(ctx->elemwise_cache, sig, res);
+  } else if (sig != NULL) {
+    strb_free(sig);
+  }
+  return res;
+}
+
+static void ge_clear(GpuElemwise *ge) {
+  unsigned int i;
+  for (i = 0; i < ge->nd; i++) {
+    if (ge->k_basic_32 != NULL && ge->k_basic_32[i] != NULL)
+      gpukernel_release(ge->k_basic_32[i]);
+    if (ge->k_basic != NULL && ge->k_basic[i] != NULL)
+      gpukernel_release(ge->k_basic[i]);
+  }
+  if (ge->k_contig != NULL)
+    gpukernel_release(ge->k_contig);
+  if (ge->k_vec != NULL)
+    gpukernel_release(ge->k_vec);
   free_args(ge->n, ge->args);
   free((void *)ge->preamble);
   free((void *)ge->expr);
-  free(ge->dims);
-  free(ge->strides);
+  free(ge->k_basic);
+  free(ge->k_basic_32);
   free(ge);
 }
 
+void GpuElemwise_free(GpuElemwise *ge) {
+  if (ga_ref_dec(&ge->refcnt) == 0)
+    ge_clear(ge);
+}
+
 int GpuElemwise_call(GpuElemwise *ge, void **args, int flags) {
+  struct ge_scratch s;
   size_t n;
-  size_t *dims;
-  ssize_t **strides;
   unsigned int nd;
+  unsigned int vec;
   int contig;
   int call32;
   int err;
 
+  s.heap = NULL;
   err = check_contig(ge, args, &n, &contig);
   if (err == GA_NO_ERROR && contig) {
     if (n == 0) return GA_NO_ERROR;
-    return call_contig(ge, args, n);
-  }
-  err = check_basic(ge, args, flags, &n, &nd, &dims, &strides, &call32);
-  if (err == GA_NO_ERROR) {
-    if (n == 0) return GA_NO_ERROR;
-    return call_basic(ge, args, n, nd, dims, strides, call32);
+    err = scratch_init(&s, 0, 0, 1 + ge->narray + ge->n);
+    if (err != GA_NO_ERROR) return err;
+    vec = can_vec(ge, args, n);
+    if (vec != 0)
+      err = call_vec(ge, args, n, vec, &s);
+    else
+      err = call_contig(ge, args, n, &s);
+    scratch_clear(&s);
+    return err;
   }
+  err = check_basic(ge, args, flags, &s, &n, &nd, &call32);
+  if (err == GA_NO_ERROR && n != 0)
+    err = call_basic(ge, args, n, nd, &s, call32);
+  scratch_clear(&s);
   return err;
 }
@@ -0,0 +1,505 @@
+#include <ctype.h>
+
+#include <gpuarray/fusion.h>
+#include <gpuarray/error.h>
+#include <gpuarray/util.h>
+
+#include "private.h"
+#include "util/strb.h"
+
+#define FN_ARRAY  0
+#define FN_SCALAR 1
+#define FN_UNARY  2
+#define FN_BINARY 3
+#define FN_CALL   4
+#define FN_CAST   5
+
+typedef struct _fnode {
+  const char *op; /* Operator (static) or function name (owned) */
+  union {
+    GpuArray *a; /* FN_ARRAY */
+    double d; /* FN_SCALAR, the others are for size and alignment */
+    uint64_t l;
+    char b[8];
+  } v;
+  int args[GPUFUSION_MAXARGS];
+  unsigned int nargs;
+  int kind;
+  int typecode; /* Type of the result */
+} fnode;
+
+struct _GpuFusion {
+  gpucontext *ctx;
+  fnode *nodes;
+  unsigned int n; /* Number of nodes */
+  unsigned int alloc; /* Allocated size of nodes */
+  int flags;
+};
+
+/* Type kinds for promotion */
+#define K_BOOL  0
+#define K_INT   1
+#define K_FLOAT 2
+
+static const int sint_types[4] = {GA_BYTE, GA_SHORT, GA_INT, GA_LONG};
+static const int uint_types[4] = {GA_UBYTE, GA_USHORT, GA_UINT, GA_ULONG};
+
+static const char *unary_ops[] = {"-", "+", "~", "!", NULL};
+static const char *arith_ops[] = {"+", "-", "*", "/", NULL};
+static const char *int_ops[] = {"%", "&", "|", "^", "<<", ">>", NULL};
+static const char *bool_ops[] = {"<", "<=", ">", ">=", "==", "!=", "&&", "||",
+                                 NULL};
+
+static int kind(int typecode) {
+  switch (typecode) {
+  case GA_BOOL:
+    return K_BOOL;
+  case GA_BYTE: case GA_SHORT: case GA_INT: case GA_LONG:
+  case GA_UBYTE: case GA_USHORT: case GA_UINT: case GA_ULONG:
+    return K_INT;
+  case GA_HALF: case GA_FLOAT: case GA_DOUBLE:
+    return K_FLOAT;
+  default:
+    return -1;
+  }
+}
+
+static int is_signed(int typecode) {
+  return (typecode == GA_BYTE || typecode == GA_SHORT ||
+          typecode == GA_INT || typecode == GA_LONG);
+}
+
+static size_t tsize(int typecode) {
+  return gpuarray_get_elsize(typecode);
+}
+
+static int float_type(size_t sz) {
+  if (sz <= 2) return GA_HALF;
+  if (sz <= 4) return GA_FLOAT;
+  return GA_DOUBLE;
+}
+
+static int int_type(size_t sz, int sgn) {
+  unsigned int i = sz <= 1 ? 0 : sz <= 2 ? 1 : sz <= 4 ? 2 : 3;
+  return sgn ? sint_types[i] : uint_types[i];
+}
+
+/*
+ * Type promotion, this follows numpy: the result can represent all
+ * the values of both types when possible, except for 64-bit integers
+ * and floats which end up in double.  A scalar does not upcast an
+ * array of the same or of a higher kind.
+ */
+static int promote(const fnode *x, const fnode *y) {
+  int t1 = x->typecode, t2 = y->typecode, tmp;
+  int k1 = kind(t1), k2 = kind(t2);
+  size_t s1, s2;
+
+  if (t1 == t2)
+    return t1;
+  if (x->kind == FN_SCALAR && y->kind != FN_SCALAR && k1 <= k2)
+    return t2;
+  if (y->kind == FN_SCALAR && x->kind != FN_SCALAR && k2 <= k1)
+    return t1;
+  if (k1 == K_BOOL)
+    return t2;
+  if (k2 == K_BOOL)
+    return t1;
+  /* Make t1 the higher kind or the signed integer type */
+  if (k1 < k2 || (k1 == K_INT && k2 == K_INT && is_signed(t2))) {
+    tmp = t1; t1 = t2; t2 = tmp;
+    tmp = k1; k1 = k2; k2 = tmp;
+  }
+  s1 = tsize(t1);
+  s2 = tsize(t2);
+  if (k1 == K_FLOAT && k2 == K_FLOAT)
+    return s1 > s2 ? t1 : t2;
+  if (k1 == K_FLOAT)
+    return float_type(s1 > s2 * 2 ? s1 : s2 * 2);
+  if (is_signed(t1) == is_signed(t2))
+    return s1 > s2 ? t1 : t2;
+  /* t1 is signed and t2 unsigned */
+  if (s1 > s2)
+    return t1;
+  if (s2 < 8)
+    return int_type(s2 * 2, 1);
+  return GA_DOUBLE;
+}
+
+/* Type in which the values of a node are computed */
+static inline const char *ctype(int typecode) {
+  return gpuarray_get_type(typecode == GA_HALF ? GA_FLOAT :
+                           typecode)->cluda_name;
+}
+
+static const char *find_op(const char **ops, const char *op) {
+  unsigned int i;
+  for (i = 0; ops[i] != NULL; i++)
+    if (strcmp(ops[i], op) == 0)
+      return ops[i];
+  return NULL;
+}
+
+static int is_ident(const char *s) {
+  if (!(isalpha((unsigned char)*s) || *s == '_'))
+    return 0;
+  for (s++; *s != '\0'; s++)
+    if (!(isalnum((unsigned char)*s) || *s == '_'))
+      return 0;
+  return 1;
+}
+
+static int check_node(GpuFusion *f, int node) {
+  return node >= 0 && (unsigned int)node < f->n;
+}
+
+static fnode *new_node(GpuFusion *f, int kind, int typecode, int *node) {
+  fnode *tmp;
+
+  if (f->n == f->alloc) {
+    tmp = realloc(f->nodes, f->alloc * 2 * sizeof(fnode));
+    if (tmp == NULL)
+      return NULL;
+    f->nodes = tmp;
+    f->alloc *= 2;
+  }
+  tmp = &f->nodes[f->n];
+  memset(tmp, 0, sizeof(*tmp));
+  tmp->kind = kind;
+  tmp->typecode = typecode;
+  *node = f->n++;
+  return tmp;
+}
+
+GpuFusion *GpuFusion_new(gpucontext *ctx, int flags) {
+  GpuFusion *res;
+
+  if (flags != 0)
+    return NULL;
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL)
+    return NULL;
+  res->ctx = ctx;
+  res->flags = flags;
+  res->alloc = 16;
+  res->nodes = calloc(res->alloc, sizeof(fnode));
+  if (res->nodes == NULL) {
+    free(res);
+    return NULL;
+  }
+  return res;
+}
+
+void GpuFusion_reset(GpuFusion *f) {
+  unsigned int i;
+  for (i = 0; i < f->n; i++)
+    if (f->nodes[i].kind == FN_CALL)
+      free((void *)f->nodes[i].op);
+  f->n = 0;
+}
+
+void GpuFusion_free(GpuFusion *f) {
+  GpuFusion_reset(f);
+  free(f->nodes);
+  free(f);
+}
+
+int GpuFusion_array(GpuFusion *f, GpuArray *a, int *node) {
+  fnode *n;
+
+  if (kind(a->typecode) < 0)
+    return GA_UNSUPPORTED_ERROR;
+  if (GpuArray_context(a) != f->ctx)
+    return GA_VALUE_ERROR;
+  n = new_node(f, FN_ARRAY, a->typecode, node);
+  if (n == NULL)
+    return GA_MEMORY_ERROR;
+  n->v.a = a;
+  return GA_NO_ERROR;
+}
+
+int GpuFusion_scalar(GpuFusion *f, int typecode, const void *val,
+                     int *node) {
+  fnode *n;
+
+  if (kind(typecode) < 0)
+    return GA_UNSUPPORTED_ERROR;
+  n = new_node(f, FN_SCALAR, typecode, node);
+  if (n == NULL)
+    return GA_MEMORY_ERROR;
+  memcpy(n->v.b, val, tsize(typecode));
+  return GA_NO_ERROR;
+}
+
+int GpuFusion_unary(GpuFusion *f, const char *op, int a, int *node) {
+  const char *sop = find_op(unary_ops, op);
+  fnode *n;
+  int t;
+
+  if (sop == NULL || !check_node(f, a))
+    return GA_VALUE_ERROR;
+  t = f->nodes[a].typecode;
+  if (sop[0] == '~' && kind(t) == K_FLOAT)
+    return GA_VALUE_ERROR;
+  if (sop[0] == '!')
+    t = GA_BOOL;
+  n = new_node(f, FN_UNARY, t, node);
+  if (n == NULL)
+    return GA_MEMORY_ERROR;
+  n->op = sop;
+  n->args[0] = a;
+  n->nargs = 1;
+  return GA_NO_ERROR;
+}
+
+int GpuFusion_binary(GpuFusion *f, const char *op, int a, int b,
+                     int *node) {
+  const char *sop;
+  fnode *n;
+  int t;
+
+  if (!check_node(f, a) || !check_node(f, b))
+    return GA_VALUE_ERROR;
+  sop = find_op(arith_ops, op);
+  if (sop == NULL)
+    sop = find_op(int_ops, op);
+  if (sop != NULL) {
+    t = promote(&f->nodes[a], &f->nodes[b]);
+    if (kind(t) == K_FLOAT && find_op(int_ops, sop) != NULL)
+      return GA_VALUE_ERROR;
+  } else {
+    sop = find_op(bool_ops, op);
+    if (sop == NULL)
+      return GA_VALUE_ERROR;
+    t = GA_BOOL;
+  }
+  n = new_node(f, FN_BINARY, t, node);
+  if (n == NULL)
+    return GA_MEMORY_ERROR;
+  n->op = sop;
+  n->args[0] = a;
+  n->args[1] = b;
+  n->nargs = 2;
+  return GA_NO_ERROR;
+}
+
+int GpuFusion_call(GpuFusion *f, const char *fn, int typecode,
+                   unsigned int nargs, const int *args, int *node) {
+  fnode acc;
+  fnode *n;
+  unsigned int i;
+
+  if (nargs > GPUFUSION_MAXARGS || !is_ident(fn))
+    return GA_VALUE_ERROR;
+  if (typecode != -1 && kind(typecode) < 0)
+    return GA_UNSUPPORTED_ERROR;
+  for (i = 0; i < nargs; i++)
+    if (!check_node(f, args[i]))
+      return GA_VALUE_ERROR;
+  if (typecode == -1) {
+    if (nargs == 0)
+      return GA_VALUE_ERROR;
+    acc = f->nodes[args[0]];
+    for (i = 1; i < nargs; i++) {
+      acc.typecode = promote(&acc, &f->nodes[args[i]]);
+      if (f->nodes[args[i]].kind != FN_SCALAR)
+        acc.kind = FN_CALL;
+    }
+    typecode = acc.typecode;
+  }
+  n = new_node(f, FN_CALL, typecode, node);
+  if (n == NULL)
+    return GA_MEMORY_ERROR;
+  n->op = strdup(fn);
+  if (n->op == NULL) {
+    f->n--;
+    return GA_MEMORY_ERROR;
+  }
+  for (i = 0; i < nargs; i++)
+    n->args[i] = args[i];
+  n->nargs = nargs;
+  return GA_NO_ERROR;
+}
+
+int GpuFusion_cast(GpuFusion *f, int typecode, int a, int *node) {
+  fnode *n;
+
+  if (kind(typecode) < 0)
+    return GA_UNSUPPORTED_ERROR;
+  if (!check_node(f, a))
+    return GA_VALUE_ERROR;
+  n = new_node(f, FN_CAST, typecode, node);
+  if (n == NULL)
+    return GA_MEMORY_ERROR;
+  n->args[0] = a;
+  n->nargs = 1;
+  return GA_NO_ERROR;
+}
+
+int GpuFusion_typecode(GpuFusion *f, int node) {
+  if (!check_node(f, node))
+    return -1;
+  return f->nodes[node].typecode;
+}
+
+/*
+ * Append `name` of type `from` converted to `typecode`.  Conversions
+ * to bool test against 0 since ga_bool is an integer type.
+ */
+static void append_conv(strb *sb, const char *name, int from, int typecode) {
+  if (typecode == GA_BOOL && from != GA_BOOL)
+    strb_appendf(sb, "(%s != 0)", name);
+  else if (from == typecode)
+    strb_appends(sb, name);
+  else
+    strb_appendf(sb, "(%s)%s", ctype(typecode), name);
+}
+
+#define NAME_LEN 16
+
+static void node_name(char *buf, const fnode *n, unsigned int idx) {
+  if (n->kind == FN_ARRAY || n->kind == FN_SCALAR) {
+    if (idx == 0)
+      strcpy(buf, "res");
+    else
+      snprintf(buf, NAME_LEN, "a%u", idx);
+  } else {
+    snprintf(buf, NAME_LEN, "t%u", idx);
+  }
+}
+
+int GpuFusion_eval(GpuFusion *f, int node, GpuArray *out, int flags) {
+  strb expr = STRB_STATIC_INIT;
+  gpuelemwise_arg *args = NULL;
+  void **callargs = NULL;
+  char (*names)[NAME_LEN] = NULL;
+  unsigned int *idx = NULL;
+  char *used = NULL;
+  GpuElemwise *ge;
+  const fnode *n;
+  unsigned int i, j, nargs, ntmp;
+  int t, err = GA_MEMORY_ERROR;
+
+  if (!check_node(f, node))
+    return GA_VALUE_ERROR;
+  if (kind(out->typecode) < 0)
+    return GA_UNSUPPORTED_ERROR;
+  if (!GpuArray_ISWRITEABLE(out))
+    return GA_INVALID_ERROR;
+
+  used = calloc(node + 1, 1);
+  idx = calloc(node + 1, sizeof(unsigned int));
+  names = calloc(node + 1, sizeof(*names));
+  /* The output comes first, then at most one argument per node */
+  args = calloc(node + 2, sizeof(gpuelemwise_arg));
+  callargs = calloc(node + 2, sizeof(void *));
+  if (used == NULL || idx == NULL || names == NULL || args == NULL ||
+      callargs == NULL)
+    goto bail;
+
+  /* Only the nodes leading to the result end up in the kernel */
+  used[node] = 1;
+  for (i = node + 1; i > 0; i--) {
+    if (!used[i - 1])
+      continue;
+    n = &f->nodes[i - 1];
+    for (j = 0; j < n->nargs; j++)
+      used[n->args[j]] = 1;
+  }
+
+  args[0].name = "res";
+  args[0].typecode = out->typecode;
+  args[0].flags = GE_WRITE;
+  callargs[0] = out;
+  nargs = 1;
+  ntmp = 0;
+  for (i = 0; i <= (unsigned int)node; i++) {
+    if (!used[i])
+      continue;
+    n = &f->nodes[i];
+    if (n->kind == FN_ARRAY) {
+      /* Arrays that appear more than once are passed once */
+      for (j = 0; j < nargs; j++)
+        if (ISCLR(args[j].flags, GE_SCALAR) && callargs[j] == n->v.a)
+          break;
+      if (j == nargs) {
+        args[j].typecode = n->typecode;
+        args[j].flags = GE_READ;
+        callargs[j] = n->v.a;
+        nargs++;
+      }
+      args[j].flags |= GE_READ;
+      idx[i] = j;
+    } else if (n->kind == FN_SCALAR) {
+      args[nargs].typecode = n->typecode;
+      args[nargs].flags = GE_SCALAR | GE_READ;
+      callargs[nargs] = (void *)n->v.b;
+      idx[i] = nargs++;
+    } else {
+      idx[i] = ntmp++;
+    }
+    node_name(names[i], n, idx[i]);
+    if (n->kind == FN_ARRAY || n->kind == FN_SCALAR) {
+      args[idx[i]].name = names[i];
+      continue;
+    }
+
+    strb_appendf(&expr, "%s %s = ", ctype(n->typecode), names[i]);
+    switch (n->kind) {
+    case FN_UNARY:
+      strb_appendf(&expr, "%s%s", n->op, names[n->args[0]]);
+      break;
+    case FN_BINARY:
+      t = n->typecode;
+      if (t == GA_BOOL && find_op(bool_ops, n->op) != NULL)
+        t = promote(&f->nodes[n->args[0]], &f->nodes[n->args[1]]);
+      append_conv(&expr, names[n->args[0]], f->nodes[n->args[0]].typecode, t);
+      strb_appendf(&expr, " %s ", n->op);
+      append_conv(&expr, names[n->args[1]], f->nodes[n->args[1]].typecode, t);
+      break;
+    case FN_CALL:
+      strb_appendf(&expr, "%s(", n->op);
+      for (j = 0; j < n->nargs; j++) {
+        if (j != 0)
+          strb_appends(&expr, ", ");
+        append_conv(&expr, names[n->args[j]], f->nodes[n->args[j]].typecode,
+                    n->typecode);
+      }
+      strb_appends(&expr, ")");
+      break;
+    case FN_CAST:
+      append_conv(&expr, names[n->args[0]], f->nodes[n->args[0]].typecode,
+                  n->typecode);
+      break;
+    }
+    strb_appends(&expr, ";\n");
+  }
+  strb_appends(&expr, "res = ");
+  append_conv(&expr, names[node], f->nodes[node].typecode, out->typecode);
+  if (strb_error(&expr))
+    goto bail;
+
+  /* Names are canonical so graphs with the same structure and types
+     share their GpuElemwise through the context */
+  strb_append0(&expr);
+  if (strb_error(&expr))
+    goto bail;
+  ge = GpuElemwise_new(f->ctx, NULL, expr.s, nargs, args, 0,
+                       GE_CONVERT_F16);
+  if (ge == NULL) {
+    err = GA_IMPL_ERROR;
+    goto bail;
+  }
+  err = GpuElemwise_call(ge, callargs, flags);
+  GpuElemwise_free(ge);
+
+ bail:
+  strb_clear(&expr);
+  free(used);
+  free(idx);
+  free(names);
+  free(args);
+  free(callargs);
+  return err;
+}
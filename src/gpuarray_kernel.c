@@ -6,15 +6,15 @@
 
 int GpuKernel_init(GpuKernel *k, gpucontext *ctx, unsigned int count,
                    const char **strs, const size_t *lens, const char *name,
-                   unsigned int argcount, const int *types, int flags,
-                   char **err_str) {
+                   unsigned int argcount, const int *types,
+                   const int *access, int flags, char **err_str) {
   int res = GA_NO_ERROR;
 
   k->args = calloc(argcount, sizeof(void *));
   if (k->args == NULL)
     return GA_MEMORY_ERROR;
   k->k = gpukernel_init(ctx, count, strs, lens, name, argcount, types,
-                        flags, &res, err_str);
+                        access, flags, &res, err_str);
   if (res != GA_NO_ERROR)
     GpuKernel_clear(k);
   return res;
@@ -86,12 +86,23 @@ int GpuKernel_sched(GpuKernel *k, size_t n, size_t *gs, size_t *ls) {
 }
 
 int GpuKernel_setarg(GpuKernel *k, unsigned int i, void *a) {
-  return gpukernel_setarg(k->k, i, a);
+  unsigned int nargs;
+  int err;
+
+  err = gpukernel_property(k->k, GA_KERNEL_PROP_NUMARGS, &nargs);
+  if (err != GA_NO_ERROR)
+    return err;
+  if (i >= nargs)
+    return GA_VALUE_ERROR;
+  k->args[i] = a;
+  return GA_NO_ERROR;
 }
 
 int GpuKernel_call(GpuKernel *k, unsigned int n,
                    const size_t *gs, const size_t *ls,
                    size_t shared, void **args) {
+  if (args == NULL)
+    args = k->args;
   return gpukernel_call(k->k, n, gs, ls, shared, args);
 }
 
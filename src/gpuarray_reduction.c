@@ -1,846 +1,892 @@
-/* Includes */
-#ifdef _MSC_VER
-#define _CRT_SECURE_NO_WARNINGS
-#endif
-
 #include <assert.h>
-#include <stdarg.h>
-#include <stddef.h>
-#include "gpuarray/config.h"
-#include <stdlib.h>
-#include <string.h>
-#include <errno.h>
 
-#include "private.h"
-#include "gpuarray/array.h"
-#include "gpuarray/error.h"
-#include "gpuarray/kernel.h"
-#include "gpuarray/util.h"
+#include <gpuarray/reduction.h>
+#include <gpuarray/array.h>
+#include <gpuarray/error.h>
+#include <gpuarray/kernel.h>
+#include <gpuarray/util.h>
 
+#include "private.h"
 #include "util/strb.h"
-#include "util/integerfactoring.h"
-
-
-/* Datatypes */
-struct maxandargmax_ctx{
-	/* Function Arguments. */
-	GpuArray*       dstMax;
-	GpuArray*       dstArgmax;
-	const GpuArray* src;
-	int             reduxLen;
-	const int*      reduxList;
-
-	/* General. */
-	int             ret;
-	int*            axisList;
-	gpucontext*     gpuCtx;
-
-	/* Source code Generator. */
-	const char*     dstMaxType;
-	const char*     dstArgmaxType;
-	int             ndd;
-	int             ndr;
-	int             nds;
-	int             ndh;
-	strb            s;
-	char*           sourceCode;
-	GpuKernel       kernel;
-
-	/* Scheduler */
-	int             hwAxisList[3];
-	size_t          blockSize [3];
-	size_t          gridSize  [3];
-	size_t          chunkSize [3];
-
-	/* Invoker */
-	gpudata*        srcStepsGD;
-	gpudata*        srcSizeGD;
-	gpudata*        chunkSizeGD;
-	gpudata*        dstMaxStepsGD;
-	gpudata*        dstArgmaxStepsGD;
+#include "util/xxhash.h"
+
+struct _GpuReduction {
+  gpucontext *ctx;
+  const char *preamble; /* Preamble code */
+  const char *map_expr; /* Map expression */
+  const char *reduce_expr; /* Reduce expression */
+  gpuelemwise_arg *args; /* Input descriptors */
+  gpureduction_out *outs; /* Output descriptors */
+  cache *kernels; /* Compiled kernels, see redux_key */
+  size_t maxgs; /* Maximum grid size */
+  unsigned int ls; /* Local size the tree kernels are compiled for */
+  unsigned int n; /* Number of inputs */
+  unsigned int narray; /* Number of array inputs */
+  unsigned int nout; /* Number of outputs */
+  int flags;
 };
-typedef struct maxandargmax_ctx maxandargmax_ctx;
-
-
-
-/* Function prototypes */
-static int   axisInSet                          (int                v,
-                                                 const int*         set,
-                                                 size_t             setLen,
-                                                 size_t*            where);
-static void  appendIdxes                        (strb*              s,
-                                                 const char*        prologue,
-                                                 const char*        prefix,
-                                                 int                startIdx,
-                                                 int                endIdx,
-                                                 const char*        suffix,
-                                                 const char*        epilogue);
-static int   maxandargmaxCheckargs              (maxandargmax_ctx*  ctx);
-static int   maxandargmaxSelectHwAxes           (maxandargmax_ctx*  ctx);
-static int   maxandargmaxGenSource              (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendKernel           (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendTypedefs         (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendPrototype        (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendOffsets          (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendIndexDeclarations(maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendRangeCalculations(maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendLoops            (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendLoopMacroDefs    (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendLoopOuter        (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendLoopInner        (maxandargmax_ctx*  ctx);
-static void  maxandargmaxAppendLoopMacroUndefs  (maxandargmax_ctx*  ctx);
-static void  maxandargmaxComputeAxisList        (maxandargmax_ctx*  ctx);
-static int   maxandargmaxCompile                (maxandargmax_ctx*  ctx);
-static int   maxandargmaxSchedule               (maxandargmax_ctx*  ctx);
-static int   maxandargmaxInvoke                 (maxandargmax_ctx*  ctx);
-static int   maxandargmaxCleanup                (maxandargmax_ctx*  ctx);
-
-
-/* Function implementation */
-GPUARRAY_PUBLIC int GpuArray_maxandargmax       (GpuArray*       dstMax,
-                                                 GpuArray*       dstArgmax,
-                                                 const GpuArray* src,
-                                                 unsigned        reduxLen,
-                                                 const unsigned* reduxList){
-	maxandargmax_ctx  ctxSTACK = {0};
-	maxandargmax_ctx  *ctx = &ctxSTACK;
-
-  ctxSTACK.dstMax = dstMax;
-	ctxSTACK.dstArgmax = dstArgmax;
-	ctxSTACK.src = src;
-	ctxSTACK.reduxLen = (int)reduxLen;
-	ctxSTACK.reduxList = (const int*)reduxList;
-
-	if(maxandargmaxCheckargs   (ctx) == GA_NO_ERROR &&
-	   maxandargmaxSelectHwAxes(ctx) == GA_NO_ERROR &&
-	   maxandargmaxGenSource   (ctx) == GA_NO_ERROR &&
-	   maxandargmaxCompile     (ctx) == GA_NO_ERROR &&
-	   maxandargmaxSchedule    (ctx) == GA_NO_ERROR &&
-	   maxandargmaxInvoke      (ctx) == GA_NO_ERROR){
-		return maxandargmaxCleanup(ctx);
-	}else{
-		return maxandargmaxCleanup(ctx);
-	}
-}
 
-/**
- * @brief Check whether axis numbered v is already in the given set of axes.
- *
- * @param [in]  v
- * @param [in]  set
- * @param [in]  setLen
- * @param [out] where
- * @return Non-zero if the set is non-empty and v is in it; Zero otherwise.
+/*
+ * Kernels are specialized on the number of (collapsed) dimensions
+ * and on which of those are reduced.  The types are fixed for a
+ * GpuReduction.
  */
+typedef struct _redux_key {
+  uint64_t redux; /* Bitmask of the reduced dimensions */
+  uint32_t nd;
+  uint32_t tree; /* One group per output rather than one thread */
+} redux_key;
 
-static int   axisInSet                          (int                v,
-                                                 const int*         set,
-                                                 size_t             setLen,
-                                                 size_t*            where){
-	size_t i;
+/* Reductions over fewer elements than this use one thread per output */
+#define TREE_MIN 64
 
-	for(i=0;i<setLen;i++){
-		if(set[i] == v){
-			if(where){*where = i;}
-			return 1;
-		}
-	}
+/* Upper bound for the local size of the tree kernels */
+#define TREE_MAXLS 256
 
-	return 0;
-}
+#define is_array(a) (ISCLR((a).flags, GE_SCALAR))
 
-/**
- * @brief Append a comma-separated list of indices, whose name contains an
- *        incrementing integer, to a string buffer.
- *
- *
- * @param [in]  s         The string buffer to which to append.
- * @param [in]  prologue  Text that is prepended in front and NOT repeated.
- * @param [in]  prefix    Text that is prepended in front of the integer and
- *                        repeated.
- * @param [in]  startIdx  First value of the integer (inclusive)
- * @param [in]  endIdx    Last  value of the integer (exclusive)
- * @param [in]  suffix    Text that is appended after the integer, followed by
- *                        a comma if it isn't the last index, and repeated.
- * @param [in]  epilogue  Text that is appended and NOT repeated.
- */
-
-static void  appendIdxes                        (strb*              s,
-                                                 const char*        prologue,
-                                                 const char*        prefix,
-                                                 int                startIdx,
-                                                 int                endIdx,
-                                                 const char*        suffix,
-                                                 const char*        epilogue){
-	int i;
-
-	prologue = prologue ? prologue : "";
-	prefix   = prefix   ? prefix   : "";
-	suffix   = suffix   ? suffix   : "";
-	epilogue = epilogue ? epilogue : "";
-
-	strb_appends(s, prologue);
-	for(i=startIdx;i<endIdx;i++){
-		strb_appendf(s, "%s%d%s%s", prefix, i, suffix, &","[i==endIdx-1]);
-	}
-	strb_appends(s, epilogue);
+static inline const char *ctype(int typecode) {
+  return gpuarray_get_type(typecode)->cluda_name;
 }
 
-/**
- * @brief Check the sanity of the arguments, in agreement with the
- *        documentation for GpuArray_maxandargmax().
- *
- *        Also initialize certain parts of the context.
- *
- * @return GA_INVALID_ERROR if arguments invalid; GA_NO_ERROR otherwise.
- */
-
-static int   maxandargmaxCheckargs              (maxandargmax_ctx*  ctx){
-	int i;
-
-	/**
-	 * We initialize certain parts of the context.
-	 */
-
-	ctx->ret           = GA_NO_ERROR;
-	ctx->axisList      = NULL;
-	ctx->gpuCtx        = NULL;
-
-	ctx->dstMaxType    = ctx->dstArgmaxType = NULL;
-	ctx->ndh           = 0;
-	ctx->sourceCode    = NULL;
-
-	ctx->hwAxisList[0] = ctx->hwAxisList[1] = ctx->hwAxisList[2] = 0;
-	ctx->blockSize [0] = ctx->blockSize [1] = ctx->blockSize [2] = 1;
-	ctx->gridSize  [0] = ctx->gridSize  [1] = ctx->gridSize  [2] = 1;
-	ctx->chunkSize [0] = ctx->chunkSize [1] = ctx->chunkSize [2] = 1;
-
-	ctx->srcStepsGD    = ctx->srcSizeGD     = ctx->chunkSizeGD   =
-	ctx->dstMaxStepsGD = ctx->dstArgmaxStepsGD = NULL;
-
-
-	/* Insane src or reduxLen? */
-	if(!ctx->dstMax || !ctx->dstArgmax || !ctx->src || ctx->src->nd == 0 ||
-	    ctx->reduxLen == 0 || ctx->reduxLen > (int)ctx->src->nd){
-		return ctx->ret=GA_INVALID_ERROR;
-	}
-
-	/* Insane or duplicate list entry? */
-	for(i=0;i<ctx->reduxLen;i++){
-		if(ctx->reduxList[i] <  0                            ||
-		   ctx->reduxList[i] >= (int)ctx->src->nd            ||
-		   axisInSet(ctx->reduxList[i], ctx->reduxList, i, 0)){
-			return ctx->ret=GA_INVALID_ERROR;
-		}
-	}
-
-	/* Unknown type? */
-	ctx->dstMaxType    = gpuarray_get_type(ctx->src->typecode)->cluda_name;
-	ctx->dstArgmaxType = gpuarray_get_type(GA_SSIZE)          ->cluda_name;
-	if(!ctx->dstMaxType || !ctx->dstArgmaxType){
-		return ctx->ret=GA_INVALID_ERROR;
-	}
-
-	/* GPU context non-existent? */
-	ctx->gpuCtx        = GpuArray_context(ctx->src);
-	if(!ctx->gpuCtx){
-		return ctx->ret=GA_INVALID_ERROR;
-	}
-
-
-	/**
-	 * We initialize some more parts of the context, using the guarantees
-	 * we now have about the sanity of the arguments.
-	 */
-
-	ctx->nds = ctx->src->nd;
-	ctx->ndr = ctx->reduxLen;
-	ctx->ndd = ctx->nds - ctx->ndr;
-
-	return ctx->ret;
+static int key_eq(cache_key_t _k1, cache_key_t _k2) {
+  redux_key *k1 = (redux_key *)_k1;
+  redux_key *k2 = (redux_key *)_k2;
+  return (k1->redux == k2->redux && k1->nd == k2->nd &&
+          k1->tree == k2->tree);
 }
 
-/**
- * @brief Select which axes (up to 3) will be assigned to hardware
- *        dimensions.
- */
+static uint64_t key_hash(cache_key_t k) {
+  return XXH64(k, sizeof(redux_key), 42);
+}
 
-static int   maxandargmaxSelectHwAxes           (maxandargmax_ctx*  ctx){
-	int    i, j, maxI = 0;
-	size_t maxV;
+static void kernel_clear(cache_value_t k) {
+  GpuKernel_clear((GpuKernel *)k);
+}
 
-	ctx->ndh = ctx->ndd<3 ? ctx->ndd : 3;
+static void free_outs(unsigned int n, gpureduction_out *outs) {
+  unsigned int i;
 
-	/**
-	 * The ctx->hwAxisLen largest axes are selected and assigned in
-	 * descending order to X, Y, Z.
-	 */
+  if (outs != NULL)
+    for (i = 0; i < n; i++) {
+      free((void *)outs[i].name);
+      free((void *)outs[i].neutral);
+    }
+  free(outs);
+}
 
-	for(i=0;i<ctx->ndh;i++){
-		maxV = 0;
+static gpureduction_out *copy_outs(unsigned int n, gpureduction_out *o) {
+  gpureduction_out *res = calloc(n, sizeof(gpureduction_out));
+  unsigned int i;
+
+  if (res == NULL) return NULL;
+
+  for (i = 0; i < n; i++) {
+    res[i].typecode = o[i].typecode;
+    res[i].name = strdup(o[i].name);
+    res[i].neutral = strdup(o[i].neutral);
+    if (res[i].name == NULL || res[i].neutral == NULL) {
+      free_outs(n, res);
+      return NULL;
+    }
+  }
+  return res;
+}
 
-		for(j=0;j<ctx->nds;j++){
-			if(!axisInSet(j, ctx->hwAxisList, i,        0) &&
-			   !axisInSet(j, ctx->reduxList,  ctx->ndr, 0) &&
-			   ctx->src->dimensions[j] >= maxV){
-				maxV = ctx->src->dimensions[j];
-				maxI = j;
-			}
-		}
+static void free_args(unsigned int n, gpuelemwise_arg *args) {
+  unsigned int i;
 
-		ctx->hwAxisList[i] = maxI;
-	}
+  if (args != NULL)
+    for (i = 0; i < n; i++)
+      free((void *)args[i].name);
+  free(args);
+}
 
-	return ctx->ret=GA_NO_ERROR;
+static gpuelemwise_arg *copy_args(unsigned int n, gpuelemwise_arg *a) {
+  gpuelemwise_arg *res = calloc(n, sizeof(gpuelemwise_arg));
+  unsigned int i;
+
+  if (res == NULL) return NULL;
+
+  for (i = 0; i < n; i++) {
+    res[i].typecode = a[i].typecode;
+    res[i].flags = a[i].flags;
+    res[i].name = strdup(a[i].name);
+    if (res[i].name == NULL) {
+      free_args(n, res);
+      return NULL;
+    }
+  }
+  return res;
 }
 
-/**
- * @brief Generate the kernel code for MaxAndArgmax.
+/*
+ * Remove the dimensions of size 1 and merge the neighbouring
+ * dimensions that are of the same kind (both reduced or both not) and
+ * contiguous for all the arrays.
  *
- * @return GA_MEMORY_ERROR if not enough memory left; GA_NO_ERROR otherwise.
+ * The outputs have a stride of 0 for the reduced dimensions, so
+ * they never prevent merging reduced dimensions.
  */
-
-static int   maxandargmaxGenSource              (maxandargmax_ctx*  ctx){
-	/* Compute internal axis remapping. */
-	ctx->axisList = malloc(ctx->nds * sizeof(unsigned));
-	if(!ctx->axisList){
-		return ctx->ret=GA_MEMORY_ERROR;
-	}
-	maxandargmaxComputeAxisList(ctx);
-
-	/* Generate kernel proper. */
-	strb_ensure(&ctx->s, 5*1024);
-	maxandargmaxAppendKernel(ctx);
-	free(ctx->axisList);
-	ctx->axisList   = NULL;
-	ctx->sourceCode = strb_cstr(&ctx->s);
-	if(!ctx->sourceCode){
-		return ctx->ret=GA_MEMORY_ERROR;
-	}
-
-	/* Return it. */
-	return ctx->ret=GA_NO_ERROR;
-}
-static void  maxandargmaxAppendKernel           (maxandargmax_ctx*  ctx){
-	maxandargmaxAppendTypedefs         (ctx);
-	maxandargmaxAppendPrototype        (ctx);
-	strb_appends           (&ctx->s, "{\n");
-	maxandargmaxAppendOffsets          (ctx);
-	maxandargmaxAppendIndexDeclarations(ctx);
-	maxandargmaxAppendRangeCalculations(ctx);
-	maxandargmaxAppendLoops            (ctx);
-	strb_appends           (&ctx->s, "}\n");
-}
-static void  maxandargmaxAppendTypedefs         (maxandargmax_ctx*  ctx){
-	strb_appends(&ctx->s, "/* Typedefs */\n");
-	strb_appendf(&ctx->s, "typedef %s     T;/* The type of the array being processed. */\n", ctx->dstMaxType);
-	strb_appendf(&ctx->s, "typedef %s     X;/* Index type: signed 32/64-bit. */\n",          ctx->dstArgmaxType);
-	strb_appends(&ctx->s, "\n");
-	strb_appends(&ctx->s, "\n");
-	strb_appends(&ctx->s, "\n");
-}
-static void  maxandargmaxAppendPrototype        (maxandargmax_ctx*  ctx){
-	strb_appends(&ctx->s, "KERNEL void maxandargmax(const GLOBAL_MEM T*        src,\n");
-	strb_appends(&ctx->s, "                         const X         srcOff,\n");
-	strb_appends(&ctx->s, "                         const GLOBAL_MEM X*        srcSteps,\n");
-	strb_appends(&ctx->s, "                         const GLOBAL_MEM X*        srcSize,\n");
-	strb_appends(&ctx->s, "                         const GLOBAL_MEM X*        chunkSize,\n");
-	strb_appends(&ctx->s, "                         GLOBAL_MEM T*              dstMax,\n");
-	strb_appends(&ctx->s, "                         const X         dstMaxOff,\n");
-	strb_appends(&ctx->s, "                         const GLOBAL_MEM X*        dstMaxSteps,\n");
-	strb_appends(&ctx->s, "                         GLOBAL_MEM X*              dstArgmax,\n");
-	strb_appends(&ctx->s, "                         const X         dstArgmaxOff,\n");
-	strb_appends(&ctx->s, "                         const GLOBAL_MEM X*        dstArgmaxSteps)");
+static void collapse(unsigned int n, unsigned int *_nd, size_t *dims,
+                     char *red, ssize_t **strs) {
+  unsigned int nd = *_nd;
+  unsigned int i, j, k;
+
+  j = 0;
+  for (i = 0; i < nd; i++) {
+    if (dims[i] == 1) continue;
+    dims[j] = dims[i];
+    red[j] = red[i];
+    for (k = 0; k < n; k++)
+      strs[k][j] = strs[k][i];
+    j++;
+  }
+  nd = j;
+
+  if (nd > 1) {
+    j = 0;
+    for (i = 1; i < nd; i++) {
+      if (red[i] == red[j]) {
+        for (k = 0; k < n; k++)
+          if (strs[k][j] != strs[k][i] * (ssize_t)dims[i])
+            break;
+        if (k == n) {
+          dims[j] *= dims[i];
+          for (k = 0; k < n; k++)
+            strs[k][j] = strs[k][i];
+          continue;
+        }
+      }
+      j++;
+      dims[j] = dims[i];
+      red[j] = red[i];
+      for (k = 0; k < n; k++)
+        strs[k][j] = strs[k][i];
+    }
+    nd = j + 1;
+  }
+  *_nd = nd;
 }
-static void  maxandargmaxAppendOffsets          (maxandargmax_ctx*  ctx){
-	strb_appends(&ctx->s, "\t/* Add offsets */\n");
-	strb_appends(&ctx->s, "\tsrc       = (const GLOBAL_MEM T*)((const GLOBAL_MEM char*)src       + srcOff);\n");
-	strb_appends(&ctx->s, "\tdstMax    = (GLOBAL_MEM T*)      ((GLOBAL_MEM char*)      dstMax    + dstMaxOff);\n");
-	strb_appends(&ctx->s, "\tdstArgmax = (GLOBAL_MEM X*)      ((GLOBAL_MEM char*)      dstArgmax + dstArgmaxOff);\n");
-	strb_appends(&ctx->s, "\t\n");
-	strb_appends(&ctx->s, "\t\n");
-}
-static void  maxandargmaxAppendIndexDeclarations(maxandargmax_ctx*  ctx){
-	int i;
-	strb_appends(&ctx->s, "\t/* GPU kernel coordinates. Always 3D. */\n");
-
-	strb_appends(&ctx->s, "\tX bi0 = GID_0,        bi1 = GID_1,        bi2 = GID_2;\n");
-	strb_appends(&ctx->s, "\tX bd0 = LDIM_0,       bd1 = LDIM_1,       bd2 = LDIM_2;\n");
-	strb_appends(&ctx->s, "\tX ti0 = LID_0,        ti1 = LID_1,        ti2 = LID_2;\n");
-	strb_appends(&ctx->s, "\tX gi0 = bi0*bd0+ti0,  gi1 = bi1*bd1+ti1,  gi2 = bi2*bd2+ti2;\n");
-	if(ctx->ndh>0){
-		strb_appends(&ctx->s, "\tX ");
-		for(i=0;i<ctx->ndh;i++){
-			strb_appendf(&ctx->s, "ci%u = chunkSize[%u]%s",
-			             i, i, (i==ctx->ndh-1) ? ";\n" : ", ");
-		}
-	}
-
-	strb_appends(&ctx->s, "\t\n");
-	strb_appends(&ctx->s, "\t\n");
-	strb_appends(&ctx->s, "\t/* Free indices & Reduction indices */\n");
-
-	if(ctx->nds > 0){appendIdxes (&ctx->s, "\tX ", "i", 0,               ctx->nds, "",        ";\n");}
-	if(ctx->nds > 0){appendIdxes (&ctx->s, "\tX ", "i", 0,               ctx->nds, "Dim",     ";\n");}
-	if(ctx->nds > 0){appendIdxes (&ctx->s, "\tX ", "i", 0,               ctx->nds, "Start",   ";\n");}
-	if(ctx->nds > 0){appendIdxes (&ctx->s, "\tX ", "i", 0,               ctx->nds, "End",     ";\n");}
-	if(ctx->nds > 0){appendIdxes (&ctx->s, "\tX ", "i", 0,               ctx->nds, "SStep",   ";\n");}
-	if(ctx->ndd > 0){appendIdxes (&ctx->s, "\tX ", "i", 0,               ctx->ndd, "MStep",   ";\n");}
-	if(ctx->ndd > 0){appendIdxes (&ctx->s, "\tX ", "i", 0,               ctx->ndd, "AStep",   ";\n");}
-	if(ctx->nds > ctx->ndd){appendIdxes (&ctx->s, "\tX ", "i", ctx->ndd, ctx->nds, "PDim",    ";\n");}
-
-	strb_appends(&ctx->s, "\t\n");
-	strb_appends(&ctx->s, "\t\n");
-}
-static void  maxandargmaxAppendRangeCalculations(maxandargmax_ctx*  ctx){
-	size_t hwDim;
-	int    i;
-
-	/* Use internal remapping when computing the ranges for this thread. */
-	strb_appends(&ctx->s, "\t/* Compute ranges for this thread. */\n");
-
-	for(i=0;i<ctx->nds;i++){
-		strb_appendf(&ctx->s, "\ti%dDim     = srcSize[%d];\n", i, ctx->axisList[i]);
-	}
-	for(i=0;i<ctx->nds;i++){
-		strb_appendf(&ctx->s, "\ti%dSStep   = srcSteps[%d];\n", i, ctx->axisList[i]);
-	}
-	for(i=0;i<ctx->ndd;i++){
-		strb_appendf(&ctx->s, "\ti%dMStep   = dstMaxSteps[%d];\n", i, i);
-	}
-	for(i=0;i<ctx->ndd;i++){
-		strb_appendf(&ctx->s, "\ti%dAStep   = dstArgmaxSteps[%d];\n", i, i);
-	}
-	for(i=ctx->nds-1;i>=ctx->ndd;i--){
-		/**
-		 * If this is the last index, it's the first cumulative dimension
-		 * product we generate, and thus we initialize to 1.
-		 */
-
-		if(i == ctx->nds-1){
-			strb_appendf(&ctx->s, "\ti%dPDim    = 1;\n", i);
-		}else{
-			strb_appendf(&ctx->s, "\ti%dPDim    = i%dPDim * i%dDim;\n", i, i+1, i+1);
-		}
-	}
-	for(i=0;i<ctx->nds;i++){
-		/**
-		 * Up to 3 dimensions get to rely on hardware loops.
-		 * The others, if any, have to use software looping beginning at 0.
-		 */
-
-		if(axisInSet(ctx->axisList[i], ctx->hwAxisList, ctx->ndh, &hwDim)){
-			strb_appendf(&ctx->s, "\ti%dStart   = gi%d * ci%d;\n", i, hwDim, hwDim);
-		}else{
-			strb_appendf(&ctx->s, "\ti%dStart   = 0;\n", i);
-		}
-	}
-	for(i=0;i<ctx->nds;i++){
-		/**
-		 * Up to 3 dimensions get to rely on hardware loops.
-		 * The others, if any, have to use software looping beginning at 0.
-		 */
-
-		if(axisInSet(ctx->axisList[i], ctx->hwAxisList, ctx->ndh, &hwDim)){
-			strb_appendf(&ctx->s, "\ti%dEnd     = i%dStart + ci%d;\n", i, i, hwDim);
-		}else{
-			strb_appendf(&ctx->s, "\ti%dEnd     = i%dStart + i%dDim;\n", i, i, i);
-		}
-	}
-
-	strb_appends(&ctx->s, "\t\n");
-	strb_appends(&ctx->s, "\t\n");
-}
-static void  maxandargmaxAppendLoops            (maxandargmax_ctx*  ctx){
-	strb_appends(&ctx->s, "\t/**\n");
-	strb_appends(&ctx->s, "\t * FREE LOOPS.\n");
-	strb_appends(&ctx->s, "\t */\n");
-	strb_appends(&ctx->s, "\t\n");
-
-	maxandargmaxAppendLoopMacroDefs  (ctx);
-	maxandargmaxAppendLoopOuter      (ctx);
-	maxandargmaxAppendLoopMacroUndefs(ctx);
-}
-static void  maxandargmaxAppendLoopMacroDefs    (maxandargmax_ctx*  ctx){
-	int i;
-
-	/**
-	 * FOROVER Macro
-	 */
-
-	strb_appends(&ctx->s, "#define FOROVER(idx)    for(i##idx = i##idx##Start; i##idx < i##idx##End; i##idx++)\n");
-
-	/**
-	 * ESCAPE Macro
-	 */
-
-	strb_appends(&ctx->s, "#define ESCAPE(idx)     if(i##idx >= i##idx##Dim){continue;}\n");
-
-	/**
-	 * SRCINDEXER Macro
-	 */
-
-	appendIdxes (&ctx->s, "#define SRCINDEXER(", "i", 0, ctx->nds, "", ")   (*(GLOBAL_MEM T*)((GLOBAL_MEM char*)src + ");
-	for(i=0;i<ctx->nds;i++){
-		strb_appendf(&ctx->s, "i%d*i%dSStep + \\\n                                            ", i, i);
-	}
-	strb_appends(&ctx->s, "0))\n");
-
-	/**
-	 * RDXINDEXER Macro
-	 */
-
-	appendIdxes (&ctx->s, "#define RDXINDEXER(", "i", ctx->ndd, ctx->nds, "", ")              (");
-	for(i=ctx->ndd;i<ctx->nds;i++){
-		strb_appendf(&ctx->s, "i%d*i%dPDim + \\\n                                        ", i, i);
-	}
-	strb_appends(&ctx->s, "0)\n");
-
-	/**
-	 * DSTMINDEXER Macro
-	 */
-
-	appendIdxes (&ctx->s, "#define DSTMINDEXER(", "i", 0, ctx->ndd, "", ")        (*(GLOBAL_MEM T*)((GLOBAL_MEM char*)dstMax + ");
-	for(i=0;i<ctx->ndd;i++){
-		strb_appendf(&ctx->s, "i%d*i%dMStep + \\\n                                                  ", i, i);
-	}
-	strb_appends(&ctx->s, "0))\n");
-
-	/**
-	 * DSTAINDEXER Macro
-	 */
-
-	appendIdxes (&ctx->s, "#define DSTAINDEXER(", "i", 0, ctx->ndd, "", ")        (*(GLOBAL_MEM X*)((GLOBAL_MEM char*)dstArgmax + ");
-	for(i=0;i<ctx->ndd;i++){
-		strb_appendf(&ctx->s, "i%d*i%dAStep + \\\n                                                     ", i, i);
-	}
-	strb_appends(&ctx->s, "0))\n");
-}
-static void  maxandargmaxAppendLoopOuter        (maxandargmax_ctx*  ctx){
-	int i;
-
-	/**
-	 * Outer Loop Header Generation
-	 */
 
-	for(i=0;i<ctx->ndd;i++){
-		strb_appendf(&ctx->s, "\tFOROVER(%d){ESCAPE(%d)\n", i, i);
-	}
-
-	/**
-	 * Inner Loop Generation
-	 */
-
-	maxandargmaxAppendLoopInner(ctx);
-
-	/**
-	 * Outer Loop Trailer Generation
-	 */
+static int gen_kernel(GpuReduction *gr, GpuKernel *k, unsigned int nd,
+                      const char *red, int tree) {
+  strb sb = STRB_STATIC_INIT;
+  unsigned int i, _i, j, first_free;
+  int *ktypes, *kaccess;
+  size_t p;
+  int flags = GA_USE_CLUDA;
+  int res;
+#ifdef DEBUG
+  char *errstr = NULL;
+#endif
 
-	for(i=0;i<ctx->ndd;i++){
-		strb_appends(&ctx->s, "\t}\n");
-	}
-}
-static void  maxandargmaxAppendLoopInner        (maxandargmax_ctx*  ctx){
-	int i;
-
-	/**
-	 * Inner Loop Prologue
-	 */
-
-	strb_appends(&ctx->s, "\t/**\n");
-	strb_appends(&ctx->s, "\t * Reduction initialization.\n");
-	strb_appends(&ctx->s, "\t */\n");
-	strb_appends(&ctx->s, "\t\n");
-
-	appendIdxes (&ctx->s, "\tT maxV = SRCINDEXER(", "i", 0, ctx->ndd, "", "");
-	if(ctx->ndd && ctx->ndr){strb_appends(&ctx->s, ",");}
-	appendIdxes (&ctx->s, "", "i", ctx->ndd, ctx->nds, "Start", ");\n");
-
-	appendIdxes (&ctx->s, "\tX maxI = RDXINDEXER(", "i", ctx->ndd, ctx->nds, "Start", ");\n");
-
-	strb_appends(&ctx->s, "\t\n");
-	strb_appends(&ctx->s, "\t/**\n");
-	strb_appends(&ctx->s, "\t * REDUCTION LOOPS.\n");
-	strb_appends(&ctx->s, "\t */\n");
-	strb_appends(&ctx->s, "\t\n");
-
-	/**
-	 * Inner Loop Header Generation
-	 */
-
-	for(i=ctx->ndd;i<ctx->nds;i++){
-		strb_appendf(&ctx->s, "\tFOROVER(%d){ESCAPE(%d)\n", i, i);
-	}
-
-	/**
-	 * Inner Loop Body Generation
-	 */
-
-	appendIdxes (&ctx->s, "\tT V = SRCINDEXER(", "i", 0, ctx->nds, "", ");\n");
-	strb_appends(&ctx->s, "\t\n");
-	strb_appends(&ctx->s, "\tif(V > maxV){\n");
-	strb_appends(&ctx->s, "\t\tmaxV = V;\n");
-	appendIdxes (&ctx->s, "\t\tmaxI = RDXINDEXER(", "i", ctx->ndd, ctx->nds, "", ");\n");
-	strb_appends(&ctx->s, "\t}\n");
-
-	/**
-	 * Inner Loop Trailer Generation
-	 */
-
-	for(i=ctx->ndd;i<ctx->nds;i++){
-		strb_appends(&ctx->s, "\t}\n");
-	}
-	strb_appends(&ctx->s, "\t\n");
-
-	/**
-	 * Inner Loop Epilogue Generation
-	 */
-
-	strb_appends(&ctx->s, "\t/**\n");
-	strb_appends(&ctx->s, "\t * Destination writeback.\n");
-	strb_appends(&ctx->s, "\t */\n");
-	strb_appends(&ctx->s, "\t\n");
-	appendIdxes (&ctx->s, "\tDSTMINDEXER(", "i", 0, ctx->ndd, "", ") = maxV;\n");
-	appendIdxes (&ctx->s, "\tDSTAINDEXER(", "i", 0, ctx->ndd, "", ") = maxI;\n");
+  flags |= gpuarray_type_flagsa(gr->n, gr->args);
+  for (j = 0; j < gr->nout; j++)
+    flags |= gpuarray_type_flags(gr->outs[j].typecode, -1);
+
+  first_free = nd;
+  for (i = 0; i < nd; i++)
+    if (!red[i]) {
+      first_free = i;
+      break;
+    }
+
+  p = 2 + nd;
+  for (j = 0; j < gr->n; j++)
+    p += ISSET(gr->args[j].flags, GE_SCALAR) ? 1 : (2 + nd);
+  for (j = 0; j < gr->nout; j++) {
+    p += 2;
+    for (i = 0; i < nd; i++)
+      p += red[i] ? 0 : 1;
+  }
+
+  ktypes = calloc(p, sizeof(int));
+  if (ktypes == NULL)
+    return GA_MEMORY_ERROR;
+  kaccess = calloc(p, sizeof(int));
+  if (kaccess == NULL) {
+    free(ktypes);
+    return GA_MEMORY_ERROR;
+  }
+
+  p = 0;
+
+  if (gr->preamble)
+    strb_appends(&sb, gr->preamble);
+  strb_appends(&sb, "\nKERNEL void reduk(const ga_size nfree, "
+               "const ga_size nred");
+  ktypes[p++] = GA_SIZE;
+  ktypes[p++] = GA_SIZE;
+  for (i = 0; i < nd; i++) {
+    strb_appendf(&sb, ", const ga_size dim%u", i);
+    ktypes[p++] = GA_SIZE;
+  }
+  for (j = 0; j < gr->n; j++) {
+    if (is_array(gr->args[j])) {
+      strb_appendf(&sb, ", GLOBAL_MEM %s *%s_data, const ga_size %s_offset",
+                   ctype(gr->args[j].typecode), gr->args[j].name,
+                   gr->args[j].name);
+      kaccess[p] = GA_ARG_READ;
+      ktypes[p++] = GA_BUFFER;
+      ktypes[p++] = GA_SIZE;
+      for (i = 0; i < nd; i++) {
+        strb_appendf(&sb, ", const ga_ssize %s_str_%u", gr->args[j].name, i);
+        ktypes[p++] = GA_SSIZE;
+      }
+    } else {
+      strb_appendf(&sb, ", %s %s", ctype(gr->args[j].typecode),
+                   gr->args[j].name);
+      ktypes[p++] = gr->args[j].typecode;
+    }
+  }
+  for (j = 0; j < gr->nout; j++) {
+    strb_appendf(&sb, ", GLOBAL_MEM %s *%s_data, const ga_size %s_offset",
+                 ctype(gr->outs[j].typecode), gr->outs[j].name,
+                 gr->outs[j].name);
+    kaccess[p] = GA_ARG_WRITE;
+    ktypes[p++] = GA_BUFFER;
+    ktypes[p++] = GA_SIZE;
+    for (i = 0; i < nd; i++) {
+      if (red[i]) continue;
+      strb_appendf(&sb, ", const ga_ssize %s_str_%u", gr->outs[j].name, i);
+      ktypes[p++] = GA_SSIZE;
+    }
+  }
+  strb_appends(&sb, ") {\n");
+
+  if (tree) {
+    for (j = 0; j < gr->nout; j++)
+      strb_appendf(&sb, "LOCAL_MEM %s %s_l[%u];\n",
+                   ctype(gr->outs[j].typecode), gr->outs[j].name, gr->ls);
+    strb_appends(&sb, "const ga_size lid = LID_0;\n"
+                 "const ga_size ls = LDIM_0;\n"
+                 "ga_size st;\n");
+  }
+  strb_appends(&sb, "ga_size gi, i, ii, pos;\n");
+  for (j = 0; j < gr->n; j++)
+    if (is_array(gr->args[j]))
+      strb_appendf(&sb, "ga_size %s_p, %s_q;\n", gr->args[j].name,
+                   gr->args[j].name);
+  for (j = 0; j < gr->nout; j++)
+    strb_appendf(&sb, "ga_size %s_p;\n", gr->outs[j].name);
+
+  if (tree)
+    strb_appends(&sb, "for (gi = GID_0; gi < nfree; gi += GDIM_0) {\n");
+  else
+    strb_appends(&sb, "for (gi = GID_0 * LDIM_0 + LID_0; gi < nfree; "
+                 "gi += GDIM_0 * LDIM_0) {\n");
+  for (j = 0; j < gr->nout; j++)
+    strb_appendf(&sb, "%s a_%s = %s, b_%s;\n", ctype(gr->outs[j].typecode),
+                 gr->outs[j].name, gr->outs[j].neutral, gr->outs[j].name);
+
+  /* Position of this output in the inputs and the outputs */
+  for (j = 0; j < gr->n; j++)
+    if (is_array(gr->args[j]))
+      strb_appendf(&sb, "%s_p = %s_offset;\n", gr->args[j].name,
+                   gr->args[j].name);
+  for (j = 0; j < gr->nout; j++)
+    strb_appendf(&sb, "%s_p = %s_offset;\n", gr->outs[j].name,
+                 gr->outs[j].name);
+  strb_appends(&sb, "ii = gi;\n");
+  for (_i = nd; _i > 0; _i--) {
+    i = _i - 1;
+    if (red[i]) continue;
+    if (i != first_free)
+      strb_appendf(&sb, "pos = ii %% dim%u;\nii = ii / dim%u;\n", i, i);
+    else
+      strb_appends(&sb, "pos = ii;\n");
+    for (j = 0; j < gr->n; j++)
+      if (is_array(gr->args[j]))
+        strb_appendf(&sb, "%s_p += pos * %s_str_%u;\n", gr->args[j].name,
+                     gr->args[j].name, i);
+    for (j = 0; j < gr->nout; j++)
+      strb_appendf(&sb, "%s_p += pos * %s_str_%u;\n", gr->outs[j].name,
+                   gr->outs[j].name, i);
+  }
+
+  /* Map and reduce the elements of this output */
+  if (tree)
+    strb_appends(&sb, "for (i = lid; i < nred; i += ls) {\n");
+  else
+    strb_appends(&sb, "for (i = 0; i < nred; i++) {\n");
+  strb_appends(&sb, "const ga_size ridx = i;\nii = i;\n");
+  for (j = 0; j < gr->n; j++)
+    if (is_array(gr->args[j]))
+      strb_appendf(&sb, "%s_q = %s_p;\n", gr->args[j].name, gr->args[j].name);
+  for (_i = nd; _i > 0; _i--) {
+    i = _i - 1;
+    if (!red[i]) continue;
+    strb_appendf(&sb, "pos = ii %% dim%u;\nii = ii / dim%u;\n", i, i);
+    for (j = 0; j < gr->n; j++)
+      if (is_array(gr->args[j]))
+        strb_appendf(&sb, "%s_q += pos * %s_str_%u;\n", gr->args[j].name,
+                     gr->args[j].name, i);
+  }
+  strb_appends(&sb, "{\n");
+  for (j = 0; j < gr->n; j++)
+    if (is_array(gr->args[j]))
+      strb_appendf(&sb, "%s %s = *(GLOBAL_MEM %s *)(((GLOBAL_MEM char *)"
+                   "%s_data) + %s_q);\n", ctype(gr->args[j].typecode),
+                   gr->args[j].name, ctype(gr->args[j].typecode),
+                   gr->args[j].name, gr->args[j].name);
+  for (j = 0; j < gr->nout; j++)
+    strb_appendf(&sb, "%s %s;\n", ctype(gr->outs[j].typecode),
+                 gr->outs[j].name);
+  strb_appends(&sb, gr->map_expr);
+  strb_appends(&sb, ";\n");
+  for (j = 0; j < gr->nout; j++)
+    strb_appendf(&sb, "b_%s = %s;\n", gr->outs[j].name, gr->outs[j].name);
+  strb_appends(&sb, "}\n{\n");
+  strb_appends(&sb, gr->reduce_expr);
+  strb_appends(&sb, ";\n}\n}\n");
+
+  /* Combine the partial results of the group */
+  if (tree) {
+    for (j = 0; j < gr->nout; j++)
+      strb_appendf(&sb, "%s_l[lid] = a_%s;\n", gr->outs[j].name,
+                   gr->outs[j].name);
+    strb_appends(&sb, "for (st = ls >> 1; st > 0; st >>= 1) {\n"
+                 "local_barrier();\n"
+                 "if (lid < st) {\n");
+    for (j = 0; j < gr->nout; j++)
+      strb_appendf(&sb, "b_%s = %s_l[lid + st];\n", gr->outs[j].name,
+                   gr->outs[j].name);
+    strb_appends(&sb, "{\n");
+    strb_appends(&sb, gr->reduce_expr);
+    strb_appends(&sb, ";\n}\n");
+    for (j = 0; j < gr->nout; j++)
+      strb_appendf(&sb, "%s_l[lid] = a_%s;\n", gr->outs[j].name,
+                   gr->outs[j].name);
+    strb_appends(&sb, "}\n}\n"
+                 "local_barrier();\n"
+                 "if (lid == 0) {\n");
+  }
+  for (j = 0; j < gr->nout; j++)
+    strb_appendf(&sb, "*(GLOBAL_MEM %s *)(((GLOBAL_MEM char *)%s_data) + "
+                 "%s_p) = a_%s;\n", ctype(gr->outs[j].typecode),
+                 gr->outs[j].name, gr->outs[j].name, gr->outs[j].name);
+  if (tree)
+    strb_appends(&sb, "}\n");
+  strb_appends(&sb, "}\n}\n");
+
+  if (strb_error(&sb)) {
+    res = GA_MEMORY_ERROR;
+    goto bail;
+  }
+
+  res = GpuKernel_init(k, gr->ctx, 1, (const char **)&sb.s, &sb.l, "reduk",
+                       p, ktypes, kaccess, flags,
+#ifdef DEBUG
+                       &errstr
+#else
+                       NULL
+#endif
+                       );
+#ifdef DEBUG
+  if (res != GA_NO_ERROR) {
+    if (errstr != NULL)
+      fprintf(stderr, "%s\n", errstr);
+    free(errstr);
+  }
+#endif
+ bail:
+  free(ktypes);
+  free(kaccess);
+  strb_clear(&sb);
+  return res;
 }
-static void  maxandargmaxAppendLoopMacroUndefs  (maxandargmax_ctx*  ctx){
-	strb_appends(&ctx->s, "#undef FOROVER\n");
-	strb_appends(&ctx->s, "#undef ESCAPE\n");
-	strb_appends(&ctx->s, "#undef SRCINDEXER\n");
-	strb_appends(&ctx->s, "#undef RDXINDEXER\n");
-	strb_appends(&ctx->s, "#undef DSTMINDEXER\n");
-	strb_appends(&ctx->s, "#undef DSTAINDEXER\n");
+
+static GpuKernel *get_kernel(GpuReduction *gr, unsigned int nd,
+                             const char *red, int tree, int *err) {
+  redux_key key;
+  redux_key *pkey;
+  GpuKernel *k;
+  unsigned int i;
+
+  memset(&key, 0, sizeof(key));
+  key.nd = nd;
+  key.tree = tree;
+  for (i = 0; i < nd; i++)
+    if (red[i])
+      key.redux |= (uint64_t)1 << i;
+
+  k = (GpuKernel *)cache_get(gr->kernels, &key);
+  if (k != NULL)
+    return k;
+
+  pkey = malloc(sizeof(*pkey));
+  k = cache_box_new(sizeof(*k), kernel_clear);
+  if (pkey == NULL || k == NULL) {
+    free(pkey);
+    cache_box_release(k);
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+  *err = gen_kernel(gr, k, nd, red, tree);
+  if (*err != GA_NO_ERROR) {
+    free(pkey);
+    cache_box_release(k);
+    return NULL;
+  }
+  memcpy(pkey, &key, sizeof(key));
+  /* Another thread may have added the same kernel in the meantime */
+  k = (GpuKernel *)cache_get_or_add(gr->kernels, pkey, k);
+  if (k == NULL)
+    *err = GA_MEMORY_ERROR;
+  return k;
 }
-static void  maxandargmaxComputeAxisList        (maxandargmax_ctx*  ctx){
-	int i, f=0;
-
-	for(i=0;i<ctx->nds;i++){
-		if(axisInSet(i, ctx->reduxList, ctx->ndr, 0)){
-			continue;
-		}
-		ctx->axisList[f++] = i;
-	}
-	memcpy(&ctx->axisList[f], ctx->reduxList, ctx->ndr * sizeof(*ctx->reduxList));
+
+GpuReduction *GpuReduction_new(gpucontext *ctx,
+                               const char *preamble,
+                               const char *map_expr,
+                               const char *reduce_expr,
+                               unsigned int n, gpuelemwise_arg *args,
+                               unsigned int nout, gpureduction_out *outs,
+                               int flags) {
+  GpuReduction *res;
+  strb sb = STRB_STATIC_INIT;
+  size_t ls, lmem, outsz;
+  unsigned int i;
+
+  if (nout == 0 || reduce_expr == NULL)
+    return NULL;
+  for (i = 0; i < n; i++)
+    if (ISSET(args[i].flags, GE_WRITE))
+      return NULL;
+
+  if (flags != 0)
+    return NULL;
+
+  if (map_expr == NULL) {
+    if (n != 1 || nout != 1)
+      return NULL;
+    strb_appendf(&sb, "%s = %s", outs[0].name, args[0].name);
+    strb_append0(&sb);
+    if (strb_error(&sb))
+      return NULL;
+    map_expr = sb.s;
+  }
+
+  res = calloc(1, sizeof(*res));
+  if (res == NULL) goto fail;
+
+  res->ctx = ctx;
+  res->flags = flags;
+  res->n = n;
+  res->nout = nout;
+
+  res->map_expr = strdup(map_expr);
+  if (res->map_expr == NULL)
+    goto fail;
+  res->reduce_expr = strdup(reduce_expr);
+  if (res->reduce_expr == NULL)
+    goto fail;
+  if (preamble != NULL) {
+    res->preamble = strdup(preamble);
+    if (res->preamble == NULL)
+      goto fail;
+  }
+
+  if (n > 0) {
+    res->args = copy_args(n, args);
+    if (res->args == NULL)
+      goto fail;
+  }
+  res->outs = copy_outs(nout, outs);
+  if (res->outs == NULL)
+    goto fail;
+
+  res->narray = 0;
+  for (i = 0; i < res->n; i++)
+    if (is_array(res->args[i])) res->narray++;
+
+  /* The object may be shared between threads (see
+     GpuArray_maxandargmax()) so this is a context cache */
+  res->kernels = gpucontext_cache(ctx->flags, 4, 16, 16, 4, key_eq, key_hash,
+                                  free, cache_box_release, cache_box_ref,
+                                  NULL);
+  if (res->kernels == NULL)
+    goto fail;
+
+  /* Size of the local buffers for the tree kernels */
+  if (gpucontext_property(ctx, GA_CTX_PROP_MAXLSIZE0, &ls) != GA_NO_ERROR ||
+      gpucontext_property(ctx, GA_CTX_PROP_LMEMSIZE, &lmem) != GA_NO_ERROR ||
+      gpucontext_property(ctx, GA_CTX_PROP_MAXGSIZE0,
+                          &res->maxgs) != GA_NO_ERROR)
+    goto fail;
+  outsz = 0;
+  for (i = 0; i < nout; i++)
+    outsz += gpuarray_get_elsize(outs[i].typecode);
+  if (ls > TREE_MAXLS)
+    ls = TREE_MAXLS;
+  /* Leave some room for what the backend may need */
+  if (ls > (lmem / 2) / outsz)
+    ls = (lmem / 2) / outsz;
+  res->ls = 1;
+  while (res->ls * 2 <= ls)
+    res->ls *= 2;
+
+  strb_clear(&sb);
+  return res;
+
+ fail:
+  strb_clear(&sb);
+  if (res != NULL)
+    GpuReduction_free(res);
+  return NULL;
 }
 
-/**
- * @brief Compile the kernel from source code.
- *
- * @return
- */
+void GpuReduction_free(GpuReduction *gr) {
+  if (gr->kernels != NULL)
+    cache_destroy(gr->kernels);
+  free_args(gr->n, gr->args);
+  free_outs(gr->nout, gr->outs);
+  free((void *)gr->preamble);
+  free((void *)gr->map_expr);
+  free((void *)gr->reduce_expr);
+  free(gr);
+}
 
-static int   maxandargmaxCompile                (maxandargmax_ctx*  ctx){
-	const int    ARG_TYPECODES[]   = {
-		GA_BUFFER, /* src */
-		GA_SIZE,   /* srcOff */
-		GA_BUFFER, /* srcSteps */
-		GA_BUFFER, /* srcSize */
-		GA_BUFFER, /* chnkSize */
-		GA_BUFFER, /* dstMax */
-		GA_SIZE,   /* dstMaxOff */
-		GA_BUFFER, /* dstMaxSteps */
-		GA_BUFFER, /* dstArgmax */
-		GA_SIZE,   /* dstArgmaxOff */
-		GA_BUFFER  /* dstArgmaxSteps */
-	};
-	const size_t ARG_TYPECODES_LEN = sizeof(ARG_TYPECODES)/sizeof(*ARG_TYPECODES);
-	const char*  SRCS[1];
-
-	SRCS[0] = ctx->sourceCode;
-
-	ctx->ret = GpuKernel_init(&ctx->kernel,
-	                          ctx->gpuCtx,
-	                          1,
-	                          SRCS,
-	                          NULL,
-	                          "maxandargmax",
-	                          ARG_TYPECODES_LEN,
-	                          ARG_TYPECODES,
-	                          GA_USE_CLUDA,
-	                          (char**)0);
-	free(ctx->sourceCode);
-	ctx->sourceCode = NULL;
-
-	return ctx->ret;
+int GpuReduction_call(GpuReduction *gr, GpuArray **outs, void **args,
+                      unsigned int nredux, const unsigned int *redux,
+                      int flags) {
+  GpuArray *a = NULL, *v;
+  GpuKernel *k = NULL;
+  char *scratch = NULL;
+  size_t *dims;
+  char *red;
+  ssize_t **strides;
+  void **kargs;
+  size_t nfree, nred, gs, ls, maxls;
+  unsigned int nd = 0, i, j, p, f;
+  unsigned int ns = gr->narray + gr->nout;
+  int tree;
+  int err;
+
+  if (flags != 0)
+    return GA_VALUE_ERROR;
+
+  /* All the array inputs must have the same shape */
+  for (i = 0; i < gr->n; i++) {
+    if (is_array(gr->args[i])) {
+      v = (GpuArray *)args[i];
+      if (v->typecode != gr->args[i].typecode)
+        return GA_VALUE_ERROR;
+      if (a == NULL) {
+        a = v;
+        continue;
+      }
+      if (v->nd != a->nd)
+        return GA_VALUE_ERROR;
+      for (j = 0; j < a->nd; j++)
+        if (v->dimensions[j] != a->dimensions[j])
+          return GA_VALUE_ERROR;
+    }
+  }
+  if (a == NULL)
+    return GA_VALUE_ERROR;
+  nd = a->nd;
+
+  if (nredux > nd)
+    return GA_VALUE_ERROR;
+
+  /* The shape, strides and kernel arguments are per call so that the
+     object can be used by many threads at once.  The pointer-sized
+     parts come first to keep them aligned. */
+  scratch = malloc(nd * sizeof(size_t) +
+                   ns * (sizeof(ssize_t *) + nd * sizeof(ssize_t)) +
+                   (2 + nd + gr->n + ns * (2 + nd)) * sizeof(void *) + nd);
+  if (scratch == NULL)
+    return GA_MEMORY_ERROR;
+  dims = (size_t *)scratch;
+  strides = (ssize_t **)(dims + nd);
+  for (i = 0; i < ns; i++)
+    strides[i] = (ssize_t *)(strides + ns) + i * nd;
+  kargs = (void **)((ssize_t *)(strides + ns) + ns * nd);
+  red = (char *)(kargs + 2 + nd + gr->n + ns * (2 + nd));
+
+  memset(red, 0, nd);
+  for (i = 0; i < nredux; i++) {
+    if (redux[i] >= nd || red[redux[i]]) {
+      err = GA_VALUE_ERROR;
+      goto end;
+    }
+    red[redux[i]] = 1;
+  }
+
+  /* The outputs have the remaining dimensions */
+  for (j = 0; j < gr->nout; j++) {
+    v = outs[j];
+    if (v->typecode != gr->outs[j].typecode || v->nd != nd - nredux ||
+        !GpuArray_ISWRITEABLE(v)) {
+      err = GA_VALUE_ERROR;
+      goto end;
+    }
+    f = 0;
+    for (i = 0; i < nd; i++) {
+      if (red[i]) {
+        strides[gr->narray + j][i] = 0;
+      } else {
+        if (v->dimensions[f] != a->dimensions[i]) {
+          err = GA_VALUE_ERROR;
+          goto end;
+        }
+        strides[gr->narray + j][i] = v->strides[f];
+        f++;
+      }
+    }
+  }
+
+  memcpy(dims, a->dimensions, nd * sizeof(size_t));
+  p = 0;
+  for (i = 0; i < gr->n; i++) {
+    if (is_array(gr->args[i])) {
+      v = (GpuArray *)args[i];
+      memcpy(strides[p], v->strides, nd * sizeof(ssize_t));
+      p++;
+    }
+  }
+
+  nfree = 1;
+  nred = 1;
+  for (i = 0; i < nd; i++) {
+    if (red[i])
+      nred *= dims[i];
+    else
+      nfree *= dims[i];
+  }
+  if (nfree == 0) {
+    err = GA_NO_ERROR;
+    goto end;
+  }
+
+  collapse(ns, &nd, dims, red, strides);
+  if (nd > 64) {
+    err = GA_UNSUPPORTED_ERROR;
+    goto end;
+  }
+
+  tree = nred >= TREE_MIN;
+  k = get_kernel(gr, nd, red, tree, &err);
+  if (k == NULL)
+    goto end;
+
+  p = 0;
+  kargs[p++] = &nfree;
+  kargs[p++] = &nred;
+  for (i = 0; i < nd; i++)
+    kargs[p++] = &dims[i];
+  f = 0;
+  for (j = 0; j < gr->n; j++) {
+    if (is_array(gr->args[j])) {
+      v = (GpuArray *)args[j];
+      kargs[p++] = v->data;
+      kargs[p++] = &v->offset;
+      for (i = 0; i < nd; i++)
+        kargs[p++] = &strides[f][i];
+      f++;
+    } else {
+      kargs[p++] = args[j];
+    }
+  }
+  for (j = 0; j < gr->nout; j++) {
+    v = outs[j];
+    kargs[p++] = v->data;
+    kargs[p++] = &v->offset;
+    for (i = 0; i < nd; i++) {
+      if (red[i]) continue;
+      kargs[p++] = &strides[gr->narray + j][i];
+    }
+  }
+
+  if (tree) {
+    err = gpukernel_property(k->k, GA_KERNEL_PROP_MAXLSIZE, &maxls);
+    if (err != GA_NO_ERROR) goto end;
+    if (maxls > gr->ls)
+      maxls = gr->ls;
+    /* The combining step needs a power of 2 */
+    ls = 1;
+    while (ls * 2 <= maxls && ls < nred)
+      ls *= 2;
+    gs = nfree < gr->maxgs ? nfree : gr->maxgs;
+  } else {
+    ls = 0;
+    gs = 0;
+    err = GpuKernel_sched(k, nfree, &gs, &ls);
+    if (err != GA_NO_ERROR) goto end;
+  }
+  err = GpuKernel_call(k, 1, &gs, &ls, 0, kargs);
+
+ end:
+  cache_box_release(k);
+  free(scratch);
+  return err;
 }
 
-/**
- * Compute a good thread block size / grid size / software chunk size for Nvidia.
+/*
+ * The GpuReduction used by GpuArray_maxandargmax() only depends on
+ * the types, so there is one per context for each combination.
  */
+struct maxandargmax_key {
+  int stype;
+  int mtype;
+  int atype;
+};
 
-static int   maxandargmaxSchedule               (maxandargmax_ctx*  ctx){
-	int            i;
-	size_t         warpMod;
-	size_t         bestWarpMod  = 1;
-	unsigned       bestWarpAxis = 0;
-	uint64_t       maxLg;
-	uint64_t       maxLs[3];
-	uint64_t       maxGg;
-	uint64_t       maxGs[3];
-	uint64_t       dims [3];
-	double         slack[3];
-	ga_factor_list factBS[3];
-	ga_factor_list factGS[3];
-	ga_factor_list factCS[3];
-
-
-	/**
-	 * Obtain the constraints of our problem.
-	 */
-
-	size_t warpSize,
-	       maxL, maxL0, maxL1, maxL2,  /* Maximum total and per-dimension thread/block sizes */
-	       maxG, maxG0, maxG1, maxG2;  /* Maximum total and per-dimension block /grid  sizes */
-	gpukernel_property(ctx->kernel.k,  GA_KERNEL_PROP_PREFLSIZE, &warpSize);
-	gpukernel_property(ctx->kernel.k,  GA_KERNEL_PROP_MAXLSIZE,  &maxL);
-	gpudata_property  (ctx->src->data, GA_CTX_PROP_MAXLSIZE0,    &maxL0);
-	gpudata_property  (ctx->src->data, GA_CTX_PROP_MAXLSIZE1,    &maxL1);
-	gpudata_property  (ctx->src->data, GA_CTX_PROP_MAXLSIZE2,    &maxL2);
-	gpudata_property  (ctx->src->data, GA_CTX_PROP_MAXGSIZE,     &maxG);
-	gpudata_property  (ctx->src->data, GA_CTX_PROP_MAXGSIZE0,    &maxG0);
-	gpudata_property  (ctx->src->data, GA_CTX_PROP_MAXGSIZE1,    &maxG1);
-	gpudata_property  (ctx->src->data, GA_CTX_PROP_MAXGSIZE2,    &maxG2);
-
-	/**
-	 * Prepare inputs to the solver.
-	 *
-	 * This involves, amongst others,
-	 * - Initializing the blockSize, gridSize and chunkSize factor lists for all
-	 *   hardware dimensions.
-	 * - Finding on which hardware axis is it optimal to place the warpSize factor.
-	 */
-
-	maxLg    = maxL;
-	maxLs[0] = maxL0, maxLs[1]=maxL1, maxLs[2]=maxL2;
-	maxGg    = maxG;
-	maxGs[0] = maxG0, maxGs[1]=maxG1, maxGs[2]=maxG2;
-	dims[0]  = dims[1]  = dims[2]  = 1;
-	slack[0] = slack[1] = slack[2] = 1.1;
-
-	for(i=0;i<ctx->ndh;i++){
-		dims[i] = ctx->src->dimensions[ctx->hwAxisList[i]];
-		gaIFLInit(&factBS[i]);
-		gaIFLInit(&factGS[i]);
-		gaIFLInit(&factCS[i]);
-
-		warpMod = dims[i]%warpSize;
-		if(bestWarpMod>0 && (warpMod==0 || warpMod>=bestWarpMod)){
-			bestWarpAxis = i;
-			bestWarpMod  = warpMod;
-		}
-	}
-
-	if(ctx->ndh > 0){
-		dims[bestWarpAxis] = (dims[bestWarpAxis] + warpSize - 1)/warpSize;
-		gaIFactorize(warpSize, 0, 0, &factBS[bestWarpAxis]);
-	}
-
-	/**
-	 * Factorization job. We'll steadily increase the slack in case of failure
-	 * in order to ensure we do get a factorization, which we place into
-	 * chunkSize.
-	 */
-
-	for(i=0;i<ctx->ndh;i++){
-		while(!gaIFactorize(dims[i], (uint64_t)(dims[i]*slack[i]), maxLs[i], &factCS[i])){
-			/**
-			 * Error! Failed to factorize dimension i with given slack and
-			 * k-smoothness constraints! Increase slack. Once slack reaches
-			 * 2.0 it will factorize guaranteed.
-			 */
-
-			slack[i] += 0.1;
-		}
-	}
-
-	/**
-	 * Invoke the scheduler.
-	 *
-	 * The scheduler will move some factors from chunkSize into blockSize and
-	 * gridSize, improving performance.
-	 */
-
-	gaIFLSchedule(ctx->ndh, maxLg, maxLs, maxGg, maxGs, factBS, factGS, factCS);
-
-	/* Output. */
-	for(i=0;i<ctx->ndh;i++){
-		ctx->blockSize[i] = gaIFLGetProduct(&factBS[i]);
-		ctx->gridSize [i] = gaIFLGetProduct(&factGS[i]);
-		ctx->chunkSize[i] = gaIFLGetProduct(&factCS[i]);
-	}
-
-	/* Return. */
-	return ctx->ret=GA_NO_ERROR;
+static int mam_eq(cache_key_t _k1, cache_key_t _k2) {
+  return memcmp(_k1, _k2, sizeof(struct maxandargmax_key)) == 0;
 }
 
-/**
- * Invoke the kernel.
- */
-
-static int   maxandargmaxInvoke                 (maxandargmax_ctx*  ctx){
-	void* args[11];
-
-	/**
-	 * Argument Marshalling. This the grossest gross thing in here.
-	 */
-
-	const int flags       = GA_BUFFER_READ_ONLY|GA_BUFFER_INIT;
-	ctx->srcStepsGD       = gpudata_alloc(ctx->gpuCtx, ctx->nds    * sizeof(size_t),
-	                                      ctx->src->strides,       flags, 0);
-	ctx->srcSizeGD        = gpudata_alloc(ctx->gpuCtx, ctx->nds    * sizeof(size_t),
-	                                      ctx->src->dimensions,    flags, 0);
-	ctx->chunkSizeGD      = gpudata_alloc(ctx->gpuCtx, ctx->ndh * sizeof(size_t),
-	                                      ctx->chunkSize,          flags, 0);
-	ctx->dstMaxStepsGD    = gpudata_alloc(ctx->gpuCtx, ctx->ndd * sizeof(size_t),
-	                                      ctx->dstMax->strides,    flags, 0);
-	ctx->dstArgmaxStepsGD = gpudata_alloc(ctx->gpuCtx, ctx->ndd * sizeof(size_t),
-	                                      ctx->dstArgmax->strides, flags, 0);
-	args[ 0] = (void*) ctx->src->data;
-	args[ 1] = (void*)&ctx->src->offset;
-	args[ 2] = (void*) ctx->srcStepsGD;
-	args[ 3] = (void*) ctx->srcSizeGD;
-	args[ 4] = (void*) ctx->chunkSizeGD;
-	args[ 5] = (void*) ctx->dstMax->data;
-	args[ 6] = (void*)&ctx->dstMax->offset;
-	args[ 7] = (void*) ctx->dstMaxStepsGD;
-	args[ 8] = (void*) ctx->dstArgmax->data;
-	args[ 9] = (void*)&ctx->dstArgmax->offset;
-	args[10] = (void*) ctx->dstArgmaxStepsGD;
-
-	if(ctx->srcStepsGD      &&
-	   ctx->srcSizeGD       &&
-	   ctx->chunkSizeGD     &&
-	   ctx->dstMaxStepsGD   &&
-	   ctx->dstArgmaxStepsGD){
-		ctx->ret = GpuKernel_call(&ctx->kernel,
-		                          ctx->ndh>0 ? ctx->ndh : 1,
-		                          ctx->gridSize,
-		                          ctx->blockSize,
-		                          0,
-		                          args);
-	}else{
-		ctx->ret = GA_MEMORY_ERROR;
-	}
-
-	gpudata_release(ctx->srcStepsGD);
-	gpudata_release(ctx->srcSizeGD);
-	gpudata_release(ctx->chunkSizeGD);
-	gpudata_release(ctx->dstMaxStepsGD);
-	gpudata_release(ctx->dstArgmaxStepsGD);
-
-	return ctx->ret;
+static uint64_t mam_hash(cache_key_t k) {
+  return XXH64(k, sizeof(struct maxandargmax_key), 42);
 }
 
-/**
- * Cleanup
- */
+/* The cached values are boxed pointers, see cache_box_new() */
+static void mam_clearv(cache_value_t v) {
+  GpuReduction_free(*(GpuReduction **)v);
+}
 
-static int   maxandargmaxCleanup                (maxandargmax_ctx*  ctx){
-	free(ctx->axisList);
-	free(ctx->sourceCode);
-	ctx->axisList       = NULL;
-	ctx->sourceCode     = NULL;
+/* The result has a reference for the caller */
+static GpuReduction **get_maxandargmax(gpucontext *ctx, int stype, int mtype,
+                                       int atype, int *err) {
+  struct maxandargmax_key key, *pkey;
+  GpuReduction **gr = NULL;
+  gpuelemwise_arg arg;
+  gpureduction_out out[2];
+  strb sb = STRB_STATIC_INIT;
+
+  memset(&key, 0, sizeof(key));
+  key.stype = stype;
+  key.mtype = mtype;
+  key.atype = atype;
+  if (ctx->reduction_cache != NULL)
+    gr = cache_get(ctx->reduction_cache, &key);
+  if (gr != NULL)
+    return gr;
+
+  /* Ties go to the lowest index.  An index of -1 marks an empty
+     partial result. */
+  strb_appendf(&sb, "if (b_am != (%s)-1 && (a_am == (%s)-1 || b_m > a_m || "
+               "(b_m == a_m && b_am < a_am))) { a_m = b_m; a_am = b_am; }",
+               ctype(atype), ctype(atype));
+  strb_append0(&sb);
+  if (strb_error(&sb)) {
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+
+  arg.name = "src";
+  arg.typecode = stype;
+  arg.flags = GE_READ;
+  out[0].name = "m";
+  out[0].typecode = mtype;
+  out[0].neutral = "0";
+  out[1].name = "am";
+  out[1].typecode = atype;
+  out[1].neutral = "-1";
+
+  gr = cache_box_new(sizeof(GpuReduction *), mam_clearv);
+  if (gr == NULL) {
+    strb_clear(&sb);
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+  *gr = GpuReduction_new(ctx, NULL, "m = src; am = ridx", sb.s, 1, &arg, 2,
+                         out, 0);
+  strb_clear(&sb);
+  if (*gr == NULL) {
+    cache_box_release(gr);
+    *err = GA_MISC_ERROR;
+    return NULL;
+  }
+  pkey = memdup(&key, sizeof(key));
+  if (pkey == NULL) {
+    cache_box_release(gr);
+    *err = GA_MEMORY_ERROR;
+    return NULL;
+  }
+  if (ctx->reduction_cache == NULL)
+    gpucontext_cache_install(&ctx->reduction_cache,
+                             gpucontext_cache(ctx->flags, 4, 8, 8, 2,
+                                              mam_eq, mam_hash, free,
+                                              cache_box_release,
+                                              cache_box_ref, NULL));
+  if (ctx->reduction_cache == NULL) {
+    free(pkey);
+    cache_box_release(gr);
+    *err = GA_MISC_ERROR;
+    return NULL;
+  }
+  /* Another thread may have added the same reduction in the meantime */
+  gr = cache_get_or_add(ctx->reduction_cache, pkey, gr);
+  if (gr == NULL)
+    *err = GA_MISC_ERROR;
+  return gr;
+}
 
-	return ctx->ret;
+int GpuArray_maxandargmax(GpuArray *dstMax, GpuArray *dstArgmax,
+                          const GpuArray *src, unsigned int reduxLen,
+                          const unsigned int *reduxList) {
+  GpuReduction **gr = NULL;
+  GpuArray view;
+  GpuArray *outs[2];
+  void *args[1];
+  unsigned int *axes = NULL;
+  unsigned int *redux = NULL;
+  unsigned int i, f, ndd;
+  int err;
+
+  if (dstMax == NULL || dstArgmax == NULL || src == NULL || src->nd == 0 ||
+      reduxLen == 0 || reduxLen > src->nd)
+    return GA_INVALID_ERROR;
+  if (dstArgmax->typecode != GA_SIZE && dstArgmax->typecode != GA_SSIZE)
+    return GA_INVALID_ERROR;
+
+  axes = calloc(src->nd, sizeof(unsigned int));
+  redux = calloc(src->nd, sizeof(unsigned int));
+  if (axes == NULL || redux == NULL) {
+    err = GA_MEMORY_ERROR;
+    goto end;
+  }
+
+  /* Put the free axes first and then the reduced ones in the order
+     given so that the flattened index of the reduction follows that
+     order. */
+  ndd = src->nd - reduxLen;
+  memset(redux, 0, src->nd * sizeof(unsigned int));
+  for (i = 0; i < reduxLen; i++) {
+    if (reduxList[i] >= src->nd || redux[reduxList[i]]) {
+      err = GA_INVALID_ERROR;
+      goto end;
+    }
+    redux[reduxList[i]] = 1;
+    axes[ndd + i] = reduxList[i];
+  }
+  f = 0;
+  for (i = 0; i < src->nd; i++)
+    if (!redux[i])
+      axes[f++] = i;
+  for (i = 0; i < reduxLen; i++)
+    redux[i] = ndd + i;
+
+  gr = get_maxandargmax(GpuArray_context(src), src->typecode,
+                        dstMax->typecode, dstArgmax->typecode, &err);
+  if (gr == NULL)
+    goto end;
+
+  err = GpuArray_transpose(&view, src, axes);
+  if (err != GA_NO_ERROR)
+    goto end;
+  args[0] = &view;
+  outs[0] = dstMax;
+  outs[1] = dstArgmax;
+  err = GpuReduction_call(*gr, outs, args, reduxLen, redux, 0);
+  GpuArray_clear(&view);
+
+ end:
+  cache_box_release(gr);
+  free(axes);
+  free(redux);
+  return err;
 }
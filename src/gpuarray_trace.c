@@ -0,0 +1,372 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "gpuarray/buffer.h"
+#include "gpuarray/error.h"
+
+#include "private.h"
+#include "util/lock.h"
+
+#define TRACE_NAME_LEN 32
+#define TRACE_DEFAULT_SIZE 65536
+
+typedef struct _trace_event {
+  /* Index of the event + 1, 0 while it is being written */
+  volatile uint64_t seq;
+  uint64_t start;
+  uint64_t end;
+  uint64_t bytes;
+  size_t dims[3];
+  size_t ls[3];
+  const void *stream;
+  void *timer; /* Device timer or NULL */
+  unsigned int nd;
+  int cat;
+  char name[TRACE_NAME_LEN];
+} trace_event;
+
+typedef struct _gpuarray_trace {
+  trace_event *events;
+  uint64_t mask; /* Number of events - 1, it is a power of 2 */
+  volatile uint64_t head; /* Total number of events recorded */
+  uint64_t tail; /* Events before this one were already written */
+  uint64_t t0; /* Time of the start of the trace */
+  void *ref; /* Device timer that ended at t0, NULL for host times */
+  ga_lock_t lock; /* Serializes the dumps, protects tail */
+  char *path; /* Where to write on release if started by the env var */
+} gpuarray_trace;
+
+static const char *cat_names[] = {"kernel", "copy", "blas", "comm"};
+
+/* Number of contexts that wrote to GPUARRAY_TRACE */
+static volatile unsigned int env_count = 0;
+
+#ifdef _MSC_VER
+static uint64_t atomic_inc(volatile uint64_t *p) {
+  return (uint64_t)InterlockedIncrement64((volatile LONG64 *)p) - 1;
+}
+
+static unsigned int atomic_inc32(volatile unsigned int *p) {
+  return (unsigned int)InterlockedIncrement((volatile LONG *)p) - 1;
+}
+
+static void barrier(void) {
+  MemoryBarrier();
+}
+
+uint64_t gpuarray_trace_now(void) {
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter(&c);
+  QueryPerformanceFrequency(&f);
+  return (uint64_t)((double)c.QuadPart * 1e9 / (double)f.QuadPart);
+}
+#else
+static uint64_t atomic_inc(volatile uint64_t *p) {
+  return __sync_fetch_and_add(p, 1);
+}
+
+static unsigned int atomic_inc32(volatile unsigned int *p) {
+  return __sync_fetch_and_add(p, 1);
+}
+
+static void barrier(void) {
+  __sync_synchronize();
+}
+
+uint64_t gpuarray_trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+void gpuarray_trace_add(gpucontext *ctx, int cat, const char *name,
+                        uint64_t start, size_t bytes, unsigned int nd,
+                        const size_t *dims, const size_t *ls,
+                        void *timer) {
+  gpuarray_trace *t = ctx->trace;
+  trace_event *e;
+  uint64_t end = gpuarray_trace_now();
+  uint64_t idx;
+  void *old;
+  unsigned int i;
+
+  if (t == NULL) {
+    if (timer != NULL)
+      ctx->ops->timer_release(ctx, timer);
+    return;
+  }
+
+  /* Each writer gets its own slot, the oldest ones are overwritten */
+  idx = atomic_inc(&t->head);
+  e = &t->events[idx & t->mask];
+  e->seq = 0;
+  barrier();
+  e->start = start;
+  e->end = end;
+  e->bytes = bytes;
+  e->stream = ctx->stream;
+  e->cat = cat;
+  if (nd > 3) nd = 3;
+  e->nd = nd;
+  for (i = 0; i < nd; i++) {
+    e->dims[i] = dims == NULL ? 0 : dims[i];
+    e->ls[i] = ls == NULL ? 0 : ls[i];
+  }
+  strncpy(e->name, name == NULL ? "unknown" : name, TRACE_NAME_LEN - 1);
+  e->name[TRACE_NAME_LEN - 1] = '\0';
+  if (t->ref != NULL) {
+    /* Whoever takes a timer out of the slot owns it, see the dump */
+    old = ga_swap_ptr(&e->timer, timer);
+    if (old != NULL)
+      ctx->ops->timer_release(ctx, old);
+  }
+  barrier();
+  e->seq = idx + 1;
+}
+
+void *gpuarray_trace_timer(gpucontext *ctx) {
+  gpuarray_trace *t = ctx->trace;
+  void *res;
+
+  if (t == NULL || t->ref == NULL ||
+      ctx->ops->timer_start(ctx, &res) != GA_NO_ERROR)
+    return NULL;
+  return res;
+}
+
+/*
+ * Make a timer that has completed, the device times are counted from
+ * its end.  Returns NULL if the backend can't time kernels.
+ */
+static void *trace_ref(gpucontext *ctx) {
+  void *res;
+  double start, end;
+
+  if (ctx->ops->timer_start == NULL ||
+      ctx->ops->timer_start(ctx, &res) != GA_NO_ERROR)
+    return NULL;
+  if (ctx->ops->timer_stop(ctx, NULL, res) != GA_NO_ERROR ||
+      ctx->ops->timer_read(ctx, res, res, &start, &end) != GA_NO_ERROR) {
+    ctx->ops->timer_release(ctx, res);
+    return NULL;
+  }
+  return res;
+}
+
+static void trace_free(gpucontext *ctx, gpuarray_trace *t) {
+  uint64_t i;
+
+  if (t->ref != NULL) {
+    for (i = 0; i <= t->mask; i++)
+      if (t->events[i].timer != NULL)
+        ctx->ops->timer_release(ctx, t->events[i].timer);
+    ctx->ops->timer_release(ctx, t->ref);
+  }
+  ga_lock_fini(&t->lock);
+  free(t->events);
+  free(t->path);
+  free(t);
+}
+
+int gpucontext_trace_start(gpucontext *ctx, size_t size) {
+  gpuarray_trace *t;
+  uint64_t n = 1;
+
+  if (ctx->trace != NULL)
+    return GA_NO_ERROR;
+  if (size == 0)
+    size = TRACE_DEFAULT_SIZE;
+  while (n < size)
+    n <<= 1;
+
+  t = calloc(1, sizeof(*t));
+  if (t == NULL)
+    return GA_MEMORY_ERROR;
+  t->events = calloc(n, sizeof(trace_event));
+  if (t->events == NULL) {
+    free(t);
+    return GA_MEMORY_ERROR;
+  }
+  if (ga_lock_init(&t->lock) != 0) {
+    free(t->events);
+    free(t);
+    return GA_SYS_ERROR;
+  }
+  t->mask = n - 1;
+  t->ref = trace_ref(ctx);
+  t->t0 = gpuarray_trace_now();
+  /* Another thread may have started it in the meantime */
+  if (!ga_install_ptr((void **)&ctx->trace, t))
+    trace_free(ctx, t);
+  return GA_NO_ERROR;
+}
+
+void gpucontext_trace_stop(gpucontext *ctx) {
+  gpuarray_trace *t = ga_swap_ptr((void **)&ctx->trace, NULL);
+
+  /* There is no way to know when the operations that saw the trace
+     are done with it, hence the restriction in the documentation. */
+  if (t != NULL)
+    trace_free(ctx, t);
+}
+
+static void json_str(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', f);
+    if ((unsigned char)*s < 0x20)
+      continue;
+    fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+static void json_dims(FILE *f, const char *key, const size_t *d,
+                      unsigned int nd) {
+  unsigned int i;
+  /* Trailing zeros are unused dimensions */
+  while (nd > 0 && d[nd - 1] == 0)
+    nd--;
+  if (nd == 0)
+    return;
+  fprintf(f, ", \"%s\": [", key);
+  for (i = 0; i < nd; i++)
+    fprintf(f, "%s%llu", i == 0 ? "" : ", ", (unsigned long long)d[i]);
+  fputc(']', f);
+}
+
+#define MAX_STREAMS 64
+
+int gpucontext_trace_dump(gpucontext *ctx, const char *path) {
+  gpuarray_trace *t = ctx->trace;
+  const void *streams[MAX_STREAMS];
+  unsigned int nstreams = 0, tid, dev;
+  trace_event *src;
+  trace_event e;
+  uint64_t head, i, first, n = 0;
+  double ts, dur, dstart, dend;
+  FILE *f;
+
+  if (t == NULL)
+    return GA_INVALID_ERROR;
+  f = fopen(path, "w");
+  if (f == NULL)
+    return GA_SYS_ERROR;
+
+  ga_lock_acquire(&t->lock);
+  head = t->head;
+  first = head - t->tail > t->mask ? head - t->mask - 1 : t->tail;
+  fputs("{\"traceEvents\": [\n", f);
+  for (i = first; i < head; i++) {
+    src = &t->events[i & t->mask];
+    /* Skip the slots that are being written or were overwritten */
+    if (src->seq != i + 1)
+      continue;
+    barrier();
+    memcpy(&e, (const void *)src, sizeof(e));
+    barrier();
+    if (src->seq != i + 1)
+      continue;
+    /* Take the timer so that a writer reusing the slot doesn't
+       release it under us.  If one already reused the slot, the
+       timer is theirs so give it back. */
+    e.timer = NULL;
+    if (t->ref != NULL && src->timer != NULL) {
+      e.timer = ga_swap_ptr(&src->timer, NULL);
+      barrier();
+      if (e.timer != NULL && src->seq != i + 1) {
+        if (!ga_install_ptr(&src->timer, e.timer))
+          ctx->ops->timer_release(ctx, e.timer);
+        e.timer = NULL;
+      }
+    }
+    ts = (double)(int64_t)(e.start - t->t0);
+    dur = (double)(e.end - e.start);
+    dev = e.timer != NULL &&
+      ctx->ops->timer_read(ctx, t->ref, e.timer, &dstart,
+                           &dend) == GA_NO_ERROR;
+    if (e.timer != NULL)
+      ctx->ops->timer_release(ctx, e.timer);
+    if (dev) {
+      ts = dstart;
+      dur = dend - dstart;
+    }
+    /* Streams are numbered in order of appearance, 0 is the default */
+    tid = 0;
+    if (e.stream != NULL) {
+      for (tid = 0; tid < nstreams; tid++)
+        if (streams[tid] == e.stream)
+          break;
+      if (tid == nstreams && nstreams < MAX_STREAMS)
+        streams[nstreams++] = e.stream;
+      tid++;
+    }
+    fputs(n++ == 0 ? "{\"name\": " : ",\n{\"name\": ", f);
+    json_str(f, e.name);
+    fprintf(f, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %u, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"%s\": %llu",
+            cat_names[e.cat], tid, ts / 1000.0, dur / 1000.0,
+            e.cat == TRACE_KERNEL ? "shared_mem" : "bytes",
+            (unsigned long long)e.bytes);
+    if (e.cat == TRACE_KERNEL) {
+      json_dims(f, "grid", e.dims, e.nd);
+      json_dims(f, "block", e.ls, e.nd);
+      fprintf(f, ", \"clock\": \"%s\"", dev ? "device" : "host");
+    } else {
+      json_dims(f, "dims", e.dims, e.nd);
+    }
+    fputs("}}", f);
+  }
+  fputs(n == 0 ? "],\n" : "\n],\n", f);
+  fputs("\"displayTimeUnit\": \"ns\"}\n", f);
+
+  /* The events are consumed, the ones recorded since stay */
+  t->tail = head;
+  ga_lock_release(&t->lock);
+  if (fclose(f) != 0)
+    return GA_SYS_ERROR;
+  return GA_NO_ERROR;
+}
+
+void gpuarray_trace_init(gpucontext *ctx) {
+  const char *path = getenv("GPUARRAY_TRACE");
+
+  ctx->trace = NULL;
+  if (path == NULL || path[0] == '\0')
+    return;
+  if (gpucontext_trace_start(ctx, 0) != GA_NO_ERROR)
+    return;
+  ctx->trace->path = strdup(path);
+  if (ctx->trace->path == NULL)
+    gpucontext_trace_stop(ctx);
+}
+
+void gpuarray_trace_fini(gpucontext *ctx) {
+  strb name = STRB_STATIC_INIT;
+  unsigned int n;
+
+  if (ctx->trace == NULL)
+    return;
+  if (ctx->trace->path != NULL && ctx->trace->head != ctx->trace->tail) {
+    /* Contexts after the first get a numbered file */
+    n = atomic_inc32(&env_count);
+    strb_appends(&name, ctx->trace->path);
+    if (n != 0)
+      strb_appendf(&name, ".%u", n);
+    strb_append0(&name);
+    if (!strb_error(&name))
+      gpucontext_trace_dump(ctx, name.s);
+    strb_clear(&name);
+  }
+  gpucontext_trace_stop(ctx);
+}
@@ -1,7 +1,9 @@
 #include <assert.h>
 
 #include "private.h"
+#include "util/lock.h"
 #include "util/strb.h"
+#include "util/xxhash.h"
 
 #include "gpuarray/util.h"
 #include "gpuarray/error.h"
@@ -108,6 +110,237 @@ void gpukernel_source_with_line_numbers(unsigned int count,
   }
 }
 
+void gpukernel_merge_access(int *res, unsigned int numargs,
+                            const int *typecodes, const int *access) {
+  unsigned int i;
+  int bits;
+
+  /* res belongs to a cached kernel that other threads may be using,
+     bits are only ever added and only when they are missing */
+  for (i = 0; i < numargs; i++) {
+    if (typecodes[i] != GA_BUFFER)
+      continue;
+    if (access == NULL || (access[i] & GA_ARG_READ_WRITE) == 0)
+      bits = GA_ARG_READ_WRITE;
+    else
+      bits = access[i] & GA_ARG_READ_WRITE;
+    if ((res[i] & bits) != bits)
+      ga_or_bits(&res[i], bits);
+  }
+}
+
+static int strb_eq(void *_k1, void *_k2) {
+  strb *k1 = (strb *)_k1;
+  strb *k2 = (strb *)_k2;
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint64_t strb_hash(void *_k) {
+  strb *k = (strb *)_k;
+  return XXH64(k->s, k->l, 42);
+}
+
+static int strb_write(strb *res, void *_k) {
+  strb_appendb(res, (strb *)_k);
+  return strb_error(res);
+}
+
+static void *strb_read(const strb *b) {
+  strb *res = strb_alloc(b->l == 0 ? 1 : b->l);
+  if (res == NULL) return NULL;
+  memcpy(res->s, b->s, b->l);
+  res->l = b->l;
+  return res;
+}
+
+/* Default maximum size of the disk cache in MB */
+#define DISK_CACHE_SIZE 256
+
+/* The disk caches are process-wide, this guards all of them */
+static ga_lock_t disk_cache_lock = GA_LOCK_INITIALIZER;
+
+cache *gpukernel_disk_cache(const char *backend) {
+  const char *path = getenv("GPUARRAY_CACHE_PATH");
+  const char *size = getenv("GPUARRAY_CACHE_SIZE");
+  strb dir = STRB_STATIC_INIT;
+  size_t max_size = DISK_CACHE_SIZE;
+  cache *mem, *res;
+
+  if (path == NULL || path[0] == '\0')
+    return NULL;
+  if (size != NULL)
+    max_size = strtoul(size, NULL, 10);
+  if (max_size == 0)
+    return NULL;
+
+  strb_appendf(&dir, "%s/%s", path, backend);
+  strb_append0(&dir);
+  if (strb_error(&dir))
+    return NULL;
+
+  mem = cache_lru(16, 4, strb_eq, strb_hash,
+                  (cache_freek_fn)strb_free, (cache_freev_fn)strb_free);
+  if (mem == NULL) {
+    strb_clear(&dir);
+    return NULL;
+  }
+  res = cache_disk(dir.s, mem, max_size * 1024 * 1024,
+                   strb_write, strb_write, strb_read, strb_read);
+  strb_clear(&dir);
+  return res;
+}
+
+strb *gpukernel_disk_cache_get(cache *c, strb *key) {
+  strb *res = NULL;
+  strb *v;
+
+  ga_lock_acquire(&disk_cache_lock);
+  /* The value may be evicted as soon as we let go of the lock */
+  v = (strb *)cache_get(c, key);
+  if (v != NULL)
+    res = strb_read(v);
+  ga_lock_release(&disk_cache_lock);
+  return res;
+}
+
+void gpukernel_disk_cache_add(cache *c, strb *key, strb *bin) {
+  ga_lock_acquire(&disk_cache_lock);
+  cache_add(c, key, bin);
+  ga_lock_release(&disk_cache_lock);
+}
+
+void gpukernel_disk_cache_del(cache *c, strb *key) {
+  ga_lock_acquire(&disk_cache_lock);
+  cache_del(c, key);
+  ga_lock_release(&disk_cache_lock);
+}
+
+/* Number of shards of the caches of multi-threaded contexts */
+#define CTX_CACHE_SHARDS 8
+
+#define DIV_UP(a, b) (((a) + (b) - 1) / (b))
+
+/* Byte budget of the kernel caches from GPUARRAY_KERNEL_CACHE_SIZE
+   (in MB), 0 if there is none. */
+static size_t kernel_cache_budget(void) {
+  const char *size = getenv("GPUARRAY_KERNEL_CACHE_SIZE");
+  if (size == NULL)
+    return 0;
+  return strtoul(size, NULL, 10) * 1024 * 1024;
+}
+
+cache *gpucontext_cache(int flags, size_t hot_size, size_t warm_size,
+                        size_t cold_size, size_t elasticity,
+                        cache_eq_fn keq, cache_hash_fn khash,
+                        cache_freek_fn kfree, cache_freev_fn vfree,
+                        cache_vref_fn vref, cache_cost_fn cost) {
+  cache *shards[CTX_CACHE_SHARDS];
+  cache *res;
+  size_t budget = cost == NULL ? 0 : kernel_cache_budget();
+  unsigned int i;
+
+  if (!(flags & GA_CTX_MULTI_THREAD)) {
+    res = cache_twoq(hot_size, warm_size, cold_size, elasticity,
+                     keq, khash, kfree, vfree);
+    if (res != NULL) {
+      res->vref = vref;
+      res->cost = cost;
+      res->max_cost = budget;
+    }
+    return res;
+  }
+
+  for (i = 0; i < CTX_CACHE_SHARDS; i++) {
+    /* Without a way to take a reference, another thread could still
+       be using an evicted value so nothing is ever evicted.  All the
+       caches of the library pass a vref, see cache_box_new(). */
+    if (vref == NULL)
+      shards[i] = cache_lru(0, 0, keq, khash, kfree, vfree);
+    else
+      shards[i] = cache_twoq(DIV_UP(hot_size, CTX_CACHE_SHARDS),
+                             DIV_UP(warm_size, CTX_CACHE_SHARDS),
+                             DIV_UP(cold_size, CTX_CACHE_SHARDS),
+                             DIV_UP(elasticity, CTX_CACHE_SHARDS),
+                             keq, khash, kfree, vfree);
+    if (shards[i] != NULL && vref != NULL) {
+      shards[i]->cost = cost;
+      shards[i]->max_cost = DIV_UP(budget, CTX_CACHE_SHARDS);
+    }
+  }
+  res = cache_sharded(CTX_CACHE_SHARDS, shards);
+  if (res != NULL)
+    res->vref = vref;
+  return res;
+}
+
+/* Header of the values from cache_box_new(), the union keeps the
+   value that follows aligned for any type. */
+typedef union _cache_box {
+  struct {
+    unsigned int refcnt;
+    cache_freev_fn clear;
+  } h;
+  long long ll;
+  double d;
+  void *p;
+} cache_box;
+
+void *cache_box_new(size_t size, cache_freev_fn clear) {
+  cache_box *b = calloc(1, sizeof(*b) + size);
+  if (b == NULL)
+    return NULL;
+  b->h.refcnt = 1;
+  b->h.clear = clear;
+  return b + 1;
+}
+
+void cache_box_ref(cache_value_t v) {
+  ga_ref_inc(&((cache_box *)v - 1)->h.refcnt);
+}
+
+void cache_box_release(cache_value_t v) {
+  cache_box *b;
+
+  if (v == NULL)
+    return;
+  b = (cache_box *)v - 1;
+  if (ga_ref_dec(&b->h.refcnt) == 0) {
+    if (b->h.clear != NULL)
+      b->h.clear(v);
+    free(b);
+  }
+}
+
+size_t gpucontext_cache_stat(cache *c, int prop_id) {
+  cache_stats st;
+
+  if (c == NULL)
+    return 0;
+  cache_get_stats(c, &st);
+  switch (prop_id) {
+  case GA_CTX_PROP_KERNEL_CACHE_HITS:
+  case GA_CTX_PROP_ELEMWISE_CACHE_HITS:
+    return st.hits;
+  case GA_CTX_PROP_KERNEL_CACHE_MISSES:
+  case GA_CTX_PROP_ELEMWISE_CACHE_MISSES:
+    return st.misses;
+  case GA_CTX_PROP_KERNEL_CACHE_EVICTIONS:
+  case GA_CTX_PROP_ELEMWISE_CACHE_EVICTIONS:
+    return st.evictions;
+  default:
+    return st.cost;
+  }
+}
+
+cache *gpucontext_cache_install(cache **slot, cache *c) {
+  if (c == NULL)
+    return *slot;
+  if (!ga_install_ptr((void **)slot, c))
+    cache_destroy(c);
+  return *slot;
+}
+
 static int get_type_flags(int typecode) {
   int flags = 0;
   if (typecode == GA_DOUBLE || typecode == GA_CDOUBLE)
@@ -15,9 +15,11 @@ static const char libname[] = "libclblast.so";
 #endif
 
 #define DEF_PROC(ret, name, args) t##name *name
+#define DEF_PROC_OPT(ret, name, args) DEF_PROC(ret, name, args)
 
 #include "libclblast.fn"
 
+#undef DEF_PROC_OPT
 #undef DEF_PROC
 
 #define DEF_PROC(ret, name, args)            \
@@ -26,6 +28,10 @@ static const char libname[] = "libclblast.so";
     return GA_LOAD_ERROR;                    \
   }
 
+/* Not in older versions */
+#define DEF_PROC_OPT(ret, name, args)        \
+  name = (t##name *)ga_func_ptr(lib, #name);
+
 static int loaded = 0;
 
 int load_libclblast(void) {
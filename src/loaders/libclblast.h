@@ -22,15 +22,19 @@ typedef enum StatusCode_ {
 int load_libclblast(void);
 
 #define DEF_PROC(ret, name, args) typedef ret t##name args
+#define DEF_PROC_OPT(ret, name, args) DEF_PROC(ret, name, args)
 
 #include "libclblast.fn"
 
+#undef DEF_PROC_OPT
 #undef DEF_PROC
 
 #define DEF_PROC(ret, name, args) extern t##name *name
+#define DEF_PROC_OPT(ret, name, args) DEF_PROC(ret, name, args)
 
 #include "libclblast.fn"
 
+#undef DEF_PROC_OPT
 #undef DEF_PROC
 
 #endif
@@ -18,9 +18,13 @@ static char libname[] = "libcuda.so";
 
 #define DEF_PROC(name, args) t##name *name
 #define DEF_PROC_V2(name, args) DEF_PROC(name, args)
+#define DEF_PROC_OPT(name, args) DEF_PROC(name, args)
+#define DEF_PROC_V2_OPT(name, args) DEF_PROC(name, args)
 
 #include "libcuda.fn"
 
+#undef DEF_PROC_V2_OPT
+#undef DEF_PROC_OPT
 #undef DEF_PROC_V2
 #undef DEF_PROC
 
@@ -38,6 +42,13 @@ static char libname[] = "libcuda.so";
     return GA_LOAD_ERROR;                                   \
   }
 
+/* Optional functions are left NULL if they are missing */
+#define DEF_PROC_OPT(name, args)             \
+  name = (t##name *)ga_func_ptr(lib, #name);
+
+#define DEF_PROC_V2_OPT(name, args)                         \
+  name = (t##name *)ga_func_ptr(lib, STRINGIFY(name##_v2));
+
 static int loaded = 0;
 
 int load_libcuda(void) {
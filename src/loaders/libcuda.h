@@ -8,7 +8,9 @@
 #endif
 
 typedef enum {
-  CUDA_SUCCESS = 0
+  CUDA_SUCCESS = 0,
+  CUDA_ERROR_OUT_OF_MEMORY = 2,
+  CUDA_ERROR_NOT_READY = 600
 } CUresult;
 
 #if defined(_WIN64) || defined(__LP64__)
@@ -23,6 +25,9 @@ typedef struct CUmod_st *CUmodule;
 typedef struct CUfunc_st *CUfunction;
 typedef struct CUevent_st *CUevent;
 typedef struct CUstream_st *CUstream;
+typedef struct CUgraph_st *CUgraph;
+typedef struct CUgraphExec_st *CUgraphExec;
+typedef struct CUgraphNode_st *CUgraphNode;
 
 typedef enum CUdevice_attribute_enum CUdevice_attribute;
 typedef enum CUfunction_attribute_enum CUfunction_attribute;
@@ -31,6 +36,31 @@ typedef enum CUctx_flags_enum CUctx_flags;
 typedef enum CUipcMem_flags_enum CUipcMem_flags;
 typedef enum CUjit_option_enum CUjit_option;
 
+typedef enum {
+  CU_STREAM_CAPTURE_MODE_GLOBAL = 0,
+  CU_STREAM_CAPTURE_MODE_THREAD_LOCAL = 1,
+  CU_STREAM_CAPTURE_MODE_RELAXED = 2
+} CUstreamCaptureMode;
+
+typedef enum {
+  CU_STREAM_CAPTURE_STATUS_NONE = 0,
+  CU_STREAM_CAPTURE_STATUS_ACTIVE = 1,
+  CU_STREAM_CAPTURE_STATUS_INVALIDATED = 2
+} CUstreamCaptureStatus;
+
+typedef struct CUDA_KERNEL_NODE_PARAMS_st {
+  CUfunction func;
+  unsigned int gridDimX;
+  unsigned int gridDimY;
+  unsigned int gridDimZ;
+  unsigned int blockDimX;
+  unsigned int blockDimY;
+  unsigned int blockDimZ;
+  unsigned int sharedMemBytes;
+  void **kernelParams;
+  void **extra;
+} CUDA_KERNEL_NODE_PARAMS;
+
 #define CU_IPC_HANDLE_SIZE 64
 
 typedef struct CUipcMemHandle_st {
@@ -41,17 +71,25 @@ int load_libcuda(void);
 
 #define DEF_PROC(name, args) typedef CUresult CUDAAPI t##name args
 #define DEF_PROC_V2(name, args) DEF_PROC(name, args)
+#define DEF_PROC_OPT(name, args) DEF_PROC(name, args)
+#define DEF_PROC_V2_OPT(name, args) DEF_PROC(name, args)
 
 #include "libcuda.fn"
 
+#undef DEF_PROC_V2_OPT
+#undef DEF_PROC_OPT
 #undef DEF_PROC_V2
 #undef DEF_PROC
 
 #define DEF_PROC(name, args) extern t##name *name
 #define DEF_PROC_V2(name, args) DEF_PROC(name, args)
+#define DEF_PROC_OPT(name, args) DEF_PROC(name, args)
+#define DEF_PROC_V2_OPT(name, args) DEF_PROC(name, args)
 
 #include "libcuda.fn"
 
+#undef DEF_PROC_V2_OPT
+#undef DEF_PROC_OPT
 #undef DEF_PROC_V2
 #undef DEF_PROC
 
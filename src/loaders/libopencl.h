@@ -53,6 +53,9 @@ typedef cl_uint cl_program_info;
 typedef cl_uint cl_program_build_info;
 typedef cl_uint cl_kernel_info;
 typedef cl_uint cl_kernel_work_group_info;
+typedef cl_uint cl_event_info;
+typedef cl_uint cl_command_queue_info;
+typedef cl_uint cl_profiling_info;
 
 int load_libopencl(void);
 
@@ -324,4 +327,17 @@ int load_libopencl(void);
 #define CL_KERNEL_PRIVATE_MEM_SIZE                  0x11B4
 #define CL_KERNEL_GLOBAL_WORK_SIZE                  0x11B5
 
+/* cl_event_info */
+#define CL_EVENT_COMMAND_EXECUTION_STATUS           0x11D3
+
+/* cl_command_queue_info */
+#define CL_QUEUE_PROPERTIES                         0x1093
+
+/* cl_profiling_info */
+#define CL_PROFILING_COMMAND_START                  0x1282
+#define CL_PROFILING_COMMAND_END                    0x1283
+
+/* command execution status */
+#define CL_COMPLETE                                 0x0
+
 #endif
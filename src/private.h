@@ -48,14 +48,21 @@ typedef struct _gpuarray_comm_ops gpuarray_comm_ops;
   unsigned int refcnt;                          \
   int flags;                                    \
   struct _gpudata *errbuf;                      \
+  struct _gpustream *stream;                    \
   cache *extcopy_cache;                         \
+  cache *multicopy_cache;                       \
+  cache *multicopy_tbl_cache;                   \
+  cache *transpose_cache;                       \
+  cache *elemwise_cache;                        \
+  cache *reduction_cache;                       \
+  struct _gpuarray_trace *trace;                \
   char bin_id[64];                              \
   char tag[8]
 
 struct _gpucontext {
   GPUCONTEXT_HEAD;
   void *ctx_ptr;
-  void *private[7];
+  void *private[20];
 };
 
 /* The real gpudata struct is likely bigger but we only care about the
@@ -69,6 +76,14 @@ typedef struct _partial_gpukernel {
   gpucontext *ctx;
 } partial_gpukernel;
 
+typedef struct _partial_gpustream {
+  gpucontext *ctx;
+} partial_gpustream;
+
+typedef struct _partial_gpugraph {
+  gpucontext *ctx;
+} partial_gpugraph;
+
 typedef struct _partial_gpucomm {
   gpucontext* ctx;
 } partial_gpucomm;
@@ -91,8 +106,8 @@ struct _gpuarray_buffer_ops {
   gpukernel *(*kernel_alloc)(gpucontext *ctx, unsigned int count,
                              const char **strings, const size_t *lengths,
                              const char *fname, unsigned int numargs,
-                             const int *typecodes, int flags, int *ret,
-                             char **err_str);
+                             const int *typecodes, const int *access,
+                             int flags, int *ret, char **err_str);
   void (*kernel_retain)(gpukernel *k);
   void (*kernel_release)(gpukernel *k);
   int (*kernel_setarg)(gpukernel *k, unsigned int i, void *a);
@@ -107,12 +122,54 @@ struct _gpuarray_buffer_ops {
   int (*property)(gpucontext *ctx, gpudata *buf, gpukernel *k, int prop_id,
                   void *res);
   const char *(*ctx_error)(gpucontext *ctx);
+  gpustream *(*stream_alloc)(gpucontext *ctx, int flags, int *ret);
+  void (*stream_retain)(gpustream *s);
+  void (*stream_release)(gpustream *s);
+  int (*stream_sync)(gpustream *s);
+  /* Switch the context to `s` (NULL for the default) and update
+     ctx->stream */
+  int (*stream_set)(gpucontext *ctx, gpustream *s);
+  /* Like buffer_read and buffer_write but don't wait for the transfer
+     to finish.  Can be NULL if the backend has no asynchronous
+     transfers. */
+  int (*buffer_read_async)(void *dst, gpudata *src, size_t srcoff,
+                           size_t sz);
+  int (*buffer_write_async)(gpudata *dst, size_t dstoff, const void *src,
+                            size_t sz);
+  /* Can be NULL if all operations are synchronous */
+  int (*buffer_query)(gpudata *b, int *done);
+  /* Return cached memory to the driver until at most `keep` bytes
+     are cached and return the number of bytes released.  Can be NULL
+     if the backend has no allocation cache. */
+  size_t (*buffer_trim)(gpucontext *ctx, size_t keep);
+  /* Graph capture and replay, see gpucontext_capture_begin().  Can
+     all be NULL if the backend doesn't support it. */
+  int (*capture_begin)(gpucontext *ctx);
+  gpugraph *(*capture_end)(gpucontext *ctx, int *ret);
+  int (*graph_launch)(gpugraph *g);
+  unsigned int (*graph_numkernels)(gpugraph *g);
+  int (*graph_setargs)(gpugraph *g, unsigned int i, unsigned int nargs,
+                       const int *types, void **args);
+  void (*graph_release)(gpugraph *g);
+  /* Device timing of kernel launches for the trace.  timer_start and
+     timer_stop are called around the launch of `k` (NULL for a timer
+     with nothing in between) and timer_read waits for the launch and
+     returns its start and end in nanoseconds after the end of `ref`.
+     Can all be NULL, the host times are used then. */
+  int (*timer_start)(gpucontext *ctx, void **t);
+  int (*timer_stop)(gpucontext *ctx, gpukernel *k, void *t);
+  int (*timer_read)(gpucontext *ctx, void *ref, void *t, double *start,
+                    double *end);
+  void (*timer_release)(gpucontext *ctx, void *t);
 };
 
 struct _gpuarray_blas_ops {
   int (*setup)(gpucontext *ctx);
   void (*teardown)(gpucontext *ctx);
   const char *(*error)(gpucontext *ctx);
+  /* Called when the current stream of a context with a BLAS handle
+     changes, can be NULL */
+  int (*set_stream)(gpucontext *ctx);
 
   int (*hdot)( size_t N,
     gpudata *X, size_t offX, size_t incX,
@@ -216,6 +273,26 @@ struct _gpuarray_blas_ops {
                    gpudata **y, size_t *offY, size_t incY,
                    gpudata **A, size_t *offA, size_t lda,
                    size_t batchCount, int flags);
+  /* Batched gemm where the matrices are at a constant stride (in
+     elements) in one buffer.  Can be NULL. */
+  int (*hgemm3D)(cb_order order, cb_transpose transA, cb_transpose transB,
+                 size_t M, size_t N, size_t K, float alpha,
+                 gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                 gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                 float beta, gpudata *C, size_t offC, size_t ldc,
+                 ssize_t strideC, size_t batchCount);
+  int (*sgemm3D)(cb_order order, cb_transpose transA, cb_transpose transB,
+                 size_t M, size_t N, size_t K, float alpha,
+                 gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                 gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                 float beta, gpudata *C, size_t offC, size_t ldc,
+                 ssize_t strideC, size_t batchCount);
+  int (*dgemm3D)(cb_order order, cb_transpose transA, cb_transpose transB,
+                 size_t M, size_t N, size_t K, double alpha,
+                 gpudata *A, size_t offA, size_t lda, ssize_t strideA,
+                 gpudata *B, size_t offB, size_t ldb, ssize_t strideB,
+                 double beta, gpudata *C, size_t offC, size_t ldc,
+                 ssize_t strideC, size_t batchCount);
 };
 
 struct _gpuarray_comm_ops {
@@ -256,6 +333,56 @@ static inline void *memdup(const void *p, size_t s) {
   return res;
 }
 
+/*
+ * Atomic helpers for objects that are shared through the context
+ * caches.  With GA_CTX_MULTI_THREAD they are used from many threads
+ * at once.
+ *
+ * ga_ref_dec() returns the new count.  ga_install_ptr() sets `*slot`
+ * to `v` if it is still NULL and returns 1 if it did.  ga_swap_ptr()
+ * sets `*slot` to `v` and returns the previous value.  ga_or_bits()
+ * sets bits in `*p`.
+ */
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline void ga_ref_inc(unsigned int *p) {
+  _InterlockedIncrement((volatile long *)p);
+}
+static inline unsigned int ga_ref_dec(unsigned int *p) {
+  return (unsigned int)_InterlockedDecrement((volatile long *)p);
+}
+static inline int ga_install_ptr(void **slot, void *v) {
+  return _InterlockedCompareExchangePointer((void * volatile *)slot, v,
+                                            NULL) == NULL;
+}
+static inline void *ga_swap_ptr(void **slot, void *v) {
+  return _InterlockedExchangePointer((void * volatile *)slot, v);
+}
+static inline void ga_or_bits(int *p, int bits) {
+  _InterlockedOr((volatile long *)p, bits);
+}
+#else
+static inline void ga_ref_inc(unsigned int *p) {
+  __sync_add_and_fetch(p, 1);
+}
+static inline unsigned int ga_ref_dec(unsigned int *p) {
+  return __sync_sub_and_fetch(p, 1);
+}
+static inline int ga_install_ptr(void **slot, void *v) {
+  return __sync_bool_compare_and_swap(slot, NULL, v);
+}
+static inline void *ga_swap_ptr(void **slot, void *v) {
+  void *old;
+  do {
+    old = *(void * volatile *)slot;
+  } while (!__sync_bool_compare_and_swap(slot, old, v));
+  return old;
+}
+static inline void ga_or_bits(int *p, int bits) {
+  __sync_fetch_and_or(p, bits);
+}
+#endif
+
 GPUARRAY_LOCAL int GpuArray_is_c_contiguous(const GpuArray *a);
 GPUARRAY_LOCAL int GpuArray_is_f_contiguous(const GpuArray *a);
 GPUARRAY_LOCAL int GpuArray_is_aligned(const GpuArray *a);
@@ -277,6 +404,165 @@ GPUARRAY_LOCAL void gpukernel_source_with_line_numbers(unsigned int count,
                                                        size_t *newl,
                                                        strb *src);
 
+/*
+ * Merge the access flags for the buffer arguments of a kernel in
+ * `res`, which must be initialized to 0 for a new kernel.  Non-buffer
+ * arguments are left to 0 and a NULL `access` means read and write.
+ *
+ * This is also used when a cached kernel is handed out again to make
+ * sure it is never less conservative than what one of its users
+ * asked for.
+ */
+GPUARRAY_LOCAL void gpukernel_merge_access(int *res, unsigned int numargs,
+                                           const int *typecodes,
+                                           const int *access);
+
+/*
+ * Open the on-disk cache of compiled kernel binaries for `backend`.
+ * Both keys and values are strb.
+ *
+ * The cache is only enabled if GPUARRAY_CACHE_PATH is set and not
+ * empty.  Its size is limited to GPUARRAY_CACHE_SIZE megabytes
+ * (default 256), setting that to 0 also disables it.
+ *
+ * Returns NULL if the cache is disabled or could not be opened.
+ *
+ * The cache is shared by all the contexts of a backend so it must
+ * only be used through the gpukernel_disk_cache_*() functions below,
+ * which serialize the accesses.
+ */
+GPUARRAY_LOCAL cache *gpukernel_disk_cache(const char *backend);
+
+/*
+ * Returns a copy of the binary stored under `key` (to free with
+ * strb_free()) or NULL if there is none.
+ */
+GPUARRAY_LOCAL strb *gpukernel_disk_cache_get(cache *c, strb *key);
+
+/*
+ * Store `bin` under `key`.  Both belong to the cache afterwards, even
+ * on failure.  Failures are ignored.
+ */
+GPUARRAY_LOCAL void gpukernel_disk_cache_add(cache *c, strb *key, strb *bin);
+
+/*
+ * Remove the binary stored under `key` if any.
+ */
+GPUARRAY_LOCAL void gpukernel_disk_cache_del(cache *c, strb *key);
+
+/*
+ * Create a cache for the objects of a context.  This is a 2Q cache
+ * with the given sizes unless `flags` has GA_CTX_MULTI_THREAD in
+ * which case it is split in shards that can be used concurrently by
+ * many threads.
+ *
+ * `vref` is set as the vref function of the cache.  If it is NULL,
+ * the values are assumed to be borrowed by the callers and are never
+ * evicted from a multi-threaded cache, which then grows without
+ * bound.  Values without a refcount of their own should be allocated
+ * with cache_box_new() so that they can be evicted.
+ *
+ * If `cost` is not NULL, it gives the size in bytes of an entry and
+ * the cache is limited to GPUARRAY_KERNEL_CACHE_SIZE megabytes if
+ * that is set.
+ */
+GPUARRAY_LOCAL cache *gpucontext_cache(int flags, size_t hot_size,
+                                       size_t warm_size, size_t cold_size,
+                                       size_t elasticity,
+                                       cache_eq_fn keq, cache_hash_fn khash,
+                                       cache_freek_fn kfree,
+                                       cache_freev_fn vfree,
+                                       cache_vref_fn vref,
+                                       cache_cost_fn cost);
+
+/*
+ * Reference counted storage for cache values that have no refcount
+ * of their own.  Returns `size` zeroed bytes with one reference for
+ * the caller, or NULL on error.  `clear` (which may be NULL) is
+ * called on the value before it is freed by the last
+ * cache_box_release().
+ *
+ * Pass cache_box_release() and cache_box_ref() as the vfree and vref
+ * functions of the cache.  Values returned by the cache then have a
+ * reference that the caller must release when it is done with them.
+ */
+GPUARRAY_LOCAL void *cache_box_new(size_t size, cache_freev_fn clear);
+GPUARRAY_LOCAL void cache_box_ref(cache_value_t v);
+GPUARRAY_LOCAL void cache_box_release(cache_value_t v);
+
+/*
+ * Get the value of one of the GA_CTX_PROP_*_CACHE_* properties for
+ * `c`, which may be NULL.
+ */
+GPUARRAY_LOCAL size_t gpucontext_cache_stat(cache *c, int prop_id);
+
+/*
+ * Store `c` in `*slot` if it is still NULL, otherwise destroy it.
+ * This makes it safe for concurrent threads to lazily create the
+ * same cache.  Returns the cache in `*slot` (which may be NULL if `c`
+ * is).
+ */
+GPUARRAY_LOCAL cache *gpucontext_cache_install(cache **slot, cache *c);
+
+/*
+ * Operation tracing, see gpucontext_trace_start().  When ctx->trace
+ * is NULL the only cost is the test.
+ */
+#define TRACE_KERNEL 0
+#define TRACE_COPY   1
+#define TRACE_BLAS   2
+#define TRACE_COMM   3
+
+/* Monotonic host time in nanoseconds */
+GPUARRAY_LOCAL uint64_t gpuarray_trace_now(void);
+
+/*
+ * Record an operation named `name` that started at `start` and ends
+ * now.  `dims` is the grid size for kernels and the problem size for
+ * BLAS operations, `ls` is the block size for kernels.  Both can be
+ * NULL.  `bytes` is the amount of dynamic shared memory for kernels.
+ * `timer` is a device timer from gpuarray_trace_timer() or NULL, it
+ * is owned by the trace after this.
+ */
+GPUARRAY_LOCAL void gpuarray_trace_add(gpucontext *ctx, int cat,
+                                       const char *name, uint64_t start,
+                                       size_t bytes, unsigned int nd,
+                                       const size_t *dims, const size_t *ls,
+                                       void *timer);
+
+/*
+ * Start a device timer for a kernel launch if the backend supports
+ * it, returns NULL otherwise.  It must be stopped with the kernel
+ * once launched.
+ */
+GPUARRAY_LOCAL void *gpuarray_trace_timer(gpucontext *ctx);
+
+/* Start tracing if GPUARRAY_TRACE is set */
+GPUARRAY_LOCAL void gpuarray_trace_init(gpucontext *ctx);
+
+/* Write the trace if it was started by gpuarray_trace_init() and
+   stop tracing */
+GPUARRAY_LOCAL void gpuarray_trace_fini(gpucontext *ctx);
+
+/*
+ * Return the result of `call` from the current function, recording
+ * it if tracing is enabled for `ctx`.
+ */
+#define TRACE_RETURN(ctx, cat, name, bytes, d0, d1, d2, call) do {       \
+    gpucontext *_tctx = (ctx);                                          \
+    size_t _tdims[3];                                                   \
+    uint64_t _tstart;                                                   \
+    int _tres;                                                          \
+    if (_tctx->trace == NULL)                                           \
+      return (call);                                                    \
+    _tdims[0] = (d0); _tdims[1] = (d1); _tdims[2] = (d2);               \
+    _tstart = gpuarray_trace_now();                                     \
+    _tres = (call);                                                     \
+    gpuarray_trace_add(_tctx, cat, name, _tstart, bytes,                \
+                       _tdims[0] == 0 ? 0 : 3, _tdims, NULL, NULL);     \
+    return _tres;                                                       \
+  } while (0)
+
 static inline uint16_t float_to_half(float value) {
 #define ga__shift 13
 #define ga__shiftSign 16
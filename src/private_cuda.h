@@ -6,6 +6,7 @@
 #include <cache.h>
 
 #include "private.h"
+#include "util/freelist.h"
 
 #include "gpuarray/buffer.h"
 
@@ -16,15 +17,21 @@
 #define BUF_TAG "cudabuf "
 #define KER_TAG "cudakern"
 #define COMM_TAG "cudacomm"
+#define STR_TAG "cudastrm"
+#define GRA_TAG "cudagrph"
 
 #define TAG_CTX(c) memcpy((c)->tag, CTX_TAG, 8)
 #define TAG_BUF(b) memcpy((b)->tag, BUF_TAG, 8)
 #define TAG_KER(k) memcpy((k)->tag, KER_TAG, 8)
 #define TAG_COMM(co) memcpy((co)->tag, COMM_TAG, 8)
+#define TAG_STR(s) memcpy((s)->tag, STR_TAG, 8)
+#define TAG_GRA(g) memcpy((g)->tag, GRA_TAG, 8)
 #define ASSERT_CTX(c) assert(memcmp((c)->tag, CTX_TAG, 8) == 0)
 #define ASSERT_BUF(b) assert(memcmp((b)->tag, BUF_TAG, 8) == 0)
 #define ASSERT_KER(k) assert(memcmp((k)->tag, KER_TAG, 8) == 0)
 #define ASSERT_COMM(co) assert(memcmp((co)->tag, COMM_TAG, 8) == 0)
+#define ASSERT_STR(s) assert(memcmp((s)->tag, STR_TAG, 8) == 0)
+#define ASSERT_GRA(g) assert(memcmp((g)->tag, GRA_TAG, 8) == 0)
 #define CLEAR(o) memset((o)->tag, 0, 8);
 
 #else
@@ -32,10 +39,14 @@
 #define TAG_BUF(b)
 #define TAG_KER(k)
 #define TAG_COMM(k)
+#define TAG_STR(s)
+#define TAG_GRA(g)
 #define ASSERT_CTX(c)
 #define ASSERT_BUF(b)
 #define ASSERT_KER(k)
 #define ASSERT_COMM(k)
+#define ASSERT_STR(s)
+#define ASSERT_GRA(g)
 #define CLEAR(o)
 #endif
 
@@ -60,14 +71,32 @@
     }                                 \
   } while (0)
 
+/* Number of idle events kept by a context for reuse */
+#define CUDA_EVPOOL_SIZE 4
+
 typedef struct _cuda_context {
   GPUCONTEXT_HEAD;
   CUcontext ctx;
   CUresult err;
+  /* Current stream, see gpucontext_set_stream() */
   CUstream s;
+  CUstream def_s;
   CUstream mem_s;
-  gpudata *freeblocks;
+  /* Released user streams, see below */
+  gpustream *spool;
+  freelist *freeblocks;
+  /* Same thing for GA_BUFFER_HOST (page-locked) buffers */
+  freelist *hostblocks;
   cache *kernel_cache;
+  /* Graph being captured, see gpucontext_capture_begin() */
+  gpugraph *cap;
+  /* Allocator statistics for device memory, see GA_CTX_PROP_MEM_* */
+  size_t mem_reserved;
+  size_t mem_used;
+  size_t mem_peak;
+  size_t mem_nallocs;
+  CUevent evpool[CUDA_EVPOOL_SIZE];
+  unsigned int nevpool;
   unsigned int enter;
   unsigned char major;
   unsigned char minor;
@@ -79,18 +108,102 @@ STATIC_ASSERT(sizeof(cuda_context) <= sizeof(gpucontext),
 /*
  * About freeblocks.
  *
- * Freeblocks is a linked list of gpudata instances that are
+ * Freeblocks keeps track of the gpudata instances that are
  * considrered to be "free".  That is they are not in use anywhere
  * else in the program.  It is used to cache and reuse allocations so
  * that we can avoid the heavy cost and synchronization of
  * cuMemAlloc() and cuMemFree().
  *
- * It is ordered by pointer address.  When adding back to it, blocks
- * will be merged with their neighbours, but not across original
- * allocation lines (which are kept track of with the CUDA_HEAD_ALLOC
- * flag.
+ * The bookkeeping is done in util/freelist.h using the `blk` member
+ * of gpudata.  Free blocks are sorted in size classes so that finding
+ * a block doesn't depend on the number of free blocks.  When adding
+ * back to it, blocks will be merged with their neighbours, but not
+ * across original allocation lines (which are kept track of with the
+ * CUDA_HEAD_ALLOC flag).
+ *
+ * Page-locked host memory is even slower to allocate and free, so
+ * GA_BUFFER_HOST buffers get the same treatment in `hostblocks`.
+ * Those are marked with CUDA_HOST_ALLOC and their ptr is usable from
+ * both the host and the device (this requires unified addressing).
+ */
+
+/*
+ * About stream synchronization.
+ *
+ * Buffers don't own any events.  Instead they remember the last
+ * stream that read from them (rs) and wrote to them (ws).  When a
+ * buffer is used on a different stream, an event from the context
+ * pool is recorded on the old stream and waited on by the new one
+ * before going back to the pool.  This orders the new use after
+ * everything queued on the old stream so far, which includes the
+ * previous use of the buffer.  A new reader stream is also made to
+ * wait for the previous one so that waiting on rs covers all the
+ * pending reads.  Buffers that are only used on a single
+ * stream never need an event and single stream contexts skip all of
+ * this.
+ *
+ * This is also what orders work between the default stream and the
+ * user streams from gpustream_new().  Since buffers can remember a
+ * stream long after it was released, released streams are kept in
+ * `spool` for reuse and only destroyed with the context.
+ */
+
+struct _gpustream {
+  cuda_context *ctx; /* Keep the context first */
+  CUstream s;
+  unsigned int refcnt;
+  gpustream *next; /* in ctx->spool */
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
+/*
+ * About graphs.
+ *
+ * While a capture is active (`cap` is set on the context), the
+ * current stream is in relaxed capture mode and the work queued on it
+ * is recorded in a CUDA graph instead of running.  Every buffer that
+ * goes through cuda_wait() on that stream is pinned by the graph with
+ * a reference so that its memory doesn't go back to the freelist
+ * while the graph can still run.  The waits across streams are
+ * skipped during the capture since the context is synchronized when
+ * it begins.  They are done for all the pinned buffers instead when
+ * the graph is launched.
+ *
+ * Kernel launches are also remembered with their node and buffer
+ * arguments so that the arguments can be changed in the instantiated
+ * graph.  Each operation counts as one use of the buffers it pins and
+ * a buffer is released when its last use is replaced.
  */
 
+typedef struct _cuda_graph_kernel {
+  gpukernel *k;
+  /* Buffer arguments of the launch, NULL for the others */
+  gpudata **bufs;
+  CUgraphNode node;
+  unsigned int gs[3];
+  unsigned int ls[3];
+  unsigned int shared;
+} cuda_graph_kernel;
+
+struct _gpugraph {
+  cuda_context *ctx; /* Keep the context first */
+  CUgraph g;
+  CUgraphExec e;
+  gpudata **bufs;
+  /* Number of operations that use each of bufs */
+  unsigned int *pins;
+  size_t nbufs;
+  size_t abufs;
+  cuda_graph_kernel *kers;
+  unsigned int nkers;
+  unsigned int akers;
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
 #define ARCH_PREFIX "compute_"
 
 GPUARRAY_LOCAL cuda_context *cuda_make_ctx(CUcontext ctx, int flags);
@@ -103,18 +216,21 @@ struct _gpudata {
   cuda_context *ctx;
   /* Don't change anything abovbe this without checking
      struct _partial_gpudata */
-  CUevent rev;
-  CUevent wev;
+  CUstream rs; /* last stream that read */
+  CUstream ws; /* last stream that wrote */
   CUstream ls; /* last stream used */
   unsigned int refcnt;
   int flags;
   size_t sz;
-  gpudata *next;
+  fl_block blk;
 #ifdef DEBUG
   char tag[8];
 #endif
 };
 
+/* gpudata from its freelist node */
+#define BLK_BUF(b) ((gpudata *)((char *)(b) - offsetof(gpudata, blk)))
+
 GPUARRAY_LOCAL gpudata *cuda_make_buf(cuda_context *c, CUdeviceptr p,
                                       size_t sz);
 GPUARRAY_LOCAL size_t cuda_get_sz(gpudata *g);
@@ -131,6 +247,7 @@ GPUARRAY_LOCAL int cuda_record(gpudata *, int);
 #define CUDA_IPC_MEMORY 0x100000
 #define CUDA_HEAD_ALLOC 0x200000
 #define CUDA_MAPPED_PTR 0x400000
+#define CUDA_HOST_ALLOC 0x800000
 
 struct _gpukernel {
   cuda_context *ctx; /* Keep the context first */
@@ -140,6 +257,8 @@ struct _gpukernel {
   size_t bin_sz;
   void *bin;
   int *types;
+  int *access;
+  char *name;
   unsigned int argcount;
   unsigned int refcnt;
 #ifdef DEBUG
@@ -0,0 +1,141 @@
+#ifndef _PRIVATE_HOST_H
+#define _PRIVATE_HOST_H
+
+#include <pthread.h>
+
+#include <cache.h>
+
+#include "private.h"
+
+#include "gpuarray/buffer.h"
+
+#ifdef DEBUG
+#include <assert.h>
+
+#define CTX_TAG "hostctx "
+#define BUF_TAG "hostbuf "
+#define KER_TAG "hostkern"
+#define STR_TAG "hoststrm"
+
+#define TAG_CTX(c) memcpy((c)->tag, CTX_TAG, 8)
+#define TAG_BUF(b) memcpy((b)->tag, BUF_TAG, 8)
+#define TAG_KER(k) memcpy((k)->tag, KER_TAG, 8)
+#define TAG_STR(s) memcpy((s)->tag, STR_TAG, 8)
+#define ASSERT_CTX(c) assert(memcmp((c)->tag, CTX_TAG, 8) == 0)
+#define ASSERT_BUF(b) assert(memcmp((b)->tag, BUF_TAG, 8) == 0)
+#define ASSERT_KER(k) assert(memcmp((k)->tag, KER_TAG, 8) == 0)
+#define ASSERT_STR(s) assert(memcmp((s)->tag, STR_TAG, 8) == 0)
+#define CLEAR(o) memset((o)->tag, 0, 8);
+
+#else
+#define TAG_CTX(c)
+#define TAG_BUF(b)
+#define TAG_KER(k)
+#define TAG_STR(s)
+#define ASSERT_CTX(c)
+#define ASSERT_BUF(b)
+#define ASSERT_KER(k)
+#define ASSERT_STR(s)
+#define CLEAR(o)
+#endif
+
+/* Keep in sync with the copy in gpuarray/extension.h */
+#define DONTFREE 0x10000000
+
+/*
+ * Per work-item state handed to the compiled kernels.  The CLUDA
+ * macros (LID_0, GDIM_1, ...) read from this.
+ *
+ * Keep in sync with the copy in HOST_PREAMBLE.
+ */
+typedef struct _host_workitem {
+  size_t lid[3];
+  size_t ldim[3];
+  size_t gid[3];
+  size_t gdim[3];
+  void *lmem;
+  void (*barrier)(struct _host_workitem *);
+} host_workitem;
+
+/* Entry points exported by every compiled kernel object. */
+typedef void (*host_entry_fn)(host_workitem *wi, void **args);
+
+struct _host_pool;
+typedef struct _host_pool host_pool;
+
+typedef struct _host_context {
+  GPUCONTEXT_HEAD;
+  host_pool *pool;
+  cache *kernel_cache;
+  const char *err_str;
+  /* Allocator statistics, see GA_CTX_PROP_MEM_* */
+  size_t mem_used;
+  size_t mem_peak;
+  size_t mem_nallocs;
+  unsigned int nthreads;
+} host_context;
+
+STATIC_ASSERT(sizeof(host_context) <= sizeof(gpucontext),
+              sizeof_struct_gpucontext_host);
+
+struct _gpudata {
+  char *ptr;
+  host_context *ctx;
+  /* Don't change anything above this without checking
+     struct _partial_gpudata */
+  size_t sz;
+  unsigned int refcnt;
+  int flags;
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
+/* Everything is synchronous so streams only need to exist */
+struct _gpustream {
+  host_context *ctx; /* Keep the context first */
+  unsigned int refcnt;
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
+struct _gpukernel {
+  host_context *ctx; /* Keep the context first */
+  void *lib;
+  host_entry_fn group;
+  host_entry_fn item;
+  void **args;
+  size_t bin_sz;
+  void *bin;
+  int *types;
+  /* Launches are synchronous, this is only reported */
+  int *access;
+  char *name;
+  unsigned int argcount;
+  unsigned int refcnt;
+  /* Set if the kernel source uses local_barrier() */
+  int barrier;
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
+/*
+ * About the execution model.
+ *
+ * Kernels are compiled to a shared object by the host C compiler
+ * (GPUARRAY_HOST_CC, default "cc") and run on a pool of
+ * GPUARRAY_HOST_THREADS worker threads (default is the number of
+ * online processors).  Work-groups are distributed among the workers.
+ *
+ * Kernels that never call local_barrier() run their work-items as a
+ * plain loop.  The others run each work-item as a coroutine on its
+ * own stack, with local_barrier() switching to the next work-item of
+ * the group.
+ *
+ * Kernel calls are synchronous, so there is nothing to wait for in
+ * buffer_sync.
+ */
+
+#endif
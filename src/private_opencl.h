@@ -4,6 +4,7 @@
 #include "private.h"
 
 #include "loaders/libopencl.h"
+#include "util/lock.h"
 
 #ifdef DEBUG
 #include <assert.h>
@@ -11,31 +12,47 @@
 #define CTX_TAG "ocl ctx "
 #define BUF_TAG "ocl buf "
 #define KER_TAG "ocl kern"
+#define STR_TAG "oclstrm "
 
 #define TAG_CTX(c) memcpy((c)->tag, CTX_TAG, 8)
 #define TAG_BUF(b) memcpy((b)->tag, BUF_TAG, 8)
 #define TAG_KER(k) memcpy((k)->tag, KER_TAG, 8)
+#define TAG_STR(s) memcpy((s)->tag, STR_TAG, 8)
 #define ASSERT_CTX(c) assert(memcmp((c)->tag, CTX_TAG, 8) == 0)
 #define ASSERT_BUF(b) assert(memcmp((b)->tag, BUF_TAG, 8) == 0)
 #define ASSERT_KER(k) assert(memcmp((k)->tag, KER_TAG, 8) == 0)
+#define ASSERT_STR(s) assert(memcmp((s)->tag, STR_TAG, 8) == 0)
 #define CLEAR(o) memset((o)->tag, 0, 8);
 
 #else
 #define TAG_CTX(c)
 #define TAG_BUF(b)
 #define TAG_KER(k)
+#define TAG_STR(s)
 #define ASSERT_CTX(c)
 #define ASSERT_BUF(b)
 #define ASSERT_KER(k)
+#define ASSERT_STR(s)
 #define CLEAR(o)
 #endif
 
+/* Number of concurrent reads tracked for a buffer */
+#define CL_MAX_READERS 4
+
+/* Maximum number of events cl_wait_list() can add */
+#define CL_MAX_WAIT (CL_MAX_READERS + 1)
+
 typedef struct _cl_ctx {
   GPUCONTEXT_HEAD;
   cl_context ctx;
+  /* Queue used by all operations, this is the queue of the current
+     stream (or def_q) */
   cl_command_queue q;
+  cl_command_queue def_q;
   char *exts;
   char *preamble;
+  /* Built programs keyed on their source */
+  cache *kernel_cache;
   cl_int err;
 } cl_ctx;
 
@@ -46,7 +63,20 @@ struct _gpudata {
   cl_ctx *ctx;
   /* Don't change anyhting above this without checking
      struct _partial_gpudata */
+  /* Last operation that wrote to the buffer */
   cl_event ev;
+  /* Reads since then, which can run concurrently */
+  cl_event rev[CL_MAX_READERS];
+  cl_uint nrev;
+  unsigned int refcnt;
+#ifdef DEBUG
+  char tag[8];
+#endif
+};
+
+struct _gpustream {
+  cl_ctx *ctx; /* Keep the context first */
+  cl_command_queue q;
   unsigned int refcnt;
 #ifdef DEBUG
   char tag[8];
@@ -57,11 +87,16 @@ struct _gpukernel {
   cl_ctx *ctx; /* Keep the context first */
   cl_kernel k;
   cl_event ev;
-  cl_event **evr;
+  gpudata **bufs;
   int *types;
+  int *access;
+  char *name;
   unsigned int argcount;
   unsigned int refcnt;
   cl_uint num_ev;
+  /* The arguments are set on `k` itself, so setting them and the
+     launch are done under this for kernels shared between threads */
+  ga_lock_t lock;
 #ifdef DEBUG
   char tag[8];
 #endif
@@ -72,4 +107,21 @@ GPUARRAY_LOCAL cl_command_queue cl_get_stream(gpucontext *ctx);
 GPUARRAY_LOCAL gpudata *cl_make_buf(gpucontext *c, cl_mem buf);
 GPUARRAY_LOCAL cl_mem cl_get_buf(gpudata *g);
 
+/*
+ * Add the events that an operation with the specified access
+ * (GA_ARG_READ and/or GA_ARG_WRITE) to `b` must wait for to `evl`.
+ * Returns the number of events added, at most CL_MAX_WAIT.
+ */
+GPUARRAY_LOCAL cl_uint cl_wait_list(gpudata *b, int access, cl_event *evl);
+/*
+ * Record that `ev` accesses `b`.  This takes its own reference to
+ * `ev`.
+ */
+GPUARRAY_LOCAL void cl_record(gpudata *b, int access, cl_event ev);
+/*
+ * Block until the host can perform an operation with the specified
+ * access on `b`.
+ */
+GPUARRAY_LOCAL int cl_wait(gpudata *b, int access);
+
 #endif
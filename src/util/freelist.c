@@ -0,0 +1,246 @@
+#include <assert.h>
+#include <string.h>
+
+#include "util/freelist.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static inline unsigned int ctz64(unsigned long long v) {
+  unsigned long r;
+  _BitScanForward64(&r, v);
+  return r;
+}
+static inline unsigned int log2_64(unsigned long long v) {
+  unsigned long r;
+  _BitScanReverse64(&r, v);
+  return r;
+}
+#else
+static inline unsigned int ctz64(unsigned long long v) {
+  return __builtin_ctzll(v);
+}
+static inline unsigned int log2_64(unsigned long long v) {
+  return 63 - __builtin_clzll(v);
+}
+#endif
+
+/*
+ * Size class of `size`.  The first level is the position of the
+ * highest bit and the second level is made of the next
+ * FREELIST_SL_BITS bits.  Sizes below FREELIST_SL_COUNT all go in
+ * the first level 0.
+ */
+static void mapping(size_t size, unsigned int *fl, unsigned int *sl) {
+  if (size < FREELIST_SL_COUNT) {
+    *fl = 0;
+    *sl = (unsigned int)size;
+  } else {
+    *fl = log2_64(size);
+    *sl = (unsigned int)(size >> (*fl - FREELIST_SL_BITS)) ^
+      FREELIST_SL_COUNT;
+  }
+}
+
+static void insert_free(freelist *fl, fl_block *b) {
+  unsigned int f, s;
+
+  mapping(b->size, &f, &s);
+  b->flags |= FREELIST_FREE;
+  b->prev_free = NULL;
+  b->next_free = fl->bins[f][s];
+  if (b->next_free != NULL)
+    b->next_free->prev_free = b;
+  fl->bins[f][s] = b;
+  fl->fl_bitmap |= 1ULL << f;
+  fl->sl_bitmap[f] |= 1U << s;
+  fl->nfree++;
+  fl->free_bytes += b->size;
+}
+
+static void remove_free(freelist *fl, fl_block *b) {
+  unsigned int f, s;
+
+  assert(b->flags & FREELIST_FREE);
+  mapping(b->size, &f, &s);
+  if (b->prev_free != NULL)
+    b->prev_free->next_free = b->next_free;
+  else
+    fl->bins[f][s] = b->next_free;
+  if (b->next_free != NULL)
+    b->next_free->prev_free = b->prev_free;
+  if (fl->bins[f][s] == NULL) {
+    fl->sl_bitmap[f] &= ~(1U << s);
+    if (fl->sl_bitmap[f] == 0)
+      fl->fl_bitmap &= ~(1ULL << f);
+  }
+  b->prev_free = NULL;
+  b->next_free = NULL;
+  b->flags &= ~FREELIST_FREE;
+  fl->nfree--;
+  fl->free_bytes -= b->size;
+}
+
+/* First non-empty class at or above (f, s) */
+static fl_block *find_class(freelist *fl, unsigned int f, unsigned int s) {
+  unsigned long long fbm;
+  uint32_t sbm;
+
+  sbm = (s < FREELIST_SL_COUNT) ? (fl->sl_bitmap[f] & (~0U << s)) : 0;
+  if (sbm == 0) {
+    if (f + 1 >= FREELIST_FL_COUNT)
+      return NULL;
+    fbm = fl->fl_bitmap & (~0ULL << (f + 1));
+    if (fbm == 0)
+      return NULL;
+    f = ctz64(fbm);
+    sbm = fl->sl_bitmap[f];
+  }
+  return fl->bins[f][ctz64(sbm)];
+}
+
+void freelist_init(freelist *fl) {
+  memset(fl, 0, sizeof(*fl));
+}
+
+void freelist_add_arena(freelist *fl, fl_block *b, size_t addr, size_t size) {
+  b->addr = addr;
+  b->size = size;
+  b->prev_phys = NULL;
+  b->next_phys = NULL;
+  b->flags = FREELIST_HEAD;
+  insert_free(fl, b);
+}
+
+fl_block *freelist_find(freelist *fl, size_t size) {
+  fl_block *b;
+  unsigned int f, s;
+  size_t round;
+
+  if (size == 0)
+    size = 1;
+  mapping(size, &f, &s);
+
+  /* The first block of the exact class is a cheap best fit */
+  b = fl->bins[f][s];
+  if (b != NULL && b->size >= size)
+    return b;
+
+  /* Everything in the classes above fits */
+  if (size >= FREELIST_SL_COUNT) {
+    round = ((size_t)1 << (f - FREELIST_SL_BITS)) - 1;
+    if (size + round < size)
+      return NULL;
+    mapping(size + round, &f, &s);
+    /* The rounded size may land in the same class */
+    b = find_class(fl, f, s);
+  } else {
+    b = find_class(fl, f, s + 1);
+  }
+  if (b != NULL)
+    return b;
+
+  /* Last resort, search the exact class */
+  mapping(size, &f, &s);
+  for (b = fl->bins[f][s]; b != NULL; b = b->next_free)
+    if (b->size >= size)
+      return b;
+  return NULL;
+}
+
+int freelist_take(freelist *fl, fl_block *b, size_t size, size_t min_split,
+                  fl_block *rest) {
+  assert(b->size >= size);
+  remove_free(fl, b);
+
+  if (b->size - size < min_split || rest == NULL)
+    return 0;
+
+  rest->addr = b->addr + size;
+  rest->size = b->size - size;
+  rest->flags = 0;
+  rest->prev_phys = b;
+  rest->next_phys = b->next_phys;
+  if (rest->next_phys != NULL)
+    rest->next_phys->prev_phys = rest;
+  b->next_phys = rest;
+  b->size = size;
+  insert_free(fl, rest);
+  return 1;
+}
+
+fl_block *freelist_release(freelist *fl, fl_block *b, fl_block **merged) {
+  fl_block *n;
+
+  merged[0] = NULL;
+  merged[1] = NULL;
+
+  /* Merge into the previous block */
+  if (!(b->flags & FREELIST_HEAD) && b->prev_phys != NULL &&
+      (b->prev_phys->flags & FREELIST_FREE)) {
+    n = b->prev_phys;
+    remove_free(fl, n);
+    n->size += b->size;
+    n->next_phys = b->next_phys;
+    if (n->next_phys != NULL)
+      n->next_phys->prev_phys = n;
+    merged[0] = b;
+    b = n;
+  }
+
+  /* Merge the next block into this one */
+  n = b->next_phys;
+  if (n != NULL && (n->flags & FREELIST_FREE)) {
+    remove_free(fl, n);
+    b->size += n->size;
+    b->next_phys = n->next_phys;
+    if (b->next_phys != NULL)
+      b->next_phys->prev_phys = b;
+    merged[merged[0] == NULL ? 0 : 1] = n;
+  }
+
+  insert_free(fl, b);
+  return b;
+}
+
+void freelist_remove_arena(freelist *fl, fl_block *b) {
+  assert((b->flags & FREELIST_HEAD) && b->next_phys == NULL);
+  remove_free(fl, b);
+}
+
+fl_block *freelist_next(freelist *fl, fl_block *b) {
+  unsigned int f, s;
+
+  if (b != NULL) {
+    if (b->next_free != NULL)
+      return b->next_free;
+    mapping(b->size, &f, &s);
+    s++;
+  } else {
+    f = 0;
+    s = 0;
+  }
+  for (; f < FREELIST_FL_COUNT; f++, s = 0) {
+    if (!(fl->fl_bitmap & (1ULL << f)))
+      continue;
+    for (; s < FREELIST_SL_COUNT; s++) {
+      if (fl->bins[f][s] != NULL)
+        return fl->bins[f][s];
+    }
+  }
+  return NULL;
+}
+
+size_t freelist_largest(freelist *fl) {
+  fl_block *b;
+  unsigned int f, s;
+  size_t res = 0;
+
+  if (fl->fl_bitmap == 0)
+    return 0;
+  f = log2_64(fl->fl_bitmap);
+  s = log2_64(fl->sl_bitmap[f]);
+  for (b = fl->bins[f][s]; b != NULL; b = b->next_free)
+    if (b->size > res)
+      res = b->size;
+  return res;
+}
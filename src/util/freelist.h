@@ -0,0 +1,129 @@
+#ifndef FREELIST_H
+#define FREELIST_H
+
+#include <stddef.h>
+
+#include "private_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/*
+ * Bookkeeping for a caching sub-allocator.
+ *
+ * Memory is obtained from the device in large chunks (arenas) which
+ * are then split into blocks.  Every block knows its neighbours in its
+ * arena (ordered by address) so that coalescing on free is O(1).  Free
+ * blocks are also kept in segregated lists by size class, with a two
+ * level bitmap to find a non-empty class that fits a request in O(1).
+ *
+ * This does no device calls and no allocation: the block nodes are
+ * embedded in the caller's structures, which must provide a new node
+ * when a block is split and get back the nodes that are no longer
+ * needed after a merge.
+ */
+
+/* Number of second level classes per power of two (as a power of 2) */
+#define FREELIST_SL_BITS 4
+#define FREELIST_SL_COUNT (1 << FREELIST_SL_BITS)
+#define FREELIST_FL_COUNT 64
+
+/* Block flags */
+#define FREELIST_FREE 0x1
+/* First block of an arena, never merged with the previous one */
+#define FREELIST_HEAD 0x2
+
+typedef struct _fl_block fl_block;
+
+struct _fl_block {
+  size_t addr;
+  size_t size;
+  /* Neighbours in the same arena */
+  fl_block *prev_phys;
+  fl_block *next_phys;
+  /* Links in the size class list while free */
+  fl_block *prev_free;
+  fl_block *next_free;
+  int flags;
+};
+
+typedef struct _freelist {
+  uint64_t fl_bitmap;
+  uint32_t sl_bitmap[FREELIST_FL_COUNT];
+  fl_block *bins[FREELIST_FL_COUNT][FREELIST_SL_COUNT];
+  /* Number of free blocks and sum of their sizes */
+  size_t nfree;
+  size_t free_bytes;
+} freelist;
+
+/*
+ * Initialize an empty freelist.
+ */
+GPUARRAY_LOCAL void freelist_init(freelist *fl);
+
+/*
+ * Register a new arena of `size` bytes at `addr`, using `b` as its
+ * node.  The arena is added as one free block.
+ */
+GPUARRAY_LOCAL void freelist_add_arena(freelist *fl, fl_block *b,
+                                       size_t addr, size_t size);
+
+/*
+ * Find a free block of at least `size` bytes.  This checks the first
+ * block of the class that `size` falls in, then the smallest class
+ * that is guaranteed to fit and only then searches the whole class of
+ * `size`.  Returns NULL if there is no block big enough.
+ *
+ * The block is not removed from the lists, use freelist_take() for that.
+ */
+GPUARRAY_LOCAL fl_block *freelist_find(freelist *fl, size_t size);
+
+/*
+ * Remove the free block `b` from the lists.  If it is larger than
+ * `size` by at least `min_split` bytes, the end is split off in `rest`
+ * which stays free.  Returns 1 if `rest` was used and 0 otherwise.
+ */
+GPUARRAY_LOCAL int freelist_take(freelist *fl, fl_block *b, size_t size,
+                                 size_t min_split, fl_block *rest);
+
+/*
+ * Put the block `b` back in the free lists, merging it with its free
+ * neighbours in the arena.
+ *
+ * The nodes that were absorbed are stored in `merged` (which must
+ * have space for 2 entries, unused entries are set to NULL) and must
+ * be disposed of by the caller.  This can include `b` itself.
+ *
+ * Returns the node that now covers the merged area.
+ */
+GPUARRAY_LOCAL fl_block *freelist_release(freelist *fl, fl_block *b,
+                                          fl_block **merged);
+
+/*
+ * Remove a completely free arena (a free FREELIST_HEAD block with no
+ * next neighbour) from the lists.  The caller then returns the memory
+ * to the device.
+ */
+GPUARRAY_LOCAL void freelist_remove_arena(freelist *fl, fl_block *b);
+
+/*
+ * Iterate over all the free blocks.  Start with `b` set to NULL.
+ * The lists must not be modified during the iteration, but you can
+ * always restart from NULL after removing a block.
+ */
+GPUARRAY_LOCAL fl_block *freelist_next(freelist *fl, fl_block *b);
+
+/*
+ * Size of the largest free block, or 0 if there are none.
+ */
+GPUARRAY_LOCAL size_t freelist_largest(freelist *fl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
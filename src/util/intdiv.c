@@ -0,0 +1,29 @@
+#include "util/intdiv.h"
+
+void intdiv32_init(intdiv32 *div, uint32_t d) {
+  uint64_t p;
+  uint32_t s = 0;
+
+  div->d = d;
+  if (d == 0) {
+    div->m = 0;
+    div->s = 0;
+    return;
+  }
+  /* s = ceil(log2(d)) */
+  while (((uint64_t)1 << s) < d)
+    s++;
+  /* m = floor(2^32 * (2^s - d) / d) + 1, which always fits in 32 bits
+     since 2^s - d < d */
+  p = ((uint64_t)1 << s) - d;
+  div->m = (uint32_t)((p << 32) / d + 1);
+  div->s = s;
+}
+
+void intdiv32_append(strb *sb, const char *q, const char *r, const char *n,
+                     const char *d) {
+  strb_appendf(sb, "%s = (ga_uint)(((((ga_ulong)%s * %s_m) >> 32) + %s) "
+               ">> %s_s);\n", q, n, d, n, d);
+  if (r != NULL)
+    strb_appendf(sb, "%s = %s - %s * (ga_uint)%s;\n", r, n, q, d);
+}
@@ -0,0 +1,61 @@
+#ifndef INTDIV_H
+#define INTDIV_H
+
+#include <stdint.h>
+
+#include "util/strb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#ifdef CONFUSE_EMACS
+}
+#endif
+
+/*
+ * Division of 32-bit unsigned integers by a value that is only known
+ * at runtime, but fixed for many divisions.
+ *
+ * The host computes a magic multiplier and a shift for the divisor
+ * so that for every 32-bit n
+ *
+ *   n / d == (mulhi(n, m) + n) >> s
+ *
+ * where mulhi is the upper half of the 64-bit product and the
+ * addition is done on 64 bits.  This is the round-up method from
+ * Granlund and Montgomery, "Division by Invariant Integers using
+ * Multiplication".  Kernels then do a multiply and a shift instead of
+ * a (very slow) hardware division.
+ */
+typedef struct _intdiv32 {
+  uint32_t d;
+  uint32_t m;
+  uint32_t s;
+} intdiv32;
+
+/*
+ * Compute the magic values for `d`.  A divisor of 0 gives values that
+ * will produce garbage, but won't fault.
+ */
+void intdiv32_init(intdiv32 *div, uint32_t d);
+
+/* Host version of the kernel code, mostly for testing. */
+static inline uint32_t intdiv32_div(const intdiv32 *div, uint32_t n) {
+  uint64_t t = ((uint64_t)n * div->m) >> 32;
+  return (uint32_t)((t + n) >> div->s);
+}
+
+/*
+ * Append kernel code that stores `n / d` in `q` and `n % d` in `r`
+ * (which may be NULL if the remainder is not needed).  `n` must be a
+ * variable of type ga_uint.  The divisor and its magic values are
+ * read from the kernel variables `<d>`, `<d>_m` and `<d>_s`.
+ */
+void intdiv32_append(strb *sb, const char *q, const char *r, const char *n,
+                     const char *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef UTIL_LOCK_H
+#define UTIL_LOCK_H
+
+/*
+ * Minimal mutex wrapper.  GA_LOCK_INITIALIZER can be used for locks
+ * with static storage, which don't need ga_lock_init() or
+ * ga_lock_fini().  ga_lock_init() returns 0 on success.
+ */
+
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK ga_lock_t;
+#define GA_LOCK_INITIALIZER SRWLOCK_INIT
+#define ga_lock_init(l) (InitializeSRWLock(l), 0)
+#define ga_lock_fini(l) ((void)(l))
+#define ga_lock_acquire(l) AcquireSRWLockExclusive(l)
+#define ga_lock_release(l) ReleaseSRWLockExclusive(l)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t ga_lock_t;
+#define GA_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define ga_lock_init(l) pthread_mutex_init(l, NULL)
+#define ga_lock_fini(l) pthread_mutex_destroy(l)
+#define ga_lock_acquire(l) pthread_mutex_lock(l)
+#define ga_lock_release(l) pthread_mutex_unlock(l)
+#endif
+
+#endif
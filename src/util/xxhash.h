@@ -99,6 +99,7 @@ They will be automatically translated by this header.
 #  define XXH32_reset XXH_NAME2(XXH_NAMESPACE, XXH32_reset)
 #  define XXH32_update XXH_NAME2(XXH_NAMESPACE, XXH32_update)
 #  define XXH32_digest XXH_NAME2(XXH_NAMESPACE, XXH32_digest)
+#  define XXH64 XXH_NAME2(XXH_NAMESPACE, XXH64)
 #endif
 
 
@@ -117,6 +118,14 @@ XXH32() :
     Speed on Core 2 Duo @ 3 GHz (single thread, SMHasher benchmark) : 5.4 GB/s
 */
 
+GPUARRAY_LOCAL unsigned long long XXH64 (const void* input, size_t length, unsigned long long seed);
+
+/*
+XXH64() :
+    Calculate the 64-bits hash of sequence of length "len" stored at memory address "input".
+    Faster on 64-bits systems. Slower on 32-bits systems.
+*/
+
 
 
 /*****************************
@@ -0,0 +1,86 @@
+/*
+ * Micro-benchmark for the in-memory caches.
+ *
+ * Build with `make bench_cache` and run without arguments.  It reports
+ * the average time of a lookup for hits and misses on keys that look
+ * like kernel cache keys.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "util/xxhash.h"
+
+#define NKEYS 4096
+#define NITER 100
+
+static int strb_eq(void *_k1, void *_k2) {
+  strb *k1 = (strb *)_k1;
+  strb *k2 = (strb *)_k2;
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint64_t strb_hash(void *_k) {
+  strb *k = (strb *)_k;
+  return XXH64(k->s, k->l, 42);
+}
+
+static void strb_release(void *k) {
+  strb_free((strb *)k);
+}
+
+static void nop(void *v) {}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static strb *mkkey(int i) {
+  strb *k = strb_new();
+  strb_appendf(k, "KERNEL void elem_%d(GLOBAL_MEM float *a, "
+               "GLOBAL_MEM float *b, ga_size n) { /* body */ }", i);
+  return k;
+}
+
+static void bench(const char *name, cache *c) {
+  strb *keys[NKEYS * 2];
+  volatile void *sink;
+  double t;
+  int i, j;
+
+  for (i = 0; i < NKEYS * 2; i++)
+    keys[i] = mkkey(i);
+  for (i = 0; i < NKEYS; i++)
+    cache_add(c, mkkey(i), keys[i]);
+
+  t = now();
+  for (j = 0; j < NITER; j++)
+    for (i = 0; i < NKEYS; i++)
+      sink = cache_get(c, keys[i]);
+  t = now() - t;
+  printf("%-6s hit:  %8.1f ns/lookup\n", name, t / (NKEYS * NITER));
+
+  t = now();
+  for (j = 0; j < NITER; j++)
+    for (i = NKEYS; i < NKEYS * 2; i++)
+      sink = cache_get(c, keys[i]);
+  t = now() - t;
+  printf("%-6s miss: %8.1f ns/lookup\n", name, t / (NKEYS * NITER));
+  (void)sink;
+
+  cache_destroy(c);
+  for (i = 0; i < NKEYS * 2; i++)
+    strb_free(keys[i]);
+}
+
+int main(void) {
+  bench("lru", cache_lru(NKEYS, 0, strb_eq, strb_hash, strb_release, nop));
+  bench("twoq", cache_twoq(NKEYS, NKEYS, NKEYS, 0, strb_eq, strb_hash,
+                           strb_release, nop));
+  return 0;
+}
@@ -1,5 +1,6 @@
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <check.h>
 
@@ -270,6 +271,117 @@ START_TEST(test_take1_offset) {
 }
 END_TEST
 
+START_TEST(test_concatenate_many) {
+  /* More pieces than buffers per launch to check the grouping */
+  GpuArray as[40];
+  const GpuArray *pas[40];
+  GpuArray r, r2;
+  GpuArray ss[40];
+  GpuArray *pss[40];
+  size_t p[39];
+  uint32_t data[2 * 3];
+  uint32_t buf[2 * 80];
+  uint32_t buf2[2 * 80];
+  size_t dims[2];
+  size_t i, j, k, total = 0;
+
+  dims[0] = 2;
+  for (i = 0; i < 40; i++) {
+    dims[1] = i % 3 + 1;
+    for (j = 0; j < 2 * dims[1]; j++)
+      data[j] = i * 100 + j;
+    ga_assert_ok(GpuArray_empty(&as[i], ctx, GA_UINT, 2, dims, GA_C_ORDER));
+    ga_assert_ok(GpuArray_write(&as[i], data, 2 * dims[1] * sizeof(uint32_t)));
+    pas[i] = &as[i];
+    total += dims[1];
+    if (i < 39)
+      p[i] = total;
+  }
+
+  ga_assert_ok(GpuArray_concatenate(&r, pas, 40, 1, GA_UINT));
+  ck_assert_int_eq(r.dimensions[0], 2);
+  ck_assert_int_eq(r.dimensions[1], total);
+  ga_assert_ok(GpuArray_read(buf, 2 * total * sizeof(uint32_t), &r));
+  k = 0;
+  for (i = 0; i < 40; i++) {
+    for (j = 0; j < i % 3 + 1; j++) {
+      ck_assert_int_eq(buf[k + j], i * 100 + j);
+      ck_assert_int_eq(buf[total + k + j], i * 100 + i % 3 + 1 + j);
+    }
+    k += i % 3 + 1;
+  }
+
+  for (i = 0; i < 40; i++)
+    pss[i] = &ss[i];
+  ga_assert_ok(GpuArray_split_copy(pss, &r, 39, p, 1));
+
+  /* Same layout with other buffers, this reuses the uploaded table */
+  ga_assert_ok(GpuArray_concatenate(&r2, (const GpuArray **)pss, 40, 1,
+                                    GA_UINT));
+  ga_assert_ok(GpuArray_read(buf, 2 * total * sizeof(uint32_t), &r));
+  ga_assert_ok(GpuArray_read(buf2, 2 * total * sizeof(uint32_t), &r2));
+  ck_assert(memcmp(buf, buf2, 2 * total * sizeof(uint32_t)) == 0);
+  GpuArray_clear(&r2);
+  for (i = 0; i < 40; i++) {
+    ck_assert_int_eq(ss[i].dimensions[1], i % 3 + 1);
+    ck_assert(GpuArray_IS_C_CONTIGUOUS(&ss[i]));
+    ga_assert_ok(GpuArray_read(buf, 2 * (i % 3 + 1) * sizeof(uint32_t), &ss[i]));
+    for (j = 0; j < 2 * (i % 3 + 1); j++)
+      ck_assert_int_eq(buf[j], i * 100 + j);
+    GpuArray_clear(&ss[i]);
+    GpuArray_clear(&as[i]);
+  }
+  GpuArray_clear(&r);
+}
+END_TEST
+
+START_TEST(test_copy_transpose) {
+  /* NCHW -> NHWC, large enough for the tiled copy */
+  const size_t dims[4] = {2, 40, 5, 9};
+  const unsigned int axes[4] = {0, 2, 3, 1};
+  const size_t mdims[2] = {37, 45};
+  GpuArray a, t, r;
+  uint32_t *data, *buf;
+  size_t i, n, c, h, w;
+
+  data = calloc(2 * 40 * 5 * 9, sizeof(uint32_t));
+  buf = calloc(2 * 40 * 5 * 9, sizeof(uint32_t));
+  ck_assert_ptr_ne(data, NULL);
+  ck_assert_ptr_ne(buf, NULL);
+  for (i = 0; i < 2 * 40 * 5 * 9; i++)
+    data[i] = i;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_UINT, 4, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data, 2 * 40 * 5 * 9 * sizeof(uint32_t)));
+  ga_assert_ok(GpuArray_transpose(&t, &a, axes));
+  ga_assert_ok(GpuArray_copy(&r, &t, GA_C_ORDER));
+  ga_assert_ok(GpuArray_read(buf, 2 * 40 * 5 * 9 * sizeof(uint32_t), &r));
+  for (n = 0; n < 2; n++)
+    for (h = 0; h < 5; h++)
+      for (w = 0; w < 9; w++)
+        for (c = 0; c < 40; c++)
+          ck_assert_int_eq(buf[((n * 5 + h) * 9 + w) * 40 + c],
+                           data[((n * 40 + c) * 5 + h) * 9 + w]);
+  GpuArray_clear(&r);
+  GpuArray_clear(&t);
+  GpuArray_clear(&a);
+
+  /* C -> F order with partial tiles */
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_UINT, 2, mdims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data, 37 * 45 * sizeof(uint32_t)));
+  ga_assert_ok(GpuArray_copy(&r, &a, GA_F_ORDER));
+  ga_assert_ok(GpuArray_read(buf, 37 * 45 * sizeof(uint32_t), &r));
+  for (h = 0; h < 37; h++)
+    for (w = 0; w < 45; w++)
+      ck_assert_int_eq(buf[w * 37 + h], data[h * 45 + w]);
+  GpuArray_clear(&r);
+  GpuArray_clear(&a);
+
+  free(data);
+  free(buf);
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("array");
   TCase *tc = tcase_create("take1");
@@ -278,5 +390,15 @@ Suite *get_suite(void) {
   tcase_add_test(tc, test_take1_ok);
   tcase_add_test(tc, test_take1_offset);
   suite_add_tcase(s, tc);
+  tc = tcase_create("concatenate");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_set_timeout(tc, 8.0);
+  tcase_add_test(tc, test_concatenate_many);
+  suite_add_tcase(s, tc);
+  tc = tcase_create("copy");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_set_timeout(tc, 8.0);
+  tcase_add_test(tc, test_copy_transpose);
+  suite_add_tcase(s, tc);
   return s;
 }
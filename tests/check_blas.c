@@ -29,12 +29,98 @@ START_TEST(test_gemmBatch_3d) {
 }
 END_TEST
 
+START_TEST(test_gemmBatch_3d_strided) {
+  GpuArray Abase, Bbase, Av, A, B, C;
+  /* batch, m, n, k */
+  const size_t nb = 3, m = 4, n = 5, k = 6;
+  size_t adims[3] = {2 * nb, k, m};
+  size_t bdims[3] = {2 * nb, n, k};
+  size_t cdims[3] = {nb, m, n};
+  ssize_t starts[3] = {0, 0, 0};
+  ssize_t steps[3] = {2, 1, 1};
+  ssize_t astops[3], bstops[3];
+  unsigned int axes[3] = {0, 2, 1};
+  float a[2 * 3 * 6 * 4], b[2 * 3 * 5 * 6], c[3 * 4 * 5];
+  float e;
+  size_t i, j, l, bi;
+
+  for (i = 0; i < 3; i++) {
+    astops[i] = adims[i];
+    bstops[i] = bdims[i];
+  }
+  for (i = 0; i < sizeof(a) / sizeof(a[0]); i++)
+    a[i] = (float)(i % 7) - 3;
+  for (i = 0; i < sizeof(b) / sizeof(b[0]); i++)
+    b[i] = (float)(i % 5) - 2;
+
+  ga_assert_ok(GpuArray_empty(&Abase, ctx, GA_FLOAT, 3, adims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_empty(&Bbase, ctx, GA_FLOAT, 3, bdims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_empty(&C, ctx, GA_FLOAT, 3, cdims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&Abase, a, sizeof(a)));
+  ga_assert_ok(GpuArray_write(&Bbase, b, sizeof(b)));
+
+  /* Every other batch, with A stored as the transpose of its
+     matrices and B passed transposed. */
+  ga_assert_ok(GpuArray_index(&Av, &Abase, starts, astops, steps));
+  ga_assert_ok(GpuArray_transpose(&A, &Av, axes));
+  ga_assert_ok(GpuArray_index(&B, &Bbase, starts, bstops, steps));
+
+  ga_assert_ok(GpuArray_rgemmBatch_3d(cb_no_trans, cb_trans, 1, &A, &B, 0,
+                                      &C, 1));
+  ga_assert_ok(GpuArray_read(c, sizeof(c), &C));
+
+  for (bi = 0; bi < nb; bi++)
+    for (i = 0; i < m; i++)
+      for (j = 0; j < n; j++) {
+        e = 0;
+        for (l = 0; l < k; l++)
+          e += a[2 * bi * k * m + l * m + i] * b[2 * bi * n * k + j * k + l];
+        ck_assert_msg(c[(bi * m + i) * n + j] == e,
+                      "C[%zu][%zu][%zu] = %f, expected %f", bi, i, j,
+                      c[(bi * m + i) * n + j], e);
+      }
+
+  GpuArray_clear(&A);
+  GpuArray_clear(&Av);
+  GpuArray_clear(&B);
+  GpuArray_clear(&Abase);
+  GpuArray_clear(&Bbase);
+  GpuArray_clear(&C);
+}
+END_TEST
+
+START_TEST(test_gemmBatch_3d_overlap) {
+  GpuArray A, B, C, Cv;
+  size_t dims[3] = {4, 8, 8};
+
+  ga_assert_ok(GpuArray_empty(&A, ctx, GA_FLOAT, 3, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_empty(&B, ctx, GA_FLOAT, 3, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_empty(&C, ctx, GA_FLOAT, 3, dims, GA_C_ORDER));
+
+  /* The output batches can't share elements */
+  ga_assert_ok(GpuArray_view(&Cv, &C));
+  Cv.strides[0] = 0;
+  ck_assert_int_eq(GpuArray_rgemmBatch_3d(cb_no_trans, cb_no_trans, 1, &A,
+                                          &B, 0, &Cv, 1), GA_VALUE_ERROR);
+  Cv.strides[0] = C.strides[1];
+  ck_assert_int_eq(GpuArray_rgemmBatch_3d(cb_no_trans, cb_no_trans, 1, &A,
+                                          &B, 0, &Cv, 1), GA_VALUE_ERROR);
+
+  GpuArray_clear(&Cv);
+  GpuArray_clear(&A);
+  GpuArray_clear(&B);
+  GpuArray_clear(&C);
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("blas");
   TCase *tc = tcase_create("all");
   tcase_add_checked_fixture(tc, setup, teardown);
   tcase_set_timeout(tc, 16.0);
   tcase_add_test(tc, test_gemmBatch_3d);
+  tcase_add_test(tc, test_gemmBatch_3d_strided);
+  tcase_add_test(tc, test_gemmBatch_3d_overlap);
   suite_add_tcase(s, tc);
   return s;
 }
@@ -1,6 +1,12 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <check.h>
 
 #include "gpuarray/buffer.h"
+#include "gpuarray/cmdlist.h"
 #include "gpuarray/error.h"
 
 #include "private.h"
@@ -185,6 +191,478 @@ START_TEST(test_buffer_move) {
 }
 END_TEST
 
+START_TEST(test_buffer_async) {
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t *hbuf;
+  int32_t buf[nelems(data)];
+  gpudata *h;
+  gpudata *d;
+  int err = GA_NO_ERROR;
+  int done;
+  unsigned int i;
+
+  h = gpudata_alloc(ctx, sizeof(data), NULL, GA_BUFFER_HOST, &err);
+  if (err == GA_DEVSUP_ERROR)
+    return;
+  ck_assert(h != NULL);
+  err = gpudata_property(h, GA_BUFFER_PROP_HOSTPOINTER, &hbuf);
+  if (err == GA_DEVSUP_ERROR) {
+    gpudata_release(h);
+    return;
+  }
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  memcpy(hbuf, data, sizeof(data));
+
+  d = gpudata_alloc(ctx, sizeof(data), NULL, 0, NULL);
+  ck_assert(d != NULL);
+
+  /* Page-locked to device and back */
+  err = gpudata_write_async(d, 0, hbuf, sizeof(data));
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_sync(d), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_query(d, &done), GA_NO_ERROR);
+  ck_assert_int_eq(done, 1);
+
+  memset(hbuf, 0, sizeof(data));
+  err = gpudata_read_async(hbuf, d, 0, sizeof(data));
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  do {
+    ck_assert_int_eq(gpudata_query(d, &done), GA_NO_ERROR);
+  } while (!done);
+  for (i = 0; i < nelems(data); i++) {
+    ck_assert_int_eq(hbuf[i], data[i]);
+  }
+
+  /* Between the buffers */
+  err = gpudata_memset(h, 0, 0);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  err = gpudata_move(h, 0, d, 0, sizeof(data));
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  err = gpudata_read(buf, h, 0, sizeof(data));
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  for (i = 0; i < nelems(data); i++) {
+    ck_assert_int_eq(buf[i], data[i]);
+  }
+
+  gpudata_release(h);
+  gpudata_release(d);
+}
+END_TEST
+
+START_TEST(test_kernel_access) {
+  static const char *src =
+    "KERNEL void kcopy(GLOBAL_MEM const float *a, ga_size n,"
+    "                  GLOBAL_MEM float *b) {"
+    "  ga_size i = GID_0 * LDIM_0 + LID_0;"
+    "  if (i < n) b[i] = a[i];"
+    "}\n";
+  static const int types[3] = {GA_BUFFER, GA_SIZE, GA_BUFFER};
+  static const int access[3] = {GA_ARG_READ, 0, GA_ARG_WRITE};
+  const int *res;
+  gpukernel *k, *k2;
+  int err = GA_NO_ERROR;
+
+  k = gpukernel_init(ctx, 1, &src, NULL, "kcopy", 3, types, access,
+                     GA_USE_CLUDA, &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(k != NULL);
+  err = gpukernel_property(k, GA_KERNEL_PROP_ACCESS, &res);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert_int_eq(res[0], GA_ARG_READ);
+  ck_assert_int_eq(res[1], 0);
+  ck_assert_int_eq(res[2], GA_ARG_WRITE);
+
+  /* No information means the buffers can be read and written */
+  k2 = gpukernel_init(ctx, 1, &src, NULL, "kcopy", 3, types, NULL,
+                      GA_USE_CLUDA, &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(k2 != NULL);
+  err = gpukernel_property(k2, GA_KERNEL_PROP_ACCESS, &res);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert_int_eq(res[0], GA_ARG_READ_WRITE);
+  ck_assert_int_eq(res[1], 0);
+  ck_assert_int_eq(res[2], GA_ARG_READ_WRITE);
+
+  gpukernel_release(k);
+  gpukernel_release(k2);
+}
+END_TEST
+
+START_TEST(test_kernel_cache_stats) {
+  static const char *src =
+    "KERNEL void kstats(GLOBAL_MEM float *a, ga_size n) {"
+    "  ga_size i = GID_0 * LDIM_0 + LID_0;"
+    "  if (i < n) a[i] = 0;"
+    "}\n";
+  static const int types[2] = {GA_BUFFER, GA_SIZE};
+  size_t hits0, misses0, hits, misses, bytes;
+  gpukernel *k, *k2;
+  int err = GA_NO_ERROR;
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_KERNEL_CACHE_HITS,
+                                       &hits0), GA_NO_ERROR);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_KERNEL_CACHE_MISSES,
+                                       &misses0), GA_NO_ERROR);
+
+  k = gpukernel_init(ctx, 1, &src, NULL, "kstats", 2, types, NULL,
+                     GA_USE_CLUDA, &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  k2 = gpukernel_init(ctx, 1, &src, NULL, "kstats", 2, types, NULL,
+                      GA_USE_CLUDA, &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_KERNEL_CACHE_HITS,
+                                       &hits), GA_NO_ERROR);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_KERNEL_CACHE_MISSES,
+                                       &misses), GA_NO_ERROR);
+  ck_assert(hits == hits0 + 1);
+  ck_assert(misses == misses0 + 1);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_KERNEL_CACHE_BYTES,
+                                       &bytes), GA_NO_ERROR);
+  ck_assert(bytes >= strlen(src));
+  ck_assert_int_eq(gpukernel_property(k, GA_KERNEL_PROP_BINSIZE, &bytes),
+                   GA_NO_ERROR);
+  ck_assert(bytes > 0);
+  ck_assert_int_eq(gpucontext_property(ctx,
+                                       GA_CTX_PROP_ELEMWISE_CACHE_EVICTIONS,
+                                       &bytes), GA_NO_ERROR);
+
+  gpukernel_release(k);
+  gpukernel_release(k2);
+}
+END_TEST
+
+START_TEST(test_stream) {
+  const int32_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  int32_t buf[nelems(data)];
+  gpustream *s, *s2;
+  gpudata *d;
+  gpudata *d2;
+  int err = GA_NO_ERROR;
+  unsigned int i;
+
+  ck_assert_ptr_eq(gpucontext_get_stream(ctx), NULL);
+
+  s = gpustream_new(ctx, 0, &err);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(s != NULL);
+  ck_assert_ptr_eq(gpustream_context(s), ctx);
+  s2 = gpustream_new(ctx, 0, &err);
+  ck_assert(s2 != NULL);
+
+  d = gpudata_alloc(ctx, sizeof(data), NULL, 0, NULL);
+  ck_assert(d != NULL);
+  d2 = gpudata_alloc(ctx, sizeof(data), NULL, 0, NULL);
+  ck_assert(d2 != NULL);
+
+  /* Write on one stream and copy on another */
+  ck_assert_int_eq(gpucontext_set_stream(ctx, s), GA_NO_ERROR);
+  ck_assert_ptr_eq(gpucontext_get_stream(ctx), s);
+  err = gpudata_write(d, 0, data, sizeof(data));
+  ck_assert(err == GA_NO_ERROR);
+
+  ck_assert_int_eq(gpucontext_set_stream(ctx, s2), GA_NO_ERROR);
+  err = gpudata_move(d2, 0, d, 0, sizeof(data));
+  ck_assert(err == GA_NO_ERROR);
+  ck_assert_int_eq(gpustream_sync(s2), GA_NO_ERROR);
+
+  ck_assert_int_eq(gpucontext_set_stream(ctx, NULL), GA_NO_ERROR);
+  ck_assert_ptr_eq(gpucontext_get_stream(ctx), NULL);
+  err = gpudata_read(buf, d2, 0, sizeof(data));
+  ck_assert(err == GA_NO_ERROR);
+  for (i = 0; i < nelems(data); i++) {
+    ck_assert_int_eq(buf[i], data[i]);
+  }
+
+  /* Releasing the current stream goes back to the default one */
+  ck_assert_int_eq(gpucontext_set_stream(ctx, s), GA_NO_ERROR);
+  gpustream_retain(s);
+  gpustream_release(s);
+  ck_assert_ptr_eq(gpucontext_get_stream(ctx), s);
+  gpustream_release(s);
+  ck_assert_ptr_eq(gpucontext_get_stream(ctx), NULL);
+  gpustream_release(s2);
+
+  gpudata_release(d);
+  gpudata_release(d2);
+}
+END_TEST
+
+START_TEST(test_trace) {
+  static const char *src =
+    "KERNEL void kcopy(GLOBAL_MEM const float *a, ga_size n,"
+    "                  GLOBAL_MEM float *b) {"
+    "  ga_size i = GID_0 * LDIM_0 + LID_0;"
+    "  if (i < n) b[i] = a[i];"
+    "}\n";
+  static const int types[3] = {GA_BUFFER, GA_SIZE, GA_BUFFER};
+  const float data[] = {0, 1, 2, 3, 4, 5, 6, 7};
+  float buf[nelems(data)];
+  char tmpl[] = "/tmp/gatraceXXXXXX";
+  char text[4096];
+  size_t n = nelems(data);
+  size_t gs = 1, ls = nelems(data);
+  void *args[3];
+  const char *name;
+  gpukernel *k;
+  gpudata *d, *d2;
+  FILE *f;
+  int err = GA_NO_ERROR;
+  int fd;
+
+  k = gpukernel_init(ctx, 1, &src, NULL, "kcopy", 3, types, NULL,
+                     GA_USE_CLUDA, &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  err = gpukernel_property(k, GA_KERNEL_PROP_NAME, &name);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert_str_eq(name, "kcopy");
+
+  d = gpudata_alloc(ctx, sizeof(data), NULL, 0, NULL);
+  ck_assert(d != NULL);
+  d2 = gpudata_alloc(ctx, sizeof(data), NULL, 0, NULL);
+  ck_assert(d2 != NULL);
+
+  ck_assert_int_eq(gpucontext_trace_start(ctx, 16), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_write(d, 0, data, sizeof(data)), GA_NO_ERROR);
+  args[0] = d;
+  args[1] = &n;
+  args[2] = d2;
+  ck_assert_int_eq(gpukernel_call(k, 1, &gs, &ls, 0, args), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_read(buf, d2, 0, sizeof(buf)), GA_NO_ERROR);
+  ck_assert(buf[7] == 7.0f);
+
+  fd = mkstemp(tmpl);
+  ck_assert(fd != -1);
+  close(fd);
+  ck_assert_int_eq(gpucontext_trace_dump(ctx, tmpl), GA_NO_ERROR);
+
+  f = fopen(tmpl, "r");
+  ck_assert(f != NULL);
+  text[fread(text, 1, sizeof(text) - 1, f)] = '\0';
+  fclose(f);
+  ck_assert(strstr(text, "\"traceEvents\"") != NULL);
+  ck_assert(strstr(text, "\"name\": \"write\", \"cat\": \"copy\"") != NULL);
+  ck_assert(strstr(text, "\"name\": \"kcopy\", \"cat\": \"kernel\"") != NULL);
+  ck_assert(strstr(text, "\"block\": [8]") != NULL);
+  ck_assert(strstr(text, "\"bytes\": 32") != NULL);
+  ck_assert(strstr(text, "\"shared_mem\": 0") != NULL);
+
+  /* Only the events since the last dump are written */
+  ck_assert_int_eq(gpukernel_call(k, 1, &gs, &ls, 0, args), GA_NO_ERROR);
+  ck_assert_int_eq(gpucontext_trace_dump(ctx, tmpl), GA_NO_ERROR);
+  gpucontext_trace_stop(ctx);
+  ck_assert_int_eq(gpucontext_trace_dump(ctx, tmpl), GA_INVALID_ERROR);
+
+  f = fopen(tmpl, "r");
+  ck_assert(f != NULL);
+  text[fread(text, 1, sizeof(text) - 1, f)] = '\0';
+  fclose(f);
+  unlink(tmpl);
+  ck_assert(strstr(text, "\"name\": \"write\"") == NULL);
+  ck_assert(strstr(text, "\"name\": \"kcopy\", \"cat\": \"kernel\"") != NULL);
+
+  gpudata_release(d);
+  gpudata_release(d2);
+  gpukernel_release(k);
+}
+END_TEST
+
+START_TEST(test_mem_stats) {
+  size_t used0, used, peak, reserved, cached, nallocs0, nallocs, largest;
+  gpudata *d;
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_USED, &used0),
+                   GA_NO_ERROR);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_NUM_ALLOCS,
+                                       &nallocs0), GA_NO_ERROR);
+
+  d = gpudata_alloc(ctx, 1000, NULL, 0, NULL);
+  ck_assert(d != NULL);
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_USED, &used),
+                   GA_NO_ERROR);
+  ck_assert(used >= used0 + 1000);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_PEAK, &peak),
+                   GA_NO_ERROR);
+  ck_assert(peak >= used);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_RESERVED,
+                                       &reserved), GA_NO_ERROR);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_CACHED,
+                                       &cached), GA_NO_ERROR);
+  ck_assert(reserved >= used + cached);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_NUM_ALLOCS,
+                                       &nallocs), GA_NO_ERROR);
+  ck_assert(nallocs <= nallocs0 + 1);
+
+  gpudata_release(d);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_USED, &used),
+                   GA_NO_ERROR);
+  ck_assert(used == used0);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_PEAK, &peak),
+                   GA_NO_ERROR);
+  ck_assert(peak >= used0 + 1000);
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_LARGEST_MEMBLOCK,
+                                       &largest), GA_NO_ERROR);
+  ck_assert(largest >= 1000);
+  ck_assert_int_eq(gpucontext_property(ctx,
+                                       GA_CTX_PROP_LARGEST_MEMBLOCK_PROBED,
+                                       &largest), GA_NO_ERROR);
+  ck_assert(largest >= 1000);
+}
+END_TEST
+
+START_TEST(test_trim) {
+  size_t reserved0, reserved, cached;
+  gpudata *d;
+
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_RESERVED,
+                                       &reserved0), GA_NO_ERROR);
+  /* Bigger than the usual arena so that it gets its own */
+  d = gpudata_alloc(ctx, 16 * 1024 * 1024, NULL, 0, NULL);
+  ck_assert(d != NULL);
+  gpudata_release(d);
+
+  gpucontext_trim(ctx, 0);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_RESERVED,
+                                       &reserved), GA_NO_ERROR);
+  ck_assert(reserved <= reserved0);
+
+  /* Nothing left to release */
+  ck_assert(gpucontext_trim(ctx, 0) == 0);
+  ck_assert_int_eq(gpucontext_property(ctx, GA_CTX_PROP_MEM_CACHED,
+                                       &cached), GA_NO_ERROR);
+  ck_assert(reserved >= cached);
+}
+END_TEST
+
+START_TEST(test_graph) {
+  static const char *src =
+    "KERNEL void kinc(GLOBAL_MEM float *a, ga_size n) {"
+    "  ga_size i = GID_0 * LDIM_0 + LID_0;"
+    "  if (i < n) a[i] += 1;"
+    "}\n";
+  static const int types[2] = {GA_BUFFER, GA_SIZE};
+  static const int btypes[2] = {GA_SIZE, GA_SIZE};
+  const float zeros[8] = {0};
+  float buf[8];
+  size_t n = nelems(buf), gs = 1, ls = nelems(buf);
+  void *args[2];
+  gpudata *a, *b;
+  gpukernel *k;
+  gpugraph *g;
+  int err = GA_NO_ERROR;
+  unsigned int i;
+
+  k = gpukernel_init(ctx, 1, &src, NULL, "kinc", 2, types, NULL,
+                     GA_USE_CLUDA, &err, NULL);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  a = gpudata_alloc(ctx, sizeof(zeros), (void *)zeros, GA_BUFFER_INIT, NULL);
+  ck_assert(a != NULL);
+  b = gpudata_alloc(ctx, sizeof(zeros), (void *)zeros, GA_BUFFER_INIT, NULL);
+  ck_assert(b != NULL);
+
+  err = gpucontext_capture_begin(ctx);
+  if (err == GA_UNSUPPORTED_ERROR) {
+    ck_assert(gpucontext_capture_end(ctx, &err) == NULL);
+    ck_assert_int_eq(err, GA_UNSUPPORTED_ERROR);
+    goto done;
+  }
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  /* Only one capture at a time */
+  ck_assert_int_eq(gpucontext_capture_begin(ctx), GA_INVALID_ERROR);
+  args[0] = a;
+  args[1] = &n;
+  ck_assert_int_eq(gpukernel_call(k, 1, &gs, &ls, 0, args), GA_NO_ERROR);
+  /* Nothing has run yet, so this can't give an answer */
+  ck_assert_int_eq(gpudata_read(buf, a, 0, sizeof(buf)), GA_INVALID_ERROR);
+  ck_assert_int_eq(gpukernel_call(k, 1, &gs, &ls, 0, args), GA_NO_ERROR);
+  g = gpucontext_capture_end(ctx, &err);
+  ck_assert_int_eq(err, GA_NO_ERROR);
+  ck_assert(g != NULL);
+  ck_assert_int_eq(gpugraph_numkernels(g), 2);
+
+  /* The captured work did not run */
+  ck_assert_int_eq(gpudata_read(buf, a, 0, sizeof(buf)), GA_NO_ERROR);
+  for (i = 0; i < nelems(buf); i++)
+    ck_assert(buf[i] == 0);
+
+  ck_assert_int_eq(gpugraph_launch(g), GA_NO_ERROR);
+  ck_assert_int_eq(gpugraph_launch(g), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_read(buf, a, 0, sizeof(buf)), GA_NO_ERROR);
+  for (i = 0; i < nelems(buf); i++)
+    ck_assert(buf[i] == 4);
+
+  /* The second launch now goes to b */
+  args[0] = b;
+  ck_assert_int_eq(gpugraph_setargs(g, 2, 2, types, args), GA_VALUE_ERROR);
+  ck_assert_int_eq(gpugraph_setargs(g, 1, 1, types, args), GA_VALUE_ERROR);
+  ck_assert_int_eq(gpugraph_setargs(g, 1, 2, btypes, args), GA_VALUE_ERROR);
+  ck_assert_int_eq(gpugraph_setargs(g, 1, 2, types, args), GA_NO_ERROR);
+  ck_assert_int_eq(gpugraph_launch(g), GA_NO_ERROR);
+  ck_assert_int_eq(gpudata_read(buf, a, 0, sizeof(buf)), GA_NO_ERROR);
+  for (i = 0; i < nelems(buf); i++)
+    ck_assert(buf[i] == 5);
+  ck_assert_int_eq(gpudata_read(buf, b, 0, sizeof(buf)), GA_NO_ERROR);
+  for (i = 0; i < nelems(buf); i++)
+    ck_assert(buf[i] == 1);
+
+  gpugraph_release(g);
+ done:
+  gpudata_release(a);
+  gpudata_release(b);
+  gpukernel_release(k);
+}
+END_TEST
+
+START_TEST(test_cmdlist) {
+  static const char *src =
+    "KERNEL void kinc(GLOBAL_MEM float *a, ga_size n) {"
+    "  ga_size i = GID_0 * LDIM_0 + LID_0;"
+    "  if (i < n) a[i] += 1;"
+    "}\n";
+  static const int types[2] = {GA_BUFFER, GA_SIZE};
+  const float zeros[8] = {0};
+  float buf[8];
+  size_t n = nelems(buf), gs = 1, ls = nelems(buf);
+  void *args[2];
+  gpudata *a, *b;
+  GpuCmdList *l;
+  GpuKernel k;
+  unsigned int i, j;
+
+  ck_assert_int_eq(GpuKernel_init(&k, ctx, 1, &src, NULL, "kinc", 2, types,
+                                  NULL, GA_USE_CLUDA, NULL), GA_NO_ERROR);
+  a = gpudata_alloc(ctx, sizeof(zeros), (void *)zeros, GA_BUFFER_INIT, NULL);
+  ck_assert(a != NULL);
+  b = gpudata_alloc(ctx, sizeof(zeros), NULL, 0, NULL);
+  ck_assert(b != NULL);
+
+  l = GpuCmdList_new(ctx, 0);
+  ck_assert(l != NULL);
+  args[0] = a;
+  args[1] = &n;
+  ck_assert_int_eq(GpuCmdList_memset(l, b, 0, 0), GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 1, &gs, &ls, 0, args),
+                   GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 1, &gs, &ls, 0, args),
+                   GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_move(l, b, 0, a, 0, sizeof(buf)), GA_NO_ERROR);
+
+  for (j = 1; j <= 3; j++) {
+    ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+    ck_assert_int_eq(gpudata_read(buf, b, 0, sizeof(buf)), GA_NO_ERROR);
+    for (i = 0; i < nelems(buf); i++)
+      ck_assert(buf[i] == 2 * j);
+  }
+
+  GpuCmdList_free(l);
+  gpudata_release(a);
+  gpudata_release(b);
+  GpuKernel_clear(&k);
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("buffer");
   TCase *tc = tcase_create("API");
@@ -195,6 +673,15 @@ Suite *get_suite(void) {
   tcase_add_test(tc, test_buffer_share);
   tcase_add_test(tc, test_buffer_read_write);
   tcase_add_test(tc, test_buffer_move);
+  tcase_add_test(tc, test_buffer_async);
+  tcase_add_test(tc, test_kernel_access);
+  tcase_add_test(tc, test_kernel_cache_stats);
+  tcase_add_test(tc, test_stream);
+  tcase_add_test(tc, test_trace);
+  tcase_add_test(tc, test_mem_stats);
+  tcase_add_test(tc, test_trim);
+  tcase_add_test(tc, test_graph);
+  tcase_add_test(tc, test_cmdlist);
   suite_add_tcase(s, tc);
   return s;
 }
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include <check.h>
+
+#include "cache.h"
+#include "util/xxhash.h"
+
+static int nfreed;
+
+static int strb_eq(void *_k1, void *_k2) {
+  strb *k1 = (strb *)_k1;
+  strb *k2 = (strb *)_k2;
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint64_t strb_hash(void *_k) {
+  strb *k = (strb *)_k;
+  return XXH64(k->s, k->l, 42);
+}
+
+/* All keys collide to exercise the probing */
+static uint64_t bad_hash(void *_k) {
+  return 3;
+}
+
+static void count_free(void *_v) {
+  nfreed++;
+  strb_free((strb *)_v);
+}
+
+static strb *mkstr(const char *fmt, int i) {
+  strb *res = strb_new();
+  strb_appendf(res, fmt, i);
+  return res;
+}
+
+static int has(cache *c, const char *fmt, int i) {
+  strb *k = mkstr(fmt, i);
+  int res = cache_get(c, k) != NULL;
+  strb_free(k);
+  return res;
+}
+
+typedef cache *(*mkcache_fn)(size_t size, cache_hash_fn khash);
+
+static cache *mk_lru(size_t size, cache_hash_fn khash) {
+  return cache_lru(size, 0, strb_eq, khash, (cache_freek_fn)strb_free,
+                   count_free);
+}
+
+static cache *mk_twoq(size_t size, cache_hash_fn khash) {
+  return cache_twoq(size, size, size, 0, strb_eq, khash,
+                    (cache_freek_fn)strb_free, count_free);
+}
+
+static void check_basic(mkcache_fn mk, cache_hash_fn khash, cache *c) {
+  if (c == NULL)
+    c = mk(1000, khash);
+  strb *k, *v;
+  int i;
+
+  ck_assert_ptr_ne(c, NULL);
+  nfreed = 0;
+  for (i = 0; i < 500; i++)
+    ck_assert_int_eq(cache_add(c, mkstr("k%d", i), mkstr("v%d", i)), 0);
+  for (i = 0; i < 500; i++) {
+    k = mkstr("k%d", i);
+    v = cache_get(c, k);
+    ck_assert_ptr_ne(v, NULL);
+    ck_assert_int_eq(atoi(v->s + 1), i);
+    strb_free(k);
+  }
+
+  /* Delete every other entry, the rest must still be reachable */
+  for (i = 0; i < 500; i += 2) {
+    k = mkstr("k%d", i);
+    ck_assert_int_eq(cache_del(c, k), 1);
+    ck_assert_int_eq(cache_del(c, k), 0);
+    strb_free(k);
+  }
+  ck_assert_int_eq(nfreed, 250);
+  for (i = 0; i < 500; i++)
+    ck_assert_int_eq(has(c, "k%d", i), i % 2);
+
+  /* Replacing frees the old value */
+  ck_assert_int_eq(cache_add(c, mkstr("k%d", 1), mkstr("w%d", 1)), 0);
+  ck_assert_int_eq(nfreed, 251);
+  k = mkstr("k%d", 1);
+  v = cache_get(c, k);
+  ck_assert(v != NULL && v->s[0] == 'w');
+
+  /* get_or_add keeps the existing value */
+  v = cache_get_or_add(c, k, mkstr("x%d", 1));
+  ck_assert(v != NULL && v->s[0] == 'w');
+  ck_assert_int_eq(nfreed, 252);
+  k = mkstr("k%d", 0);
+  v = cache_get_or_add(c, k, mkstr("x%d", 0));
+  ck_assert(v != NULL && v->s[0] == 'x');
+  ck_assert_int_eq(has(c, "k%d", 0), 1);
+
+  cache_destroy(c);
+  ck_assert_int_eq(nfreed, 252 + 251);
+}
+
+START_TEST(test_lru_basic) {
+  check_basic(mk_lru, strb_hash, NULL);
+  check_basic(mk_lru, bad_hash, NULL);
+}
+END_TEST
+
+START_TEST(test_twoq_basic) {
+  check_basic(mk_twoq, strb_hash, NULL);
+  check_basic(mk_twoq, bad_hash, NULL);
+}
+END_TEST
+
+START_TEST(test_lru_evict) {
+  cache *c = mk_lru(4, strb_hash);
+  int i;
+
+  for (i = 0; i < 4; i++)
+    cache_add(c, mkstr("k%d", i), mkstr("v%d", i));
+  /* Use k0 so that k1 is the oldest */
+  ck_assert_int_eq(has(c, "k%d", 0), 1);
+  cache_add(c, mkstr("k%d", 4), mkstr("v%d", 4));
+  ck_assert_int_eq(has(c, "k%d", 1), 0);
+  ck_assert_int_eq(has(c, "k%d", 0), 1);
+  ck_assert_int_eq(has(c, "k%d", 4), 1);
+  cache_destroy(c);
+}
+END_TEST
+
+START_TEST(test_lru_grow) {
+  /* An unbounded cache must grow past its initial table */
+  cache *c = mk_lru(0, strb_hash);
+  int i;
+
+  for (i = 0; i < 10000; i++)
+    ck_assert_int_eq(cache_add(c, mkstr("k%d", i), mkstr("v%d", i)), 0);
+  for (i = 0; i < 10000; i++)
+    ck_assert_int_eq(has(c, "k%d", i), 1);
+  ck_assert_int_eq(has(c, "k%d", 10000), 0);
+  cache_destroy(c);
+}
+END_TEST
+
+static size_t strb_cost(void *k, void *v) {
+  return ((strb *)v)->l;
+}
+
+static void check_budget(cache *c) {
+  cache_stats st;
+  strb *k;
+  int i;
+
+  c->cost = strb_cost;
+  c->max_cost = 100;
+  /* Values of 10 bytes */
+  for (i = 0; i < 10; i++)
+    cache_add(c, mkstr("k%d", i), mkstr("v%09d", i));
+  cache_get_stats(c, &st);
+  ck_assert_int_eq(st.cost, 100);
+  ck_assert_int_eq(st.evictions, 0);
+
+  /* Keep k0 in use so that something else goes */
+  ck_assert_int_eq(has(c, "k%d", 0), 1);
+  cache_add(c, mkstr("k%d", 10), mkstr("v%019d", 10));
+  cache_get_stats(c, &st);
+  ck_assert(st.cost <= 100);
+  ck_assert_int_eq(st.evictions, 2);
+  ck_assert_int_eq(has(c, "k%d", 0), 1);
+  ck_assert_int_eq(has(c, "k%d", 10), 1);
+
+  /* An entry over the budget by itself stays alone */
+  cache_add(c, mkstr("k%d", 11), mkstr("v%0199d", 11));
+  cache_get_stats(c, &st);
+  ck_assert_int_eq(st.cost, 200);
+  ck_assert_int_eq(has(c, "k%d", 11), 1);
+  ck_assert_int_eq(has(c, "k%d", 0), 0);
+
+  /* Replacing updates the cost */
+  cache_add(c, mkstr("k%d", 11), mkstr("v%d", 1));
+  cache_get_stats(c, &st);
+  ck_assert_int_eq(st.cost, 2);
+  k = mkstr("k%d", 11);
+  ck_assert_int_eq(cache_del(c, k), 1);
+  strb_free(k);
+  cache_get_stats(c, &st);
+  ck_assert_int_eq(st.cost, 0);
+  ck_assert_int_eq(st.hits, 4);
+  ck_assert_int_eq(st.misses, 1);
+  cache_destroy(c);
+}
+
+START_TEST(test_budget) {
+  check_budget(mk_lru(0, strb_hash));
+  check_budget(mk_twoq(100, strb_hash));
+}
+END_TEST
+
+#define NTHREADS 16
+#define NOPS 20000
+#define NKEYS 512
+
+/* Reference counted values, shared between the cache and the threads */
+typedef struct _rval {
+  int key;
+  volatile int refcnt;
+} rval;
+
+static volatile int live;
+
+static rval *rval_new(int key) {
+  rval *v = malloc(sizeof(*v));
+  v->key = key;
+  v->refcnt = 1;
+  __sync_fetch_and_add(&live, 1);
+  return v;
+}
+
+static void rval_ref(void *_v) {
+  __sync_fetch_and_add(&((rval *)_v)->refcnt, 1);
+}
+
+static void rval_unref(void *_v) {
+  rval *v = (rval *)_v;
+  if (__sync_sub_and_fetch(&v->refcnt, 1) == 0) {
+    /* Catch late users */
+    v->key = -1;
+    free(v);
+    __sync_fetch_and_sub(&live, 1);
+  }
+}
+
+static int int_eq(void *k1, void *k2) {
+  return *(int *)k1 == *(int *)k2;
+}
+
+static uint64_t int_hash(void *k) {
+  return XXH64(k, sizeof(int), 42);
+}
+
+static int *int_new(int i) {
+  int *res = malloc(sizeof(int));
+  *res = i;
+  return res;
+}
+
+static void *stress(void *arg) {
+  cache *c = (cache *)arg;
+  unsigned int seed = (unsigned int)(size_t)&arg;
+  rval *v;
+  int i, k, bad = 0;
+
+  for (i = 0; i < NOPS; i++) {
+    k = rand_r(&seed) % NKEYS;
+    switch (rand_r(&seed) % 4) {
+    case 0:
+      v = cache_get(c, &k);
+      break;
+    case 1:
+      v = cache_get_or_add(c, int_new(k), rval_new(k));
+      break;
+    case 2:
+      rval_ref(v = rval_new(k));
+      if (cache_add(c, int_new(k), v) != 0) bad++;
+      break;
+    default:
+      cache_del(c, &k);
+      v = NULL;
+    }
+    if (v != NULL) {
+      if (v->key != k) bad++;
+      rval_unref(v);
+    }
+  }
+  return (void *)(size_t)bad;
+}
+
+START_TEST(test_sharded_stress) {
+  cache *shards[4];
+  pthread_t th[NTHREADS];
+  cache_stats st;
+  cache *c;
+  void *bad;
+  int i;
+
+  live = 0;
+  /* Small shards so that there is a lot of eviction */
+  for (i = 0; i < 4; i++)
+    shards[i] = cache_twoq(8, 16, 8, 2, int_eq, int_hash, free, rval_unref);
+  c = cache_sharded(4, shards);
+  ck_assert_ptr_ne(c, NULL);
+  c->vref = rval_ref;
+
+  for (i = 0; i < NTHREADS; i++)
+    ck_assert_int_eq(pthread_create(&th[i], NULL, stress, c), 0);
+  for (i = 0; i < NTHREADS; i++) {
+    ck_assert_int_eq(pthread_join(th[i], &bad), 0);
+    ck_assert_int_eq((int)(size_t)bad, 0);
+  }
+  cache_get_stats(c, &st);
+  ck_assert(st.hits + st.misses > 0);
+  cache_destroy(c);
+  ck_assert_int_eq(live, 0);
+}
+END_TEST
+
+START_TEST(test_sharded_basic) {
+  cache *shards[3];
+  int i;
+
+  for (i = 0; i < 3; i++)
+    shards[i] = cache_lru(0, 0, strb_eq, strb_hash,
+                          (cache_freek_fn)strb_free, count_free);
+  check_basic(NULL, NULL, cache_sharded(3, shards));
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("cache");
+  TCase *tc = tcase_create("All");
+  tcase_add_test(tc, test_lru_basic);
+  tcase_add_test(tc, test_twoq_basic);
+  tcase_add_test(tc, test_lru_evict);
+  tcase_add_test(tc, test_lru_grow);
+  tcase_add_test(tc, test_budget);
+  tcase_add_test(tc, test_sharded_basic);
+  tcase_add_test(tc, test_sharded_stress);
+  suite_add_tcase(s, tc);
+  return s;
+}
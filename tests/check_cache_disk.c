@@ -0,0 +1,175 @@
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+
+#include "cache.h"
+#include "util/xxhash.h"
+
+static char dirpath[] = "/tmp/check_cache_disk.XXXXXX";
+
+static int strb_eq(void *_k1, void *_k2) {
+  strb *k1 = (strb *)_k1;
+  strb *k2 = (strb *)_k2;
+  return (k1->l == k2->l &&
+          memcmp(k1->s, k2->s, k1->l) == 0);
+}
+
+static uint64_t strb_hash(void *_k) {
+  strb *k = (strb *)_k;
+  return XXH64(k->s, k->l, 42);
+}
+
+static int strb_write(strb *res, void *_k) {
+  strb_appendb(res, (strb *)_k);
+  return strb_error(res);
+}
+
+static void *strb_read(const strb *b) {
+  strb *res = strb_alloc(b->l + 1);
+  if (res == NULL) return NULL;
+  memcpy(res->s, b->s, b->l);
+  res->l = b->l;
+  return res;
+}
+
+static strb *mkstr(const char *s, size_t pad) {
+  strb *res = strb_new();
+  strb_appends(res, s);
+  while (pad-- > 0)
+    strb_appendc(res, 'x');
+  return res;
+}
+
+static cache *open_cache(size_t max_size) {
+  cache *mem = cache_lru(4, 0, strb_eq, strb_hash,
+                         (cache_freek_fn)strb_free,
+                         (cache_freev_fn)strb_free);
+  return cache_disk(dirpath, mem, max_size, strb_write, strb_write,
+                    strb_read, strb_read);
+}
+
+static size_t dir_size(int *nfiles) {
+  DIR *d = opendir(dirpath);
+  struct dirent *de;
+  struct stat st;
+  /* Room for the directory, the '/' and any file name */
+  char path[sizeof(dirpath) + sizeof(de->d_name)];
+  size_t res = 0;
+  *nfiles = 0;
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name);
+    stat(path, &st);
+    res += st.st_size;
+    (*nfiles)++;
+  }
+  closedir(d);
+  return res;
+}
+
+static void setup(void) {
+  strcpy(dirpath, "/tmp/check_cache_disk.XXXXXX");
+  ck_assert_ptr_ne(mkdtemp(dirpath), NULL);
+}
+
+static void teardown(void) {
+  DIR *d = opendir(dirpath);
+  struct dirent *de;
+  /* Room for the directory, the '/' and any file name */
+  char path[sizeof(dirpath) + sizeof(de->d_name)];
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name);
+    unlink(path);
+  }
+  closedir(d);
+  rmdir(dirpath);
+}
+
+START_TEST(test_disk_persist) {
+  cache *c;
+  strb *k, *v;
+  int n;
+
+  c = open_cache(1024 * 1024);
+  ck_assert_ptr_ne(c, NULL);
+  ck_assert_int_eq(cache_add(c, mkstr("key1", 0), mkstr("value1", 0)), 0);
+  ck_assert_int_eq(cache_add(c, mkstr("key2", 0), mkstr("value2", 0)), 0);
+  cache_destroy(c);
+
+  /* Only the two entries, no leftover temporary files */
+  dir_size(&n);
+  ck_assert_int_eq(n, 2);
+
+  c = open_cache(1024 * 1024);
+  ck_assert_ptr_ne(c, NULL);
+  k = mkstr("key2", 0);
+  v = (strb *)cache_get(c, k);
+  ck_assert_ptr_ne(v, NULL);
+  ck_assert_int_eq(v->l, 6);
+  ck_assert(memcmp(v->s, "value2", 6) == 0);
+  strb_free(k);
+
+  k = mkstr("key3", 0);
+  ck_assert_ptr_eq(cache_get(c, k), NULL);
+  strb_free(k);
+
+  k = mkstr("key1", 0);
+  cache_del(c, k);
+  strb_free(k);
+  cache_destroy(c);
+
+  dir_size(&n);
+  ck_assert_int_eq(n, 1);
+}
+END_TEST
+
+START_TEST(test_disk_evict) {
+  cache *c;
+  char name[16];
+  strb *k;
+  size_t sz;
+  int i, n;
+
+  c = open_cache(8192);
+  ck_assert_ptr_ne(c, NULL);
+  for (i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "key%d", i);
+    ck_assert_int_eq(cache_add(c, mkstr(name, 0), mkstr("v", 1000)), 0);
+  }
+  sz = dir_size(&n);
+  ck_assert_uint_le(sz, 8192);
+  ck_assert_int_gt(n, 0);
+  ck_assert_int_lt(n, 20);
+  cache_destroy(c);
+
+  /* The last one is always kept */
+  c = open_cache(8192);
+  k = mkstr("key19", 0);
+  ck_assert_ptr_ne(cache_get(c, k), NULL);
+  strb_free(k);
+  cache_destroy(c);
+
+  /* Reopening with a smaller size trims the directory */
+  c = open_cache(2048);
+  cache_destroy(c);
+  sz = dir_size(&n);
+  ck_assert_uint_le(sz, 2048);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("cache_disk");
+  TCase *tc = tcase_create("All");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_disk_persist);
+  tcase_add_test(tc, test_disk_evict);
+  suite_add_tcase(s, tc);
+  return s;
+}
@@ -0,0 +1,407 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "gpuarray/cmdlist.h"
+#include "gpuarray/error.h"
+
+#include "private.h"
+
+/*
+ * Mock backend that logs the operations it is asked to do instead of
+ * running them.  The objects only have the members the generic code
+ * looks at.
+ */
+
+struct _gpudata {
+  void *devptr;
+  gpucontext *ctx;
+  size_t sz;
+  unsigned int refcnt;
+};
+
+struct _gpukernel {
+  gpucontext *ctx;
+  unsigned int refcnt;
+  unsigned int nargs;
+  const int *types;
+};
+
+struct _gpugraph {
+  gpucontext *ctx;
+  unsigned int nops;
+};
+
+typedef struct _event {
+  char op;
+  int captured;
+  gpudata *buf;
+  size_t val;
+} event;
+
+static event events[64];
+static unsigned int nevents;
+static int capturing;
+static int fail_capture;
+static unsigned int launches;
+static unsigned int ngraphs;
+
+static gpucontext ctx;
+static gpucontext gctx;
+static gpucontext other_ctx;
+
+static const int ktypes[2] = {GA_BUFFER, GA_SIZE};
+
+static void log_event(char op, gpudata *buf, size_t val) {
+  ck_assert(nevents < 64);
+  events[nevents].op = op;
+  events[nevents].captured = capturing;
+  events[nevents].buf = buf;
+  events[nevents].val = val;
+  nevents++;
+}
+
+static void check_event(unsigned int i, char op, int captured, gpudata *buf,
+                        size_t val) {
+  ck_assert(i < nevents);
+  ck_assert_int_eq(events[i].op, op);
+  ck_assert_int_eq(events[i].captured, captured);
+  ck_assert(events[i].buf == buf);
+  ck_assert(events[i].val == val);
+}
+
+static void mock_retain(gpudata *b) {
+  b->refcnt++;
+}
+
+static void mock_release(gpudata *b) {
+  b->refcnt--;
+}
+
+static int mock_move(gpudata *dst, size_t dstoff, gpudata *src,
+                     size_t srcoff, size_t sz) {
+  log_event('m', dst, sz);
+  return GA_NO_ERROR;
+}
+
+static int mock_memset(gpudata *dst, size_t dstoff, int data) {
+  log_event('s', dst, data);
+  return GA_NO_ERROR;
+}
+
+static void mock_kretain(gpukernel *k) {
+  k->refcnt++;
+}
+
+static void mock_krelease(gpukernel *k) {
+  k->refcnt--;
+}
+
+static int mock_call(gpukernel *k, unsigned int n, const size_t *gs,
+                     const size_t *ls, size_t shared, void **args) {
+  log_event('k', (gpudata *)args[0], *(size_t *)args[1]);
+  return GA_NO_ERROR;
+}
+
+static int mock_property(gpucontext *c, gpudata *b, gpukernel *k,
+                         int prop_id, void *res) {
+  if (b != NULL && prop_id == GA_BUFFER_PROP_SIZE) {
+    *((size_t *)res) = b->sz;
+    return GA_NO_ERROR;
+  }
+  if (k != NULL && prop_id == GA_KERNEL_PROP_NUMARGS) {
+    *((unsigned int *)res) = k->nargs;
+    return GA_NO_ERROR;
+  }
+  if (k != NULL && prop_id == GA_KERNEL_PROP_TYPES) {
+    *((const int **)res) = k->types;
+    return GA_NO_ERROR;
+  }
+  return GA_INVALID_ERROR;
+}
+
+static int mock_capture_begin(gpucontext *c) {
+  if (fail_capture)
+    return GA_IMPL_ERROR;
+  capturing = 1;
+  return GA_NO_ERROR;
+}
+
+static gpugraph *mock_capture_end(gpucontext *c, int *ret) {
+  gpugraph *res = calloc(1, sizeof(*res));
+  unsigned int i;
+  capturing = 0;
+  res->ctx = c;
+  for (i = 0; i < nevents; i++)
+    res->nops += events[i].captured;
+  ngraphs++;
+  return res;
+}
+
+static int mock_graph_launch(gpugraph *g) {
+  launches++;
+  return GA_NO_ERROR;
+}
+
+static void mock_graph_release(gpugraph *g) {
+  ngraphs--;
+  free(g);
+}
+
+static int mock_blas_setup(gpucontext *c) {
+  return GA_NO_ERROR;
+}
+
+static int mock_sgemm(cb_order order, cb_transpose transA,
+                      cb_transpose transB, size_t M, size_t N, size_t K,
+                      float alpha, gpudata *A, size_t offA, size_t lda,
+                      gpudata *B, size_t offB, size_t ldb, float beta,
+                      gpudata *C, size_t offC, size_t ldc) {
+  log_event('g', C, M);
+  return GA_NO_ERROR;
+}
+
+static gpuarray_buffer_ops mock_ops;
+static gpuarray_buffer_ops mock_graph_ops;
+static gpuarray_blas_ops mock_blas;
+
+static void setup(void) {
+  mock_ops.buffer_retain = mock_retain;
+  mock_ops.buffer_release = mock_release;
+  mock_ops.buffer_move = mock_move;
+  mock_ops.buffer_memset = mock_memset;
+  mock_ops.kernel_retain = mock_kretain;
+  mock_ops.kernel_release = mock_krelease;
+  mock_ops.kernel_call = mock_call;
+  mock_ops.property = mock_property;
+  mock_graph_ops = mock_ops;
+  mock_graph_ops.capture_begin = mock_capture_begin;
+  mock_graph_ops.capture_end = mock_capture_end;
+  mock_graph_ops.graph_launch = mock_graph_launch;
+  mock_graph_ops.graph_release = mock_graph_release;
+  mock_blas.setup = mock_blas_setup;
+  mock_blas.sgemm = mock_sgemm;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.ops = &mock_ops;
+  ctx.blas_ops = &mock_blas;
+  memset(&gctx, 0, sizeof(gctx));
+  gctx.ops = &mock_graph_ops;
+  memset(&other_ctx, 0, sizeof(other_ctx));
+  other_ctx.ops = &mock_ops;
+
+  nevents = 0;
+  capturing = 0;
+  fail_capture = 0;
+  launches = 0;
+  ngraphs = 0;
+}
+
+static void teardown(void) {
+}
+
+static void init_buf(gpudata *b, gpucontext *c, size_t sz) {
+  memset(b, 0, sizeof(*b));
+  b->ctx = c;
+  b->sz = sz;
+  b->refcnt = 1;
+}
+
+static void init_kernel(GpuKernel *k, gpukernel *gk, gpucontext *c,
+                        void **args) {
+  memset(gk, 0, sizeof(*gk));
+  gk->ctx = c;
+  gk->refcnt = 1;
+  gk->nargs = 2;
+  gk->types = ktypes;
+  k->k = gk;
+  k->args = args;
+}
+
+START_TEST(test_replay) {
+  static const size_t gs = 4, ls = 32;
+  gpudata a, b;
+  gpukernel gk;
+  GpuKernel k;
+  GpuCmdList *l;
+  void *args[2];
+  size_t n = 10;
+  unsigned int i;
+
+  init_buf(&a, &ctx, 64);
+  init_buf(&b, &ctx, 64);
+  init_kernel(&k, &gk, &ctx, args);
+
+  l = GpuCmdList_new(&ctx, 0);
+  ck_assert(l != NULL);
+  args[0] = &a;
+  args[1] = &n;
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 1, &gs, &ls, 0, args),
+                   GA_NO_ERROR);
+  /* The arguments were copied */
+  n = 20;
+  args[0] = &b;
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 1, &gs, &ls, 0, NULL),
+                   GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_move(l, &b, 0, &a, 16, 48), GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_memset(l, &a, 8, 3), GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_gemm(l, GA_FLOAT, cb_c, cb_no_trans,
+                                   cb_no_trans, 2, 2, 2, 1.0, &a, 0, 2,
+                                   &a, 4, 2, 0.0, &b, 0, 2), GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_size(l), 5);
+  ck_assert_int_eq(nevents, 0);
+  ck_assert(gk.refcnt == 3);
+
+  /* Without graph support both runs do all the operations in order */
+  for (i = 0; i < 2; i++)
+    ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+  ck_assert_int_eq(nevents, 10);
+  for (i = 0; i < 2; i++) {
+    check_event(i * 5 + 0, 'k', 0, &a, 10);
+    check_event(i * 5 + 1, 'k', 0, &b, 20);
+    check_event(i * 5 + 2, 'm', 0, &b, 48);
+    check_event(i * 5 + 3, 's', 0, &a, 3);
+    check_event(i * 5 + 4, 'g', 0, &b, 2);
+  }
+
+  GpuCmdList_reset(l);
+  ck_assert_int_eq(GpuCmdList_size(l), 0);
+  ck_assert(a.refcnt == 1);
+  ck_assert(b.refcnt == 1);
+  ck_assert(gk.refcnt == 1);
+  ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+  ck_assert_int_eq(nevents, 10);
+  GpuCmdList_free(l);
+}
+END_TEST
+
+START_TEST(test_validation) {
+  static const size_t gs[2] = {4, 0}, ls[2] = {32, 1};
+  gpudata a, o;
+  gpukernel gk, ogk;
+  GpuKernel k, ok;
+  GpuCmdList *l;
+  void *args[2];
+  size_t n = 10;
+
+  ck_assert(GpuCmdList_new(&ctx, 0x100) == NULL);
+
+  init_buf(&a, &ctx, 64);
+  init_buf(&o, &other_ctx, 64);
+  init_kernel(&k, &gk, &ctx, args);
+  init_kernel(&ok, &ogk, &other_ctx, args);
+  l = GpuCmdList_new(&ctx, 0);
+  ck_assert(l != NULL);
+
+  args[0] = &a;
+  args[1] = &n;
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 0, gs, ls, 0, args),
+                   GA_VALUE_ERROR);
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 4, gs, ls, 0, args),
+                   GA_VALUE_ERROR);
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 2, gs, ls, 0, args),
+                   GA_VALUE_ERROR);
+  ck_assert_int_eq(GpuCmdList_call(l, &ok, 1, gs, ls, 0, args),
+                   GA_VALUE_ERROR);
+  args[0] = &o;
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 1, gs, ls, 0, args),
+                   GA_VALUE_ERROR);
+  args[0] = NULL;
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 1, gs, ls, 0, args),
+                   GA_VALUE_ERROR);
+
+  ck_assert_int_eq(GpuCmdList_move(l, &a, 0, &a, 32, 48), GA_VALUE_ERROR);
+  ck_assert_int_eq(GpuCmdList_move(l, &a, 65, &a, 0, 0), GA_VALUE_ERROR);
+  ck_assert_int_eq(GpuCmdList_move(l, &a, 0, &o, 0, 8), GA_VALUE_ERROR);
+  ck_assert_int_eq(GpuCmdList_memset(l, &a, 65, 0), GA_VALUE_ERROR);
+  ck_assert_int_eq(GpuCmdList_gemm(l, GA_INT, cb_c, cb_no_trans,
+                                   cb_no_trans, 2, 2, 2, 1.0, &a, 0, 2,
+                                   &a, 4, 2, 0.0, &a, 0, 2),
+                   GA_UNSUPPORTED_ERROR);
+
+  ck_assert_int_eq(GpuCmdList_size(l), 0);
+  ck_assert(a.refcnt == 1);
+  ck_assert(o.refcnt == 1);
+  ck_assert(gk.refcnt == 1);
+  GpuCmdList_free(l);
+}
+END_TEST
+
+START_TEST(test_graph) {
+  static const size_t gs = 4, ls = 32;
+  gpudata a;
+  gpukernel gk;
+  GpuKernel k;
+  GpuCmdList *l;
+  void *args[2];
+  size_t n = 10;
+  unsigned int i;
+
+  init_buf(&a, &gctx, 64);
+  init_kernel(&k, &gk, &gctx, args);
+  args[0] = &a;
+  args[1] = &n;
+
+  l = GpuCmdList_new(&gctx, 0);
+  ck_assert(l != NULL);
+  ck_assert_int_eq(GpuCmdList_call(l, &k, 1, &gs, &ls, 0, args),
+                   GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_memset(l, &a, 0, 0), GA_NO_ERROR);
+
+  /* Captured once, then only launched */
+  for (i = 0; i < 3; i++)
+    ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+  ck_assert_int_eq(nevents, 2);
+  check_event(0, 'k', 1, &a, 10);
+  check_event(1, 's', 1, &a, 0);
+  ck_assert_int_eq(launches, 3);
+  ck_assert_int_eq(ngraphs, 1);
+
+  /* A change makes it capture again */
+  ck_assert_int_eq(GpuCmdList_move(l, &a, 0, &a, 32, 32), GA_NO_ERROR);
+  ck_assert_int_eq(ngraphs, 0);
+  ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+  ck_assert_int_eq(nevents, 5);
+  check_event(4, 'm', 1, &a, 32);
+  ck_assert_int_eq(launches, 4);
+  ck_assert_int_eq(ngraphs, 1);
+
+  GpuCmdList_free(l);
+  ck_assert_int_eq(ngraphs, 0);
+  ck_assert(a.refcnt == 1);
+  ck_assert(gk.refcnt == 1);
+
+  /* Opted out */
+  l = GpuCmdList_new(&gctx, GPUCMDLIST_NO_GRAPH);
+  ck_assert(l != NULL);
+  ck_assert_int_eq(GpuCmdList_memset(l, &a, 0, 1), GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+  check_event(5, 's', 0, &a, 1);
+  ck_assert_int_eq(launches, 4);
+  GpuCmdList_free(l);
+
+  /* The capture fails, replay the operations directly */
+  fail_capture = 1;
+  l = GpuCmdList_new(&gctx, 0);
+  ck_assert(l != NULL);
+  ck_assert_int_eq(GpuCmdList_memset(l, &a, 0, 2), GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+  ck_assert_int_eq(GpuCmdList_run(l), GA_NO_ERROR);
+  check_event(6, 's', 0, &a, 2);
+  check_event(7, 's', 0, &a, 2);
+  ck_assert_int_eq(launches, 4);
+  GpuCmdList_free(l);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("cmdlist");
+  TCase *tc = tcase_create("mock");
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_replay);
+  tcase_add_test(tc, test_validation);
+  tcase_add_test(tc, test_graph);
+  suite_add_tcase(s, tc);
+  return s;
+}
@@ -4,6 +4,7 @@
 #include "gpuarray/buffer.h"
 #include "gpuarray/elemwise.h"
 #include "gpuarray/error.h"
+#include "gpuarray/fusion.h"
 #include "gpuarray/types.h"
 
 extern void *ctx;
@@ -178,6 +179,125 @@ START_TEST(test_contig_0) {
 }
 END_TEST
 
+START_TEST(test_contig_vec) {
+  GpuArray a;
+  GpuArray b;
+  GpuArray c;
+
+  GpuElemwise *ge;
+
+  /* Not a multiple of the vector size to exercise the tail */
+  float data1[1027];
+  float data2[1027];
+  float data3[1027];
+  uint16_t hdata1[9];
+  uint16_t hdata2[9];
+  uint16_t hdata3[9];
+
+  size_t dims[1];
+  size_t i;
+
+  gpuelemwise_arg args[3] = {{0}};
+  void *rargs[3];
+
+  for (i = 0; i < 1027; i++) {
+    data1[i] = (float)i;
+    data2[i] = (float)(2 * i);
+  }
+
+  dims[0] = 1027;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data1, sizeof(data1)));
+
+  ga_assert_ok(GpuArray_empty(&b, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&b, data2, sizeof(data2)));
+
+  ga_assert_ok(GpuArray_empty(&c, ctx, GA_FLOAT, 1, dims, GA_C_ORDER));
+
+  args[0].name = "a";
+  args[0].typecode = GA_FLOAT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "b";
+  args[1].typecode = GA_FLOAT;
+  args[1].flags = GE_READ;
+
+  args[2].name = "c";
+  args[2].typecode = GA_FLOAT;
+  args[2].flags = GE_WRITE;
+
+  ge = GpuElemwise_new(ctx, "", "c = a + b", 3, args, 1, 0);
+
+  ck_assert_ptr_ne(ge, NULL);
+
+  rargs[0] = &a;
+  rargs[1] = &b;
+  rargs[2] = &c;
+
+  ga_assert_ok(GpuElemwise_call(ge, rargs, GE_NOCOLLAPSE));
+
+  ga_assert_ok(GpuArray_read(data3, sizeof(data3), &c));
+
+  for (i = 0; i < 1027; i++)
+    ck_assert(data3[i] == (float)(3 * i));
+
+  /* Misaligned start, goes through the scalar kernel */
+  a.offset += sizeof(float);
+  a.dimensions[0] -= 1;
+  b.dimensions[0] -= 1;
+  c.dimensions[0] -= 1;
+
+  ga_assert_ok(GpuElemwise_call(ge, rargs, GE_NOCOLLAPSE));
+
+  ga_assert_ok(GpuArray_read(data3, sizeof(float) * 1026, &c));
+
+  for (i = 0; i < 1026; i++)
+    ck_assert(data3[i] == (float)(3 * i + 1));
+
+  GpuElemwise_free(ge);
+  a.offset -= sizeof(float);
+  GpuArray_clear(&a);
+  GpuArray_clear(&b);
+  GpuArray_clear(&c);
+
+  for (i = 0; i < 9; i++) {
+    hdata1[i] = F16[i / 2];
+    hdata2[i] = F16[i - i / 2];
+  }
+
+  dims[0] = 9;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_HALF, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, hdata1, sizeof(hdata1)));
+
+  ga_assert_ok(GpuArray_empty(&b, ctx, GA_HALF, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&b, hdata2, sizeof(hdata2)));
+
+  ga_assert_ok(GpuArray_empty(&c, ctx, GA_HALF, 1, dims, GA_C_ORDER));
+
+  args[0].typecode = GA_HALF;
+  args[1].typecode = GA_HALF;
+  args[2].typecode = GA_HALF;
+
+  ge = GpuElemwise_new(ctx, "", "c = a + b", 3, args, 1, GE_CONVERT_F16);
+
+  ck_assert_ptr_ne(ge, NULL);
+
+  ga_assert_ok(GpuElemwise_call(ge, rargs, GE_NOCOLLAPSE));
+
+  ga_assert_ok(GpuArray_read(hdata3, sizeof(hdata3), &c));
+
+  for (i = 0; i < 9; i++)
+    ck_assert_int_eq(hdata3[i], F16[i]);
+
+  GpuElemwise_free(ge);
+  GpuArray_clear(&a);
+  GpuArray_clear(&b);
+  GpuArray_clear(&c);
+}
+END_TEST
+
 START_TEST(test_basic_simple) {
   GpuArray a;
   GpuArray b;
@@ -738,6 +858,170 @@ START_TEST(test_basic_0) {
 }
 END_TEST
 
+START_TEST(test_shared) {
+  GpuArray a;
+  GpuArray b;
+
+  GpuElemwise *ge1, *ge2, *ge3;
+
+  static const uint32_t data1[3] = {1, 2, 3};
+  uint32_t data2[3] = {0};
+
+  size_t dims[1];
+
+  gpuelemwise_arg args[2] = {{0}};
+  void *rargs[2];
+
+  dims[0] = 3;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_UINT, 1, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data1, sizeof(data1)));
+
+  ga_assert_ok(GpuArray_empty(&b, ctx, GA_UINT, 1, dims, GA_C_ORDER));
+
+  args[0].name = "a";
+  args[0].typecode = GA_UINT;
+  args[0].flags = GE_READ;
+
+  args[1].name = "b";
+  args[1].typecode = GA_UINT;
+  args[1].flags = GE_WRITE;
+
+  ge1 = GpuElemwise_new(ctx, "", "b = a + 1", 2, args, 1, 0);
+  ck_assert_ptr_ne(ge1, NULL);
+
+  /* Same signature, same object */
+  ge2 = GpuElemwise_new(ctx, "", "b = a + 1", 2, args, 1, 0);
+  ck_assert_ptr_eq(ge2, ge1);
+
+  /* Different flags */
+  ge3 = GpuElemwise_new(ctx, "", "b = a + 1", 2, args, 1, GE_NOADDR64);
+  ck_assert_ptr_ne(ge3, NULL);
+  ck_assert_ptr_ne(ge3, ge1);
+  GpuElemwise_free(ge3);
+
+  /* Different argument type */
+  args[0].typecode = GA_INT;
+  ge3 = GpuElemwise_new(ctx, "", "b = a + 1", 2, args, 1, 0);
+  ck_assert_ptr_ne(ge3, NULL);
+  ck_assert_ptr_ne(ge3, ge1);
+  GpuElemwise_free(ge3);
+
+  /* Still usable after one of the references is gone */
+  GpuElemwise_free(ge1);
+
+  rargs[0] = &a;
+  rargs[1] = &b;
+
+  ga_assert_ok(GpuElemwise_call(ge2, rargs, 0));
+  ga_assert_ok(GpuArray_read(data2, sizeof(data2), &b));
+  ck_assert_int_eq(data2[0], 2);
+  ck_assert_int_eq(data2[1], 3);
+  ck_assert_int_eq(data2[2], 4);
+
+  GpuElemwise_free(ge2);
+  GpuArray_clear(&a);
+  GpuArray_clear(&b);
+}
+END_TEST
+
+START_TEST(test_fusion_simple) {
+  GpuArray a, b, c, d, r;
+  GpuFusion *f;
+
+  static const float data1[6] = {1, 2, 3, 4, 5, 6};
+  static const float data2[6] = {2, 2, 2, 2, 2, 2};
+  static const float data3[3] = {1, 0, -1};
+  static const int32_t data4[6] = {1, 2, 3, 4, 5, 6};
+  float data5[6];
+  int32_t idata[6];
+  double ddata[6];
+
+  size_t dims[2];
+  int64_t two = 2;
+  int na, nb, nc, nd, ns, n1, n2, n3;
+  unsigned int i;
+
+  dims[0] = 2;
+  dims[1] = 3;
+
+  ga_assert_ok(GpuArray_empty(&a, ctx, GA_FLOAT, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&a, data1, sizeof(data1)));
+  ga_assert_ok(GpuArray_empty(&b, ctx, GA_FLOAT, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&b, data2, sizeof(data2)));
+  ga_assert_ok(GpuArray_empty(&d, ctx, GA_INT, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&d, data4, sizeof(data4)));
+  ga_assert_ok(GpuArray_empty(&r, ctx, GA_FLOAT, 2, dims, GA_C_ORDER));
+
+  dims[0] = 1;
+  ga_assert_ok(GpuArray_empty(&c, ctx, GA_FLOAT, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuArray_write(&c, data3, sizeof(data3)));
+
+  f = GpuFusion_new(ctx, 0);
+  ck_assert_ptr_ne(f, NULL);
+
+  /* a * b + c * a, with c broadcasted */
+  ga_assert_ok(GpuFusion_array(f, &a, &na));
+  ga_assert_ok(GpuFusion_array(f, &b, &nb));
+  ga_assert_ok(GpuFusion_array(f, &c, &nc));
+  ga_assert_ok(GpuFusion_binary(f, "*", na, nb, &n1));
+  ga_assert_ok(GpuFusion_binary(f, "*", nc, na, &n2));
+  ga_assert_ok(GpuFusion_binary(f, "+", n1, n2, &n3));
+  ck_assert_int_eq(GpuFusion_typecode(f, n3), GA_FLOAT);
+  ga_assert_ok(GpuFusion_eval(f, n3, &r, GE_BROADCAST));
+  ga_assert_ok(GpuArray_read(data5, sizeof(data5), &r));
+  for (i = 0; i < 6; i++)
+    ck_assert(data5[i] == data1[i] * 2 + data3[i % 3] * data1[i]);
+
+  /* Without broadcasting the shapes must match */
+  ck_assert_int_eq(GpuFusion_eval(f, n3, &r, 0), GA_VALUE_ERROR);
+
+  /* The output can be an input */
+  ga_assert_ok(GpuFusion_eval(f, n3, &a, GE_BROADCAST));
+  ga_assert_ok(GpuArray_read(data5, sizeof(data5), &a));
+  for (i = 0; i < 6; i++)
+    ck_assert(data5[i] == data1[i] * 2 + data3[i % 3] * data1[i]);
+
+  /* Scalars don't upcast arrays of the same kind */
+  GpuFusion_reset(f);
+  ga_assert_ok(GpuFusion_array(f, &d, &nd));
+  ga_assert_ok(GpuFusion_scalar(f, GA_LONG, &two, &ns));
+  ck_assert_int_eq(GpuFusion_typecode(f, ns), GA_LONG);
+  ga_assert_ok(GpuFusion_binary(f, "*", nd, ns, &n1));
+  ck_assert_int_eq(GpuFusion_typecode(f, n1), GA_INT);
+  ga_assert_ok(GpuFusion_binary(f, ">", n1, nd, &n2));
+  ck_assert_int_eq(GpuFusion_typecode(f, n2), GA_BOOL);
+  ck_assert_int_eq(GpuFusion_binary(f, "=", n1, nd, &n3), GA_VALUE_ERROR);
+
+  ga_assert_ok(GpuFusion_eval(f, n1, &d, 0));
+  ga_assert_ok(GpuArray_read(idata, sizeof(idata), &d));
+  for (i = 0; i < 6; i++)
+    ck_assert_int_eq(idata[i], data4[i] * 2);
+
+  /* int32 and float32 arrays give float64 */
+  ga_assert_ok(GpuFusion_array(f, &b, &nb));
+  ga_assert_ok(GpuFusion_binary(f, "-", nd, nb, &n3));
+  ck_assert_int_eq(GpuFusion_typecode(f, n3), GA_DOUBLE);
+  ga_assert_ok(GpuFusion_call(f, "fabs", -1, 1, &n3, &n1));
+  ck_assert_int_eq(GpuFusion_typecode(f, n1), GA_DOUBLE);
+
+  GpuArray_clear(&r);
+  dims[0] = 2;
+  ga_assert_ok(GpuArray_empty(&r, ctx, GA_DOUBLE, 2, dims, GA_C_ORDER));
+  ga_assert_ok(GpuFusion_eval(f, n1, &r, 0));
+  ga_assert_ok(GpuArray_read(ddata, sizeof(ddata), &r));
+  for (i = 0; i < 6; i++)
+    ck_assert(ddata[i] == (double)(data4[i] * 2 - 2));
+
+  GpuFusion_free(f);
+  GpuArray_clear(&a);
+  GpuArray_clear(&b);
+  GpuArray_clear(&c);
+  GpuArray_clear(&d);
+  GpuArray_clear(&r);
+}
+END_TEST
+
 Suite *get_suite(void) {
   Suite *s = suite_create("elemwise");
   TCase *tc = tcase_create("contig");
@@ -746,6 +1030,8 @@ Suite *get_suite(void) {
   tcase_add_test(tc, test_contig_simple);
   tcase_add_test(tc, test_contig_f16);
   tcase_add_test(tc, test_contig_0);
+  tcase_add_test(tc, test_contig_vec);
+  tcase_add_test(tc, test_shared);
   suite_add_tcase(s, tc);
   tc = tcase_create("basic");
   tcase_set_timeout(tc, 8.0);
@@ -760,5 +1046,10 @@ Suite *get_suite(void) {
   tcase_add_test(tc, test_basic_neg_strides);
   tcase_add_test(tc, test_basic_0);
   suite_add_tcase(s, tc);
+  tc = tcase_create("fusion");
+  tcase_set_timeout(tc, 8.0);
+  tcase_add_checked_fixture(tc, setup, teardown);
+  tcase_add_test(tc, test_fusion_simple);
+  suite_add_tcase(s, tc);
   return s;
 }
@@ -3,8 +3,10 @@
 #include <gpuarray/buffer.h>
 #include <gpuarray/array.h>
 #include <gpuarray/error.h>
+#include <gpuarray/reduction.h>
 #include <gpuarray/types.h>
 
+#include <math.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -435,6 +437,194 @@ START_TEST(test_alldimsreduced){
 	GpuArray_clear(&gaArgmax);
 }END_TEST
 
+START_TEST(test_gpureduction_sum){
+	pcgSeed(1);
+
+	/**
+	 * Sum of x*y*alpha over the axes {0,2} of a 3D tensor, with y being a
+	 * non-contiguous view. The same object is then reused to reduce over
+	 * all the axes.
+	 */
+
+	size_t i,j,k;
+	size_t dims[3]     = {32,50,79};
+	size_t dimsT[3]    = {79,50,32};
+	size_t prodDims    = dims[0]*dims[1]*dims[2];
+	const unsigned reduxList[]    = {2,0};
+	const unsigned reduxListAll[] = {0,1,2};
+	float   alpha      = 0.5f;
+
+	float*  pX      = calloc(1, sizeof(*pX)   * prodDims);
+	float*  pY      = calloc(1, sizeof(*pY)   * prodDims);
+	double* pSum    = calloc(1, sizeof(*pSum) * dims[1]);
+	double  sumAll;
+
+	ck_assert_ptr_ne(pX,   NULL);
+	ck_assert_ptr_ne(pY,   NULL);
+	ck_assert_ptr_ne(pSum, NULL);
+
+	for(i=0;i<prodDims;i++){
+		pX[i] = pcgRand01();
+		pY[i] = pcgRand01();
+	}
+
+
+	/**
+	 * Run the kernel.
+	 */
+
+	GpuArray gaX;
+	GpuArray gaYT;
+	GpuArray gaY;
+	GpuArray gaSum;
+	GpuArray gaSumAll;
+	GpuArray* outs[1];
+	void*     args[3];
+
+	gpuelemwise_arg  inArgs[3] = {{"x",     GA_FLOAT, GE_READ},
+	                              {"y",     GA_FLOAT, GE_READ},
+	                              {"alpha", GA_FLOAT, GE_SCALAR}};
+	gpureduction_out outArgs[1] = {{"s", GA_DOUBLE, "0"}};
+
+	ga_assert_ok(GpuArray_empty(&gaX,      ctx, GA_FLOAT,  3, dims,     GA_C_ORDER));
+	ga_assert_ok(GpuArray_empty(&gaYT,     ctx, GA_FLOAT,  3, dimsT,    GA_F_ORDER));
+	ga_assert_ok(GpuArray_empty(&gaSum,    ctx, GA_DOUBLE, 1, &dims[1], GA_C_ORDER));
+	ga_assert_ok(GpuArray_empty(&gaSumAll, ctx, GA_DOUBLE, 0, NULL,     GA_C_ORDER));
+
+	ga_assert_ok(GpuArray_write(&gaX,  pX, sizeof(*pX)*prodDims));
+	ga_assert_ok(GpuArray_write(&gaYT, pY, sizeof(*pY)*prodDims));
+	ga_assert_ok(GpuArray_transpose(&gaY, &gaYT, NULL));
+
+	GpuReduction* gr = GpuReduction_new(ctx, NULL, "s = (ga_double)x*y*alpha",
+	                                    "a_s = a_s + b_s", 3, inArgs,
+	                                    1, outArgs, 0);
+	ck_assert_ptr_ne(gr, NULL);
+
+	outs[0] = &gaSum;
+	args[0] = &gaX;
+	args[1] = &gaY;
+	args[2] = &alpha;
+	ck_assert_int_eq(GpuReduction_call(gr, outs, args, 2, reduxList, 1),
+	                 GA_VALUE_ERROR);
+	ga_assert_ok(GpuReduction_call(gr, outs, args, 2, reduxList, 0));
+	outs[0] = &gaSumAll;
+	ga_assert_ok(GpuReduction_call(gr, outs, args, 3, reduxListAll, 0));
+
+	ga_assert_ok(GpuArray_read(pSum,    sizeof(*pSum)*dims[1], &gaSum));
+	ga_assert_ok(GpuArray_read(&sumAll, sizeof(sumAll),        &gaSumAll));
+
+
+	/**
+	 * Check that the destination tensors are correct.
+	 */
+
+	double gtSumAll = 0;
+	for(j=0;j<dims[1];j++){
+		double gtSum = 0;
+
+		for(i=0;i<dims[0];i++){
+			for(k=0;k<dims[2];k++){
+				size_t idx = (i*dims[1] + j)*dims[2] + k;
+				gtSum += (double)pX[idx]*pY[idx]*alpha;
+			}
+		}
+		gtSumAll += gtSum;
+
+		ck_assert_msg(fabs(gtSum - pSum[j]) < 1e-9*gtSum, "Sum value mismatch!");
+	}
+	ck_assert_msg(fabs(gtSumAll - sumAll) < 1e-9*gtSumAll, "Sum value mismatch!");
+
+	/**
+	 * Deallocate.
+	 */
+
+	GpuReduction_free(gr);
+	free(pX);
+	free(pY);
+	free(pSum);
+	GpuArray_clear(&gaX);
+	GpuArray_clear(&gaY);
+	GpuArray_clear(&gaYT);
+	GpuArray_clear(&gaSum);
+	GpuArray_clear(&gaSumAll);
+}END_TEST
+
+START_TEST(test_gpureduction_multi){
+	pcgSeed(1);
+
+	/**
+	 * Min and max at the same time over the second axis of a matrix, for
+	 * both a short (one thread per output) and a long reduction.
+	 */
+
+	size_t i,j,t;
+	size_t dims[2][2]  = {{1000,7},{3,5000}};
+	const unsigned reduxList[] = {1};
+
+	gpuelemwise_arg  inArgs[1]  = {{"x", GA_INT, GE_READ}};
+	gpureduction_out outArgs[2] = {{"lo", GA_INT, "0x7fffffff"},
+	                               {"hi", GA_INT, "-0x7fffffff - 1"}};
+
+	GpuReduction* gr = GpuReduction_new(ctx, NULL, "lo = x; hi = x",
+	                                    "a_lo = b_lo < a_lo ? b_lo : a_lo; "
+	                                    "a_hi = b_hi > a_hi ? b_hi : a_hi",
+	                                    1, inArgs, 2, outArgs, 0);
+	ck_assert_ptr_ne(gr, NULL);
+
+	for(t=0;t<2;t++){
+		size_t prodDims = dims[t][0]*dims[t][1];
+		int*   pX       = calloc(1, sizeof(*pX)  * prodDims);
+		int*   pLo      = calloc(1, sizeof(*pLo) * dims[t][0]);
+		int*   pHi      = calloc(1, sizeof(*pHi) * dims[t][0]);
+
+		ck_assert_ptr_ne(pX,  NULL);
+		ck_assert_ptr_ne(pLo, NULL);
+		ck_assert_ptr_ne(pHi, NULL);
+
+		for(i=0;i<prodDims;i++){
+			pX[i] = (int)pcgRand() - 0x40000000;
+		}
+
+		GpuArray  gaX;
+		GpuArray  gaLo;
+		GpuArray  gaHi;
+		GpuArray* outs[2] = {&gaLo, &gaHi};
+		void*     args[1] = {&gaX};
+
+		ga_assert_ok(GpuArray_empty(&gaX,  ctx, GA_INT, 2, dims[t], GA_C_ORDER));
+		ga_assert_ok(GpuArray_empty(&gaLo, ctx, GA_INT, 1, dims[t], GA_C_ORDER));
+		ga_assert_ok(GpuArray_empty(&gaHi, ctx, GA_INT, 1, dims[t], GA_C_ORDER));
+		ga_assert_ok(GpuArray_write(&gaX, pX, sizeof(*pX)*prodDims));
+
+		ga_assert_ok(GpuReduction_call(gr, outs, args, 1, reduxList, 0));
+
+		ga_assert_ok(GpuArray_read(pLo, sizeof(*pLo)*dims[t][0], &gaLo));
+		ga_assert_ok(GpuArray_read(pHi, sizeof(*pHi)*dims[t][0], &gaHi));
+
+		for(i=0;i<dims[t][0];i++){
+			int gtLo = pX[i*dims[t][1]], gtHi = pX[i*dims[t][1]];
+
+			for(j=0;j<dims[t][1];j++){
+				int v = pX[i*dims[t][1] + j];
+				gtLo = v < gtLo ? v : gtLo;
+				gtHi = v > gtHi ? v : gtHi;
+			}
+
+			ck_assert_int_eq(gtLo, pLo[i]);
+			ck_assert_int_eq(gtHi, pHi[i]);
+		}
+
+		free(pX);
+		free(pLo);
+		free(pHi);
+		GpuArray_clear(&gaX);
+		GpuArray_clear(&gaLo);
+		GpuArray_clear(&gaHi);
+	}
+
+	GpuReduction_free(gr);
+}END_TEST
+
 Suite *get_suite(void) {
 	Suite *s  = suite_create("reduction");
 	TCase *tc = tcase_create("basic");
@@ -445,6 +635,8 @@ Suite *get_suite(void) {
 	tcase_add_test(tc, test_idxtranspose);
 	tcase_add_test(tc, test_veryhighrank);
 	tcase_add_test(tc, test_alldimsreduced);
+	tcase_add_test(tc, test_gpureduction_sum);
+	tcase_add_test(tc, test_gpureduction_multi);
 
 	suite_add_tcase(s, tc);
 	return s;
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "util/freelist.h"
+
+/*
+ * Fake device allocator.  Arenas are handed out back to back at fake
+ * addresses so that blocks from two arenas can be adjacent.
+ */
+static freelist fl;
+static fl_block nodes[64];
+static int used[64];
+static size_t next_addr;
+
+static fl_block *new_node(void) {
+  int i;
+  for (i = 0; i < 64; i++) {
+    if (!used[i]) {
+      used[i] = 1;
+      return &nodes[i];
+    }
+  }
+  ck_abort_msg("out of nodes");
+  return NULL;
+}
+
+static void free_node(fl_block *b) {
+  if (b != NULL)
+    used[b - nodes] = 0;
+}
+
+static fl_block *new_arena(size_t size) {
+  fl_block *b = new_node();
+  freelist_add_arena(&fl, b, next_addr, size);
+  next_addr += size;
+  return b;
+}
+
+/* Same sequence as the CUDA allocator */
+static fl_block *alloc(size_t size) {
+  fl_block *b, *rest;
+  b = freelist_find(&fl, size);
+  if (b == NULL)
+    b = new_arena(size < 4096 ? 4096 : size);
+  rest = new_node();
+  if (!freelist_take(&fl, b, size, 64, rest))
+    free_node(rest);
+  return b;
+}
+
+static fl_block *release(fl_block *b) {
+  fl_block *merged[2];
+  fl_block *res = freelist_release(&fl, b, merged);
+  free_node(merged[0]);
+  free_node(merged[1]);
+  return res;
+}
+
+static void setup(void) {
+  freelist_init(&fl);
+  memset(used, 0, sizeof(used));
+  next_addr = 0x10000;
+}
+
+START_TEST(test_freelist_split) {
+  fl_block *a, *b;
+
+  a = alloc(256);
+  ck_assert_uint_eq(a->addr, 0x10000);
+  ck_assert_uint_eq(a->size, 256);
+  ck_assert_uint_eq(fl.nfree, 1);
+  ck_assert_uint_eq(fl.free_bytes, 4096 - 256);
+
+  b = alloc(512);
+  ck_assert_uint_eq(b->addr, 0x10000 + 256);
+  ck_assert_uint_eq(fl.free_bytes, 4096 - 768);
+
+  /* Too small a remainder is not split */
+  b = alloc(4096 - 768 - 32);
+  ck_assert_uint_eq(b->size, 4096 - 768);
+  ck_assert_uint_eq(fl.nfree, 0);
+  ck_assert_uint_eq(fl.free_bytes, 0);
+}
+END_TEST
+
+START_TEST(test_freelist_bestfit) {
+  fl_block *a, *b, *c, *d, *e;
+
+  a = alloc(1024);
+  b = alloc(64);
+  c = alloc(300);
+  d = alloc(64);
+  e = alloc(4096 - 1024 - 64 - 300 - 64);
+  (void)b; (void)d; (void)e;
+
+  /* Holes of 1024 and 300 */
+  release(a);
+  release(c);
+  ck_assert_uint_eq(fl.nfree, 2);
+
+  a = alloc(256);
+  ck_assert_uint_eq(a->addr, c->addr);
+  a = alloc(512);
+  ck_assert_uint_eq(a->addr, 0x10000);
+
+  ck_assert_ptr_eq(freelist_find(&fl, 2048), NULL);
+  ck_assert_uint_eq(freelist_largest(&fl), 512);
+}
+END_TEST
+
+START_TEST(test_freelist_coalesce) {
+  fl_block *a, *b, *c, *r;
+
+  a = alloc(128);
+  b = alloc(128);
+  c = alloc(128);
+
+  r = release(a);
+  ck_assert_ptr_eq(r, a);
+  ck_assert_uint_eq(fl.nfree, 2);
+
+  /* Merges with the previous one */
+  r = release(b);
+  ck_assert_ptr_eq(r, a);
+  ck_assert_uint_eq(r->size, 256);
+  ck_assert_uint_eq(fl.nfree, 2);
+
+  /* Merges on both sides */
+  r = release(c);
+  ck_assert_ptr_eq(r, a);
+  ck_assert_uint_eq(r->size, 4096);
+  ck_assert_uint_eq(fl.nfree, 1);
+  ck_assert(r->flags & FREELIST_HEAD);
+  ck_assert_ptr_eq(r->next_phys, NULL);
+
+  freelist_remove_arena(&fl, r);
+  ck_assert_uint_eq(fl.nfree, 0);
+  ck_assert_uint_eq(fl.free_bytes, 0);
+  ck_assert_ptr_eq(freelist_next(&fl, NULL), NULL);
+}
+END_TEST
+
+START_TEST(test_freelist_arenas) {
+  fl_block *a, *b, *r;
+  int n;
+
+  a = alloc(4096);
+  b = alloc(4096);
+  /* The fake arenas are adjacent */
+  ck_assert_uint_eq(a->addr + a->size, b->addr);
+
+  release(a);
+  r = release(b);
+  ck_assert_ptr_eq(r, b);
+  ck_assert_uint_eq(r->size, 4096);
+  ck_assert_uint_eq(fl.nfree, 2);
+
+  n = 0;
+  for (r = freelist_next(&fl, NULL); r != NULL; r = freelist_next(&fl, r))
+    n++;
+  ck_assert_int_eq(n, 2);
+
+  while ((r = freelist_next(&fl, NULL)) != NULL) {
+    freelist_remove_arena(&fl, r);
+    free_node(r);
+  }
+  ck_assert_uint_eq(fl.nfree, 0);
+}
+END_TEST
+
+START_TEST(test_freelist_classes) {
+  fl_block *b[32];
+  size_t sz;
+  int i;
+
+  /* One arena per size, some share a class */
+  for (i = 0; i < 32; i++)
+    b[i] = new_arena(1000 + i * 37);
+  for (i = 31; i >= 0; i--) {
+    sz = 1000 + i * 37;
+    ck_assert_uint_ge(freelist_find(&fl, sz)->size, sz);
+    /* Never more than a couple of classes above */
+    ck_assert_uint_lt(freelist_find(&fl, sz)->size, sz + sz / 4);
+  }
+  ck_assert_ptr_eq(freelist_find(&fl, 1000 + 31 * 37 + 1), NULL);
+  ck_assert_uint_eq(freelist_largest(&fl), 1000 + 31 * 37);
+  for (i = 0; i < 32; i++)
+    freelist_remove_arena(&fl, b[i]);
+  ck_assert_uint_eq(fl.nfree, 0);
+  ck_assert_uint_eq(freelist_largest(&fl), 0);
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("util_freelist");
+  TCase *tc = tcase_create("All");
+  tcase_add_checked_fixture(tc, setup, NULL);
+  tcase_add_test(tc, test_freelist_split);
+  tcase_add_test(tc, test_freelist_bestfit);
+  tcase_add_test(tc, test_freelist_coalesce);
+  tcase_add_test(tc, test_freelist_arenas);
+  tcase_add_test(tc, test_freelist_classes);
+  suite_add_tcase(s, tc);
+  return s;
+}
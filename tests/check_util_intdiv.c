@@ -0,0 +1,78 @@
+#include <stdint.h>
+
+#include <check.h>
+
+#include "util/intdiv.h"
+
+static void check_div(uint32_t d) {
+  static const uint32_t ns[] = {
+    0, 1, 2, 3, 7, 8, 9, 100, 1000, 65535, 65536, 65537,
+    1234567, 0x7ffffffe, 0x7fffffff, 0x80000000, 0x80000001,
+    0xfffffffe, 0xffffffff
+  };
+  intdiv32 div;
+  uint32_t n;
+  size_t i;
+
+  intdiv32_init(&div, d);
+  for (i = 0; i < sizeof(ns) / sizeof(ns[0]); i++) {
+    n = ns[i];
+    ck_assert_msg(intdiv32_div(&div, n) == n / d, "%u / %u", n, d);
+  }
+  /* Around the multiples of d */
+  for (i = 1; i < 64; i++) {
+    if ((uint64_t)d * i > 0xffffffff)
+      break;
+    n = d * (uint32_t)i;
+    ck_assert_msg(intdiv32_div(&div, n) == i, "%u / %u", n, d);
+    ck_assert_msg(intdiv32_div(&div, n - 1) == i - 1, "%u / %u", n - 1, d);
+  }
+}
+
+START_TEST(test_intdiv_small) {
+  uint32_t d;
+  for (d = 1; d < 4096; d++)
+    check_div(d);
+}
+END_TEST
+
+START_TEST(test_intdiv_large) {
+  uint32_t s;
+  /* Powers of two and their neighbours are the edge cases for the
+     shift */
+  for (s = 12; s < 32; s++) {
+    check_div((uint32_t)1 << s);
+    check_div(((uint32_t)1 << s) - 1);
+    check_div(((uint32_t)1 << s) + 1);
+  }
+  check_div(641);
+  check_div(6700417);
+  check_div(0xfffffffe);
+  check_div(0xffffffff);
+}
+END_TEST
+
+START_TEST(test_intdiv_n_stride_65521) {
+  static const uint32_t ds[] = {3, 7, 10, 641, 12345, 0x7fffffff};
+  intdiv32 div;
+  uint32_t n;
+  size_t i;
+
+  for (i = 0; i < sizeof(ds) / sizeof(ds[0]); i++) {
+    intdiv32_init(&div, ds[i]);
+    /* Every 65521th numerator (a prime stride) across the 32-bit range */
+    for (n = ds[i] % 65521; n < 0xffffffff - 65521; n += 65521)
+      ck_assert_msg(intdiv32_div(&div, n) == n / ds[i], "%u / %u", n, ds[i]);
+  }
+}
+END_TEST
+
+Suite *get_suite(void) {
+  Suite *s = suite_create("util_intdiv");
+  TCase *tc = tcase_create("All");
+  tcase_add_test(tc, test_intdiv_small);
+  tcase_add_test(tc, test_intdiv_large);
+  tcase_add_test(tc, test_intdiv_n_stride_65521);
+  suite_add_tcase(s, tc);
+  return s;
+}
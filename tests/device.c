@@ -49,6 +49,10 @@ int get_env_dev(const char **name) {
     d |= (int)no;
     return d;
   }
+  if (strcmp(dev, "host") == 0) {
+    *name = "host";
+    return 0;
+  }
   return -1;
 }
 